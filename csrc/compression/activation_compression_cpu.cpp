@@ -0,0 +1,465 @@
+/* Copyright 2020 The Microsoft DeepSpeed Team */
+#include <torch/extension.h>
+#include <string.h>
+#include <algorithm>
+#include <cmath>
+#include <memory>
+#include <vector>
+#include "optimizer_8bit.h"
+#include "simd.h"
+#include "thread_pool.h"
+
+#define CHECK_CPU(x) AT_ASSERTM(!x.type().is_cuda(), #x " must be a CPU tensor")
+#define CHECK_CONTIGUOUS(x) AT_ASSERTM(x.is_contiguous(), #x " must be contiguous")
+#define CHECK_INPUT(x) \
+    CHECK_CPU(x);      \
+    CHECK_CONTIGUOUS(x)
+
+// Codecs for activation checkpoints kept in host memory.
+//
+//  - blockwise int8: every block_size consecutive elements share one fp32
+//    scale, their largest magnitude, and are stored as linear int8 in
+//    [-127, 127] like the 8-bit optimizer moments. Rounding matches the torch
+//    fallback in deepspeed_activation_compression.py bit for bit.
+//  - byte planes (lossless): 2 and 4 byte elements are split into the planes
+//    of their bytes after rotating the sign into the lowest bit, so the most
+//    significant plane holds the exponent. Each plane of a block is stored
+//    as its minimum and the bit-packed offsets from it, and blocks with
+//    enough zeros, as left by ReLU or dropout, store a zero bitmap and only
+//    the planes of the non-zero elements. Exponents of a block span few
+//    values, while random low mantissa planes stay at 8 bits.
+
+// Elements handled per parallel task at least.
+#define CODEC_GRAIN_ELEMENTS 65536
+
+// Elements per block of the byte plane codec and bytes of a plane header,
+// the minimum and the bit width.
+#define BYTEPLANE_BLOCK_SIZE 4096
+#define BYTEPLANE_HEADER_BYTES 2
+
+template <typename T>
+const float* load_float(const T* src, int64_t n, float* buffer)
+{
+    for (int64_t i = 0; i < n; i++) buffer[i] = static_cast<float>(src[i]);
+    return buffer;
+}
+
+template <>
+const float* load_float<float>(const float* src, int64_t n, float* buffer)
+{
+    return src;
+}
+
+#ifdef VERSION_GE_1_5
+template <>
+const float* load_float<at::BFloat16>(const at::BFloat16* src, int64_t n, float* buffer)
+{
+    simd_bf16_to_float((const uint16_t*)src, buffer, n);
+    return buffer;
+}
+#endif
+
+template <typename T>
+void quantize_blocks(const T* x, int8_t* q, float* absmax, int64_t n, int64_t block_size)
+{
+    int64_t num_blocks = (n + block_size - 1) / block_size;
+    int64_t grain = std::max<int64_t>(1, CODEC_GRAIN_ELEMENTS / block_size);
+    ThreadPool::Instance().parallel_for(0, num_blocks, grain, [&](int64_t begin, int64_t end) {
+        std::vector<float> buffer(block_size);
+        for (int64_t b = begin; b < end; b++) {
+            int64_t start = b * block_size;
+            int64_t len = std::min(block_size, n - start);
+            const float* values = load_float(x + start, len, buffer.data());
+            float scale = simd_absmax(values, len);
+            absmax[b] = scale;
+            // a multiply by the inverse, rintf and fmaxf/fminf vectorize; the
+            // clamp also maps nan to -127 instead of an undefined conversion
+            float inverse = scale == 0.f ? 0.f : 127.f / scale;
+            int8_t* out = q + start;
+            for (int64_t i = 0; i < len; i++)
+                out[i] = (int8_t)fminf(fmaxf(rintf(values[i] * inverse), -127.f), 127.f);
+        }
+    });
+}
+
+template <typename T>
+void dequantize_blocks(const int8_t* q, const float* absmax, T* x, int64_t n, int64_t block_size)
+{
+    int64_t num_blocks = (n + block_size - 1) / block_size;
+    int64_t grain = std::max<int64_t>(1, CODEC_GRAIN_ELEMENTS / block_size);
+    ThreadPool::Instance().parallel_for(0, num_blocks, grain, [&](int64_t begin, int64_t end) {
+        for (int64_t b = begin; b < end; b++) {
+            int64_t start = b * block_size;
+            int64_t len = std::min(block_size, n - start);
+            for (int64_t i = start; i < start + len; i++)
+                x[i] = static_cast<T>(dequantize_signed_8bit(q[i], absmax[b]));
+        }
+    });
+}
+
+// Quantizes input, a float, half or bfloat16 tensor, into q, an int8 tensor of
+// the same number of elements, and absmax, one float per block.
+void quantize_blockwise(const at::Tensor& input,
+                        at::Tensor& q,
+                        at::Tensor& absmax,
+                        int64_t block_size)
+{
+    CHECK_INPUT(input);
+    CHECK_INPUT(q);
+    CHECK_INPUT(absmax);
+    int64_t n = input.numel();
+    AT_ASSERTM(block_size > 0, "block size must be positive");
+    AT_ASSERTM(q.scalar_type() == at::ScalarType::Char && q.numel() == n,
+               "q must be an int8 tensor with one element per input element");
+    AT_ASSERTM(absmax.scalar_type() == at::ScalarType::Float &&
+                   absmax.numel() == (n + block_size - 1) / block_size,
+               "absmax must be a float tensor with one element per block");
+
+    int8_t* q_ptr = (int8_t*)q.data_ptr();
+    float* absmax_ptr = (float*)absmax.data_ptr();
+    switch (input.scalar_type()) {
+        case at::ScalarType::Float:
+            quantize_blocks<float>(
+                (const float*)input.data_ptr(), q_ptr, absmax_ptr, n, block_size);
+            break;
+        case at::ScalarType::Half:
+            quantize_blocks<at::Half>(
+                (const at::Half*)input.data_ptr(), q_ptr, absmax_ptr, n, block_size);
+            break;
+#ifdef VERSION_GE_1_5
+        case at::ScalarType::BFloat16:
+            quantize_blocks<at::BFloat16>(
+                (const at::BFloat16*)input.data_ptr(), q_ptr, absmax_ptr, n, block_size);
+            break;
+#endif
+        default:
+            AT_ERROR("quantize_blockwise not implemented for '",
+                     toString(input.scalar_type()),
+                     "'");
+    }
+}
+
+// Inverse of quantize_blockwise, writes the values into out.
+void dequantize_blockwise(const at::Tensor& q,
+                          const at::Tensor& absmax,
+                          at::Tensor& out,
+                          int64_t block_size)
+{
+    CHECK_INPUT(q);
+    CHECK_INPUT(absmax);
+    CHECK_INPUT(out);
+    int64_t n = out.numel();
+    AT_ASSERTM(block_size > 0, "block size must be positive");
+    AT_ASSERTM(q.scalar_type() == at::ScalarType::Char && q.numel() == n,
+               "q must be an int8 tensor with one element per output element");
+    AT_ASSERTM(absmax.scalar_type() == at::ScalarType::Float &&
+                   absmax.numel() == (n + block_size - 1) / block_size,
+               "absmax must be a float tensor with one element per block");
+
+    const int8_t* q_ptr = (const int8_t*)q.data_ptr();
+    const float* absmax_ptr = (const float*)absmax.data_ptr();
+    switch (out.scalar_type()) {
+        case at::ScalarType::Float:
+            dequantize_blocks<float>(q_ptr, absmax_ptr, (float*)out.data_ptr(), n, block_size);
+            break;
+        case at::ScalarType::Half:
+            dequantize_blocks<at::Half>(
+                q_ptr, absmax_ptr, (at::Half*)out.data_ptr(), n, block_size);
+            break;
+#ifdef VERSION_GE_1_5
+        case at::ScalarType::BFloat16:
+            dequantize_blocks<at::BFloat16>(
+                q_ptr, absmax_ptr, (at::BFloat16*)out.data_ptr(), n, block_size);
+            break;
+#endif
+        default:
+            AT_ERROR("dequantize_blockwise not implemented for '",
+                     toString(out.scalar_type()),
+                     "'");
+    }
+}
+
+template <typename W>
+inline W rotate_sign(W v)
+{
+    return (W)((v << 1) | (v >> (sizeof(W) * 8 - 1)));
+}
+
+template <typename W>
+inline W unrotate_sign(W v)
+{
+    return (W)((v >> 1) | (v << (sizeof(W) * 8 - 1)));
+}
+
+inline int bit_width(uint8_t range)
+{
+    int width = 0;
+    while (range >> width) width++;
+    return width;
+}
+
+inline int64_t packed_bytes(int64_t len, int width) { return (len * width + 7) / 8; }
+
+inline uint8_t* pack_bits(const uint8_t* values, int64_t len, uint8_t base, int width, uint8_t* out)
+{
+    if (width == 8) {
+        for (int64_t i = 0; i < len; i++) out[i] = (uint8_t)(values[i] - base);
+        return out + len;
+    }
+    uint64_t acc = 0;
+    int bits = 0;
+    for (int64_t i = 0; i < len && width > 0; i++) {
+        acc |= (uint64_t)(uint8_t)(values[i] - base) << bits;
+        bits += width;
+        for (; bits >= 8; bits -= 8) {
+            *out++ = (uint8_t)acc;
+            acc >>= 8;
+        }
+    }
+    if (bits > 0) *out++ = (uint8_t)acc;
+    return out;
+}
+
+inline const uint8_t* unpack_bits(const uint8_t* in,
+                                  int64_t len,
+                                  uint8_t base,
+                                  int width,
+                                  uint8_t* values)
+{
+    if (width == 0) {
+        memset(values, base, len);
+        return in;
+    }
+    if (width == 8) {
+        for (int64_t i = 0; i < len; i++) values[i] = (uint8_t)(in[i] + base);
+        return in + len;
+    }
+    uint64_t acc = 0;
+    int bits = 0;
+    uint64_t mask = (1u << width) - 1;
+    for (int64_t i = 0; i < len; i++) {
+        for (; bits < width; bits += 8) acc |= (uint64_t)(*in++) << bits;
+        values[i] = (uint8_t)(base + (acc & mask));
+        acc >>= width;
+        bits -= width;
+    }
+    return in;
+}
+
+// One block prepared for encoding: the zero bitmap if it pays off, the
+// non-zero words split into byte planes and the minimum and bit width of
+// every plane.
+template <typename W>
+struct BytePlaneBlock {
+    uint8_t bitmap[BYTEPLANE_BLOCK_SIZE / 8];
+    uint8_t planes[BYTEPLANE_BLOCK_SIZE * sizeof(W)];
+    uint8_t bases[sizeof(W)];
+    uint8_t widths[sizeof(W)];
+    bool has_bitmap;
+    int64_t count;
+
+    void split(const W* x, int64_t len)
+    {
+        int64_t zeros = 0;
+        for (int64_t i = 0; i < len; i++) zeros += x[i] == 0;
+        // a bit per element is cheaper than storing the zeros in the planes
+        has_bitmap = zeros * 8 * (int64_t)sizeof(W) > len;
+        count = 0;
+        if (has_bitmap) std::fill(bitmap, bitmap + (len + 7) / 8, 0);
+        for (int64_t i = 0; i < len; i++) {
+            if (has_bitmap) {
+                if (x[i] == 0) continue;
+                bitmap[i / 8] |= 1 << (i % 8);
+            }
+            W v = rotate_sign(x[i]);
+            for (int p = 0; p < (int)sizeof(W); p++)
+                planes[p * BYTEPLANE_BLOCK_SIZE + count] = (uint8_t)(v >> (8 * p));
+            count++;
+        }
+        for (int p = 0; p < (int)sizeof(W); p++) {
+            const uint8_t* plane = planes + p * BYTEPLANE_BLOCK_SIZE;
+            uint8_t lo = 255, hi = 0;
+            for (int64_t i = 0; i < count; i++) {
+                lo = std::min(lo, plane[i]);
+                hi = std::max(hi, plane[i]);
+            }
+            bases[p] = count ? lo : 0;
+            widths[p] = count ? bit_width(hi - lo) : 0;
+        }
+    }
+
+    int64_t encoded_bytes(int64_t len) const
+    {
+        int64_t size = 1 + (has_bitmap ? (len + 7) / 8 : 0);
+        for (int p = 0; p < (int)sizeof(W); p++)
+            size += BYTEPLANE_HEADER_BYTES + packed_bytes(count, widths[p]);
+        return size;
+    }
+
+    uint8_t* write(int64_t len, uint8_t* out) const
+    {
+        *out++ = has_bitmap;
+        if (has_bitmap) {
+            memcpy(out, bitmap, (len + 7) / 8);
+            out += (len + 7) / 8;
+        }
+        for (int p = 0; p < (int)sizeof(W); p++) {
+            *out++ = bases[p];
+            *out++ = widths[p];
+            out = pack_bits(planes + p * BYTEPLANE_BLOCK_SIZE, count, bases[p], widths[p], out);
+        }
+        return out;
+    }
+};
+
+// Encodes n words into data, the encoded blocks one after another, and index,
+// the byte offset of every block and the total size, so blocks decode in
+// parallel. Sizes are computed in a first pass and the blocks split again
+// while writing, which is cheaper than staging all of them.
+//
+// Block layout: a flag byte, the zero bitmap if the flag is set, then for
+// every plane its minimum, its bit width and the packed offsets of the
+// non-zero words from the minimum.
+template <typename W>
+std::vector<at::Tensor> byteplane_encode_words(const W* x, int64_t n, const at::Tensor& input)
+{
+    int64_t num_blocks = (n + BYTEPLANE_BLOCK_SIZE - 1) / BYTEPLANE_BLOCK_SIZE;
+    int64_t grain = std::max<int64_t>(1, CODEC_GRAIN_ELEMENTS / BYTEPLANE_BLOCK_SIZE);
+    at::Tensor index = at::empty({num_blocks + 1}, input.options().dtype(at::kLong));
+    int64_t* offsets = (int64_t*)index.data_ptr();
+
+    ThreadPool::Instance().parallel_for(0, num_blocks, grain, [&](int64_t begin, int64_t end) {
+        std::unique_ptr<BytePlaneBlock<W>> block(new BytePlaneBlock<W>());
+        for (int64_t b = begin; b < end; b++) {
+            int64_t start = b * BYTEPLANE_BLOCK_SIZE;
+            int64_t len = std::min<int64_t>(BYTEPLANE_BLOCK_SIZE, n - start);
+            block->split(x + start, len);
+            offsets[b + 1] = block->encoded_bytes(len);
+        }
+    });
+
+    offsets[0] = 0;
+    for (int64_t b = 0; b < num_blocks; b++) offsets[b + 1] += offsets[b];
+    at::Tensor data = at::empty({offsets[num_blocks]}, input.options().dtype(at::kByte));
+    uint8_t* out = (uint8_t*)data.data_ptr();
+
+    ThreadPool::Instance().parallel_for(0, num_blocks, grain, [&](int64_t begin, int64_t end) {
+        std::unique_ptr<BytePlaneBlock<W>> block(new BytePlaneBlock<W>());
+        for (int64_t b = begin; b < end; b++) {
+            int64_t start = b * BYTEPLANE_BLOCK_SIZE;
+            int64_t len = std::min<int64_t>(BYTEPLANE_BLOCK_SIZE, n - start);
+            block->split(x + start, len);
+            block->write(len, out + offsets[b]);
+        }
+    });
+    return {index, data};
+}
+
+template <typename W>
+void byteplane_decode_words(const int64_t* offsets, const uint8_t* data, W* x, int64_t n)
+{
+    const int planes = sizeof(W);
+    int64_t num_blocks = (n + BYTEPLANE_BLOCK_SIZE - 1) / BYTEPLANE_BLOCK_SIZE;
+    int64_t grain = std::max<int64_t>(1, CODEC_GRAIN_ELEMENTS / BYTEPLANE_BLOCK_SIZE);
+    ThreadPool::Instance().parallel_for(0, num_blocks, grain, [&](int64_t begin, int64_t end) {
+        std::vector<uint8_t> split(BYTEPLANE_BLOCK_SIZE * planes);
+        for (int64_t b = begin; b < end; b++) {
+            int64_t start = b * BYTEPLANE_BLOCK_SIZE;
+            int64_t len = std::min<int64_t>(BYTEPLANE_BLOCK_SIZE, n - start);
+            const uint8_t* src = data + offsets[b];
+            bool has_bitmap = *src++;
+            const uint8_t* bitmap = src;
+            int64_t count = len;
+            if (has_bitmap) {
+                count = 0;
+                for (int64_t i = 0; i < (len + 7) / 8; i++) count += __builtin_popcount(bitmap[i]);
+                src += (len + 7) / 8;
+            }
+            for (int p = 0; p < planes; p++) {
+                uint8_t base = src[0];
+                uint8_t width = src[1];
+                src = unpack_bits(
+                    src + BYTEPLANE_HEADER_BYTES, count, base, width, split.data() + p * count);
+            }
+            int64_t j = 0;
+            for (int64_t i = 0; i < len; i++) {
+                if (has_bitmap && !(bitmap[i / 8] & (1 << (i % 8)))) {
+                    x[start + i] = 0;
+                    continue;
+                }
+                W v = 0;
+                for (int p = 0; p < planes; p++) v |= (W)split[p * count + j] << (8 * p);
+                x[start + i] = unrotate_sign(v);
+                j++;
+            }
+        }
+    });
+}
+
+// Lossless encoding of a tensor of 2 or 4 byte elements, returns the block
+// index and the encoded bytes.
+std::vector<at::Tensor> byteplane_encode(const at::Tensor& input)
+{
+    CHECK_INPUT(input);
+    switch (input.element_size()) {
+        case 2:
+            return byteplane_encode_words<uint16_t>(
+                (const uint16_t*)input.data_ptr(), input.numel(), input);
+        case 4:
+            return byteplane_encode_words<uint32_t>(
+                (const uint32_t*)input.data_ptr(), input.numel(), input);
+        default:
+            AT_ERROR("byteplane_encode not implemented for '",
+                     toString(input.scalar_type()),
+                     "'");
+    }
+}
+
+// Decodes the output of byteplane_encode into out, which has the dtype and
+// number of elements of the encoded tensor.
+void byteplane_decode(const at::Tensor& index, const at::Tensor& data, at::Tensor& out)
+{
+    CHECK_INPUT(index);
+    CHECK_INPUT(data);
+    CHECK_INPUT(out);
+    int64_t n = out.numel();
+    AT_ASSERTM(index.scalar_type() == at::ScalarType::Long &&
+                   index.numel() == (n + BYTEPLANE_BLOCK_SIZE - 1) / BYTEPLANE_BLOCK_SIZE + 1,
+               "index does not match the number of output elements");
+    AT_ASSERTM(data.scalar_type() == at::ScalarType::Byte, "data must be a uint8 tensor");
+
+    const int64_t* offsets = (const int64_t*)index.data_ptr();
+    const uint8_t* bytes = (const uint8_t*)data.data_ptr();
+    AT_ASSERTM(offsets[index.numel() - 1] == data.numel(), "index does not match the data");
+    switch (out.element_size()) {
+        case 2:
+            byteplane_decode_words<uint16_t>(offsets, bytes, (uint16_t*)out.data_ptr(), n);
+            break;
+        case 4:
+            byteplane_decode_words<uint32_t>(offsets, bytes, (uint32_t*)out.data_ptr(), n);
+            break;
+        default:
+            AT_ERROR("byteplane_decode not implemented for '", toString(out.scalar_type()), "'");
+    }
+}
+
+PYBIND11_MODULE(TORCH_EXTENSION_NAME, m)
+{
+    attach_thread_pool();
+    m.def("quantize_blockwise",
+          &quantize_blockwise,
+          "Blockwise int8 quantization of activation checkpoints",
+          py::call_guard<py::gil_scoped_release>());
+    m.def("dequantize_blockwise",
+          &dequantize_blockwise,
+          "Dequantization of blockwise int8 activation checkpoints",
+          py::call_guard<py::gil_scoped_release>());
+    m.def("byteplane_encode",
+          &byteplane_encode,
+          "Lossless byte plane encoding of activation checkpoints",
+          py::call_guard<py::gil_scoped_release>());
+    m.def("byteplane_decode",
+          &byteplane_decode,
+          "Decoding of byte plane encoded activation checkpoints",
+          py::call_guard<py::gil_scoped_release>());
+}
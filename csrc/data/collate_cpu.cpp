@@ -0,0 +1,161 @@
+/* Copyright 2020 The Microsoft DeepSpeed Team */
+#include <torch/extension.h>
+#include <string.h>
+#include <algorithm>
+#include <vector>
+#include "thread_pool.h"
+
+#define CHECK_CPU(x) AT_ASSERTM(!x.type().is_cuda(), #x " must be a CPU tensor")
+#define CHECK_CONTIGUOUS(x) AT_ASSERTM(x.is_contiguous(), #x " must be contiguous")
+#define CHECK_INPUT(x) \
+    CHECK_CPU(x);      \
+    CHECK_CONTIGUOUS(x)
+
+// Bytes copied per parallel task at least, so batches of small samples such as
+// labels are copied by one thread instead of paying for a parallel region.
+#define COLLATE_GRAIN_BYTES 65536
+
+// Tokens written per parallel task at least when gathering token sequences.
+#define GATHER_GRAIN_TOKENS 32768
+
+// Stacks samples, tensors of equal dtype and size, into the rows of out. out is preallocated by the caller, typically a pinned buffer
+// from a pool that is reused across batches, so collation neither allocates
+// nor touches the allocator of the training process.
+void collate(const std::vector<at::Tensor>& samples, at::Tensor& out)
+{
+    CHECK_INPUT(out);
+    int64_t batch = samples.size();
+    AT_ASSERTM(out.dim() > 0 && out.size(0) == batch, "out must have one row per sample");
+    if (batch == 0) return;
+
+    // like torch.stack, samples of another shape are rejected even when they
+    // have as many elements
+    auto row_sizes = samples[0].sizes();
+    if (out.sizes().slice(1) != row_sizes)
+        AT_ERROR("collate output rows of size ",
+                 out.sizes().slice(1),
+                 " do not match the first sample of size ",
+                 row_sizes);
+
+    int64_t row_bytes = samples[0].numel() * out.element_size();
+    std::vector<at::Tensor> rows;
+    rows.reserve(batch);
+    for (int64_t i = 0; i < batch; i++) {
+        const auto& sample = samples[i];
+        CHECK_CPU(sample);
+        if (sample.scalar_type() != out.scalar_type())
+            AT_ERROR("collate sample dtype ",
+                     toString(sample.scalar_type()),
+                     " does not match output dtype ",
+                     toString(out.scalar_type()));
+        if (sample.sizes() != row_sizes)
+            AT_ERROR("collate sample ",
+                     i,
+                     " has size ",
+                     sample.sizes(),
+                     " but the first sample has size ",
+                     row_sizes);
+        rows.push_back(sample.contiguous());
+    }
+
+    char* dst = (char*)out.data_ptr();
+    int64_t grain = std::max<int64_t>(1, COLLATE_GRAIN_BYTES / std::max<int64_t>(1, row_bytes));
+    ThreadPool::Instance().parallel_for(0, batch, grain, [&](int64_t begin, int64_t end) {
+        for (int64_t i = begin; i < end; i++)
+            memcpy(dst + i * row_bytes, rows[i].data_ptr(), row_bytes);
+    });
+}
+
+template <typename T>
+void gather_token_rows(const T* tokens,
+                       const int64_t* offsets,
+                       const int64_t* indices,
+                       int64_t batch,
+                       int64_t seq_length,
+                       int64_t pad_id,
+                       int64_t* input_ids,
+                       int64_t* attention_mask)
+{
+    int64_t grain = std::max<int64_t>(1, GATHER_GRAIN_TOKENS / std::max<int64_t>(1, seq_length));
+    ThreadPool::Instance().parallel_for(0, batch, grain, [&](int64_t begin, int64_t end) {
+        for (int64_t i = begin; i < end; i++) {
+            int64_t start = offsets[indices[i]];
+            int64_t length = std::min(offsets[indices[i] + 1] - start, seq_length);
+            const T* src = tokens + start;
+            int64_t* ids = input_ids + i * seq_length;
+            int64_t* mask = attention_mask + i * seq_length;
+            for (int64_t j = 0; j < length; j++) {
+                ids[j] = src[j];
+                mask[j] = 1;
+            }
+            for (int64_t j = length; j < seq_length; j++) {
+                ids[j] = pad_id;
+                mask[j] = 0;
+            }
+        }
+    });
+}
+
+// Gathers the token sequences of the samples in indices from a flat token
+// array, typically memory mapped, into the rows of input_ids. Sample k holds
+// tokens[offsets[k]:offsets[k + 1]]; longer samples are truncated to the row
+// length and shorter ones padded with pad_id, with attention_mask set to 1 for
+// real tokens. Token ids are stored as uint16, passed as int16 bits, or int32.
+void gather_tokens(const at::Tensor& tokens,
+                   const at::Tensor& offsets,
+                   const at::Tensor& indices,
+                   at::Tensor& input_ids,
+                   at::Tensor& attention_mask,
+                   int64_t pad_id)
+{
+    CHECK_INPUT(tokens);
+    CHECK_INPUT(offsets);
+    CHECK_INPUT(indices);
+    CHECK_INPUT(input_ids);
+    CHECK_INPUT(attention_mask);
+    AT_ASSERTM(offsets.scalar_type() == at::kLong, "offsets must be int64");
+    AT_ASSERTM(indices.scalar_type() == at::kLong, "indices must be int64");
+    AT_ASSERTM(input_ids.scalar_type() == at::kLong, "input_ids must be int64");
+    AT_ASSERTM(attention_mask.scalar_type() == at::kLong, "attention_mask must be int64");
+
+    int64_t batch = indices.numel();
+    AT_ASSERTM(input_ids.dim() == 2 && input_ids.size(0) == batch,
+               "input_ids must have one row per sample");
+    AT_ASSERTM(attention_mask.sizes() == input_ids.sizes(),
+               "attention_mask must have the shape of input_ids");
+    int64_t seq_length = input_ids.size(1);
+
+    const int64_t* offsets_ptr = (const int64_t*)offsets.data_ptr();
+    const int64_t* indices_ptr = (const int64_t*)indices.data_ptr();
+    int64_t num_samples = offsets.numel() - 1;
+    for (int64_t i = 0; i < batch; i++)
+        AT_ASSERTM(indices_ptr[i] >= 0 && indices_ptr[i] < num_samples,
+                   "sample index out of range");
+
+    int64_t* ids = (int64_t*)input_ids.data_ptr();
+    int64_t* mask = (int64_t*)attention_mask.data_ptr();
+    switch (tokens.scalar_type()) {
+        case at::kShort:
+            gather_token_rows(
+                (const uint16_t*)tokens.data_ptr(), offsets_ptr, indices_ptr, batch, seq_length, pad_id, ids, mask);
+            break;
+        case at::kInt:
+            gather_token_rows(
+                (const int32_t*)tokens.data_ptr(), offsets_ptr, indices_ptr, batch, seq_length, pad_id, ids, mask);
+            break;
+        default: AT_ERROR("gather_tokens not implemented for '", toString(tokens.scalar_type()), "'");
+    }
+}
+
+PYBIND11_MODULE(TORCH_EXTENSION_NAME, m)
+{
+    attach_thread_pool();
+    m.def("collate",
+          &collate,
+          "Stack equally sized samples into a preallocated tensor (CPU)",
+          py::call_guard<py::gil_scoped_release>());
+    m.def("gather_tokens",
+          &gather_tokens,
+          "Gather token sequences into padded rows of a preallocated tensor (CPU)",
+          py::call_guard<py::gil_scoped_release>());
+}
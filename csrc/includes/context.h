@@ -9,6 +9,7 @@
 #include "cuda.h"
 #include "curand.h"
 #include "gemm_test.h"
+#include "thread_pool.h"
 #include <stack>
 
 #define WARP_SIZE 32
@@ -91,6 +92,9 @@ public:
 
     cublasHandle_t GetCublasHandle() { return _cublasHandle; }
 
+    // Host thread pool shared with the DeepSpeed CPU extensions.
+    ThreadPool& GetThreadPool() { return ThreadPool::Instance(); }
+
     std::pair<uint64_t, uint64_t> IncrementOffset(uint64_t offset_inc)
     {
         //if(_local_rank == 0)printf("current offset is %lu\n", _curr_offset);
@@ -0,0 +1,51 @@
+/* Copyright 2020 The Microsoft DeepSpeed Team */
+#pragma once
+
+#include <stdint.h>
+#include <cmath>
+
+// Blockwise 8-bit storage of the optimizer moments, shared by the CUDA and CPU
+// kernels so both produce bit compatible states.
+//
+// Every OPTIMIZER_8BIT_BLOCK_SIZE consecutive elements share one fp32 scale,
+// the largest magnitude in the block after the update.
+//  - exp_avg (m) is signed and roughly symmetric: linear int8 in [-127, 127].
+//  - exp_avg_sq (v) is non-negative with a wide range: sqrt(v / absmax) is
+//    stored as linear uint8, which spends the codes on small values and is
+//    linear in the sqrt(v) the update divides by. Codes are rounded up so a
+//    non-zero v never decodes to zero and blows up m / (sqrt(v) + eps).
+
+#define OPTIMIZER_8BIT_BLOCK_SIZE 2048
+
+#ifdef __CUDACC__
+#define OPTIMIZER_8BIT_HD __host__ __device__
+#else
+#define OPTIMIZER_8BIT_HD
+#endif
+
+OPTIMIZER_8BIT_HD inline float dequantize_signed_8bit(int8_t q, float absmax)
+{
+    return q * (absmax / 127.f);
+}
+
+OPTIMIZER_8BIT_HD inline int8_t quantize_signed_8bit(float x, float absmax)
+{
+    if (absmax == 0.f) return 0;
+    float q = rintf(x / absmax * 127.f);
+    q = q > 127.f ? 127.f : (q < -127.f ? -127.f : q);
+    return (int8_t)q;
+}
+
+OPTIMIZER_8BIT_HD inline float dequantize_sqrt_8bit(uint8_t q, float absmax)
+{
+    float s = q * (1.f / 255.f);
+    return s * s * absmax;
+}
+
+OPTIMIZER_8BIT_HD inline uint8_t quantize_sqrt_8bit(float x, float absmax)
+{
+    if (absmax == 0.f) return 0;
+    float q = ceilf(sqrtf(x / absmax) * 255.f);
+    q = q > 255.f ? 255.f : (q < 0.f ? 0.f : q);
+    return (uint8_t)q;
+}
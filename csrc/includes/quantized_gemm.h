@@ -0,0 +1,185 @@
+/* Copyright 2020 The Microsoft DeepSpeed Team */
+#pragma once
+
+#include <stdint.h>
+#include <algorithm>
+#include <cmath>
+#include <vector>
+
+#if defined(__AVX512F__) || defined(__AVX2__)
+#include <immintrin.h>
+#endif
+
+// Weight-quantized gemms of inference on the CPU, out = x * w^T + bias with
+// an optional GeLU, for weights packed offline by
+// deepspeed/pt/deepspeed_quantized_inference.py.
+//
+//  - int8: every output channel n has an fp32 scale and int8 codes in
+//    [-127, 127]. The codes are packed in tiles of QGEMM_TILE_N channels by
+//    QGEMM_TILE_K inputs, [N / 16][K / 4][16][4], zero padded, so one 512 bit
+//    load holds 4 inputs of 16 channels, the operand of the AVX512-VNNI u8 x s8
+//    dot product. Activations are quantized per row to int8 and shifted by 128
+//    to unsigned; compensation[n] = 128 * sum_k w[n, k] removes the shift.
+//  - int4: codes in [-7, 7] with one fp32 scale per group of group_size
+//    inputs of a channel, two codes per byte, the even input in the low
+//    nibble, stored as code + 8. Sums of a group are int32 and scaled in fp32.
+//
+// Both accumulate exactly in int32, so the result only depends on the
+// quantization, not on the instruction set.
+
+#define QGEMM_TILE_N 16
+#define QGEMM_TILE_K 4
+// activation rows sharing the weight loads of a tile
+#define QGEMM_ROWS 4
+// zero point of the unsigned activations of the int8 gemm
+#define QGEMM_ACTIVATION_SHIFT 128
+
+inline int64_t qgemm_round_up(int64_t x, int64_t multiple)
+{
+    return (x + multiple - 1) / multiple * multiple;
+}
+
+// Quantizes a row of k activations to int8 codes of scale absmax / 127 and
+// returns the scale. The codes are written shifted by shift, the rest of the
+// row up to padded_k is the code 0.
+template <typename Q>
+inline float qgemm_quantize_row(const float* x, int64_t k, int64_t padded_k, int shift, Q* q)
+{
+    float absmax = 0.f;
+    for (int64_t i = 0; i < k; i++) absmax = std::max(absmax, std::fabs(x[i]));
+    float scale = absmax / 127.f;
+    float inverse = absmax == 0.f ? 0.f : 127.f / absmax;
+    for (int64_t i = 0; i < k; i++)
+        q[i] = (Q)((int)fminf(fmaxf(rintf(x[i] * inverse), -127.f), 127.f) + shift);
+    for (int64_t i = k; i < padded_k; i++) q[i] = (Q)shift;
+    return scale;
+}
+
+// int32 sums of ROWS unsigned activation rows, padded_k apart, with the 16
+// channels of a packed tile.
+template <int ROWS>
+inline void qgemm_tile_dot(const uint8_t* a, int64_t padded_k, const int8_t* tile, int32_t* acc)
+{
+#if defined(__AVX512VNNI__)
+    __m512i sums[ROWS];
+    for (int r = 0; r < ROWS; r++) sums[r] = _mm512_setzero_si512();
+    for (int64_t k = 0; k < padded_k; k += QGEMM_TILE_K) {
+        __m512i w = _mm512_loadu_si512((const void*)(tile + k * QGEMM_TILE_N));
+        for (int r = 0; r < ROWS; r++) {
+            int32_t inputs;
+            __builtin_memcpy(&inputs, a + r * padded_k + k, sizeof(inputs));
+            sums[r] = _mm512_dpbusd_epi32(sums[r], _mm512_set1_epi32(inputs), w);
+        }
+    }
+    for (int r = 0; r < ROWS; r++) _mm512_storeu_si512((void*)(acc + r * QGEMM_TILE_N), sums[r]);
+#else
+    for (int r = 0; r < ROWS; r++) {
+        int32_t* out = acc + r * QGEMM_TILE_N;
+        const uint8_t* row = a + r * padded_k;
+        for (int j = 0; j < QGEMM_TILE_N; j++) out[j] = 0;
+        for (int64_t k = 0; k < padded_k; k += QGEMM_TILE_K) {
+            const int8_t* w = tile + k * QGEMM_TILE_N;
+            for (int j = 0; j < QGEMM_TILE_N; j++)
+                for (int i = 0; i < QGEMM_TILE_K; i++)
+                    out[j] += (int32_t)row[k + i] * w[j * QGEMM_TILE_K + i];
+        }
+    }
+#endif
+}
+
+// The tanh approximation of the fused transformer kernels.
+inline float qgemm_gelu(float x)
+{
+    const float sqrt_param = 0.79788456080286535587989211986876f;
+    const float mul_param = 0.044715f;
+    return x * 0.5f * (1.0f + tanhf(sqrt_param * (x + mul_param * x * x * x)));
+}
+
+// Dequantizes the int32 sums of a row, adds the bias and applies the GeLU.
+inline float qgemm_epilogue(float sum, float scale, const float* bias, int64_t n, bool gelu)
+{
+    float out = sum * scale;
+    if (bias) out += bias[n];
+    return gelu ? qgemm_gelu(out) : out;
+}
+
+// Output columns [tile_begin * 16, tile_end * 16) of all m rows of the int8
+// gemm, the activations being quantized already.
+inline void qgemm_int8_tiles(const uint8_t* a,
+                             const float* a_scales,
+                             int64_t m,
+                             int64_t padded_k,
+                             const int8_t* packed,
+                             const int32_t* compensation,
+                             const float* w_scales,
+                             const float* bias,
+                             bool gelu,
+                             int64_t n,
+                             int64_t tile_begin,
+                             int64_t tile_end,
+                             float* out)
+{
+    int32_t acc[QGEMM_ROWS * QGEMM_TILE_N];
+    for (int64_t tile = tile_begin; tile < tile_end; tile++) {
+        const int8_t* weights = packed + tile * padded_k * QGEMM_TILE_N;
+        int64_t n_begin = tile * QGEMM_TILE_N;
+        int64_t n_end = std::min(n, n_begin + QGEMM_TILE_N);
+        for (int64_t row = 0; row < m; row += QGEMM_ROWS) {
+            int64_t rows = std::min<int64_t>(QGEMM_ROWS, m - row);
+            const uint8_t* inputs = a + row * padded_k;
+            if (rows == QGEMM_ROWS)
+                qgemm_tile_dot<QGEMM_ROWS>(inputs, padded_k, weights, acc);
+            else
+                for (int64_t r = 0; r < rows; r++)
+                    qgemm_tile_dot<1>(
+                        inputs + r * padded_k, padded_k, weights, acc + r * QGEMM_TILE_N);
+            for (int64_t r = 0; r < rows; r++)
+                for (int64_t j = n_begin; j < n_end; j++) {
+                    int32_t sum = acc[r * QGEMM_TILE_N + j - n_begin] - compensation[j];
+                    out[(row + r) * n + j] = qgemm_epilogue(
+                        (float)sum, a_scales[row + r] * w_scales[j], bias, j, gelu);
+                }
+        }
+    }
+}
+
+// Output columns [n_begin, n_end) of all m rows of the int4 gemm, the
+// activations being quantized to signed int8 already.
+inline void qgemm_int4_columns(const int8_t* a,
+                               const float* a_scales,
+                               int64_t m,
+                               int64_t k,
+                               int64_t padded_k,
+                               const uint8_t* packed,
+                               const float* w_scales,
+                               int64_t group_size,
+                               const float* bias,
+                               bool gelu,
+                               int64_t n,
+                               int64_t n_begin,
+                               int64_t n_end,
+                               float* out)
+{
+    int64_t groups = (k + group_size - 1) / group_size;
+    std::vector<int8_t> codes(padded_k);
+    for (int64_t j = n_begin; j < n_end; j++) {
+        const uint8_t* bytes = packed + j * (padded_k / 2);
+        for (int64_t i = 0; i < padded_k / 2; i++) {
+            codes[2 * i] = (int8_t)(bytes[i] & 0xF) - 8;
+            codes[2 * i + 1] = (int8_t)(bytes[i] >> 4) - 8;
+        }
+        const float* scales = w_scales + j * groups;
+        for (int64_t row = 0; row < m; row++) {
+            const int8_t* inputs = a + row * padded_k;
+            float sum = 0.f;
+            for (int64_t g = 0; g < groups; g++) {
+                int64_t begin = g * group_size;
+                int64_t end = std::min(k, begin + group_size);
+                int32_t dot = 0;
+                for (int64_t i = begin; i < end; i++) dot += (int32_t)inputs[i] * codes[i];
+                sum += scales[g] * (float)dot;
+            }
+            out[row * n + j] = qgemm_epilogue(sum, a_scales[row], bias, j, gelu);
+        }
+    }
+}
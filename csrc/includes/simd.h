@@ -0,0 +1,219 @@
+/* Copyright 2020 The Microsoft DeepSpeed Team */
+#pragma once
+
+#include <cstdint>
+
+#if defined(__AVX512F__) || defined(__AVX2__)
+#include <immintrin.h>
+#endif
+
+// Host-side vector helpers shared by the CPU kernels. The width is picked at
+// compile time from the target flags, the portable default of setup.py or
+// -march=native with DS_BUILD_NATIVE=1; every helper has a scalar path and a
+// scalar tail so callers never need to pad their buffers.
+
+#if defined(__AVX512F__)
+#define SIMD_WIDTH 16
+#define SIMD_FLOAT __m512
+#define SIMD_LOAD(x) _mm512_loadu_ps(x)
+#define SIMD_STORE(a, d) _mm512_storeu_ps(a, d)
+#define SIMD_SET(x) _mm512_set1_ps(x)
+#define SIMD_ADD(x, y) _mm512_add_ps(x, y)
+#define SIMD_MUL(x, y) _mm512_mul_ps(x, y)
+#define SIMD_FMA(x, y, c) _mm512_fmadd_ps(x, y, c)
+#define SIMD_DIV(x, y) _mm512_div_ps(x, y)
+#define SIMD_SQRT(x) _mm512_sqrt_ps(x)
+#define SIMD_REDUCE_ADD(x) _mm512_reduce_add_ps(x)
+#elif defined(__AVX2__)
+#define SIMD_WIDTH 8
+#define SIMD_FLOAT __m256
+#define SIMD_LOAD(x) _mm256_loadu_ps(x)
+#define SIMD_STORE(a, d) _mm256_storeu_ps(a, d)
+#define SIMD_SET(x) _mm256_set1_ps(x)
+#define SIMD_ADD(x, y) _mm256_add_ps(x, y)
+#define SIMD_MUL(x, y) _mm256_mul_ps(x, y)
+#define SIMD_FMA(x, y, c) _mm256_fmadd_ps(x, y, c)
+#define SIMD_DIV(x, y) _mm256_div_ps(x, y)
+#define SIMD_SQRT(x) _mm256_sqrt_ps(x)
+
+inline float simd_reduce_add_256(__m256 x)
+{
+    __m128 lo = _mm256_castps256_ps128(x);
+    __m128 hi = _mm256_extractf128_ps(x, 1);
+    lo = _mm_add_ps(lo, hi);
+    lo = _mm_hadd_ps(lo, lo);
+    lo = _mm_hadd_ps(lo, lo);
+    return _mm_cvtss_f32(lo);
+}
+#define SIMD_REDUCE_ADD(x) simd_reduce_add_256(x)
+#endif
+
+// dst[i] += src[i]
+inline void simd_add_inplace(float* dst, const float* src, int64_t n)
+{
+    int64_t i = 0;
+#if defined(SIMD_WIDTH)
+    for (; i + SIMD_WIDTH <= n; i += SIMD_WIDTH)
+        SIMD_STORE(dst + i, SIMD_ADD(SIMD_LOAD(dst + i), SIMD_LOAD(src + i)));
+#endif
+    for (; i < n; i++) dst[i] += src[i];
+}
+
+// x[i] *= scale
+inline void simd_scale_inplace(float* x, float scale, int64_t n)
+{
+    int64_t i = 0;
+#if defined(SIMD_WIDTH)
+    SIMD_FLOAT s = SIMD_SET(scale);
+    for (; i + SIMD_WIDTH <= n; i += SIMD_WIDTH) SIMD_STORE(x + i, SIMD_MUL(SIMD_LOAD(x + i), s));
+#endif
+    for (; i < n; i++) x[i] *= scale;
+}
+
+// dst[i] += scale * src[i]
+inline void simd_axpy_inplace(float* dst, float scale, const float* src, int64_t n)
+{
+    int64_t i = 0;
+#if defined(SIMD_WIDTH)
+    SIMD_FLOAT s = SIMD_SET(scale);
+    for (; i + SIMD_WIDTH <= n; i += SIMD_WIDTH)
+        SIMD_STORE(dst + i, SIMD_FMA(SIMD_LOAD(src + i), s, SIMD_LOAD(dst + i)));
+#endif
+    for (; i < n; i++) dst[i] += scale * src[i];
+}
+
+// Returns sum(x[i] * y[i])
+inline float simd_dot(const float* x, const float* y, int64_t n)
+{
+    float sum = 0.f;
+    int64_t i = 0;
+#if defined(SIMD_WIDTH)
+    SIMD_FLOAT acc = SIMD_SET(0.f);
+    for (; i + SIMD_WIDTH <= n; i += SIMD_WIDTH)
+        acc = SIMD_FMA(SIMD_LOAD(x + i), SIMD_LOAD(y + i), acc);
+    sum = SIMD_REDUCE_ADD(acc);
+#endif
+    for (; i < n; i++) sum += x[i] * y[i];
+    return sum;
+}
+
+// Returns sum(x[i] * x[i]) and sets *finite to false if any x[i] is inf or nan.
+// Non-finite values are tracked separately from the sum so that a large but
+// finite vector is not reported as an overflow.
+inline float simd_sum_squares(const float* x, int64_t n, bool* finite)
+{
+    float sum = 0.f;
+    float check = 0.f;
+    int64_t i = 0;
+#if defined(SIMD_WIDTH)
+    SIMD_FLOAT acc = SIMD_SET(0.f);
+    SIMD_FLOAT zero = SIMD_SET(0.f);
+    SIMD_FLOAT nan_acc = SIMD_SET(0.f);
+    for (; i + SIMD_WIDTH <= n; i += SIMD_WIDTH) {
+        SIMD_FLOAT v = SIMD_LOAD(x + i);
+        acc = SIMD_FMA(v, v, acc);
+        // v * 0 is 0 for finite v and nan for inf/nan
+        nan_acc = SIMD_FMA(v, zero, nan_acc);
+    }
+    sum = SIMD_REDUCE_ADD(acc);
+    check = SIMD_REDUCE_ADD(nan_acc);
+#endif
+    for (; i < n; i++) {
+        sum += x[i] * x[i];
+        check += x[i] * 0.f;
+    }
+    *finite = (check == check);
+    return sum;
+}
+
+// bfloat16 is the upper half of an fp32, so widening is a 16 bit shift. The
+// values are passed as their raw bits to keep this header free of torch types.
+inline void simd_bf16_to_float(const uint16_t* src, float* dst, int64_t n)
+{
+    int64_t i = 0;
+#if defined(__AVX512F__)
+    for (; i + 16 <= n; i += 16) {
+        __m512i v = _mm512_cvtepu16_epi32(_mm256_loadu_si256((const __m256i*)(src + i)));
+        _mm512_storeu_ps(dst + i, _mm512_castsi512_ps(_mm512_slli_epi32(v, 16)));
+    }
+#elif defined(__AVX2__)
+    for (; i + 8 <= n; i += 8) {
+        __m256i v = _mm256_cvtepu16_epi32(_mm_loadu_si128((const __m128i*)(src + i)));
+        _mm256_storeu_ps(dst + i, _mm256_castsi256_ps(_mm256_slli_epi32(v, 16)));
+    }
+#endif
+    for (; i < n; i++) {
+        uint32_t bits = (uint32_t)src[i] << 16;
+        float f;
+        __builtin_memcpy(&f, &bits, sizeof(f));
+        dst[i] = f;
+    }
+}
+
+#define SIMD_BF16_CONVERT_SIZE 1024
+
+// Returns sum(x[i] * x[i]) over bfloat16 bits and sets *finite like
+// simd_sum_squares. CPUs with AVX512-BF16 multiply the pairs natively with an
+// fp32 accumulator; otherwise the values are widened to fp32 in blocks.
+inline float simd_bf16_sum_squares(const uint16_t* x, int64_t n, bool* finite)
+{
+#if defined(__AVX512BF16__) && defined(__AVX512BW__)
+    __m512 acc = _mm512_setzero_ps();
+    __m512i exponent = _mm512_set1_epi16(0x7f80);
+    __mmask32 non_finite = 0;
+    int64_t i = 0;
+    for (; i + 32 <= n; i += 32) {
+        __m512i v = _mm512_loadu_si512((const void*)(x + i));
+        acc = _mm512_dpbf16_ps(acc, (__m512bh)v, (__m512bh)v);
+        // inf and nan have every exponent bit set
+        non_finite |= _mm512_cmpeq_epi16_mask(_mm512_and_si512(v, exponent), exponent);
+    }
+    float sum = _mm512_reduce_add_ps(acc);
+    bool tail_finite = true;
+    if (i < n) {
+        float buffer[32];
+        simd_bf16_to_float(x + i, buffer, n - i);
+        sum += simd_sum_squares(buffer, n - i, &tail_finite);
+    }
+    *finite = non_finite == 0 && tail_finite;
+    return sum;
+#else
+    float buffer[SIMD_BF16_CONVERT_SIZE];
+    float sum = 0.f;
+    *finite = true;
+    for (int64_t i = 0; i < n; i += SIMD_BF16_CONVERT_SIZE) {
+        int64_t len = n - i < SIMD_BF16_CONVERT_SIZE ? n - i : SIMD_BF16_CONVERT_SIZE;
+        simd_bf16_to_float(x + i, buffer, len);
+        bool block_finite;
+        sum += simd_sum_squares(buffer, len, &block_finite);
+        *finite = *finite && block_finite;
+    }
+    return sum;
+#endif
+}
+
+// Returns max(|x[i]|), 0 for an empty range. nan values are skipped: max_ps
+// returns its second operand when either is nan, which is the accumulator.
+inline float simd_absmax(const float* x, int64_t n)
+{
+    float absmax = 0.f;
+    int64_t i = 0;
+#if defined(__AVX512F__)
+    __m512 acc = _mm512_setzero_ps();
+    for (; i + 16 <= n; i += 16) acc = _mm512_max_ps(_mm512_abs_ps(_mm512_loadu_ps(x + i)), acc);
+    absmax = _mm512_reduce_max_ps(acc);
+#elif defined(__AVX2__)
+    __m256 acc = _mm256_setzero_ps();
+    __m256 sign = _mm256_set1_ps(-0.f);
+    for (; i + 8 <= n; i += 8)
+        acc = _mm256_max_ps(_mm256_andnot_ps(sign, _mm256_loadu_ps(x + i)), acc);
+    float lanes[8];
+    _mm256_storeu_ps(lanes, acc);
+    for (int j = 0; j < 8; j++) absmax = lanes[j] > absmax ? lanes[j] : absmax;
+#endif
+    for (; i < n; i++) {
+        float a = x[i] < 0.f ? -x[i] : x[i];
+        absmax = a > absmax ? a : absmax;
+    }
+    return absmax;
+}
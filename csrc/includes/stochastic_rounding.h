@@ -0,0 +1,86 @@
+/* Copyright 2020 The Microsoft DeepSpeed Team */
+#pragma once
+
+#include <c10/util/Half.h>
+#include <stdint.h>
+#include <cmath>
+
+// Stochastic rounding of fp32 values to 16 bit floating point types, shared by
+// the CUDA and CPU optimizer kernels and mirrored by
+// deepspeed/pt/deepspeed_stochastic_rounding.py.
+//
+// x is rounded to one of the two representable neighbours around it with a
+// probability proportional to its distance from the other one, so the rounded
+// value is x in expectation and updates smaller than half an ulp survive on
+// average instead of always being rounded away.
+//
+// The random numbers come from a counter based generator: element index j of
+// a tensor gets stochastic_rounding_bits(seed, j), a stateless hash that every
+// thread computes independently and that reproduces across devices and runs.
+
+#ifdef __CUDACC__
+#define STOCHASTIC_ROUNDING_HD __host__ __device__
+#else
+#define STOCHASTIC_ROUNDING_HD
+#endif
+
+// 32 bit integer finalizer with low bias (lowbias32 by Chris Wellons)
+STOCHASTIC_ROUNDING_HD inline uint32_t stochastic_rounding_hash(uint32_t x)
+{
+    x ^= x >> 16;
+    x *= 0x7feb352du;
+    x ^= x >> 15;
+    x *= 0x846ca68bu;
+    x ^= x >> 16;
+    return x;
+}
+
+STOCHASTIC_ROUNDING_HD inline uint32_t stochastic_rounding_bits(uint32_t seed, uint32_t index)
+{
+    return stochastic_rounding_hash(index ^ stochastic_rounding_hash(seed));
+}
+
+// false for inf and NaN, without relying on isfinite being visible in both
+// host and device code
+STOCHASTIC_ROUNDING_HD inline bool stochastic_rounding_finite(float x)
+{
+    return fabsf(x) <= 3.402823466e+38f;
+}
+
+// Rounds x to T using random, 32 uniformly distributed bits. Values that are
+// exact in T, infinities and NaN round to nearest, and so does a value whose
+// other neighbour would overflow to infinity.
+template <typename T>
+STOCHASTIC_ROUNDING_HD inline T stochastic_round(float x, uint32_t random)
+{
+    T nearest = static_cast<T>(x);
+    float rounded = static_cast<float>(nearest);
+    if (rounded == x || !stochastic_rounding_finite(rounded)) return nearest;
+
+    // the representable neighbour on the other side of x, one ulp away
+    unsigned short other_bits;
+    if (rounded == 0.f)
+        other_bits = x < 0.f ? 0x8001 : 0x0001;
+    else if (fabsf(x) > fabsf(rounded))
+        other_bits = nearest.x + 1;
+    else
+        other_bits = nearest.x - 1;
+    float other = static_cast<float>(T(other_bits, T::from_bits()));
+    if (!stochastic_rounding_finite(other)) return nearest;
+
+    // 24 random bits are exact in fp32
+    float u = (random >> 8) * (1.f / 16777216.f);
+    return u < (x - rounded) / (other - rounded) ? T(other_bits, T::from_bits()) : nearest;
+}
+
+template <>
+STOCHASTIC_ROUNDING_HD inline float stochastic_round<float>(float x, uint32_t random)
+{
+    return x;
+}
+
+template <>
+STOCHASTIC_ROUNDING_HD inline double stochastic_round<double>(float x, uint32_t random)
+{
+    return x;
+}
@@ -0,0 +1,551 @@
+/* Copyright 2020 The Microsoft DeepSpeed Team */
+#pragma once
+
+#include <pthread.h>
+#include <sched.h>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <cstdlib>
+#include <deque>
+#include <exception>
+#include <fstream>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <vector>
+
+// Host-side parallel runtime shared by the DeepSpeed CPU kernels, so kernels,
+// optimizer steps, checkpoint codecs and data collation running at the same
+// time divide the cores of the process instead of each starting its own
+// OpenMP team.
+//
+// Every worker owns a task deque: it pushes and pops tasks at the back and
+// idle workers steal from the front of the others, those on the same NUMA
+// node first. Workers are pinned to the cpus of their NUMA node when the
+// process spans several nodes. parallel_for hands out chunks of its range
+// dynamically to the calling thread and the workers that pick up its tasks,
+// so it may be nested and called from tasks without deadlocking.
+//
+// The pool has OMP_NUM_THREADS threads including the caller, by default the
+// number of cpus the process may use, e.g. as bound by deepspeed_launch.
+// Workers start on first use and again in children forked after that.
+//
+// One process shares a single pool: it is owned by the deepspeed_thread_pool_cpu
+// extension and every other CPU extension attaches to it when it is loaded,
+// see attach_thread_pool below. The methods touching the workers are virtual,
+// so an attached extension runs the code of the owning one, with its fork
+// generation and worker of the calling thread, never its own copies of them.
+
+// Chunks per thread parallel_for splits its range into at most, so threads
+// finishing early take over work of slower ones.
+#define THREAD_POOL_CHUNKS_PER_THREAD 4
+
+// Name of the capsule the owning extension publishes its pool as.
+#define THREAD_POOL_CAPSULE "deepspeed.thread_pool"
+
+struct ThreadPoolWorkerStats {
+    int numa_node;
+    double busy_seconds;
+    uint64_t tasks;
+    uint64_t steals;
+};
+
+inline std::vector<int> parse_cpulist(const std::string& cpulist)
+{
+    std::vector<int> cpus;
+    std::stringstream stream(cpulist);
+    std::string chunk;
+    while (std::getline(stream, chunk, ',')) {
+        if (chunk.empty() || chunk[0] == '\n') continue;
+        size_t dash = chunk.find('-');
+        int first = std::stoi(chunk.substr(0, dash));
+        int last = dash == std::string::npos ? first : std::stoi(chunk.substr(dash + 1));
+        for (int cpu = first; cpu <= last; cpu++) cpus.push_back(cpu);
+    }
+    return cpus;
+}
+
+class ThreadPool {
+public:
+    explicit ThreadPool(int num_threads = 0)
+        : _num_threads(num_threads > 0 ? num_threads : DefaultNumThreads()), _generation(-1)
+    {
+        static std::once_flag registered;
+        std::call_once(registered, []() {
+            pthread_atfork(nullptr, nullptr, []() { ForkGeneration()++; });
+        });
+    }
+
+    virtual ~ThreadPool() { Stop(); }
+
+    static ThreadPool& Instance()
+    {
+        ThreadPool* shared = Shared();
+        if (shared) return *shared;
+        static ThreadPool _pool;
+        return _pool;
+    }
+
+    // The pool of the process, set by attach_thread_pool.
+    static ThreadPool*& Shared()
+    {
+        static ThreadPool* _shared = nullptr;
+        return _shared;
+    }
+
+    static int DefaultNumThreads()
+    {
+        const char* env = getenv("OMP_NUM_THREADS");
+        if (env && atoi(env) > 0) return atoi(env);
+        cpu_set_t cpus;
+        if (sched_getaffinity(0, sizeof(cpus), &cpus) == 0) return std::max(1, CPU_COUNT(&cpus));
+        return std::max(1u, std::thread::hardware_concurrency());
+    }
+
+    // Threads running parallel work, the workers and the calling thread.
+    int NumThreads() const { return _num_threads; }
+
+    // Resizes the pool. Must not be called while it runs tasks.
+    virtual void SetNumThreads(int num_threads)
+    {
+        Stop();
+        _num_threads = num_threads > 0 ? num_threads : DefaultNumThreads();
+    }
+
+    // Index of the calling worker of this pool, -1 on other threads.
+    virtual int WorkerIndex() const
+    {
+        const ThreadPool* pool;
+        int index;
+        CurrentWorker(&pool, &index);
+        return pool == this ? index : -1;
+    }
+
+    // Runs task on a worker, or right away if the pool has no workers. Tasks
+    // submitted by a worker go to its own deque, others are spread round robin.
+    virtual void Submit(std::function<void()> task)
+    {
+        State* state = Start();
+        if (state->workers.empty()) {
+            task();
+            return;
+        }
+        int index = WorkerIndex();
+        if (index < 0) index = state->next_worker++ % state->workers.size();
+        Worker& worker = *state->workers[index];
+        {
+            std::lock_guard<std::mutex> lock(worker.mutex);
+            worker.tasks.push_back(std::move(task));
+        }
+        {
+            std::lock_guard<std::mutex> lock(state->mutex);
+            state->queued++;
+        }
+        state->wakeup.notify_one();
+    }
+
+    // Runs one queued task on the calling thread if there is any, e.g. while
+    // waiting for tasks to finish.
+    virtual bool RunOne()
+    {
+        State* state = Start();
+        std::function<void()> task;
+        int index = WorkerIndex();
+        if (!(index >= 0 && Pop(state, index, &task)) && !Steal(state, index, &task))
+            return false;
+        task();
+        return true;
+    }
+
+    // Calls f(chunk_begin, chunk_end) on chunks covering [begin, end) in
+    // parallel, each at least grain long. Like at::parallel_for, small ranges
+    // run on the calling thread, and the first exception f throws is rethrown
+    // once all chunks are done.
+    template <typename F>
+    void parallel_for(int64_t begin, int64_t end, int64_t grain, const F& f)
+    {
+        if (begin >= end) return;
+        grain = std::max<int64_t>(grain, 1);
+        int64_t range = end - begin;
+        if (range <= grain || _num_threads == 1) {
+            f(begin, end);
+            return;
+        }
+
+        int64_t max_chunks = int64_t(_num_threads) * THREAD_POOL_CHUNKS_PER_THREAD;
+        int64_t chunk = std::max(grain, (range + max_chunks - 1) / max_chunks);
+        auto group = std::make_shared<ChunkGroup>();
+        group->begin = begin;
+        group->end = end;
+        group->chunk = chunk;
+        group->num_chunks = (range + chunk - 1) / chunk;
+        group->remaining = group->num_chunks;
+        group->body = [&f](int64_t chunk_begin, int64_t chunk_end) { f(chunk_begin, chunk_end); };
+
+        // Late helpers find no chunk left and only touch the group, which
+        // they keep alive, never the body on the stack of this call.
+        int64_t helpers = std::min<int64_t>(_num_threads - 1, group->num_chunks - 1);
+        for (int64_t i = 0; i < helpers; i++) Submit([group]() { group->Run(); });
+        group->Run();
+
+        std::unique_lock<std::mutex> lock(group->mutex);
+        group->done.wait(lock, [&]() { return group->remaining == 0; });
+        if (group->error) std::rethrow_exception(group->error);
+    }
+
+    // Per worker NUMA node, busy time and number of tasks run and stolen, and
+    // the seconds since the last reset to compute their utilization.
+    virtual std::vector<ThreadPoolWorkerStats> Stats(double* elapsed_seconds = nullptr)
+    {
+        State* state = Start();
+        std::vector<ThreadPoolWorkerStats> stats;
+        for (auto& worker : state->workers)
+            stats.push_back({worker->numa_node,
+                             worker->busy_ns.load() * 1e-9,
+                             worker->tasks_run.load(),
+                             worker->steals.load()});
+        if (elapsed_seconds)
+            *elapsed_seconds =
+                std::chrono::duration<double>(Clock::now() - state->stats_start).count();
+        return stats;
+    }
+
+    virtual void ResetStats()
+    {
+        State* state = Start();
+        for (auto& worker : state->workers) {
+            worker->busy_ns = 0;
+            worker->tasks_run = 0;
+            worker->steals = 0;
+        }
+        state->stats_start = Clock::now();
+    }
+
+private:
+    typedef std::chrono::steady_clock Clock;
+
+    struct Worker {
+        std::mutex mutex;
+        std::deque<std::function<void()>> tasks;
+        int numa_node;
+        std::vector<int> cpus;
+        std::thread thread;
+        std::atomic<uint64_t> busy_ns{0};
+        std::atomic<uint64_t> tasks_run{0};
+        std::atomic<uint64_t> steals{0};
+    };
+
+    struct State {
+        std::vector<std::unique_ptr<Worker>> workers;
+        std::mutex mutex;
+        std::condition_variable wakeup;
+        int64_t queued = 0;
+        bool stop = false;
+        std::atomic<uint64_t> next_worker{0};
+        Clock::time_point stats_start;
+    };
+
+    struct ChunkGroup {
+        int64_t begin, end, chunk, num_chunks;
+        std::function<void(int64_t, int64_t)> body;
+        std::atomic<int64_t> next{0};
+        std::atomic<bool> failed{false};
+        std::exception_ptr error;
+        std::mutex mutex;
+        std::condition_variable done;
+        int64_t remaining;
+
+        void Run()
+        {
+            for (int64_t i = next++; i < num_chunks; i = next++) {
+                if (!failed) {
+                    try {
+                        int64_t chunk_begin = begin + i * chunk;
+                        body(chunk_begin, std::min(end, chunk_begin + chunk));
+                    } catch (...) {
+                        std::lock_guard<std::mutex> lock(mutex);
+                        if (!error) error = std::current_exception();
+                        failed = true;
+                    }
+                }
+                std::lock_guard<std::mutex> lock(mutex);
+                if (--remaining == 0) done.notify_all();
+            }
+        }
+    };
+
+    // Incremented in every forked child by the hook the constructor of the
+    // first pool of an extension registers.
+    static std::atomic<int64_t>& ForkGeneration()
+    {
+        static std::atomic<int64_t> _fork_generation{0};
+        return _fork_generation;
+    }
+
+    static void CurrentWorker(const ThreadPool** pool, int* index, bool set = false)
+    {
+        static thread_local const ThreadPool* _pool = nullptr;
+        static thread_local int _index = -1;
+        if (set) {
+            _pool = *pool;
+            _index = *index;
+        } else {
+            *pool = _pool;
+            *index = _index;
+        }
+    }
+
+    // cpus of every NUMA node the process may run on, one entry without NUMA.
+    static std::vector<std::vector<int>> NumaNodes()
+    {
+        cpu_set_t allowed;
+        if (sched_getaffinity(0, sizeof(allowed), &allowed) != 0) CPU_ZERO(&allowed);
+        std::vector<std::vector<int>> nodes;
+        for (int node = 0;; node++) {
+            std::ifstream file("/sys/devices/system/node/node" + std::to_string(node) +
+                               "/cpulist");
+            if (!file) break;
+            std::string cpulist;
+            std::getline(file, cpulist);
+            std::vector<int> cpus;
+            for (int cpu : parse_cpulist(cpulist))
+                if (cpu < CPU_SETSIZE && CPU_ISSET(cpu, &allowed)) cpus.push_back(cpu);
+            if (!cpus.empty()) nodes.push_back(cpus);
+        }
+        if (nodes.size() < 2) return std::vector<std::vector<int>>(1);
+        return nodes;
+    }
+
+    // The state of the running workers, started if needed.
+    State* Start()
+    {
+        if (_generation == ForkGeneration()) return _state.get();
+        std::lock_guard<std::mutex> lock(_start_mutex);
+        if (_generation == ForkGeneration()) return _state.get();
+        // In a forked child the workers of the parent are gone and the locks
+        // may be held, so their state is leaked instead of being cleaned up.
+        if (_state) _state.release();
+
+        std::unique_ptr<State> state(new State());
+        state->stats_start = Clock::now();
+        std::vector<std::vector<int>> nodes = NumaNodes();
+        size_t num_cpus = 0;
+        for (auto& cpus : nodes) num_cpus += cpus.size();
+        int num_workers = _num_threads - 1;
+        for (int i = 0; i < num_workers; i++) {
+            state->workers.emplace_back(new Worker());
+            // workers are spread over the nodes in proportion to their cpus
+            size_t node = 0;
+            if (nodes.size() > 1) {
+                size_t position = i * num_cpus / num_workers, first = 0;
+                while (position >= first + nodes[node].size()) first += nodes[node++].size();
+            }
+            state->workers[i]->numa_node = node;
+            state->workers[i]->cpus = nodes[node];
+        }
+        for (int i = 0; i < num_workers; i++)
+            state->workers[i]->thread = std::thread(&ThreadPool::WorkerLoop, this, state.get(), i);
+        _state = std::move(state);
+        _generation = ForkGeneration().load();
+        return _state.get();
+    }
+
+    void Stop()
+    {
+        std::lock_guard<std::mutex> lock(_start_mutex);
+        if (!_state || _generation != ForkGeneration()) return;
+        {
+            std::lock_guard<std::mutex> state_lock(_state->mutex);
+            _state->stop = true;
+        }
+        _state->wakeup.notify_all();
+        for (auto& worker : _state->workers) worker->thread.join();
+        _state.reset();
+        _generation = -1;
+    }
+
+    static bool Pop(State* state, int index, std::function<void()>* task)
+    {
+        Worker& worker = *state->workers[index];
+        std::lock_guard<std::mutex> lock(worker.mutex);
+        if (worker.tasks.empty()) return false;
+        *task = std::move(worker.tasks.back());
+        worker.tasks.pop_back();
+        Dequeued(state);
+        return true;
+    }
+
+    // Takes the oldest task of another worker, preferring those on the NUMA
+    // node of thief, any worker if thief is not one.
+    static bool Steal(State* state, int thief, std::function<void()>* task)
+    {
+        int num_workers = state->workers.size();
+        int node = thief >= 0 ? state->workers[thief]->numa_node : -1;
+        for (int pass = 0; pass < 2; pass++) {
+            for (int offset = 1; offset <= num_workers; offset++) {
+                int index = (std::max(thief, 0) + offset) % num_workers;
+                Worker& victim = *state->workers[index];
+                if (index == thief || ((victim.numa_node == node) != (pass == 0) && node >= 0))
+                    continue;
+                std::lock_guard<std::mutex> lock(victim.mutex);
+                if (victim.tasks.empty()) continue;
+                *task = std::move(victim.tasks.front());
+                victim.tasks.pop_front();
+                Dequeued(state);
+                return true;
+            }
+            if (node < 0) break;
+        }
+        return false;
+    }
+
+    static void Dequeued(State* state)
+    {
+        std::lock_guard<std::mutex> lock(state->mutex);
+        state->queued--;
+    }
+
+    void WorkerLoop(State* state, int index)
+    {
+        const ThreadPool* pool = this;
+        CurrentWorker(&pool, &index, true);
+        Worker& worker = *state->workers[index];
+        if (!worker.cpus.empty()) {
+            cpu_set_t cpus;
+            CPU_ZERO(&cpus);
+            for (int cpu : worker.cpus) CPU_SET(cpu, &cpus);
+            pthread_setaffinity_np(pthread_self(), sizeof(cpus), &cpus);
+        }
+
+        std::function<void()> task;
+        while (true) {
+            bool stolen = false;
+            if (!Pop(state, index, &task)) stolen = Steal(state, index, &task);
+            if (task) {
+                auto start = Clock::now();
+                task();
+                task = nullptr;
+                worker.busy_ns += std::chrono::duration_cast<std::chrono::nanoseconds>(
+                                      Clock::now() - start)
+                                      .count();
+                worker.tasks_run++;
+                if (stolen) worker.steals++;
+                continue;
+            }
+            std::unique_lock<std::mutex> lock(state->mutex);
+            state->wakeup.wait(lock, [&]() { return state->stop || state->queued > 0; });
+            if (state->stop && state->queued == 0) return;
+        }
+    }
+
+    int _num_threads;
+    std::atomic<int64_t> _generation;
+    std::mutex _start_mutex;
+    std::unique_ptr<State> _state;
+};
+
+// Tasks with dependencies, run on a ThreadPool once the tasks they depend on
+// are done. A graph can be run any number of times.
+class TaskGraph {
+public:
+    // Adds task, to run after the tasks deps, and returns its id. Tasks can
+    // only depend on tasks added before them, so the graph has no cycles.
+    int Add(std::function<void()> task, const std::vector<int>& deps = std::vector<int>())
+    {
+        int id = _nodes.size();
+        for (int dep : deps) {
+            if (dep < 0 || dep >= id)
+                throw std::invalid_argument("task " + std::to_string(id) +
+                                            " depends on unknown task " + std::to_string(dep));
+            _nodes[dep].successors.push_back(id);
+        }
+        _nodes.push_back({std::move(task), std::vector<int>(), int(deps.size())});
+        return id;
+    }
+
+    size_t Size() const { return _nodes.size(); }
+
+    // Runs all tasks, helping the pool while waiting, and rethrows the first
+    // exception a task threw. Tasks not started by then are skipped.
+    void Run(ThreadPool& pool = ThreadPool::Instance())
+    {
+        if (_nodes.empty()) return;
+        auto run = std::make_shared<GraphRun>(_nodes.size());
+        for (size_t i = 0; i < _nodes.size(); i++) run->deps[i] = _nodes[i].num_deps;
+        for (size_t i = 0; i < _nodes.size(); i++)
+            if (_nodes[i].num_deps == 0) Schedule(pool, run, i);
+
+        while (run->remaining > 0) {
+            if (pool.RunOne()) continue;
+            std::unique_lock<std::mutex> lock(run->mutex);
+            run->done.wait_for(
+                lock, std::chrono::microseconds(100), [&]() { return run->remaining == 0; });
+        }
+        if (run->error) std::rethrow_exception(run->error);
+    }
+
+private:
+    struct Node {
+        std::function<void()> task;
+        std::vector<int> successors;
+        int num_deps;
+    };
+
+    struct GraphRun {
+        explicit GraphRun(size_t size) : deps(new std::atomic<int>[size]), remaining(size) {}
+        std::unique_ptr<std::atomic<int>[]> deps;
+        std::atomic<int64_t> remaining;
+        std::atomic<bool> failed{false};
+        std::exception_ptr error;
+        std::mutex mutex;
+        std::condition_variable done;
+    };
+
+    void Schedule(ThreadPool& pool, std::shared_ptr<GraphRun> run, int id)
+    {
+        pool.Submit([this, &pool, run, id]() {
+            if (!run->failed) {
+                try {
+                    _nodes[id].task();
+                } catch (...) {
+                    std::lock_guard<std::mutex> lock(run->mutex);
+                    if (!run->error) run->error = std::current_exception();
+                    run->failed = true;
+                }
+            }
+            for (int successor : _nodes[id].successors)
+                if (--run->deps[successor] == 0) Schedule(pool, run, successor);
+            if (--run->remaining == 0) {
+                std::lock_guard<std::mutex> lock(run->mutex);
+                run->done.notify_all();
+            }
+        });
+    }
+
+    std::vector<Node> _nodes;
+};
+
+#if defined(TORCH_EXTENSION_NAME) && defined(PYBIND11_MODULE)
+// Makes ThreadPool::Instance() of the calling extension the pool published by
+// deepspeed_thread_pool_cpu, if that is built. Called when an extension loads.
+inline void attach_thread_pool()
+{
+    try {
+        py::object capsule = py::module::import("deepspeed_thread_pool_cpu").attr("_pool");
+        void* pool = PyCapsule_GetPointer(capsule.ptr(), THREAD_POOL_CAPSULE);
+        if (pool)
+            ThreadPool::Shared() = static_cast<ThreadPool*>(pool);
+        else
+            PyErr_Clear();
+    } catch (py::error_already_set&) {
+        // not built, keep the pool of this extension
+    }
+}
+#endif
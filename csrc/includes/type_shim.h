@@ -64,6 +64,47 @@
         default: AT_ERROR(#NAME, " not implemented for '", toString(TYPE), "'"); \
     }
 
+// BFloat16 kernels rely on the host/device arithmetic of c10::BFloat16, which
+// needs torch 1.5. With older versions the BFloat16 case is left out and the
+// dispatch reports the type as not implemented.
+#ifdef VERSION_GE_1_5
+#define DISPATCH_CASE_BFLOAT16(LEVEL, ...)        \
+    case at::ScalarType::BFloat16: {              \
+        using scalar_t_##LEVEL = at::BFloat16;    \
+        __VA_ARGS__;                              \
+        break;                                    \
+    }
+#else
+#define DISPATCH_CASE_BFLOAT16(LEVEL, ...)
+#endif
+
+#define DISPATCH_FLOAT_HALF_AND_BFLOAT16(TYPE, LEVEL, NAME, ...)                 \
+    switch (TYPE) {                                                              \
+        case at::ScalarType::Float: {                                            \
+            using scalar_t_##LEVEL = float;                                      \
+            __VA_ARGS__;                                                         \
+            break;                                                               \
+        }                                                                        \
+        case at::ScalarType::Half: {                                             \
+            using scalar_t_##LEVEL = at::Half;                                   \
+            __VA_ARGS__;                                                         \
+            break;                                                               \
+        }                                                                        \
+        DISPATCH_CASE_BFLOAT16(LEVEL, __VA_ARGS__)                               \
+        default: AT_ERROR(#NAME, " not implemented for '", toString(TYPE), "'"); \
+    }
+
+#define DISPATCH_HALF_AND_BFLOAT16(TYPE, LEVEL, NAME, ...)                       \
+    switch (TYPE) {                                                              \
+        case at::ScalarType::Half: {                                             \
+            using scalar_t_##LEVEL = at::Half;                                   \
+            __VA_ARGS__;                                                         \
+            break;                                                               \
+        }                                                                        \
+        DISPATCH_CASE_BFLOAT16(LEVEL, __VA_ARGS__)                               \
+        default: AT_ERROR(#NAME, " not implemented for '", toString(TYPE), "'"); \
+    }
+
 template <typename T>
 __device__ __forceinline__ T
 reduce_block_into_lanes(T* x,
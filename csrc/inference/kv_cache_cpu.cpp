@@ -0,0 +1,143 @@
+/* Copyright 2020 The Microsoft DeepSpeed Team */
+#include <torch/extension.h>
+#include <algorithm>
+#include <cmath>
+#include <vector>
+#include "simd.h"
+#include "thread_pool.h"
+
+#define CHECK_CPU(x) AT_ASSERTM(!x.type().is_cuda(), #x " must be a CPU tensor")
+#define CHECK_CONTIGUOUS(x) AT_ASSERTM(x.is_contiguous(), #x " must be contiguous")
+#define CHECK_INPUT(x) \
+    CHECK_CPU(x);      \
+    CHECK_CONTIGUOUS(x)
+
+// Single query attention of decoding against a paged key/value cache.
+//
+// The cache of a layer is a pool of blocks, [num_blocks, block_size, heads,
+// head_size], and a sequence owns the blocks listed in its row of the block
+// table, token t of the sequence being at offset t % block_size of block
+// block_table[t / block_size]. Each (sequence, head) task reads the keys of
+// the sequence block by block, keeps its scores in a buffer of the sequence
+// length and accumulates the values weighted by the softmax into the output.
+
+void attend_head(const float* query,
+                 const float* key_cache,
+                 const float* value_cache,
+                 const int32_t* block_table,
+                 int64_t length,
+                 int64_t block_size,
+                 int64_t heads,
+                 int64_t head,
+                 int64_t head_size,
+                 float scale,
+                 float* out,
+                 std::vector<float>& scores)
+{
+    std::fill(out, out + head_size, 0.f);
+    if (length == 0) return;
+    scores.resize(length);
+
+    // offset of the head of token t in the cache
+    auto offset = [&](int64_t t) {
+        int64_t slot = (int64_t)block_table[t / block_size] * block_size + t % block_size;
+        return (slot * heads + head) * head_size;
+    };
+
+    float max_score = -INFINITY;
+    for (int64_t t = 0; t < length; t++) {
+        scores[t] = scale * simd_dot(query, key_cache + offset(t), head_size);
+        max_score = std::max(max_score, scores[t]);
+    }
+    float sum = 0.f;
+    for (int64_t t = 0; t < length; t++) {
+        scores[t] = expf(scores[t] - max_score);
+        sum += scores[t];
+    }
+    for (int64_t t = 0; t < length; t++)
+        simd_axpy_inplace(out, scores[t], value_cache + offset(t), head_size);
+    simd_scale_inplace(out, 1.f / sum, head_size);
+}
+
+void paged_attention(const at::Tensor& query,
+                     const at::Tensor& key_cache,
+                     const at::Tensor& value_cache,
+                     const at::Tensor& block_tables,
+                     const at::Tensor& lengths,
+                     float scale,
+                     at::Tensor& out)
+{
+    CHECK_INPUT(query);
+    CHECK_INPUT(key_cache);
+    CHECK_INPUT(value_cache);
+    CHECK_INPUT(block_tables);
+    CHECK_INPUT(lengths);
+    CHECK_INPUT(out);
+    AT_ASSERTM(query.scalar_type() == at::ScalarType::Float &&
+                   key_cache.scalar_type() == at::ScalarType::Float &&
+                   value_cache.scalar_type() == at::ScalarType::Float &&
+                   out.scalar_type() == at::ScalarType::Float,
+               "query, cache and output must be float tensors");
+    AT_ASSERTM(block_tables.scalar_type() == at::ScalarType::Int &&
+                   lengths.scalar_type() == at::ScalarType::Int,
+               "block tables and lengths must be int32 tensors");
+    AT_ASSERTM(query.dim() == 3 && key_cache.dim() == 4 && block_tables.dim() == 2,
+               "query must be [batch, heads, head_size] and the cache "
+               "[num_blocks, block_size, heads, head_size]");
+    AT_ASSERTM(key_cache.sizes() == value_cache.sizes(), "key and value caches differ");
+
+    int64_t batch_size = query.size(0);
+    int64_t heads = query.size(1);
+    int64_t head_size = query.size(2);
+    int64_t block_size = key_cache.size(1);
+    int64_t max_blocks = block_tables.size(1);
+    AT_ASSERTM(key_cache.size(2) == heads && key_cache.size(3) == head_size,
+               "the cache does not match the query");
+    AT_ASSERTM(block_tables.size(0) == batch_size && lengths.numel() == batch_size &&
+                   out.sizes() == query.sizes(),
+               "every sequence needs a block table, a length and an output");
+
+    const int32_t* lengths_ptr = (const int32_t*)lengths.data_ptr();
+    const int32_t* tables_ptr = (const int32_t*)block_tables.data_ptr();
+    for (int64_t b = 0; b < batch_size; b++) {
+        AT_ASSERTM(lengths_ptr[b] >= 0 && lengths_ptr[b] <= max_blocks * block_size,
+                   "a sequence is longer than its block table");
+        for (int64_t i = 0; i * block_size < lengths_ptr[b]; i++)
+            AT_ASSERTM(tables_ptr[b * max_blocks + i] >= 0 &&
+                           tables_ptr[b * max_blocks + i] < key_cache.size(0),
+                       "a block table points outside the cache");
+    }
+
+    const float* query_ptr = (const float*)query.data_ptr();
+    const float* key_ptr = (const float*)key_cache.data_ptr();
+    const float* value_ptr = (const float*)value_cache.data_ptr();
+    float* out_ptr = (float*)out.data_ptr();
+    ThreadPool::Instance().parallel_for(0, batch_size * heads, 1, [&](int64_t begin, int64_t end) {
+        std::vector<float> scores;
+        for (int64_t task = begin; task < end; task++) {
+            int64_t b = task / heads;
+            int64_t head = task % heads;
+            attend_head(query_ptr + task * head_size,
+                        key_ptr,
+                        value_ptr,
+                        tables_ptr + b * max_blocks,
+                        lengths_ptr[b],
+                        block_size,
+                        heads,
+                        head,
+                        head_size,
+                        scale,
+                        out_ptr + task * head_size,
+                        scores);
+        }
+    });
+}
+
+PYBIND11_MODULE(TORCH_EXTENSION_NAME, m)
+{
+    attach_thread_pool();
+    m.def("paged_attention",
+          &paged_attention,
+          "Single query attention against a paged key/value cache",
+          py::call_guard<py::gil_scoped_release>());
+}
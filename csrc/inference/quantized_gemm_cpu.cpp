@@ -0,0 +1,177 @@
+/* Copyright 2020 The Microsoft DeepSpeed Team */
+#include <torch/extension.h>
+#include <vector>
+#include "quantized_gemm.h"
+#include "thread_pool.h"
+
+#define CHECK_CPU(x) AT_ASSERTM(!x.type().is_cuda(), #x " must be a CPU tensor")
+#define CHECK_CONTIGUOUS(x) AT_ASSERTM(x.is_contiguous(), #x " must be contiguous")
+#define CHECK_INPUT(x) \
+    CHECK_CPU(x);      \
+    CHECK_CONTIGUOUS(x)
+
+// Activation rows quantized per parallel task at least.
+#define QGEMM_QUANTIZE_GRAIN_ROWS 16
+
+// The bias of an epilogue, an empty tensor for none.
+const float* bias_ptr(const at::Tensor& bias, int64_t n)
+{
+    if (bias.numel() == 0) return nullptr;
+    CHECK_INPUT(bias);
+    AT_ASSERTM(bias.scalar_type() == at::ScalarType::Float && bias.numel() == n,
+               "bias must be a float tensor with one element per output channel");
+    return (const float*)bias.data_ptr();
+}
+
+void check_activations(const at::Tensor& input, int64_t k)
+{
+    CHECK_INPUT(input);
+    AT_ASSERTM(input.scalar_type() == at::ScalarType::Float && input.dim() == 2 &&
+                   input.size(1) == k,
+               "input must be a float [rows, in_features] tensor");
+}
+
+// Quantizes the rows of input in parallel, returning their scales.
+template <typename Q>
+at::Tensor quantize_rows(const at::Tensor& input, int64_t padded_k, int shift, Q* q)
+{
+    int64_t m = input.size(0);
+    int64_t k = input.size(1);
+    at::Tensor scales = at::empty({m}, input.options());
+    const float* x = (const float*)input.data_ptr();
+    float* scales_ptr = (float*)scales.data_ptr();
+    ThreadPool::Instance().parallel_for(
+        0, m, QGEMM_QUANTIZE_GRAIN_ROWS, [&](int64_t begin, int64_t end) {
+            for (int64_t row = begin; row < end; row++)
+                scales_ptr[row] =
+                    qgemm_quantize_row(x + row * k, k, padded_k, shift, q + row * padded_k);
+        });
+    return scales;
+}
+
+at::Tensor int8_linear(const at::Tensor& input,
+                       const at::Tensor& packed,
+                       const at::Tensor& compensation,
+                       const at::Tensor& scales,
+                       const at::Tensor& bias,
+                       bool gelu)
+{
+    CHECK_INPUT(packed);
+    CHECK_INPUT(compensation);
+    CHECK_INPUT(scales);
+    int64_t n = scales.numel();
+    AT_ASSERTM(packed.scalar_type() == at::ScalarType::Char && packed.dim() == 4 &&
+                   packed.size(2) == QGEMM_TILE_N && packed.size(3) == QGEMM_TILE_K &&
+                   packed.size(0) == (n + QGEMM_TILE_N - 1) / QGEMM_TILE_N,
+               "packed must be an int8 [N / 16, K / 4, 16, 4] tensor");
+    AT_ASSERTM(compensation.scalar_type() == at::ScalarType::Int && compensation.numel() == n,
+               "compensation must be an int32 tensor with one element per output channel");
+    AT_ASSERTM(scales.scalar_type() == at::ScalarType::Float, "scales must be a float tensor");
+    int64_t padded_k = packed.size(1) * QGEMM_TILE_K;
+    int64_t k = input.size(-1);
+    AT_ASSERTM(k <= padded_k && padded_k - k < QGEMM_TILE_K,
+               "input does not match the packed weight");
+    check_activations(input, k);
+    const float* bias_data = bias_ptr(bias, n);
+
+    int64_t m = input.size(0);
+    std::vector<uint8_t> a(m * padded_k);
+    at::Tensor a_scales = quantize_rows(input, padded_k, QGEMM_ACTIVATION_SHIFT, a.data());
+    at::Tensor out = at::empty({m, n}, input.options());
+
+    const int8_t* packed_ptr = (const int8_t*)packed.data_ptr();
+    const int32_t* compensation_ptr = (const int32_t*)compensation.data_ptr();
+    const float* scales_ptr = (const float*)scales.data_ptr();
+    const float* a_scales_ptr = (const float*)a_scales.data_ptr();
+    float* out_ptr = (float*)out.data_ptr();
+    // a task runs all rows on its tiles, reading each weight tile once
+    ThreadPool::Instance().parallel_for(0, packed.size(0), 1, [&](int64_t begin, int64_t end) {
+        qgemm_int8_tiles(a.data(),
+                         a_scales_ptr,
+                         m,
+                         padded_k,
+                         packed_ptr,
+                         compensation_ptr,
+                         scales_ptr,
+                         bias_data,
+                         gelu,
+                         n,
+                         begin,
+                         end,
+                         out_ptr);
+    });
+    return out;
+}
+
+at::Tensor int4_linear(const at::Tensor& input,
+                       const at::Tensor& packed,
+                       const at::Tensor& scales,
+                       int64_t group_size,
+                       const at::Tensor& bias,
+                       bool gelu)
+{
+    CHECK_INPUT(packed);
+    CHECK_INPUT(scales);
+    AT_ASSERTM(group_size > 0, "group size must be positive");
+    AT_ASSERTM(packed.scalar_type() == at::ScalarType::Byte && packed.dim() == 2,
+               "packed must be a uint8 [N, K / 2] tensor");
+    int64_t n = packed.size(0);
+    int64_t padded_k = packed.size(1) * 2;
+    int64_t k = input.size(-1);
+    AT_ASSERTM(k <= padded_k && padded_k - k < 2, "input does not match the packed weight");
+    AT_ASSERTM(scales.scalar_type() == at::ScalarType::Float && scales.dim() == 2 &&
+                   scales.size(0) == n && scales.size(1) == (k + group_size - 1) / group_size,
+               "scales must be a float [N, groups] tensor");
+    check_activations(input, k);
+    const float* bias_data = bias_ptr(bias, n);
+
+    int64_t m = input.size(0);
+    std::vector<int8_t> a(m * padded_k);
+    at::Tensor a_scales = quantize_rows(input, padded_k, 0, a.data());
+    at::Tensor out = at::empty({m, n}, input.options());
+
+    const uint8_t* packed_ptr = (const uint8_t*)packed.data_ptr();
+    const float* scales_ptr = (const float*)scales.data_ptr();
+    const float* a_scales_ptr = (const float*)a_scales.data_ptr();
+    float* out_ptr = (float*)out.data_ptr();
+    ThreadPool::Instance().parallel_for(0, n, QGEMM_TILE_N, [&](int64_t begin, int64_t end) {
+        qgemm_int4_columns(a.data(),
+                           a_scales_ptr,
+                           m,
+                           k,
+                           padded_k,
+                           packed_ptr,
+                           scales_ptr,
+                           group_size,
+                           bias_data,
+                           gelu,
+                           n,
+                           begin,
+                           end,
+                           out_ptr);
+    });
+    return out;
+}
+
+bool has_vnni()
+{
+#if defined(__AVX512VNNI__)
+    return true;
+#else
+    return false;
+#endif
+}
+
+PYBIND11_MODULE(TORCH_EXTENSION_NAME, m)
+{
+    attach_thread_pool();
+    m.def("int8_linear",
+          &int8_linear,
+          "Linear layer of packed per channel int8 weights",
+          py::call_guard<py::gil_scoped_release>());
+    m.def("int4_linear",
+          &int4_linear,
+          "Linear layer of packed group-wise int4 weights",
+          py::call_guard<py::gil_scoped_release>());
+    m.def("has_vnni", &has_vnni, "Whether the int8 gemm was built with AVX512-VNNI");
+}
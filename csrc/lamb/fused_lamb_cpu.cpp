@@ -0,0 +1,509 @@
+/* Copyright 2020 The Microsoft DeepSpeed Team */
+#include <torch/extension.h>
+#include <algorithm>
+#include <cmath>
+#include <type_traits>
+#include <vector>
+#include "optimizer_8bit.h"
+#include "simd.h"
+#include "stochastic_rounding.h"
+#include "thread_pool.h"
+
+#define CHECK_CPU(x) AT_ASSERTM(!x.type().is_cuda(), #x " must be a CPU tensor")
+#define CHECK_CONTIGUOUS(x) AT_ASSERTM(x.is_contiguous(), #x " must be contiguous")
+#define CHECK_INPUT(x) \
+    CHECK_CPU(x);      \
+    CHECK_CONTIGUOUS(x)
+
+// The CPU kernel walks the tensors in blocks of the 8-bit quantization size for
+// both state formats, so each block is dequantized, updated and requantized
+// while it is in cache and the two formats share the same code.
+#define LAMB_CPU_BLOCK_SIZE OPTIMIZER_8BIT_BLOCK_SIZE
+
+typedef enum {
+    ADAM_MODE_0 = 0,  // eps under square root
+    ADAM_MODE_1 = 1   // eps outside square root
+} adamMode_t;
+
+struct LambParams {
+    float beta1;
+    float beta2;
+    float eps;
+    float grad_scale;
+    float step_size;
+    float decay;
+    adamMode_t mode;
+    bool stochastic_rounding;  // round p_copy stochastically, see stochastic_rounding.h
+    uint32_t seed;
+};
+
+// Optimizer moments, either fp32 (m, v) or blockwise 8-bit (m_q, v_q and their
+// per block absmax).
+struct LambState {
+    float* m;
+    float* v;
+    int8_t* m_q;
+    float* m_absmax;
+    uint8_t* v_q;
+    float* v_absmax;
+};
+
+// m = b1 * m + (1 - b1) * g / grad_scale, v = b2 * v + (1 - b2) * (g / grad_scale)^2
+static void lamb_update_moments(float* m, float* v, const float* g, int64_t n, const LambParams& lp)
+{
+    float inv_scale = 1.f / lp.grad_scale;
+    int64_t i = 0;
+#if defined(SIMD_WIDTH)
+    SIMD_FLOAT b1 = SIMD_SET(lp.beta1);
+    SIMD_FLOAT b1c = SIMD_SET(1 - lp.beta1);
+    SIMD_FLOAT b2 = SIMD_SET(lp.beta2);
+    SIMD_FLOAT b2c = SIMD_SET(1 - lp.beta2);
+    SIMD_FLOAT inv = SIMD_SET(inv_scale);
+    for (; i + SIMD_WIDTH <= n; i += SIMD_WIDTH) {
+        SIMD_FLOAT sg = SIMD_MUL(SIMD_LOAD(g + i), inv);
+        SIMD_STORE(m + i, SIMD_FMA(b1, SIMD_LOAD(m + i), SIMD_MUL(b1c, sg)));
+        SIMD_STORE(v + i, SIMD_FMA(b2, SIMD_LOAD(v + i), SIMD_MUL(b2c, SIMD_MUL(sg, sg))));
+    }
+#endif
+    for (; i < n; i++) {
+        float sg = g[i] * inv_scale;
+        m[i] = lp.beta1 * m[i] + (1 - lp.beta1) * sg;
+        v[i] = lp.beta2 * v[i] + (1 - lp.beta2) * sg * sg;
+    }
+}
+
+// u = m / denom(v) + decay * p
+static void lamb_compute_update(const float* p,
+                                const float* m,
+                                const float* v,
+                                float* u,
+                                int64_t n,
+                                const LambParams& lp)
+{
+    int64_t i = 0;
+#if defined(SIMD_WIDTH)
+    SIMD_FLOAT eps = SIMD_SET(lp.eps);
+    SIMD_FLOAT decay = SIMD_SET(lp.decay);
+    for (; i + SIMD_WIDTH <= n; i += SIMD_WIDTH) {
+        SIMD_FLOAT denom = lp.mode == ADAM_MODE_0 ? SIMD_SQRT(SIMD_ADD(SIMD_LOAD(v + i), eps))
+                                                  : SIMD_ADD(SIMD_SQRT(SIMD_LOAD(v + i)), eps);
+        SIMD_STORE(u + i, SIMD_FMA(decay, SIMD_LOAD(p + i), SIMD_DIV(SIMD_LOAD(m + i), denom)));
+    }
+#endif
+    for (; i < n; i++) {
+        float denom = lp.mode == ADAM_MODE_0 ? sqrtf(v[i] + lp.eps) : sqrtf(v[i]) + lp.eps;
+        u[i] = m[i] / denom + lp.decay * p[i];
+    }
+}
+
+template <typename T>
+const float* load_float(const T* src, int64_t n, float* buffer)
+{
+    for (int64_t i = 0; i < n; i++) buffer[i] = static_cast<float>(src[i]);
+    return buffer;
+}
+
+template <>
+const float* load_float<float>(const float* src, int64_t n, float* buffer)
+{
+    return src;
+}
+
+#ifdef VERSION_GE_1_5
+template <>
+const float* load_float<at::BFloat16>(const at::BFloat16* src, int64_t n, float* buffer)
+{
+    simd_bf16_to_float((const uint16_t*)src, buffer, n);
+    return buffer;
+}
+#endif
+
+// Points m and v at the fp32 moments of block b, dequantizing 8-bit moments
+// into the given buffers.
+template <bool QUANTIZED>
+void lamb_load_moments(const LambState& s,
+                       int64_t b,
+                       int64_t start,
+                       int64_t len,
+                       float* m_buffer,
+                       float* v_buffer,
+                       float** m,
+                       float** v)
+{
+    if (QUANTIZED) {
+        for (int64_t i = 0; i < len; i++) {
+            m_buffer[i] = dequantize_signed_8bit(s.m_q[start + i], s.m_absmax[b]);
+            v_buffer[i] = dequantize_sqrt_8bit(s.v_q[start + i], s.v_absmax[b]);
+        }
+        *m = m_buffer;
+        *v = v_buffer;
+    } else {
+        *m = s.m + start;
+        *v = s.v + start;
+    }
+}
+
+// Requantizes block b of the updated moments and leaves the decoded values in
+// m and v, so the update computed from them matches the one of the next pass.
+static void lamb_store_moments_8bit(const LambState& s,
+                                    int64_t b,
+                                    int64_t start,
+                                    int64_t len,
+                                    float* m,
+                                    float* v)
+{
+    float m_absmax = 0.f;
+    float v_absmax = 0.f;
+    for (int64_t i = 0; i < len; i++) {
+        m_absmax = std::max(m_absmax, std::fabs(m[i]));
+        v_absmax = std::max(v_absmax, v[i]);
+    }
+    for (int64_t i = 0; i < len; i++) {
+        int8_t mq = quantize_signed_8bit(m[i], m_absmax);
+        uint8_t vq = quantize_sqrt_8bit(v[i], v_absmax);
+        s.m_q[start + i] = mq;
+        s.v_q[start + i] = vq;
+        m[i] = dequantize_signed_8bit(mq, m_absmax);
+        v[i] = dequantize_sqrt_8bit(vq, v_absmax);
+    }
+    s.m_absmax[b] = m_absmax;
+    s.v_absmax[b] = v_absmax;
+}
+
+template <typename GRAD_T, bool QUANTIZED>
+float lamb_cpu_step(float* p,
+                    GRAD_T* p_copy,
+                    const LambState& s,
+                    const GRAD_T* g,
+                    int64_t n,
+                    const LambParams& lp,
+                    float max_coeff,
+                    float min_coeff)
+{
+    int64_t num_blocks = (n + LAMB_CPU_BLOCK_SIZE - 1) / LAMB_CPU_BLOCK_SIZE;
+    std::vector<float> w_l2(num_blocks);
+    std::vector<float> u_l2(num_blocks);
+
+    // Pass 1: update the moments and reduce |p|^2 and |update|^2 per block
+    ThreadPool::Instance().parallel_for(0, num_blocks, 1, [&](int64_t begin, int64_t end) {
+        float g_buffer[LAMB_CPU_BLOCK_SIZE];
+        float m_buffer[LAMB_CPU_BLOCK_SIZE];
+        float v_buffer[LAMB_CPU_BLOCK_SIZE];
+        float u_buffer[LAMB_CPU_BLOCK_SIZE];
+        for (int64_t b = begin; b < end; b++) {
+            int64_t start = b * LAMB_CPU_BLOCK_SIZE;
+            int64_t len = std::min<int64_t>(LAMB_CPU_BLOCK_SIZE, n - start);
+            float* m;
+            float* v;
+            lamb_load_moments<QUANTIZED>(s, b, start, len, m_buffer, v_buffer, &m, &v);
+            lamb_update_moments(m, v, load_float(g + start, len, g_buffer), len, lp);
+            if (QUANTIZED) lamb_store_moments_8bit(s, b, start, len, m, v);
+            lamb_compute_update(p + start, m, v, u_buffer, len, lp);
+
+            bool finite;
+            w_l2[b] = simd_sum_squares(p + start, len, &finite);
+            u_l2[b] = simd_sum_squares(u_buffer, len, &finite);
+        }
+    });
+
+    double w_sum = 0;
+    double u_sum = 0;
+    for (int64_t b = 0; b < num_blocks; b++) {
+        w_sum += w_l2[b];
+        u_sum += u_l2[b];
+    }
+    float reg_w = std::sqrt(w_sum);
+    float reg_u = std::sqrt(u_sum);
+
+    float lamb_coeff = 1.0;
+    if (reg_w != 0 and reg_u != 0) {
+        lamb_coeff = reg_w / reg_u;
+        if (lamb_coeff > max_coeff) { lamb_coeff = max_coeff; }
+        if (lamb_coeff < min_coeff) { lamb_coeff = min_coeff; }
+    }
+
+    // Pass 2: apply the trust ratio scaled update
+    float scale = -lp.step_size * lamb_coeff;
+    ThreadPool::Instance().parallel_for(0, num_blocks, 1, [&](int64_t begin, int64_t end) {
+        float m_buffer[LAMB_CPU_BLOCK_SIZE];
+        float v_buffer[LAMB_CPU_BLOCK_SIZE];
+        float u_buffer[LAMB_CPU_BLOCK_SIZE];
+        for (int64_t b = begin; b < end; b++) {
+            int64_t start = b * LAMB_CPU_BLOCK_SIZE;
+            int64_t len = std::min<int64_t>(LAMB_CPU_BLOCK_SIZE, n - start);
+            float* m;
+            float* v;
+            lamb_load_moments<QUANTIZED>(s, b, start, len, m_buffer, v_buffer, &m, &v);
+            lamb_compute_update(p + start, m, v, u_buffer, len, lp);
+
+            float* pb = p + start;
+            int64_t i = 0;
+#if defined(SIMD_WIDTH)
+            SIMD_FLOAT scale_v = SIMD_SET(scale);
+            for (; i + SIMD_WIDTH <= len; i += SIMD_WIDTH)
+                SIMD_STORE(pb + i, SIMD_FMA(scale_v, SIMD_LOAD(u_buffer + i), SIMD_LOAD(pb + i)));
+#endif
+            for (; i < len; i++) pb[i] += scale * u_buffer[i];
+
+            if (p_copy != nullptr && lp.stochastic_rounding) {
+                for (i = 0; i < len; i++)
+                    p_copy[start + i] = stochastic_round<GRAD_T>(
+                        pb[i], stochastic_rounding_bits(lp.seed, (uint32_t)(start + i)));
+            } else if (p_copy != nullptr) {
+                for (i = 0; i < len; i++) p_copy[start + i] = static_cast<GRAD_T>(pb[i]);
+            }
+        }
+    });
+
+    return lamb_coeff;
+}
+
+static LambParams make_lamb_params(float lr,
+                                   float beta1,
+                                   float beta2,
+                                   float eps,
+                                   float grad_scale,
+                                   int step,
+                                   int mode,
+                                   int bias_correction,
+                                   float decay,
+                                   bool stochastic_rounding,
+                                   int64_t seed)
+{
+    float step_size = lr;
+    if (bias_correction == 1) {
+        const float bias_correction1 = 1 - std::pow(beta1, step);
+        const float bias_correction2 = 1 - std::pow(beta2, step);
+        step_size = lr * std::sqrt(bias_correction2) / bias_correction1;
+    }
+    return {beta1,
+            beta2,
+            eps,
+            grad_scale,
+            step_size,
+            decay,
+            (adamMode_t)mode,
+            stochastic_rounding,
+            (uint32_t)seed};
+}
+
+// Whether the optional one byte skip flag is set, the step is a no-op then.
+bool skip_step(const at::Tensor& skip)
+{
+    if (skip.numel() == 0) return false;
+    CHECK_INPUT(skip);
+    AT_ASSERTM(skip.numel() == 1 && skip.element_size() == 1,
+               "expected skip to hold a single bool or uint8 flag");
+    return *(const uint8_t*)skip.data_ptr() != 0;
+}
+
+template <bool QUANTIZED>
+void lamb_cpu_dispatch(at::Tensor& p,
+                       at::Tensor& p_copy,
+                       const LambState& s,
+                       at::Tensor& g,
+                       const LambParams& lp,
+                       float max_coeff,
+                       float min_coeff,
+                       at::Tensor& lamb_coeff_val)
+{
+    AT_ASSERTM(p.type().scalarType() == at::ScalarType::Float,
+               "expected parameter to be of float type");
+    AT_ASSERTM(p_copy.numel() == 0 || p_copy.type().scalarType() == g.type().scalarType(),
+               "p_copy should have the type of the gradient");
+
+    float lamb_coeff = 0;
+    switch (g.type().scalarType()) {
+        case at::ScalarType::Float:
+            lamb_coeff = lamb_cpu_step<float, QUANTIZED>(
+                (float*)p.data_ptr(),
+                nullptr,  // don't output p_copy for fp32, it's wasted write
+                s,
+                (const float*)g.data_ptr(),
+                p.numel(),
+                lp,
+                max_coeff,
+                min_coeff);
+            break;
+        case at::ScalarType::Half:
+            lamb_coeff = lamb_cpu_step<at::Half, QUANTIZED>(
+                (float*)p.data_ptr(),
+                p_copy.numel() ? (at::Half*)p_copy.data_ptr() : nullptr,
+                s,
+                (const at::Half*)g.data_ptr(),
+                p.numel(),
+                lp,
+                max_coeff,
+                min_coeff);
+            break;
+#ifdef VERSION_GE_1_5
+        case at::ScalarType::BFloat16:
+            lamb_coeff = lamb_cpu_step<at::BFloat16, QUANTIZED>(
+                (float*)p.data_ptr(),
+                p_copy.numel() ? (at::BFloat16*)p_copy.data_ptr() : nullptr,
+                s,
+                (const at::BFloat16*)g.data_ptr(),
+                p.numel(),
+                lp,
+                max_coeff,
+                min_coeff);
+            break;
+#endif
+        default: AT_ERROR("lamb not implemented for '", toString(g.type().scalarType()), "'");
+    }
+
+    *(float*)lamb_coeff_val.data_ptr() = lamb_coeff;
+}
+
+// C++ interface, same signature as the CUDA extension
+void lamb(at::Tensor& p,
+          at::Tensor& p_copy,
+          at::Tensor& m,
+          at::Tensor& v,
+          at::Tensor& g,
+          float lr,
+          float beta1,
+          float beta2,
+          float max_coeff,
+          float min_coeff,
+          float eps,
+          float grad_scale,
+          int step,
+          int mode,
+          int bias_correction,
+          float decay,
+          bool stochastic_rounding,
+          int64_t seed,
+          at::Tensor& lamb_coeff_val,
+          at::Tensor& skip)
+{
+    CHECK_INPUT(p);
+    if (p_copy.numel() > 0) {
+        CHECK_INPUT(p_copy);
+    }
+    CHECK_INPUT(m);
+    CHECK_INPUT(v);
+    CHECK_INPUT(g);
+    CHECK_INPUT(lamb_coeff_val);
+    int64_t num_elem = p.numel();
+    AT_ASSERTM(m.numel() == num_elem, "number of elements in m and p tensors should be equal");
+    AT_ASSERTM(v.numel() == num_elem, "number of elements in v and p tensors should be equal");
+    AT_ASSERTM(g.numel() == num_elem, "number of elements in g and p tensors should be equal");
+    AT_ASSERTM(
+        p_copy.numel() == num_elem || p_copy.numel() == 0,
+        "number of elements in p_copy and p tensors should be equal, or p_copy should be empty");
+    AT_ASSERTM(lamb_coeff_val.numel() >= 1 &&
+                   lamb_coeff_val.type().scalarType() == at::ScalarType::Float,
+               "expected lamb_coeff_val to hold a float");
+    AT_ASSERTM(m.type().scalarType() == at::ScalarType::Float &&
+                   v.type().scalarType() == at::ScalarType::Float,
+               "expected optimizer states to be of float type");
+    if (skip_step(skip)) return;
+
+    LambState s = {(float*)m.data_ptr(), (float*)v.data_ptr(), nullptr, nullptr, nullptr, nullptr};
+    lamb_cpu_dispatch<false>(
+        p,
+        p_copy,
+        s,
+        g,
+        make_lamb_params(lr,
+                         beta1,
+                         beta2,
+                         eps,
+                         grad_scale,
+                         step,
+                         mode,
+                         bias_correction,
+                         decay,
+                         stochastic_rounding,
+                         seed),
+        max_coeff,
+        min_coeff,
+        lamb_coeff_val);
+}
+
+void lamb_8bit(at::Tensor& p,
+               at::Tensor& p_copy,
+               at::Tensor& m,
+               at::Tensor& m_absmax,
+               at::Tensor& v,
+               at::Tensor& v_absmax,
+               at::Tensor& g,
+               float lr,
+               float beta1,
+               float beta2,
+               float max_coeff,
+               float min_coeff,
+               float eps,
+               float grad_scale,
+               int step,
+               int mode,
+               int bias_correction,
+               float decay,
+               bool stochastic_rounding,
+               int64_t seed,
+               at::Tensor& lamb_coeff_val,
+               at::Tensor& skip)
+{
+    CHECK_INPUT(p);
+    if (p_copy.numel() > 0) {
+        CHECK_INPUT(p_copy);
+    }
+    CHECK_INPUT(m);
+    CHECK_INPUT(m_absmax);
+    CHECK_INPUT(v);
+    CHECK_INPUT(v_absmax);
+    CHECK_INPUT(g);
+    CHECK_INPUT(lamb_coeff_val);
+    int64_t num_elem = p.numel();
+    int64_t num_blocks = (num_elem + OPTIMIZER_8BIT_BLOCK_SIZE - 1) / OPTIMIZER_8BIT_BLOCK_SIZE;
+    AT_ASSERTM(m.numel() == num_elem, "number of elements in m and p tensors should be equal");
+    AT_ASSERTM(v.numel() == num_elem, "number of elements in v and p tensors should be equal");
+    AT_ASSERTM(g.numel() == num_elem, "number of elements in g and p tensors should be equal");
+    AT_ASSERTM(m_absmax.numel() == num_blocks && v_absmax.numel() == num_blocks,
+               "expected one absmax per block of 2048 elements");
+    AT_ASSERTM(
+        p_copy.numel() == num_elem || p_copy.numel() == 0,
+        "number of elements in p_copy and p tensors should be equal, or p_copy should be empty");
+    AT_ASSERTM(lamb_coeff_val.numel() >= 1 &&
+                   lamb_coeff_val.type().scalarType() == at::ScalarType::Float,
+               "expected lamb_coeff_val to hold a float");
+    AT_ASSERTM(m.type().scalarType() == at::ScalarType::Char, "expected m to be of int8 type");
+    AT_ASSERTM(v.type().scalarType() == at::ScalarType::Byte, "expected v to be of uint8 type");
+    if (skip_step(skip)) return;
+
+    LambState s = {nullptr,
+                   nullptr,
+                   (int8_t*)m.data_ptr(),
+                   (float*)m_absmax.data_ptr(),
+                   (uint8_t*)v.data_ptr(),
+                   (float*)v_absmax.data_ptr()};
+    lamb_cpu_dispatch<true>(
+        p,
+        p_copy,
+        s,
+        g,
+        make_lamb_params(lr,
+                         beta1,
+                         beta2,
+                         eps,
+                         grad_scale,
+                         step,
+                         mode,
+                         bias_correction,
+                         decay,
+                         stochastic_rounding,
+                         seed),
+        max_coeff,
+        min_coeff,
+        lamb_coeff_val);
+}
+
+PYBIND11_MODULE(TORCH_EXTENSION_NAME, m)
+{
+    attach_thread_pool();
+    m.def("lamb", &lamb, "Adam optimized CPU implementation with LAMB.");
+    m.def("lamb_8bit",
+          &lamb_8bit,
+          "Adam optimized CPU implementation with LAMB and blockwise 8-bit states.");
+}
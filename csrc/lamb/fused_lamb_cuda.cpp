@@ -1,5 +1,6 @@
 /* Copyright 2019 The Microsoft DeepSpeed Team */
 #include <torch/extension.h>
+#include "optimizer_8bit.h"
 
 // CUDA forward declaration
 void fused_lamb_cuda(at::Tensor& p,
@@ -18,9 +19,37 @@ void fused_lamb_cuda(at::Tensor& p,
                      int mode,
                      int bias_correction,
                      float decay,
+                     bool stochastic_rounding,
+                     int64_t seed,
                      at::Tensor& w_l2_i,
                      at::Tensor& u_l2_i,
-                     at::Tensor& lamb_coeff_val);
+                     at::Tensor& lamb_coeff_val,
+                     at::Tensor& skip);
+
+void fused_lamb_8bit_cuda(at::Tensor& p,
+                          at::Tensor& p_copy,
+                          at::Tensor& m,
+                          at::Tensor& m_absmax,
+                          at::Tensor& v,
+                          at::Tensor& v_absmax,
+                          at::Tensor& g,
+                          float lr,
+                          float beta1,
+                          float beta2,
+                          float max_coeff,
+                          float min_coeff,
+                          float eps,
+                          float grad_scale,
+                          int step,
+                          int mode,
+                          int bias_correction,
+                          float decay,
+                          bool stochastic_rounding,
+                          int64_t seed,
+                          at::Tensor& w_l2_i,
+                          at::Tensor& u_l2_i,
+                          at::Tensor& lamb_coeff_val,
+                          at::Tensor& skip);
 
 #define CHECK_CUDA(x) AT_ASSERTM(x.type().is_cuda(), #x " must be a CUDA tensor")
 #define CHECK_CONTIGUOUS(x) AT_ASSERTM(x.is_contiguous(), #x " must be contiguous")
@@ -28,29 +57,46 @@ void fused_lamb_cuda(at::Tensor& p,
     CHECK_CUDA(x);     \
     CHECK_CONTIGUOUS(x)
 
-// C++ interface
-at::Tensor lamb(at::Tensor& p,
-                at::Tensor& p_copy,
-                at::Tensor& m,
-                at::Tensor& v,
-                at::Tensor& g,
-                float lr,
-                float beta1,
-                float beta2,
-                float max_coeff,
-                float min_coeff,
-                float eps,
-                float grad_scale,
-                int step,
-                int mode,
-                int bias_correction,
-                float decay)
+// An optional one byte flag on the device, the step is a no-op when it is set.
+void check_skip(const at::Tensor& skip)
+{
+    if (skip.numel() == 0) return;
+    CHECK_INPUT(skip);
+    AT_ASSERTM(skip.numel() == 1 && skip.element_size() == 1,
+               "expected skip to hold a single bool or uint8 flag");
+}
+
+// C++ interface, the trust ratio is written to lamb_coeff_val[0] on the device
+// so that callers can collect the ratios of all tensors without synchronizing.
+// When the skip flag is set nothing is written, p and the moments included.
+void lamb(at::Tensor& p,
+          at::Tensor& p_copy,
+          at::Tensor& m,
+          at::Tensor& v,
+          at::Tensor& g,
+          float lr,
+          float beta1,
+          float beta2,
+          float max_coeff,
+          float min_coeff,
+          float eps,
+          float grad_scale,
+          int step,
+          int mode,
+          int bias_correction,
+          float decay,
+          bool stochastic_rounding,
+          int64_t seed,
+          at::Tensor& lamb_coeff_val,
+          at::Tensor& skip)
 {
     CHECK_INPUT(p);
     if (p_copy.numel() > 0) CHECK_INPUT(p_copy);
     CHECK_INPUT(m);
     CHECK_INPUT(v);
     CHECK_INPUT(g);
+    CHECK_INPUT(lamb_coeff_val);
+    check_skip(skip);
     int64_t num_elem = p.numel();
     AT_ASSERTM(m.numel() == num_elem, "number of elements in m and p tensors should be equal");
     AT_ASSERTM(v.numel() == num_elem, "number of elements in v and p tensors should be equal");
@@ -58,6 +104,9 @@ at::Tensor lamb(at::Tensor& p,
     AT_ASSERTM(
         p_copy.numel() == num_elem || p_copy.numel() == 0,
         "number of elements in p_copy and p tensors should be equal, or p_copy should be empty");
+    AT_ASSERTM(lamb_coeff_val.numel() >= 1 &&
+                   lamb_coeff_val.type().scalarType() == at::ScalarType::Float,
+               "expected lamb_coeff_val to hold a float");
 
     // intermediate for weight L2 reduction
     // make sure that the threads per block is at least 512 during the kernel launch otherwise the
@@ -75,11 +124,6 @@ at::Tensor lamb(at::Tensor& p,
         p.options().dtype(p.type().scalarType() == at::ScalarType::Half ? at::ScalarType::Float
                                                                         : p.type().scalarType()));
 
-    at::Tensor lamb_coeff_val = at::empty(
-        {1},
-        p.options().dtype(p.type().scalarType() == at::ScalarType::Half ? at::ScalarType::Float
-                                                                        : p.type().scalarType()));
-
     fused_lamb_cuda(p,
                     p_copy,
                     m,
@@ -96,14 +140,99 @@ at::Tensor lamb(at::Tensor& p,
                     mode,
                     bias_correction,
                     decay,
+                    stochastic_rounding,
+                    seed,
                     w_l2_i,
                     u_l2_i,
-                    lamb_coeff_val);
+                    lamb_coeff_val,
+                    skip);
+}
+
+// C++ interface for blockwise 8-bit states: m is int8, v is uint8 and
+// m_absmax, v_absmax hold one fp32 scale per OPTIMIZER_8BIT_BLOCK_SIZE elements
+void lamb_8bit(at::Tensor& p,
+               at::Tensor& p_copy,
+               at::Tensor& m,
+               at::Tensor& m_absmax,
+               at::Tensor& v,
+               at::Tensor& v_absmax,
+               at::Tensor& g,
+               float lr,
+               float beta1,
+               float beta2,
+               float max_coeff,
+               float min_coeff,
+               float eps,
+               float grad_scale,
+               int step,
+               int mode,
+               int bias_correction,
+               float decay,
+               bool stochastic_rounding,
+               int64_t seed,
+               at::Tensor& lamb_coeff_val,
+               at::Tensor& skip)
+{
+    CHECK_INPUT(p);
+    if (p_copy.numel() > 0) {
+        CHECK_INPUT(p_copy);
+    }
+    CHECK_INPUT(m);
+    CHECK_INPUT(m_absmax);
+    CHECK_INPUT(v);
+    CHECK_INPUT(v_absmax);
+    CHECK_INPUT(g);
+    CHECK_INPUT(lamb_coeff_val);
+    check_skip(skip);
+    int64_t num_elem = p.numel();
+    int64_t num_blocks = (num_elem + OPTIMIZER_8BIT_BLOCK_SIZE - 1) / OPTIMIZER_8BIT_BLOCK_SIZE;
+    AT_ASSERTM(m.numel() == num_elem, "number of elements in m and p tensors should be equal");
+    AT_ASSERTM(v.numel() == num_elem, "number of elements in v and p tensors should be equal");
+    AT_ASSERTM(g.numel() == num_elem, "number of elements in g and p tensors should be equal");
+    AT_ASSERTM(m_absmax.numel() == num_blocks && v_absmax.numel() == num_blocks,
+               "expected one absmax per block of 2048 elements");
+    AT_ASSERTM(
+        p_copy.numel() == num_elem || p_copy.numel() == 0,
+        "number of elements in p_copy and p tensors should be equal, or p_copy should be empty");
+    AT_ASSERTM(lamb_coeff_val.numel() >= 1 &&
+                   lamb_coeff_val.type().scalarType() == at::ScalarType::Float,
+               "expected lamb_coeff_val to hold a float");
+    AT_ASSERTM(m.type().scalarType() == at::ScalarType::Char, "expected m to be of int8 type");
+    AT_ASSERTM(v.type().scalarType() == at::ScalarType::Byte, "expected v to be of uint8 type");
 
-    return lamb_coeff_val;
+    // one partial sum per quantization block, reduced in place by part2
+    at::Tensor w_l2_i = at::empty({num_blocks}, p.options());
+    at::Tensor u_l2_i = at::empty({num_blocks}, p.options());
+    fused_lamb_8bit_cuda(p,
+                         p_copy,
+                         m,
+                         m_absmax,
+                         v,
+                         v_absmax,
+                         g,
+                         lr,
+                         beta1,
+                         beta2,
+                         max_coeff,
+                         min_coeff,
+                         eps,
+                         grad_scale,
+                         step,
+                         mode,
+                         bias_correction,
+                         decay,
+                         stochastic_rounding,
+                         seed,
+                         w_l2_i,
+                         u_l2_i,
+                         lamb_coeff_val,
+                         skip);
 }
 
 PYBIND11_MODULE(TORCH_EXTENSION_NAME, m)
 {
     m.def("lamb", &lamb, "Adam optimized CUDA implementation with LAMB.");
+    m.def("lamb_8bit",
+          &lamb_8bit,
+          "Adam optimized CUDA implementation with LAMB and blockwise 8-bit states.");
 }
@@ -55,6 +55,8 @@ struct SharedMemory<double> {
 };
 }  // namespace
 
+#include "optimizer_8bit.h"
+#include "stochastic_rounding.h"
 #include "type_shim.h"
 
 typedef enum {
@@ -198,8 +200,11 @@ __global__ void lamb_cuda_kernel_part1(
     adamMode_t mode,
     const float decay,
     T* __restrict__ w_l2_i,
-    T* __restrict__ u_l2_i)
+    T* __restrict__ u_l2_i,
+    const uint8_t* __restrict__ skip)  // the step is a no-op where *skip is set, NULL for never
 {
+    if (skip != NULL && *skip) return;
+
     // Assuming 2D grids and 2D blocks
     const int blockId = gridDim.x * blockIdx.y + blockIdx.x;
     const int threadsPerBlock = blockDim.x * blockDim.y;
@@ -267,8 +272,13 @@ __global__ void lamb_cuda_kernel_part3(
     const float decay,
     T* __restrict__ w_l2_i,
     T* __restrict__ u_l2_i,
-    T* __restrict__ lamb_coeff_val)
+    T* __restrict__ lamb_coeff_val,
+    const bool stochastic_rounding,
+    const uint32_t seed,
+    const uint8_t* __restrict__ skip)
 {
+    if (skip != NULL && *skip) return;
+
     // Assuming 2D grids and 2D blocks
     const int blockId = gridDim.x * blockIdx.y + blockIdx.x;
     const int threadsPerBlock = blockDim.x * blockDim.y;
@@ -305,7 +315,10 @@ __global__ void lamb_cuda_kernel_part3(
 
         pj = pj - (step_size * lamb_coeff * update);
         p[j] = pj;
-        if (p_copy != NULL) p_copy[j] = (GRAD_T)pj;
+        if (p_copy != NULL)
+            p_copy[j] = stochastic_rounding
+                            ? stochastic_round<GRAD_T>(pj, stochastic_rounding_bits(seed, j))
+                            : (GRAD_T)pj;
     }
 }
 
@@ -325,9 +338,12 @@ void fused_lamb_cuda(at::Tensor& p,
                      int mode,
                      int bias_correction,
                      float decay,
+                     bool stochastic_rounding,
+                     int64_t seed,
                      at::Tensor& w_l2_i,
                      at::Tensor& u_l2_i,
-                     at::Tensor& lamb_coeff)
+                     at::Tensor& lamb_coeff,
+                     at::Tensor& skip)
 {
     //        using namespace at;
 
@@ -360,16 +376,19 @@ void fused_lamb_cuda(at::Tensor& p,
         step_size = lr;
     }
     cudaStream_t stream = at::cuda::getCurrentCUDAStream();
+    const uint8_t* skip_ptr = skip.numel() ? (const uint8_t*)skip.data_ptr() : NULL;
 
-    if (g.type().scalarType() == at::ScalarType::Half) {
-        // all other values should be fp32 for half gradients
+    if (g.type().scalarType() == at::ScalarType::Half ||
+        g.type().scalarType() == at::ScalarType::BFloat16) {
+        // all other values should be fp32 for half and bfloat16 gradients
         AT_ASSERTM(p.type().scalarType() == at::ScalarType::Float,
                    "expected parameter to be of float type");
         // dispatch is done on the gradient type
         using namespace at;  // prevents "toString is undefined" errors
-        AT_DISPATCH_FLOATING_TYPES_AND_HALF(
-            g.scalar_type(), "lamb_cuda_kernel", ([&] {
-                using accscalar_t = at::acc_type<scalar_t, true>;
+        DISPATCH_HALF_AND_BFLOAT16(
+            g.scalar_type(), 0, "lamb_cuda_kernel", {
+                using scalar_t = scalar_t_0;
+                using accscalar_t = float;
 
                 lamb_cuda_kernel_part1<accscalar_t, scalar_t, threadsPerBlock>
                     <<<blocks, threadsPerBlock, smemsize, stream>>>(
@@ -387,7 +406,8 @@ void fused_lamb_cuda(at::Tensor& p,
                         (adamMode_t)mode,
                         decay,
                         w_l2_i.data<accscalar_t>(),
-                        u_l2_i.data<accscalar_t>());
+                        u_l2_i.data<accscalar_t>(),
+                        skip_ptr);
 
                 lamb_cuda_kernel_part2<accscalar_t, scalar_t, threadsPerBlock>
                     <<<1, threadsPerBlock, smemsize, stream>>>(
@@ -412,8 +432,11 @@ void fused_lamb_cuda(at::Tensor& p,
                         decay,
                         w_l2_i.data<accscalar_t>(),
                         u_l2_i.data<accscalar_t>(),
-                        lamb_coeff.data<accscalar_t>());
-            }));
+                        lamb_coeff.data<accscalar_t>(),
+                        stochastic_rounding,
+                        (uint32_t)seed,
+                        skip_ptr);
+            });
     } else {
         using namespace at;
         AT_DISPATCH_FLOATING_TYPES(
@@ -434,7 +457,8 @@ void fused_lamb_cuda(at::Tensor& p,
                         (adamMode_t)mode,
                         decay,
                         w_l2_i.data<scalar_t>(),
-                        u_l2_i.data<scalar_t>());
+                        u_l2_i.data<scalar_t>(),
+                        skip_ptr);
 
                 lamb_cuda_kernel_part2<scalar_t, scalar_t, threadsPerBlock>
                     <<<1, threadsPerBlock, smemsize, stream>>>(
@@ -459,11 +483,302 @@ void fused_lamb_cuda(at::Tensor& p,
                         decay,
                         w_l2_i.data<scalar_t>(),
                         u_l2_i.data<scalar_t>(),
-                        lamb_coeff.data<scalar_t>());
+                        lamb_coeff.data<scalar_t>(),
+                        false,
+                        0,
+                        skip_ptr);
             }));
     }
     THCudaCheck(cudaGetLastError());
 }
 
+// Blockwise 8-bit states: one thread block per quantization block, so the
+// absmax of the updated moments can be reduced before they are requantized.
+#define LAMB_8BIT_THREADS 256
+#define LAMB_8BIT_ELEMS_PER_THREAD (OPTIMIZER_8BIT_BLOCK_SIZE / LAMB_8BIT_THREADS)
+
+template <typename GRAD_T>
+__global__ void lamb_8bit_cuda_kernel_part1(float* __restrict__ p,
+                                            int8_t* __restrict__ m,
+                                            float* __restrict__ m_absmax,
+                                            uint8_t* __restrict__ v,
+                                            float* __restrict__ v_absmax,
+                                            const GRAD_T* __restrict__ g,
+                                            const float b1,
+                                            const float b2,
+                                            const float eps,
+                                            const float grad_scale,
+                                            const size_t tsize,
+                                            adamMode_t mode,
+                                            const float decay,
+                                            float* __restrict__ w_l2_i,
+                                            float* __restrict__ u_l2_i,
+                                            const uint8_t* __restrict__ skip)
+{
+    // the whole block returns, before any of its barriers
+    if (skip != NULL && *skip) return;
+
+    __shared__ float s_m_max[LAMB_8BIT_THREADS];
+    __shared__ float s_v_max[LAMB_8BIT_THREADS];
+
+    cg::thread_block cta = cg::this_thread_block();
+    const int tid = cta.thread_rank();
+    const int block = blockIdx.x;
+    const size_t start = (size_t)block * OPTIMIZER_8BIT_BLOCK_SIZE;
+
+    float m_reg[LAMB_8BIT_ELEMS_PER_THREAD];
+    float v_reg[LAMB_8BIT_ELEMS_PER_THREAD];
+    float m_max = 0;
+    float v_max = 0;
+
+    const float old_m_absmax = m_absmax[block];
+    const float old_v_absmax = v_absmax[block];
+
+#pragma unroll
+    for (int k = 0; k < LAMB_8BIT_ELEMS_PER_THREAD; k++) {
+        size_t j = start + k * LAMB_8BIT_THREADS + tid;
+        m_reg[k] = 0;
+        v_reg[k] = 0;
+        if (j < tsize) {
+            float scaled_grad = g[j] / grad_scale;
+            m_reg[k] = b1 * dequantize_signed_8bit(m[j], old_m_absmax) + (1 - b1) * scaled_grad;
+            v_reg[k] = b2 * dequantize_sqrt_8bit(v[j], old_v_absmax) +
+                       (1 - b2) * scaled_grad * scaled_grad;
+            m_max = fmaxf(m_max, fabsf(m_reg[k]));
+            v_max = fmaxf(v_max, v_reg[k]);
+        }
+    }
+
+    s_m_max[tid] = m_max;
+    s_v_max[tid] = v_max;
+    cg::sync(cta);
+    for (int offset = LAMB_8BIT_THREADS / 2; offset > 0; offset /= 2) {
+        if (tid < offset) {
+            s_m_max[tid] = fmaxf(s_m_max[tid], s_m_max[tid + offset]);
+            s_v_max[tid] = fmaxf(s_v_max[tid], s_v_max[tid + offset]);
+        }
+        cg::sync(cta);
+    }
+    m_max = s_m_max[0];
+    v_max = s_v_max[0];
+
+    float reg_w = 0;
+    float reg_u = 0;
+
+#pragma unroll
+    for (int k = 0; k < LAMB_8BIT_ELEMS_PER_THREAD; k++) {
+        size_t j = start + k * LAMB_8BIT_THREADS + tid;
+        if (j < tsize) {
+            int8_t mq = quantize_signed_8bit(m_reg[k], m_max);
+            uint8_t vq = quantize_sqrt_8bit(v_reg[k], v_max);
+            m[j] = mq;
+            v[j] = vq;
+
+            // the update is computed from the stored values, as in part3
+            float mj = dequantize_signed_8bit(mq, m_max);
+            float vj = dequantize_sqrt_8bit(vq, v_max);
+            float denom;
+            if (mode == ADAM_MODE_0)
+                denom = sqrtf(vj + eps);
+            else  // Mode 1
+                denom = sqrtf(vj) + eps;
+            float pj = p[j];
+            float update = (mj / denom) + (decay * pj);
+
+            reg_u += update * update;
+            reg_w += pj * pj;
+        }
+    }
+
+    if (tid == 0) {
+        m_absmax[block] = m_max;
+        v_absmax[block] = v_max;
+    }
+
+    reduce_two_vectors_in_register<float, LAMB_8BIT_THREADS>(reg_w, reg_u, w_l2_i, u_l2_i);
+}
+
+// Reduces the per block partial sums of part1, of which there can be more than
+// threads in the block, into g_a[0] and g_b[0].
+template <int blockSize>
+__global__ void lamb_8bit_cuda_kernel_part2(const size_t tsize,
+                                            float* __restrict__ g_a,
+                                            float* __restrict__ g_b)
+{
+    const int threadIdInBlock = cg::this_thread_block().thread_rank();
+
+    float a = 0;
+    float b = 0;
+    for (int j = threadIdInBlock; j < tsize; j += blockSize) {
+        a += g_a[j];
+        b += g_b[j];
+    }
+
+    reduce_two_vectors_in_register<float, blockSize>(a, b, g_a, g_b);
+}
+
+template <typename GRAD_T>
+__global__ void lamb_8bit_cuda_kernel_part3(
+    float* __restrict__ p,
+    GRAD_T* __restrict__ p_copy,  // For mixed precision training, pass NULL if not needed
+    const int8_t* __restrict__ m,
+    const float* __restrict__ m_absmax,
+    const uint8_t* __restrict__ v,
+    const float* __restrict__ v_absmax,
+    const float max_coeff,
+    const float min_coeff,
+    const float eps,
+    const float step_size,
+    const size_t tsize,
+    adamMode_t mode,
+    const float decay,
+    float* __restrict__ w_l2_i,
+    float* __restrict__ u_l2_i,
+    float* __restrict__ lamb_coeff_val,
+    const bool stochastic_rounding,
+    const uint32_t seed,
+    const uint8_t* __restrict__ skip)
+{
+    if (skip != NULL && *skip) return;
+
+    const int blockId = gridDim.x * blockIdx.y + blockIdx.x;
+    const int threadsPerBlock = blockDim.x * blockDim.y;
+    const int threadIdInBlock = cg::this_thread_block().thread_rank();
+    const int i = (blockId * threadsPerBlock + threadIdInBlock);
+    const int totThreads = gridDim.x * gridDim.y * threadsPerBlock;
+
+    float reg_w = sqrtf(w_l2_i[0]);
+    float reg_u = sqrtf(u_l2_i[0]);
+
+    float lamb_coeff = 1.0;
+
+    if (reg_w != 0 and reg_u != 0) {
+        lamb_coeff = reg_w / reg_u;
+        if (lamb_coeff > max_coeff) { lamb_coeff = max_coeff; }
+        if (lamb_coeff < min_coeff) { lamb_coeff = min_coeff; }
+    }
+
+    if (blockId == 0 and threadIdInBlock == 0) { lamb_coeff_val[0] = lamb_coeff; }
+
+    for (int j = i; j < tsize; j += totThreads) {
+        const int block = j / OPTIMIZER_8BIT_BLOCK_SIZE;
+        float pj = p[j];
+        float mj = dequantize_signed_8bit(m[j], m_absmax[block]);
+        float vj = dequantize_sqrt_8bit(v[j], v_absmax[block]);
+        float denom;
+        if (mode == ADAM_MODE_0)
+            denom = sqrtf(vj + eps);
+        else  // Mode 1
+            denom = sqrtf(vj) + eps;
+        float update = (mj / denom) + (decay * pj);
+
+        pj = pj - (step_size * lamb_coeff * update);
+        p[j] = pj;
+        if (p_copy != NULL)
+            p_copy[j] = stochastic_rounding
+                            ? stochastic_round<GRAD_T>(pj, stochastic_rounding_bits(seed, j))
+                            : (GRAD_T)pj;
+    }
+}
+
+void fused_lamb_8bit_cuda(at::Tensor& p,
+                          at::Tensor& p_copy,
+                          at::Tensor& m,
+                          at::Tensor& m_absmax,
+                          at::Tensor& v,
+                          at::Tensor& v_absmax,
+                          at::Tensor& g,
+                          float lr,
+                          float beta1,
+                          float beta2,
+                          float max_coeff,
+                          float min_coeff,
+                          float eps,
+                          float grad_scale,
+                          int step,
+                          int mode,
+                          int bias_correction,
+                          float decay,
+                          bool stochastic_rounding,
+                          int64_t seed,
+                          at::Tensor& w_l2_i,
+                          at::Tensor& u_l2_i,
+                          at::Tensor& lamb_coeff,
+                          at::Tensor& skip)
+{
+    int tsize = p.numel();
+    const int quant_blocks = (tsize + OPTIMIZER_8BIT_BLOCK_SIZE - 1) / OPTIMIZER_8BIT_BLOCK_SIZE;
+
+    const int threadsPerBlock = 512;
+    int num_blocks = (tsize + threadsPerBlock - 1) / threadsPerBlock;
+    if (num_blocks > 512) num_blocks = 512;
+
+    AT_ASSERTM(at::cuda::detail::canUse32BitIndexMath(p),
+               "parameter tensor is too large to be indexed with int32");
+    AT_ASSERTM(p.type().scalarType() == at::ScalarType::Float,
+               "expected parameter to be of float type");
+
+    float step_size = 0;
+    if (bias_correction == 1) {
+        const float bias_correction1 = 1 - std::pow(beta1, step);
+        const float bias_correction2 = 1 - std::pow(beta2, step);
+        step_size = lr * std::sqrt(bias_correction2) / bias_correction1;
+    } else {
+        step_size = lr;
+    }
+    cudaStream_t stream = at::cuda::getCurrentCUDAStream();
+    const uint8_t* skip_ptr = skip.numel() ? (const uint8_t*)skip.data_ptr() : NULL;
+
+    using namespace at;  // prevents "toString is undefined" errors
+    DISPATCH_FLOAT_HALF_AND_BFLOAT16(
+        g.scalar_type(), 0, "lamb_8bit_cuda_kernel", {
+            using scalar_t = scalar_t_0;
+            lamb_8bit_cuda_kernel_part1<scalar_t>
+                <<<quant_blocks, LAMB_8BIT_THREADS, 2 * LAMB_8BIT_THREADS * sizeof(float), stream>>>(
+                    p.data<float>(),
+                    m.data<int8_t>(),
+                    m_absmax.data<float>(),
+                    v.data<uint8_t>(),
+                    v_absmax.data<float>(),
+                    g.data<scalar_t>(),
+                    beta1,
+                    beta2,
+                    eps,
+                    grad_scale,
+                    tsize,
+                    (adamMode_t)mode,
+                    decay,
+                    w_l2_i.data<float>(),
+                    u_l2_i.data<float>(),
+                    skip_ptr);
+
+            lamb_8bit_cuda_kernel_part2<threadsPerBlock>
+                <<<1, threadsPerBlock, 2 * threadsPerBlock * sizeof(float), stream>>>(
+                    quant_blocks, w_l2_i.data<float>(), u_l2_i.data<float>());
+
+            lamb_8bit_cuda_kernel_part3<scalar_t><<<num_blocks, threadsPerBlock, 0, stream>>>(
+                p.data<float>(),
+                p_copy.numel() ? p_copy.data<scalar_t>() : NULL,
+                m.data<int8_t>(),
+                m_absmax.data<float>(),
+                v.data<uint8_t>(),
+                v_absmax.data<float>(),
+                max_coeff,
+                min_coeff,
+                eps,
+                step_size,
+                tsize,
+                (adamMode_t)mode,
+                decay,
+                w_l2_i.data<float>(),
+                u_l2_i.data<float>(),
+                lamb_coeff.data<float>(),
+                stochastic_rounding,
+                (uint32_t)seed,
+                skip_ptr);
+        });
+    THCudaCheck(cudaGetLastError());
+}
+
 // template __device__ void reduce_two_vectors_in_register<float,512>(float a, float b, float* g_a,
 // float* g_b, cg::grid_group &cgg);
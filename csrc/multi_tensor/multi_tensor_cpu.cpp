@@ -0,0 +1,184 @@
+/* Copyright 2020 The Microsoft DeepSpeed Team */
+#include <torch/extension.h>
+#include <algorithm>
+#include <vector>
+#include "simd.h"
+#include "thread_pool.h"
+
+#define CHECK_CPU(x) AT_ASSERTM(!x.type().is_cuda(), #x " must be a CPU tensor")
+#define CHECK_CONTIGUOUS(x) AT_ASSERTM(x.is_contiguous(), #x " must be contiguous")
+#define CHECK_INPUT(x) \
+    CHECK_CPU(x);      \
+    CHECK_CONTIGUOUS(x)
+
+// Elements handled per parallel task. Large tensors are split and small ones
+// are handled whole, so the work is balanced regardless of the layer sizes.
+#define MULTI_TENSOR_CHUNK_SIZE 65536
+
+// Reduced precision chunks are converted to fp32 through a stack buffer of
+// this many elements.
+#define MULTI_TENSOR_CONVERT_SIZE 1024
+
+struct TensorChunk {
+    int64_t tensor;
+    int64_t offset;
+    int64_t numel;
+};
+
+static std::vector<TensorChunk> split_chunks(const std::vector<at::Tensor>& tensors)
+{
+    std::vector<TensorChunk> chunks;
+    for (int64_t t = 0; t < (int64_t)tensors.size(); t++) {
+        int64_t numel = tensors[t].numel();
+        for (int64_t off = 0; off < numel; off += MULTI_TENSOR_CHUNK_SIZE)
+            chunks.push_back({t, off, std::min<int64_t>(MULTI_TENSOR_CHUNK_SIZE, numel - off)});
+    }
+    return chunks;
+}
+
+template <typename T>
+float chunk_sum_squares(const T* x, int64_t n, bool* finite)
+{
+    float buffer[MULTI_TENSOR_CONVERT_SIZE];
+    float sum = 0.f;
+    *finite = true;
+    for (int64_t i = 0; i < n; i += MULTI_TENSOR_CONVERT_SIZE) {
+        int64_t len = std::min<int64_t>(MULTI_TENSOR_CONVERT_SIZE, n - i);
+        for (int64_t j = 0; j < len; j++) buffer[j] = static_cast<float>(x[i + j]);
+        bool block_finite;
+        sum += simd_sum_squares(buffer, len, &block_finite);
+        *finite = *finite && block_finite;
+    }
+    return sum;
+}
+
+template <>
+float chunk_sum_squares<float>(const float* x, int64_t n, bool* finite)
+{
+    return simd_sum_squares(x, n, finite);
+}
+
+#ifdef VERSION_GE_1_5
+template <>
+float chunk_sum_squares<at::BFloat16>(const at::BFloat16* x, int64_t n, bool* finite)
+{
+    return simd_bf16_sum_squares((const uint16_t*)x, n, finite);
+}
+#endif
+
+template <typename T>
+void chunk_scale(T* x, float scale, int64_t n)
+{
+    for (int64_t i = 0; i < n; i++) x[i] = static_cast<T>(static_cast<float>(x[i]) * scale);
+}
+
+template <>
+void chunk_scale<float>(float* x, float scale, int64_t n)
+{
+    simd_scale_inplace(x, scale, n);
+}
+
+// Reads every tensor once and returns a double tensor of num_groups + 1
+// values: the squared L2 norm of the tensors in each group, followed by 1 if
+// any tensor holds an inf or nan and 0 otherwise. Tensors with a negative
+// group id are only checked for overflow. Partial sums are reduced in a fixed
+// order so the result does not depend on the number of threads.
+at::Tensor multi_tensor_norm_and_overflow(std::vector<at::Tensor>& tensors,
+                                          std::vector<int64_t>& group_ids,
+                                          int64_t num_groups)
+{
+    AT_ASSERTM(tensors.size() == group_ids.size(), "every tensor needs a group id");
+    for (auto& t : tensors) {
+        CHECK_INPUT(t);
+    }
+
+    std::vector<TensorChunk> chunks = split_chunks(tensors);
+    std::vector<float> partial_sums(chunks.size());
+    std::vector<char> partial_finite(chunks.size());
+
+    ThreadPool::Instance().parallel_for(0, chunks.size(), 1, [&](int64_t begin, int64_t end) {
+        for (int64_t c = begin; c < end; c++) {
+            const at::Tensor& t = tensors[chunks[c].tensor];
+            bool finite = true;
+            switch (t.type().scalarType()) {
+                case at::ScalarType::Float:
+                    partial_sums[c] = chunk_sum_squares<float>(
+                        (const float*)t.data_ptr() + chunks[c].offset, chunks[c].numel, &finite);
+                    break;
+                case at::ScalarType::Half:
+                    partial_sums[c] = chunk_sum_squares<at::Half>(
+                        (const at::Half*)t.data_ptr() + chunks[c].offset, chunks[c].numel, &finite);
+                    break;
+#ifdef VERSION_GE_1_5
+                case at::ScalarType::BFloat16:
+                    partial_sums[c] = chunk_sum_squares<at::BFloat16>(
+                        (const at::BFloat16*)t.data_ptr() + chunks[c].offset,
+                        chunks[c].numel,
+                        &finite);
+                    break;
+#endif
+                default:
+                    AT_ERROR("multi_tensor_norm_and_overflow not implemented for '",
+                             toString(t.type().scalarType()),
+                             "'");
+            }
+            partial_finite[c] = finite;
+        }
+    });
+
+    at::Tensor result = at::zeros({num_groups + 1}, at::TensorOptions().dtype(at::kDouble));
+    double* out = (double*)result.data_ptr();
+    for (size_t c = 0; c < chunks.size(); c++) {
+        int64_t group = group_ids[chunks[c].tensor];
+        AT_ASSERTM(group < num_groups, "group id out of range");
+        if (group >= 0) out[group] += partial_sums[c];
+        if (!partial_finite[c]) out[num_groups] = 1.0;
+    }
+
+    return result;
+}
+
+// Multiplies every tensor by scale in place.
+void multi_tensor_scale(std::vector<at::Tensor>& tensors, double scale)
+{
+    for (auto& t : tensors) {
+        CHECK_INPUT(t);
+    }
+
+    std::vector<TensorChunk> chunks = split_chunks(tensors);
+
+    ThreadPool::Instance().parallel_for(0, chunks.size(), 1, [&](int64_t begin, int64_t end) {
+        for (int64_t c = begin; c < end; c++) {
+            at::Tensor& t = tensors[chunks[c].tensor];
+            switch (t.type().scalarType()) {
+                case at::ScalarType::Float:
+                    chunk_scale<float>(
+                        (float*)t.data_ptr() + chunks[c].offset, scale, chunks[c].numel);
+                    break;
+                case at::ScalarType::Half:
+                    chunk_scale<at::Half>(
+                        (at::Half*)t.data_ptr() + chunks[c].offset, scale, chunks[c].numel);
+                    break;
+#ifdef VERSION_GE_1_5
+                case at::ScalarType::BFloat16:
+                    chunk_scale<at::BFloat16>(
+                        (at::BFloat16*)t.data_ptr() + chunks[c].offset, scale, chunks[c].numel);
+                    break;
+#endif
+                default:
+                    AT_ERROR("multi_tensor_scale not implemented for '",
+                             toString(t.type().scalarType()),
+                             "'");
+            }
+        }
+    });
+}
+
+PYBIND11_MODULE(TORCH_EXTENSION_NAME, m)
+{
+    attach_thread_pool();
+    m.def("norm_and_overflow",
+          &multi_tensor_norm_and_overflow,
+          "Fused squared L2 norm and inf/nan check over a list of tensors (CPU)");
+    m.def("scale_", &multi_tensor_scale, "Scale a list of tensors in place (CPU)");
+}
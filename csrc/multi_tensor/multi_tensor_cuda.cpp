@@ -0,0 +1,55 @@
+/* Copyright 2020 The Microsoft DeepSpeed Team */
+#include <torch/extension.h>
+#include <vector>
+
+// CUDA forward declaration
+at::Tensor multi_tensor_norm_and_overflow_cuda(std::vector<at::Tensor>& tensors,
+                                               std::vector<int64_t>& group_ids,
+                                               int64_t num_groups);
+
+void multi_tensor_scale_cuda(std::vector<at::Tensor>& tensors, float scale);
+
+#define CHECK_CUDA(x) AT_ASSERTM(x.type().is_cuda(), #x " must be a CUDA tensor")
+#define CHECK_CONTIGUOUS(x) AT_ASSERTM(x.is_contiguous(), #x " must be contiguous")
+#define CHECK_INPUT(x) \
+    CHECK_CUDA(x);     \
+    CHECK_CONTIGUOUS(x)
+
+void check_tensors(const std::vector<at::Tensor>& tensors)
+{
+    AT_ASSERTM(!tensors.empty(), "expected at least one tensor");
+    for (auto& t : tensors) {
+        CHECK_INPUT(t);
+        AT_ASSERTM(t.device() == tensors[0].device(), "tensors must be on the same device");
+    }
+}
+
+// Reads every tensor once and returns a double tensor of num_groups + 1
+// values on their device: the squared L2 norm of the tensors in each group,
+// followed by 1 if any tensor holds an inf or nan and 0 otherwise. Tensors
+// with a negative group id are only checked for overflow. Nothing is read
+// back to the host.
+at::Tensor multi_tensor_norm_and_overflow(std::vector<at::Tensor>& tensors,
+                                          std::vector<int64_t>& group_ids,
+                                          int64_t num_groups)
+{
+    check_tensors(tensors);
+    AT_ASSERTM(tensors.size() == group_ids.size(), "every tensor needs a group id");
+    for (auto group : group_ids) AT_ASSERTM(group < num_groups, "group id out of range");
+    return multi_tensor_norm_and_overflow_cuda(tensors, group_ids, num_groups);
+}
+
+// Multiplies every tensor by scale in place.
+void multi_tensor_scale(std::vector<at::Tensor>& tensors, double scale)
+{
+    check_tensors(tensors);
+    multi_tensor_scale_cuda(tensors, (float)scale);
+}
+
+PYBIND11_MODULE(TORCH_EXTENSION_NAME, m)
+{
+    m.def("norm_and_overflow",
+          &multi_tensor_norm_and_overflow,
+          "Fused squared L2 norm and inf/nan check over a list of tensors (CUDA)");
+    m.def("scale_", &multi_tensor_scale, "Scale a list of tensors in place (CUDA)");
+}
@@ -0,0 +1,213 @@
+/* Copyright 2020 The Microsoft DeepSpeed Team */
+#include <cuda.h>
+#include <cuda_runtime.h>
+#include <string.h>
+#include <vector>
+#include "ATen/ATen.h"
+#include "ATen/cuda/CUDAContext.h"
+#include <THC/THCGeneral.h>
+
+// Elements handled per thread block. Large tensors are split and small ones
+// are handled whole, so one launch covers the whole list whatever the layer
+// sizes, like the chunks of multi_tensor_cpu.cpp.
+#define MULTI_TENSOR_CHUNK_SIZE 65536
+#define MULTI_TENSOR_THREADS 512
+
+typedef enum { CHUNK_FLOAT = 0, CHUNK_HALF = 1, CHUNK_BFLOAT16 = 2 } chunkDtype_t;
+
+// A row of the chunk table copied to the device: the address of the first
+// element, the number of elements, the group id of the tensor, -1 if it is
+// only checked for overflow, and its chunkDtype_t.
+struct TensorChunk {
+    int64_t address;
+    int64_t numel;
+    int64_t group;
+    int64_t dtype;
+};
+
+static int64_t chunk_dtype(const at::Tensor& t)
+{
+    switch (t.type().scalarType()) {
+        case at::ScalarType::Float: return CHUNK_FLOAT;
+        case at::ScalarType::Half: return CHUNK_HALF;
+#ifdef VERSION_GE_1_5
+        case at::ScalarType::BFloat16: return CHUNK_BFLOAT16;
+#endif
+        default:
+            AT_ERROR(
+                "multi tensor kernels not implemented for '", toString(t.type().scalarType()), "'");
+    }
+}
+
+// The chunks of all tensors on the device of the tensors. Returns an empty
+// tensor if they have no elements.
+static at::Tensor chunk_table(const std::vector<at::Tensor>& tensors,
+                              const std::vector<int64_t>& group_ids)
+{
+    std::vector<TensorChunk> chunks;
+    for (size_t t = 0; t < tensors.size(); t++) {
+        int64_t dtype = chunk_dtype(tensors[t]);
+        int64_t element_size = tensors[t].element_size();
+        int64_t address = (int64_t)tensors[t].data_ptr();
+        int64_t numel = tensors[t].numel();
+        for (int64_t off = 0; off < numel; off += MULTI_TENSOR_CHUNK_SIZE)
+            chunks.push_back({address + off * element_size,
+                              std::min<int64_t>(MULTI_TENSOR_CHUNK_SIZE, numel - off),
+                              group_ids[t],
+                              dtype});
+    }
+    if (chunks.empty()) return at::empty({0});
+
+    // one host to device copy of the whole table, from pinned memory so it
+    // is queued on the stream like the kernels
+    at::Tensor table =
+        at::empty({(int64_t)chunks.size(), 4}, at::TensorOptions().dtype(at::kLong)).pin_memory();
+    memcpy(table.data_ptr(), chunks.data(), chunks.size() * sizeof(TensorChunk));
+    return table.to(tensors[0].device(), at::kLong, /*non_blocking=*/true);
+}
+
+__device__ __forceinline__ float chunk_load(const TensorChunk& chunk, int64_t i)
+{
+    switch (chunk.dtype) {
+        case CHUNK_HALF: return static_cast<float>(((const at::Half*)chunk.address)[i]);
+#ifdef VERSION_GE_1_5
+        case CHUNK_BFLOAT16: return static_cast<float>(((const at::BFloat16*)chunk.address)[i]);
+#endif
+        default: return ((const float*)chunk.address)[i];
+    }
+}
+
+__device__ __forceinline__ void chunk_store(const TensorChunk& chunk, int64_t i, float x)
+{
+    switch (chunk.dtype) {
+        case CHUNK_HALF: ((at::Half*)chunk.address)[i] = static_cast<at::Half>(x); break;
+#ifdef VERSION_GE_1_5
+        case CHUNK_BFLOAT16:
+            ((at::BFloat16*)chunk.address)[i] = static_cast<at::BFloat16>(x);
+            break;
+#endif
+        default: ((float*)chunk.address)[i] = x;
+    }
+}
+
+// Checked on the bits, which --use_fast_math leaves alone.
+__device__ __forceinline__ int is_finite(float x)
+{
+    return (__float_as_uint(x) & 0x7f800000) != 0x7f800000;
+}
+
+// One block per chunk: its sum of squares and whether all of it is finite.
+__global__ void chunk_norm_and_overflow(const TensorChunk* __restrict__ chunks,
+                                        float* __restrict__ partial_sums,
+                                        uint8_t* __restrict__ partial_finite)
+{
+    __shared__ float s_sum[MULTI_TENSOR_THREADS];
+    __shared__ int s_finite[MULTI_TENSOR_THREADS];
+
+    const TensorChunk chunk = chunks[blockIdx.x];
+    float sum = 0.f;
+    int finite = 1;
+    for (int64_t i = threadIdx.x; i < chunk.numel; i += blockDim.x) {
+        float x = chunk_load(chunk, i);
+        sum += x * x;
+        finite &= is_finite(x);
+    }
+
+    unsigned int tid = threadIdx.x;
+    s_sum[tid] = sum;
+    s_finite[tid] = finite;
+    __syncthreads();
+    for (unsigned int s = blockDim.x / 2; s > 0; s >>= 1) {
+        if (tid < s) {
+            s_sum[tid] += s_sum[tid + s];
+            s_finite[tid] &= s_finite[tid + s];
+        }
+        __syncthreads();
+    }
+    if (tid == 0) {
+        partial_sums[blockIdx.x] = s_sum[0];
+        partial_finite[blockIdx.x] = s_finite[0];
+    }
+}
+
+// Block g < num_groups sums the partial sums of the chunks of group g, the
+// last block sets the overflow flag. Every thread reads the same chunks on
+// every call and the tree is fixed, so the result is deterministic.
+__global__ void reduce_groups(const TensorChunk* __restrict__ chunks,
+                              const float* __restrict__ partial_sums,
+                              const uint8_t* __restrict__ partial_finite,
+                              int64_t num_chunks,
+                              int64_t num_groups,
+                              double* __restrict__ result)
+{
+    __shared__ double s_value[MULTI_TENSOR_THREADS];
+
+    int64_t group = blockIdx.x;
+    double value = 0.0;
+    for (int64_t c = threadIdx.x; c < num_chunks; c += blockDim.x) {
+        if (group < num_groups) {
+            if (chunks[c].group == group) value += partial_sums[c];
+        } else if (!partial_finite[c]) {
+            value = 1.0;
+        }
+    }
+
+    unsigned int tid = threadIdx.x;
+    s_value[tid] = value;
+    __syncthreads();
+    for (unsigned int s = blockDim.x / 2; s > 0; s >>= 1) {
+        if (tid < s) {
+            s_value[tid] = group < num_groups ? s_value[tid] + s_value[tid + s]
+                                              : fmax(s_value[tid], s_value[tid + s]);
+        }
+        __syncthreads();
+    }
+    if (tid == 0) result[group] = s_value[0];
+}
+
+__global__ void chunk_scale(const TensorChunk* __restrict__ chunks, float scale)
+{
+    const TensorChunk chunk = chunks[blockIdx.x];
+    for (int64_t i = threadIdx.x; i < chunk.numel; i += blockDim.x)
+        chunk_store(chunk, i, chunk_load(chunk, i) * scale);
+}
+
+at::Tensor multi_tensor_norm_and_overflow_cuda(std::vector<at::Tensor>& tensors,
+                                               std::vector<int64_t>& group_ids,
+                                               int64_t num_groups)
+{
+    at::Tensor result =
+        at::zeros({num_groups + 1}, tensors[0].options().dtype(at::ScalarType::Double));
+    at::Tensor table = chunk_table(tensors, group_ids);
+    int64_t num_chunks = table.size(0);
+    if (num_chunks == 0) return result;
+
+    at::Tensor partial_sums = at::empty({num_chunks}, result.options().dtype(at::kFloat));
+    at::Tensor partial_finite = at::empty({num_chunks}, result.options().dtype(at::kByte));
+    const TensorChunk* chunks = (const TensorChunk*)table.data_ptr();
+    cudaStream_t stream = at::cuda::getCurrentCUDAStream();
+
+    chunk_norm_and_overflow<<<num_chunks, MULTI_TENSOR_THREADS, 0, stream>>>(
+        chunks, (float*)partial_sums.data_ptr(), (uint8_t*)partial_finite.data_ptr());
+    reduce_groups<<<num_groups + 1, MULTI_TENSOR_THREADS, 0, stream>>>(
+        chunks,
+        (const float*)partial_sums.data_ptr(),
+        (const uint8_t*)partial_finite.data_ptr(),
+        num_chunks,
+        num_groups,
+        (double*)result.data_ptr());
+    THCudaCheck(cudaGetLastError());
+    return result;
+}
+
+void multi_tensor_scale_cuda(std::vector<at::Tensor>& tensors, float scale)
+{
+    at::Tensor table = chunk_table(tensors, std::vector<int64_t>(tensors.size(), -1));
+    int64_t num_chunks = table.size(0);
+    if (num_chunks == 0) return;
+
+    cudaStream_t stream = at::cuda::getCurrentCUDAStream();
+    chunk_scale<<<num_chunks, MULTI_TENSOR_THREADS, 0, stream>>>(
+        (const TensorChunk*)table.data_ptr(), scale);
+    THCudaCheck(cudaGetLastError());
+}
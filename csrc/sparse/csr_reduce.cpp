@@ -0,0 +1,119 @@
+/* Copyright 2020 The Microsoft DeepSpeed Team */
+#include <torch/extension.h>
+#include <algorithm>
+#include <numeric>
+#include <type_traits>
+#include <vector>
+#include "simd.h"
+#include "thread_pool.h"
+
+#define CHECK_CPU(x) AT_ASSERTM(!x.type().is_cuda(), #x " must be a CPU tensor")
+#define CHECK_CONTIGUOUS(x) AT_ASSERTM(x.is_contiguous(), #x " must be contiguous")
+#define CHECK_INPUT(x) \
+    CHECK_CPU(x);      \
+    CHECK_CONTIGUOUS(x)
+
+// Rows coalesced per parallel task. Embedding rows are usually a few KB so a
+// handful of them is enough to amortize the scheduling cost.
+#define CSR_ROWS_PER_TASK 16
+
+template <typename T>
+void sum_row_groups(const T* values,
+                    const int64_t* order,
+                    const std::vector<int64_t>& group_starts,
+                    int64_t row_size,
+                    T* out_values)
+{
+    int64_t num_groups = group_starts.size() - 1;
+    ThreadPool& pool = ThreadPool::Instance();
+    pool.parallel_for(0, num_groups, CSR_ROWS_PER_TASK, [&](int64_t begin, int64_t end) {
+        std::vector<float> acc(row_size);
+        std::vector<float> row(row_size);
+        for (int64_t g = begin; g < end; g++) {
+            T* dst = out_values + g * row_size;
+            int64_t first = group_starts[g];
+            int64_t last = group_starts[g + 1];
+            if (std::is_same<T, float>::value) {
+                float* fdst = reinterpret_cast<float*>(dst);
+                std::copy(values + order[first] * row_size,
+                          values + (order[first] + 1) * row_size,
+                          dst);
+                for (int64_t k = first + 1; k < last; k++)
+                    simd_add_inplace(fdst,
+                                     reinterpret_cast<const float*>(values) + order[k] * row_size,
+                                     row_size);
+            } else {
+                // Reduced precision rows are accumulated in fp32 and rounded once.
+                std::fill(acc.begin(), acc.end(), 0.f);
+                for (int64_t k = first; k < last; k++) {
+                    const T* src = values + order[k] * row_size;
+                    for (int64_t j = 0; j < row_size; j++) row[j] = static_cast<float>(src[j]);
+                    simd_add_inplace(acc.data(), row.data(), row_size);
+                }
+                for (int64_t j = 0; j < row_size; j++) dst[j] = static_cast<T>(acc[j]);
+            }
+        }
+    });
+}
+
+// Sorts the row indices of a CSR gradient, merges duplicates and sums their
+// rows. Returns {unique_indices, summed_values} with indices in ascending order.
+std::vector<at::Tensor> csr_coalesce(at::Tensor& indices, at::Tensor& values)
+{
+    CHECK_INPUT(indices);
+    CHECK_INPUT(values);
+    AT_ASSERTM(indices.dim() == 1, "indices should be a 1-D tensor");
+    AT_ASSERTM(values.dim() == 2, "values should be a 2-D tensor");
+    AT_ASSERTM(indices.type().scalarType() == at::ScalarType::Long, "indices should be int64");
+    AT_ASSERTM(indices.size(0) == values.size(0),
+               "number of indices should match the number of value rows");
+
+    int64_t nnz = indices.size(0);
+    int64_t row_size = values.size(1);
+    const int64_t* idx = (const int64_t*)indices.data_ptr();
+
+    std::vector<int64_t> order(nnz);
+    std::iota(order.begin(), order.end(), 0);
+    std::stable_sort(order.begin(), order.end(), [idx](int64_t a, int64_t b) {
+        return idx[a] < idx[b];
+    });
+
+    std::vector<int64_t> group_starts;
+    group_starts.reserve(nnz + 1);
+    for (int64_t k = 0; k < nnz; k++)
+        if (k == 0 || idx[order[k]] != idx[order[k - 1]]) group_starts.push_back(k);
+    group_starts.push_back(nnz);
+
+    int64_t num_unique = group_starts.size() - 1;
+    at::Tensor out_indices = at::empty({num_unique}, indices.options());
+    at::Tensor out_values = at::empty({num_unique, row_size}, values.options());
+
+    int64_t* out_idx = (int64_t*)out_indices.data_ptr();
+    for (int64_t g = 0; g < num_unique; g++) out_idx[g] = idx[order[group_starts[g]]];
+
+    switch (values.type().scalarType()) {
+        case at::ScalarType::Float:
+            sum_row_groups<float>((const float*)values.data_ptr(),
+                                  order.data(),
+                                  group_starts,
+                                  row_size,
+                                  (float*)out_values.data_ptr());
+            break;
+        case at::ScalarType::Half:
+            sum_row_groups<at::Half>((const at::Half*)values.data_ptr(),
+                                     order.data(),
+                                     group_starts,
+                                     row_size,
+                                     (at::Half*)out_values.data_ptr());
+            break;
+        default: AT_ERROR("csr_coalesce not implemented for '", toString(values.type().scalarType()), "'");
+    }
+
+    return {out_indices, out_values};
+}
+
+PYBIND11_MODULE(TORCH_EXTENSION_NAME, m)
+{
+    attach_thread_pool();
+    m.def("coalesce", &csr_coalesce, "Merge duplicate CSR rows (CPU)");
+}
@@ -0,0 +1,46 @@
+/* Copyright 2020 The Microsoft DeepSpeed Team */
+#include <torch/extension.h>
+#include <map>
+#include <string>
+#include <vector>
+#include "thread_pool.h"
+
+int get_num_threads() { return ThreadPool::Instance().NumThreads(); }
+
+void set_num_threads(int num_threads) { ThreadPool::Instance().SetNumThreads(num_threads); }
+
+// Busy seconds, tasks run and stolen, NUMA node and the fraction of time
+// busy of every worker since the last reset.
+std::vector<std::map<std::string, double>> get_utilization(bool reset)
+{
+    double elapsed = 0;
+    std::vector<std::map<std::string, double>> utilization;
+    for (const auto& stats : ThreadPool::Instance().Stats(&elapsed)) {
+        std::map<std::string, double> worker;
+        worker["numa_node"] = stats.numa_node;
+        worker["busy_seconds"] = stats.busy_seconds;
+        worker["tasks"] = stats.tasks;
+        worker["steals"] = stats.steals;
+        worker["utilization"] = elapsed > 0 ? stats.busy_seconds / elapsed : 0;
+        utilization.push_back(worker);
+    }
+    if (reset) ThreadPool::Instance().ResetStats();
+    return utilization;
+}
+
+PYBIND11_MODULE(TORCH_EXTENSION_NAME, m)
+{
+    // the pool every other DeepSpeed CPU extension attaches to
+    m.attr("_pool") = py::capsule(&ThreadPool::Instance(), THREAD_POOL_CAPSULE);
+    m.def("get_num_threads",
+          &get_num_threads,
+          "Threads of the DeepSpeed CPU thread pool, including the caller");
+    m.def("set_num_threads",
+          &set_num_threads,
+          "Resize the DeepSpeed CPU thread pool, 0 for the default",
+          py::call_guard<py::gil_scoped_release>());
+    m.def("get_utilization",
+          &get_utilization,
+          "Per worker utilization counters of the DeepSpeed CPU thread pool",
+          py::arg("reset") = false);
+}
@@ -1,6 +1,7 @@
 #include <cublas_v2.h>
 #include <cuda_fp16.h>
 #include <cuda_runtime.h>
+#include <torch/extension.h>
 #include <type_traits>
 #include <unordered_map>
 #include <vector>
@@ -2435,6 +2436,7 @@ void restore_rand_state(bool grad_enable) { Context::Instance().RestoreRandOffse
 
 PYBIND11_MODULE(TORCH_EXTENSION_NAME, m)
 {
+    attach_thread_pool();
     m.def("forward_transformer_fp32",
           &ds_transformer_forward<float>,
           "DeepSpeed Transformer forward with fp32 (CUDA)");
@@ -4,6 +4,7 @@ Copyright 2020 The Microsoft DeepSpeed Team
 
 from deepspeed.pt.deepspeed_light import DeepSpeedLight
 from deepspeed.pt.deepspeed_light import ADAM_OPTIMIZER, LAMB_OPTIMIZER
+from deepspeed.pt.deepspeed_pipe import PipelineEngine, PipelineModule
 from deepspeed.pt.deepspeed_lr_schedules import add_tuning_arguments
 from deepspeed.pt.log_utils import logger
 from deepspeed.pt.deepspeed_cuda import DeepSpeedTransformerLayer, DeepSpeedTransformerConfig
@@ -11,6 +12,7 @@ from deepspeed.pt.deepspeed_cuda import DeepSpeedSelfAttentionLayer
 from deepspeed.pt.deepspeed_cuda import DeepSpeedMLPLayer
 from deepspeed.pt.deepspeed_cuda import DeepSpeedBiasResidualDropoutLayer
 from deepspeed.pt.deepspeed_cuda import DeepSpeedLayerNormalizeLayer
+from deepspeed.pt.deepspeed_tensor_parallel import DeepSpeedTensorParallelTransformerLayer
 from deepspeed.pt.deepspeed_cuda import DeepSpeedStoreRandState
 from deepspeed.pt.deepspeed_cuda import DeepSpeedRestoreRandState
 from deepspeed.pt.deepspeed_config import DeepSpeedConfig
@@ -52,7 +54,9 @@ def initialize(args,
         args: a dictionary containing local_rank and deepspeed_config
             file location
 
-        model: Required: nn.module class before apply any wrappers
+        model: Required: nn.module class before apply any wrappers. A PipelineModule
+            is trained with pipeline parallelism by a PipelineEngine, see
+            PipelineEngine.train_batch
 
         optimizer: Optional: a user defined optimizer, this is typically used instead of defining
             an optimizer in the DeepSpeed json config.
@@ -96,16 +100,18 @@ def initialize(args,
             __git_branch__),
     )
 
-    engine = DeepSpeedLight(args=args,
-                            model=model,
-                            optimizer=optimizer,
-                            model_parameters=model_parameters,
-                            training_data=training_data,
-                            lr_scheduler=lr_scheduler,
-                            mpu=mpu,
-                            dist_init_required=dist_init_required,
-                            collate_fn=collate_fn,
-                            config_params=config_params)
+    engine_class = PipelineEngine if isinstance(model,
+                                                PipelineModule) else DeepSpeedLight
+    engine = engine_class(args=args,
+                          model=model,
+                          optimizer=optimizer,
+                          model_parameters=model_parameters,
+                          training_data=training_data,
+                          lr_scheduler=lr_scheduler,
+                          mpu=mpu,
+                          dist_init_required=dist_init_required,
+                          collate_fn=collate_fn,
+                          config_params=config_params)
 
     return_items = [
         engine,
@@ -0,0 +1,272 @@
+'''
+Copyright 2020 The Microsoft DeepSpeed Team
+
+Compression of activation checkpoints.
+
+Checkpoints are stored by one of the codecs below, chosen per checkpointed
+layer by a policy, and decompressed right before the layer is recomputed:
+
+    none      the tensor is kept as is
+    int8      blockwise int8 with one fp32 scale per block, lossy, stores 1/2
+              of fp16 and 1/4 of fp32 checkpoints. Runs on the GPU with torch
+              ops and on host tensors with the native codec, both round the
+              same way.
+    lossless  byte planes with bit-packing and zero bitmaps, exact. Native
+              codec for host tensors only, i.e. with cpu_checkpointing;
+              checkpoints on the GPU are kept as is.
+
+The native codecs live in csrc/compression/activation_compression_cpu.cpp.
+'''
+
+import time
+
+import torch
+
+from deepspeed.pt.log_utils import logger
+
+try:
+    import deepspeed_compression_cpu
+except ImportError:
+    deepspeed_compression_cpu = None
+
+NONE = 'none'
+INT8 = 'int8'
+LOSSLESS = 'lossless'
+CODECS = [NONE, INT8, LOSSLESS]
+
+# Elements sharing one int8 scale, as OPTIMIZER_8BIT_BLOCK_SIZE in
+# csrc/includes/optimizer_8bit.h
+INT8_BLOCK_SIZE = 2048
+
+
+def _nbytes(tensor):
+    return tensor.numel() * tensor.element_size()
+
+
+def quantize_int8(tensor, block_size=INT8_BLOCK_SIZE):
+    """Returns the int8 codes of the flattened tensor and the fp32 absmax of
+    every block of block_size elements."""
+    flat = tensor.contiguous().view(-1)
+    numel = flat.numel()
+    num_blocks = -(-numel // block_size)
+    if deepspeed_compression_cpu is not None and not flat.is_cuda:
+        q = torch.empty(numel, dtype=torch.int8)
+        absmax = torch.empty(num_blocks, dtype=torch.float32)
+        deepspeed_compression_cpu.quantize_blockwise(flat, q, absmax, block_size)
+        return q, absmax
+
+    blocks = flat.float()
+    padding = num_blocks * block_size - numel
+    if padding:
+        blocks = torch.cat([blocks, blocks.new_zeros(padding)])
+    blocks = blocks.view(num_blocks, block_size)
+    absmax = blocks.abs().max(dim=1)[0]
+    inverse = torch.where(absmax > 0, 127.0 / absmax, torch.zeros_like(absmax))
+    q = (blocks * inverse.unsqueeze(1)).round_().clamp_(-127, 127).to(torch.int8)
+    q = q.view(-1)
+    return (q.narrow(0, 0, numel).clone() if padding else q), absmax
+
+
+def dequantize_int8(q, absmax, dtype, block_size=INT8_BLOCK_SIZE):
+    """Inverse of quantize_int8, returns a flat tensor of dtype on the device
+    of q."""
+    numel = q.numel()
+    if deepspeed_compression_cpu is not None and not q.is_cuda:
+        out = torch.empty(numel, dtype=dtype)
+        deepspeed_compression_cpu.dequantize_blockwise(q, absmax, out, block_size)
+        return out
+
+    num_blocks = absmax.numel()
+    values = q.float()
+    padding = num_blocks * block_size - numel
+    if padding:
+        values = torch.cat([values, values.new_zeros(padding)])
+    values = values.view(num_blocks, block_size) * (absmax / 127.0).unsqueeze(1)
+    return values.view(-1).narrow(0, 0, numel).to(dtype)
+
+
+def lossless_supported(tensor):
+    return deepspeed_compression_cpu is not None and not tensor.is_cuda \
+        and tensor.element_size() in (2, 4)
+
+
+def encode_lossless(tensor):
+    """Returns the block index and the encoded bytes of a host tensor."""
+    return deepspeed_compression_cpu.byteplane_encode(tensor.contiguous().view(-1))
+
+
+def decode_lossless(index, data, numel, dtype):
+    out = torch.empty(numel, dtype=dtype)
+    deepspeed_compression_cpu.byteplane_decode(index, data, out)
+    return out
+
+
+class CompressedTensor(object):
+    """A tensor stored by codec as the tensors in payload."""
+    def __init__(self, codec, size, dtype, payload):
+        self.codec = codec
+        self.size = size
+        self.dtype = dtype
+        self.payload = payload
+
+    def nbytes(self):
+        return sum(_nbytes(tensor) for tensor in self.payload)
+
+
+def payload_tensors(items):
+    """The tensors storing items, a list of tensors and CompressedTensors, e.g.
+    to offload them."""
+    tensors = []
+    for item in items:
+        if isinstance(item, CompressedTensor):
+            tensors.extend(item.payload)
+        else:
+            tensors.append(item)
+    return tensors
+
+
+def with_payload_tensors(items, tensors):
+    """items with their payload_tensors replaced by tensors, e.g. the copies
+    fetched back after offloading."""
+    tensors = iter(tensors)
+    replaced = []
+    for item in items:
+        if isinstance(item, CompressedTensor):
+            payload = [next(tensors) for _ in item.payload]
+            replaced.append(CompressedTensor(item.codec, item.size, item.dtype, payload))
+        else:
+            replaced.append(next(tensors))
+    return replaced
+
+
+class CompressionStats(object):
+    """Bytes and time spent compressing and decompressing checkpoints. The
+    throughput is over the uncompressed bytes and only covers the GPU work
+    when the compressor synchronizes."""
+    def __init__(self):
+        self.reset()
+
+    def reset(self):
+        self.raw_bytes = 0
+        self.compressed_bytes = 0
+        self.compress_time = 0.0
+        self.decompressed_bytes = 0
+        self.decompress_time = 0.0
+        self.skipped = 0
+
+    def ratio(self):
+        return float(self.raw_bytes) / self.compressed_bytes if self.compressed_bytes \
+            else 1.0
+
+    def as_dict(self):
+        def throughput(nbytes, seconds):
+            return nbytes / seconds / 1e9 if seconds > 0 else 0.0
+
+        return {
+            'compression_ratio': self.ratio(),
+            'raw_MB': self.raw_bytes / 1e6,
+            'compressed_MB': self.compressed_bytes / 1e6,
+            'compress_GBps': throughput(self.raw_bytes,
+                                        self.compress_time),
+            'decompress_GBps': throughput(self.decompressed_bytes,
+                                          self.decompress_time),
+            'skipped': self.skipped
+        }
+
+    def log(self, reset=True):
+        stats = self.as_dict()
+        logger.info('activation checkpoint compression: ratio {:.2f} ({:.1f} MB to '
+                    '{:.1f} MB), compress {:.2f} GB/s, decompress {:.2f} GB/s, '
+                    '{} checkpoints not compressible'.format(stats['compression_ratio'],
+                                                             stats['raw_MB'],
+                                                             stats['compressed_MB'],
+                                                             stats['compress_GBps'],
+                                                             stats['decompress_GBps'],
+                                                             stats['skipped']))
+        if reset:
+            self.reset()
+
+
+class ActivationCompressor(object):
+    """Compresses the checkpoints of each layer with the codec policy assigns
+    to it.
+
+    Arguments:
+        policy: a codec for all layers, or a list with the codec of each
+            checkpointed layer in forward order; layers past its end are
+            not compressed
+        block_size: elements per int8 block
+        synchronize: synchronize the device around the codecs so the stats
+            measure the GPU time
+    """
+    def __init__(self, policy, block_size=INT8_BLOCK_SIZE, synchronize=False):
+        codecs = [policy] if isinstance(policy, str) else list(policy)
+        for codec in codecs:
+            assert codec in CODECS, 'unknown activation compression {}, ' \
+                'expected one of {}'.format(codec, CODECS)
+        self.policy = policy
+        self.block_size = block_size
+        self.synchronize = synchronize
+        self.stats = CompressionStats()
+        self.warned = False
+
+    def codec(self, layer):
+        if isinstance(self.policy, str):
+            return self.policy
+        return self.policy[layer] if layer < len(self.policy) else NONE
+
+    def num_uncompressed(self, num_layers):
+        """How many of num_layers layers are stored as is."""
+        return sum(self.codec(layer) == NONE for layer in range(num_layers))
+
+    def _time(self):
+        if self.synchronize and torch.cuda.is_available():
+            torch.cuda.synchronize()
+        return time.time()
+
+    def compress(self, tensor, layer):
+        """tensor as a CompressedTensor, or tensor itself if the codec of layer
+        is none or cannot store it."""
+        codec = self.codec(layer)
+        if codec == NONE:
+            return tensor
+        if not tensor.is_floating_point() or (codec == LOSSLESS
+                                              and not lossless_supported(tensor)):
+            if codec == LOSSLESS and not self.warned:
+                logger.warning('lossless activation compression needs the native '
+                               'codec and host checkpoints, storing them as is')
+                self.warned = True
+            self.stats.skipped += 1
+            return tensor
+
+        start = self._time()
+        if codec == INT8:
+            payload = list(quantize_int8(tensor, self.block_size))
+        else:
+            payload = list(encode_lossless(tensor))
+        compressed = CompressedTensor(codec, tensor.size(), tensor.dtype, payload)
+        self.stats.compress_time += self._time() - start
+        self.stats.raw_bytes += _nbytes(tensor)
+        self.stats.compressed_bytes += compressed.nbytes()
+        return compressed
+
+    def decompress(self, item):
+        """The tensor stored by item, which may also be an uncompressed tensor."""
+        if not isinstance(item, CompressedTensor):
+            return item
+
+        start = self._time()
+        numel = 1
+        for dim in item.size:
+            numel *= dim
+        if item.codec == INT8:
+            tensor = dequantize_int8(item.payload[0],
+                                     item.payload[1],
+                                     item.dtype,
+                                     self.block_size)
+        else:
+            tensor = decode_lossless(item.payload[0], item.payload[1], numel, item.dtype)
+        tensor = tensor.view(item.size)
+        self.stats.decompress_time += self._time() - start
+        self.stats.decompressed_bytes += _nbytes(tensor)
+        return tensor
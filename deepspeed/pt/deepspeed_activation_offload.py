@@ -0,0 +1,264 @@
+'''
+Copyright 2020 The Microsoft DeepSpeed Team
+
+Asynchronous offload of activation checkpoints to host memory.
+
+Checkpoints are copied to pinned host memory on a side stream during the
+forward pass, so the copy overlaps the next layers instead of stalling the
+compute stream. Backward needs the checkpoints in reverse order: when the
+checkpoint of layer L is fetched, those of the next prefetch_depth layers,
+L-1 and below, are copied back on another stream while layer L recomputes.
+
+Host memory is one pinned arena per dtype that checkpoints are appended to
+during the forward pass and that is reused once backward has consumed all of
+them, so steady state training does not allocate or pin memory.
+
+The streams, events and copies are issued through a backend. The CUDA backend
+is used for training; SimulatedOffloadBackend runs the same schedule on CPU
+tensors for testing.
+'''
+
+import contextlib
+
+import torch
+
+
+class CudaOffloadBackend(object):
+    def __init__(self, device):
+        self.device = device
+
+    def new_stream(self):
+        return torch.cuda.Stream(device=self.device)
+
+    def stream(self, stream):
+        return torch.cuda.stream(stream)
+
+    def current_stream(self):
+        return torch.cuda.current_stream(self.device)
+
+    def record_event(self, stream):
+        event = torch.cuda.Event()
+        event.record(stream)
+        return event
+
+    def wait_event(self, stream, event):
+        stream.wait_event(event)
+
+    def wait_stream(self, stream, other):
+        stream.wait_stream(other)
+
+    def record_stream(self, tensor, stream):
+        tensor.record_stream(stream)
+
+    def empty_host(self, numel, dtype):
+        return torch.empty(numel, dtype=dtype, pin_memory=True)
+
+    def copy_to_host(self, host, tensor):
+        host.copy_(tensor.view(-1), non_blocking=True)
+
+    def copy_to_device(self, host):
+        return host.to(self.device, non_blocking=True)
+
+
+class SimulatedOffloadBackend(object):
+    """Backend whose device is the CPU. Copies complete immediately, streams
+    and events only record the order in which operations were issued in ops,
+    as (operation, stream name) pairs."""
+    class Stream(object):
+        def __init__(self, name):
+            self.name = name
+
+    def __init__(self):
+        self.default_stream = self.Stream('default')
+        self.current = self.default_stream
+        self.ops = []
+        self.num_streams = 0
+
+    def new_stream(self):
+        self.num_streams += 1
+        return self.Stream('side{}'.format(self.num_streams))
+
+    @contextlib.contextmanager
+    def stream(self, stream):
+        previous = self.current
+        self.current = stream
+        try:
+            yield
+        finally:
+            self.current = previous
+
+    def current_stream(self):
+        return self.current
+
+    def record_event(self, stream):
+        self.ops.append(('record_event', stream.name))
+        return stream.name
+
+    def wait_event(self, stream, event):
+        self.ops.append(('wait_event', stream.name))
+
+    def wait_stream(self, stream, other):
+        self.ops.append(('wait_stream', stream.name))
+
+    def record_stream(self, tensor, stream):
+        pass
+
+    def empty_host(self, numel, dtype):
+        return torch.empty(numel, dtype=dtype)
+
+    def copy_to_host(self, host, tensor):
+        self.ops.append(('copy_to_host', self.current.name))
+        host.copy_(tensor.view(-1))
+
+    def copy_to_device(self, host):
+        self.ops.append(('copy_to_device', self.current.name))
+        return host.clone()
+
+
+class _HostArena(object):
+    """Pinned host memory that tensors of one dtype are appended to. Memory is
+    allocated in chunks while the arena grows and merged into one chunk of
+    the high water mark on reset, so later rounds fit without allocating."""
+    def __init__(self, backend, dtype):
+        self.backend = backend
+        self.dtype = dtype
+        self.chunks = []
+        self.chunk = 0
+        self.offset = 0
+        self.high_water_mark = 0
+        self.used = 0
+        self.allocations = 0
+
+    def alloc(self, numel):
+        while self.chunk < len(self.chunks) \
+                and self.offset + numel > self.chunks[self.chunk].numel():
+            self.used += self.chunks[self.chunk].numel() - self.offset
+            self.chunk += 1
+            self.offset = 0
+        if self.chunk == len(self.chunks):
+            size = max(numel, self.chunks[-1].numel() * 2 if self.chunks else numel)
+            self.chunks.append(self.backend.empty_host(size, self.dtype))
+            self.allocations += 1
+
+        view = self.chunks[self.chunk].narrow(0, self.offset, numel)
+        self.offset += numel
+        self.used += numel
+        self.high_water_mark = max(self.high_water_mark, self.used)
+        return view
+
+    def reset(self):
+        if len(self.chunks) > 1:
+            self.chunks = [self.backend.empty_host(self.high_water_mark, self.dtype)]
+            self.allocations += 1
+        self.chunk = 0
+        self.offset = 0
+        self.used = 0
+
+
+class OffloadedCheckpoint(object):
+    """Host copies of the tensors saved by one checkpointed layer."""
+    def __init__(self, index, host, event):
+        self.index = index
+        self.host = host
+        self.offload_event = event
+        self.prefetched = None
+        self.prefetch_event = None
+        self.fetched = False
+
+
+class ActivationOffloader(object):
+    """Offloads the checkpoints of one forward pass and fetches them back in
+    reverse order during backward, prefetching up to prefetch_depth layers
+    ahead."""
+    def __init__(self, backend, prefetch_depth=1):
+        assert prefetch_depth >= 0, 'prefetch depth must not be negative'
+        self.backend = backend
+        self.prefetch_depth = prefetch_depth
+        self.offload_stream = backend.new_stream()
+        self.prefetch_stream = backend.new_stream()
+        self.arenas = {}
+        self.checkpoints = []
+        self.pending = 0
+        self.fetch_hits = 0
+        self.fetch_misses = 0
+
+    def _arena(self, dtype):
+        if dtype not in self.arenas:
+            self.arenas[dtype] = _HostArena(self.backend, dtype)
+        return self.arenas[dtype]
+
+    def host_allocations(self):
+        """Number of host buffers allocated so far."""
+        return sum(arena.allocations for arena in self.arenas.values())
+
+    def offload(self, tensors):
+        """Start copying tensors, which were produced on the current stream,
+        to host memory. Returns the checkpoint to fetch them with. Its host
+        tensors are only guaranteed to be complete once it was fetched."""
+        if self.pending == 0 and self.checkpoints:
+            self.reset()
+
+        current_stream = self.backend.current_stream()
+        self.backend.wait_stream(self.offload_stream, current_stream)
+        host = []
+        with self.backend.stream(self.offload_stream):
+            for tensor in tensors:
+                view = self._arena(tensor.dtype).alloc(tensor.numel())
+                self.backend.copy_to_host(view, tensor)
+                # keep the device memory from being reused before the copy
+                self.backend.record_stream(tensor, self.offload_stream)
+                host.append(view.view(tensor.size()))
+            event = self.backend.record_event(self.offload_stream)
+
+        checkpoint = OffloadedCheckpoint(len(self.checkpoints), host, event)
+        self.checkpoints.append(checkpoint)
+        self.pending += 1
+        return checkpoint
+
+    def _prefetch(self, checkpoint):
+        self.backend.wait_event(self.prefetch_stream, checkpoint.offload_event)
+        with self.backend.stream(self.prefetch_stream):
+            checkpoint.prefetched = [
+                self.backend.copy_to_device(host) for host in checkpoint.host
+            ]
+            checkpoint.prefetch_event = self.backend.record_event(self.prefetch_stream)
+
+    def fetch(self, checkpoint):
+        """The tensors of checkpoint on the device, ready for the current
+        stream. Starts prefetching the checkpoints of the preceding layers."""
+        assert not checkpoint.fetched, 'checkpoint was already fetched'
+        if checkpoint.prefetched is None:
+            self.fetch_misses += 1
+            self._prefetch(checkpoint)
+        else:
+            self.fetch_hits += 1
+
+        current_stream = self.backend.current_stream()
+        self.backend.wait_event(current_stream, checkpoint.prefetch_event)
+        tensors = checkpoint.prefetched
+        for tensor in tensors:
+            self.backend.record_stream(tensor, current_stream)
+        checkpoint.prefetched = None
+        checkpoint.fetched = True
+        self.pending -= 1
+
+        index = checkpoint.index - 1
+        while index >= 0 and index >= checkpoint.index - self.prefetch_depth:
+            previous = self.checkpoints[index]
+            if not previous.fetched and previous.prefetched is None:
+                self._prefetch(previous)
+            index -= 1
+
+        return tensors
+
+    def reset(self):
+        """Drop all checkpoints and reuse their host memory. Happens on its own
+        once every checkpoint was fetched; call it after forward passes that
+        are not followed by backward, e.g. in evaluation."""
+        # copies still reading the host memory must finish before the next
+        # offload overwrites it
+        self.backend.wait_stream(self.offload_stream, self.prefetch_stream)
+        for arena in self.arenas.values():
+            arena.reset()
+        self.checkpoints = []
+        self.pending = 0
@@ -0,0 +1,164 @@
+'''
+Copyright 2020 The Microsoft DeepSpeed Team
+'''
+
+import os
+import copy
+import threading
+from collections import defaultdict
+from concurrent.futures import ThreadPoolExecutor
+
+import torch
+
+from deepspeed.pt.log_utils import logger
+
+
+class StagingBufferPool(object):
+    """Host buffers that hold tensor snapshots until they are written to disk.
+
+    Buffers are cached by (dtype, shape) so that consecutive checkpoints of the
+    same model reuse them instead of allocating (and pinning) host memory on
+    every save. The total size of cached and in-use buffers is kept under
+    max_bytes: cached buffers are dropped first, then acquire() blocks until
+    in-flight writes release their buffers. A snapshot larger than max_bytes
+    on its own is still allowed once nothing else is in flight, so a too small
+    cap degrades to one checkpoint at a time instead of deadlocking.
+    """
+    def __init__(self, max_bytes, pin_memory=False):
+        self.max_bytes = max_bytes
+        self.pin_memory = pin_memory
+        self.total_bytes = 0
+        self.in_flight_bytes = 0
+        self.cache = defaultdict(list)
+        self.cond = threading.Condition()
+
+    @staticmethod
+    def _nbytes(tensor):
+        return tensor.numel() * tensor.element_size()
+
+    def _evict(self, needed_bytes):
+        for key in list(self.cache.keys()):
+            while self.cache[key] and self.total_bytes + needed_bytes > self.max_bytes:
+                self.total_bytes -= self._nbytes(self.cache[key].pop())
+
+    def acquire(self, tensor):
+        key = (tensor.dtype, tuple(tensor.size()))
+        nbytes = self._nbytes(tensor)
+        with self.cond:
+            if self.cache[key]:
+                return self.cache[key].pop()
+
+            self._evict(nbytes)
+            while (self.total_bytes + nbytes > self.max_bytes
+                   and self.in_flight_bytes > 0):
+                self.cond.wait()
+                if self.cache[key]:
+                    return self.cache[key].pop()
+                self._evict(nbytes)
+            self.total_bytes += nbytes
+
+        return torch.empty(tensor.size(), dtype=tensor.dtype, pin_memory=self.pin_memory)
+
+    def mark_in_flight(self, buffers):
+        with self.cond:
+            self.in_flight_bytes += sum([self._nbytes(b) for b in buffers])
+
+    def release(self, buffers):
+        with self.cond:
+            for b in buffers:
+                self.in_flight_bytes -= self._nbytes(b)
+                self.cache[(b.dtype, tuple(b.size()))].append(b)
+            self.cond.notify_all()
+
+
+class AsyncCheckpointWriter(object):
+    """Writes checkpoints from background threads.
+
+    save() copies every tensor of the state into host staging buffers and
+    returns once the copies are done, so training can keep updating the
+    parameters while the files are serialized. Each file is written to a
+    temporary name, fsync'ed and renamed into place, so a checkpoint is either
+    complete on disk or absent. Files from one or more save() calls are
+    written concurrently by num_threads workers.
+
+    Arguments:
+        max_staging_bytes: upper bound of host memory used for snapshots
+        num_threads: number of files written in parallel
+    """
+    def __init__(self, max_staging_bytes, num_threads=1):
+        self.pool = StagingBufferPool(max_staging_bytes,
+                                      pin_memory=torch.cuda.is_available())
+        self.executor = ThreadPoolExecutor(max_workers=num_threads)
+        self.futures = []
+
+    def _snapshot(self, obj, buffers, memo):
+        if torch.is_tensor(obj):
+            if id(obj) not in memo:
+                buf = self.pool.acquire(obj)
+                buf.copy_(obj.detach(), non_blocking=True)
+                buffers.append(buf)
+                memo[id(obj)] = buf
+            return memo[id(obj)]
+        if isinstance(obj, dict):
+            snapshot = copy.copy(obj)
+            for k, v in obj.items():
+                snapshot[k] = self._snapshot(v, buffers, memo)
+            return snapshot
+        if isinstance(obj, (list, tuple)) and not hasattr(obj, '_fields'):
+            return type(obj)(self._snapshot(v, buffers, memo) for v in obj)
+        return copy.deepcopy(obj)
+
+    def save(self, state, path, save_fn=torch.save):
+        """Snapshot state and write it to path in the background with
+        save_fn(state, file_object)."""
+        buffers = []
+        snapshot = self._snapshot(state, buffers, {})
+        if torch.cuda.is_available():
+            # device to host copies were issued non_blocking
+            torch.cuda.synchronize()
+
+        self.pool.mark_in_flight(buffers)
+        self._prune()
+        self.futures.append(
+            self.executor.submit(self._write,
+                                 snapshot,
+                                 path,
+                                 buffers,
+                                 save_fn))
+
+    def _write(self, snapshot, path, buffers, save_fn):
+        tmp_path = path + '.tmp'
+        try:
+            with open(tmp_path, 'wb') as f:
+                save_fn(snapshot, f)
+                f.flush()
+                os.fsync(f.fileno())
+            os.replace(tmp_path, path)
+
+            # persist the rename itself
+            dir_fd = os.open(os.path.dirname(os.path.abspath(path)), os.O_RDONLY)
+            try:
+                os.fsync(dir_fd)
+            finally:
+                os.close(dir_fd)
+            logger.info('Checkpoint written: {}'.format(path))
+        finally:
+            self.pool.release(buffers)
+
+    def _prune(self):
+        # drop the finished writes, failed ones are kept for wait() to raise
+        self.futures = [
+            f for f in self.futures if not f.done() or f.exception() is not None
+        ]
+
+    def is_complete(self):
+        """True when every checkpoint passed to save() is on disk."""
+        self._prune()
+        return all([f.done() for f in self.futures])
+
+    def wait(self):
+        """Block until every pending checkpoint is on disk. Errors raised by the
+        background writes are re-raised here."""
+        futures, self.futures = self.futures, []
+        for f in futures:
+            f.result()
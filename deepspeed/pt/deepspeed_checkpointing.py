@@ -22,6 +22,10 @@ from torch.cuda import _lazy_call, device as device_ctx_manager
 from deepspeed.pt.deepspeed_timer import SynchronizedWallClockTimer as Timers
 import torch.distributed as dist
 from deepspeed.pt.deepspeed_config import DeepSpeedConfig
+from deepspeed.pt.deepspeed_activation_offload import ActivationOffloader, \
+    CudaOffloadBackend
+from deepspeed.pt.deepspeed_activation_compression import ActivationCompressor, \
+    CompressedTensor, payload_tensors, with_payload_tensors
 from deepspeed.pt.log_utils import logger
 
 #DeepSpeed Checkpointing Enabled or Disabled
@@ -45,9 +49,21 @@ size_offsets = []
 
 timers = None
 
+#Asynchronous CPU checkpointing
+offloader = None
+
+#Checkpoint compression, the index of the next checkpointed layer selects the
+#codec of the compression policy
+compressor = None
+checkpoint_index = 0
+
 #optimization flags
 PARTITION_ACTIVATIONS = False
 PA_TO_CPU = False
+ASYNC_PA_TO_CPU = False
+PREFETCH_DEPTH = 1
+COMPRESSION = 'none'
+CHECKPOINT_LAYERS = None
 CONTIGUOUS_CHECKPOINTING = False
 SYNCHRONIZE = False
 PROFILE_TIME = False
@@ -334,10 +350,15 @@ class CheckpointFunction(torch.autograd.Function):
             timers('forward').start()
 
         ctx.run_function = run_function
+        ctx.offloaded = None
+        ctx.compressed = None
         global num_layers
         global mp_rank, mp_size, mp_group
         global contiguous_data_buffers, contiguous_size_buffers
         global data_offsets, size_offsets
+        global offloader, checkpoint_index
+        ctx.layer = checkpoint_index
+        checkpoint_index += 1
         if mp_rank is None:
             if mpu is not None:
                 mp_rank = mpu.get_model_parallel_rank()
@@ -357,6 +378,10 @@ class CheckpointFunction(torch.autograd.Function):
                 logger.info(
                     f"----Partition Activations {PARTITION_ACTIVATIONS}, CPU CHECKPOINTING {PA_TO_CPU}"
                 )
+                logger.info(
+                    f"----Asynchronous CPU CHECKPOINTING {ASYNC_PA_TO_CPU} with prefetch depth {PREFETCH_DEPTH}"
+                )
+                logger.info(f"----Checkpoint compression {COMPRESSION}")
                 logger.info(
                     f"----contiguous Memory Checkpointing {CONTIGUOUS_CHECKPOINTING} with {num_layers} total layers"
                 )
@@ -371,6 +396,7 @@ class CheckpointFunction(torch.autograd.Function):
             #inputs.append(args[-1])
 
             inputs = []
+            compress = compressor is not None and compressor.codec(ctx.layer) != 'none'
             for i, item in enumerate(args[:-1]):
                 partition_size = get_partition_size(item)
                 partition = item.detach().contiguous().view(-1).narrow(
@@ -378,16 +404,33 @@ class CheckpointFunction(torch.autograd.Function):
                     get_partition_start(item),
                     partition_size).clone()
 
-                if CONTIGUOUS_CHECKPOINTING:
+                if compress:
+                    #compressed checkpoints bypass the contiguous buffers. int8
+                    #is quantized on the GPU before moving to the CPU, lossless
+                    #only encodes host tensors
+                    to_cpu = PA_TO_CPU and not ASYNC_PA_TO_CPU
+                    if to_cpu and compressor.codec(ctx.layer) == 'lossless':
+                        partition = partition.cpu()
+                    stored = [compressor.compress(partition, ctx.layer)]
+                    if to_cpu:
+                        host = [tensor.cpu() for tensor in payload_tensors(stored)]
+                        stored = with_payload_tensors(stored, host)
+                    inputs.append(stored[0])
+                elif PA_TO_CPU and ASYNC_PA_TO_CPU:
+                    #copied to the pinned host arena of the offloader below
+                    inputs.append(partition)
+                elif CONTIGUOUS_CHECKPOINTING:
                     buffer_device = torch.device(
                         'cpu') if PA_TO_CPU else partition.device
 
+                    num_buffers = num_layers if compressor is None \
+                        else compressor.num_uncompressed(num_layers)
                     if i >= len(contiguous_data_buffers):
                         tensor_list = [
                             torch.tensor(()).new_empty([partition_size],
                                                        dtype=partition.dtype,
                                                        device=buffer_device)
-                            for i in range(num_layers)
+                            for i in range(num_buffers)
                         ]
                         contiguous_data_buffers.append(tensor_list)
                         data_offsets.append(0)
@@ -396,7 +439,7 @@ class CheckpointFunction(torch.autograd.Function):
                             torch.tensor(()).new_empty([partition_size],
                                                        dtype=partition.dtype,
                                                        device=buffer_device)
-                            for i in range(num_layers)
+                            for i in range(num_buffers)
                         ]
                         contiguous_data_buffers[i] = tensor_list
                         data_offsets[i] = 0
@@ -409,6 +452,21 @@ class CheckpointFunction(torch.autograd.Function):
                     partition = partition.cpu() if PA_TO_CPU else partition
                     inputs.append(partition)
 
+            if PA_TO_CPU and ASYNC_PA_TO_CPU:
+                if offloader is None:
+                    offloader = ActivationOffloader(CudaOffloadBackend(cuda_device),
+                                                    prefetch_depth=PREFETCH_DEPTH)
+                ctx.offloaded = offloader.offload(payload_tensors(inputs))
+                inputs = with_payload_tensors(inputs, ctx.offloaded.host)
+
+            if compress:
+                ctx.compressed = inputs
+                #the checkpoints are saved as empty placeholders
+                inputs = [
+                    torch.empty(0, dtype=inp.dtype, device=inp.payload[0].device)
+                    if isinstance(inp, CompressedTensor) else inp for inp in inputs
+                ]
+
             inputs.append(args[-1])
 
         #just in case something funky is happening such as reuse of inputs
@@ -515,9 +573,29 @@ class CheckpointFunction(torch.autograd.Function):
         global cuda_device, transport_stream, PARTITION_ACTIVATIONS
 
         if PARTITION_ACTIVATIONS:
+            saved_tensors = ctx.saved_tensors
+            stored = ctx.compressed
+            if ctx.offloaded is not None:
+                #the prefetched device copies replace the host checkpoints,
+                #this also starts prefetching the checkpoints of earlier layers
+                fetched = offloader.fetch(ctx.offloaded)
+                stored = fetched if stored is None else with_payload_tensors(
+                    stored,
+                    fetched)
+            if stored is not None:
+                for item, tensor in zip(saved_tensors[0::2], stored):
+                    item.data = compressor.decompress(tensor).data \
+                        if compressor is not None else tensor.data
+            if PROFILE_TIME and compressor is not None and ctx.layer == 0:
+                #the first layer is recomputed last
+                if dist.get_rank() == 0:
+                    compressor.stats.log(reset=False)
+                compressor.stats.reset()
+
             #with torch.cuda.stream(transport_stream):
-            inputs = get_full_inputs(ctx.saved_tensors,
-                                     device=cuda_device if PA_TO_CPU else None)
+            inputs = get_full_inputs(
+                saved_tensors,
+                device=cuda_device if PA_TO_CPU and ctx.offloaded is None else None)
             detached_inputs = detach_variable(inputs)
         else:
             inputs = ctx.saved_tensors
@@ -563,6 +641,23 @@ def checkpoint(function, *args):
     return CheckpointFunction.apply(function, *args)
 
 
+def checkpoint_layer(layer_id, function, *args):
+    """Checkpoint layer layer_id if it is one of the checkpoint_layers, e.g.
+    of a plan of deepspeed.pt.deepspeed_recompute_planner, else run it
+    keeping its activations. Every layer is checkpointed without a plan."""
+    if CHECKPOINT_LAYERS is None or layer_id in CHECKPOINT_LAYERS:
+        return checkpoint(function, *args)
+    return function(*args)
+
+
+def start_forward():
+    """Starts counting the checkpointed layers of the compression policy from
+    the first one. Call at the start of every forward pass of the model, as
+    DeepSpeedLight.forward does."""
+    global checkpoint_index
+    checkpoint_index = 0
+
+
 def partition_activations_in_checkpoint(partition_activation):
     global PARTITION_ACTIVATIONS
     PARTITION_ACTIVATIONS = partition_activation
@@ -601,10 +696,17 @@ def reset():
         data_offsets = []
         size_offsets = []
 
+    if offloader is not None:
+        offloader.reset()
+
+    global checkpoint_index
+    checkpoint_index = 0
+
 
 def _configure_using_config_file(deepspeed_config):
     global num_layers, PARTITION_ACTIVATIONS, CONTIGUOUS_CHECKPOINTING, \
-            PA_TO_CPU, SYNCHRONIZE, PROFILE_TIME
+            PA_TO_CPU, ASYNC_PA_TO_CPU, PREFETCH_DEPTH, COMPRESSION, \
+            CHECKPOINT_LAYERS, SYNCHRONIZE, PROFILE_TIME
 
     config = DeepSpeedConfig(deepspeed_config).activation_checkpointing_config
     logger.info(config.repr())
@@ -612,21 +714,32 @@ def _configure_using_config_file(deepspeed_config):
     CONTIGUOUS_CHECKPOINTING = config.contiguous_memory_optimization
     num_layers = config.number_checkpoints
     PA_TO_CPU = config.cpu_checkpointing
+    ASYNC_PA_TO_CPU = config.async_cpu_checkpointing
+    PREFETCH_DEPTH = config.prefetch_depth
+    COMPRESSION = config.compression
+    CHECKPOINT_LAYERS = config.checkpoint_layers
     SYNCHRONIZE = config.synchronize_checkpoint_boundary
     PROFILE_TIME = config.profile
 
 
 def _configure_defaults():
 
-    global mpu, num_layers, deepspeed_checkpointing_enabled
+    global mpu, num_layers, deepspeed_checkpointing_enabled, offloader, compressor
 
     global PARTITION_ACTIVATIONS, CONTIGUOUS_CHECKPOINTING, \
-            PA_TO_CPU, SYNCHRONIZE, PROFILE_TIME
+            PA_TO_CPU, ASYNC_PA_TO_CPU, PREFETCH_DEPTH, COMPRESSION, \
+            CHECKPOINT_LAYERS, SYNCHRONIZE, PROFILE_TIME
 
     PARTITION_ACTIVATIONS = False
     CONTIGUOUS_CHECKPOINTING = False
     num_layers = False
     PA_TO_CPU = False
+    ASYNC_PA_TO_CPU = False
+    PREFETCH_DEPTH = 1
+    offloader = None
+    COMPRESSION = 'none'
+    compressor = None
+    CHECKPOINT_LAYERS = None
     SYNCHRONIZE = False
     PROFILE_TIME = False
     deepspeed_checkpointing_enabled = True
@@ -641,6 +754,10 @@ def configure(
     checkpoint_in_cpu=None,
     synchronize=None,
     profile=None,
+    async_checkpoint_in_cpu=None,
+    prefetch_depth=None,
+    compression=None,
+    checkpoint_layers=None,
 ):
     """Configure DeepSpeed Activation Checkpointing.
 
@@ -674,13 +791,34 @@ def configure(
             deepspeed.checkpointing.checkpoint invocation. Will overwrite deepspeed_config
             if provided
 
+        async_checkpoint_in_cpu: Optional: Copies CPU activation checkpoints to a reused
+            pinned host buffer on a separate stream, and prefetches them back during
+            backward. Only works with checkpoint_in_cpu. Default is false. Will overwrite
+            deepspeed_config if provided
+
+        prefetch_depth: Optional: Number of layers whose CPU checkpoints are copied back
+            ahead of their recomputation with async_checkpoint_in_cpu. By default 1. Will
+            overwrite deepspeed_config if provided
+
+        compression: Optional: Codec of the partitioned activation checkpoints, 'none',
+            'int8' or 'lossless', or a list with the codec of every checkpointed layer
+            in forward order, counted from start_forward. Only works with
+            partition_activations, 'lossless' only with checkpoint_in_cpu and without
+            async_checkpoint_in_cpu. By default 'none'. Will overwrite deepspeed_config
+            if provided
+
+        checkpoint_layers: Optional: Indices of the layers checkpoint_layer checkpoints,
+            e.g. of a plan of deepspeed.pt.deepspeed_recompute_planner. By default None,
+            which checkpoints every layer. Will overwrite deepspeed_config if provided
+
     Returns:
         None
     """
-    global mpu, num_layers, deepspeed_checkpointing_enabled
+    global mpu, num_layers, deepspeed_checkpointing_enabled, compressor
 
     global PARTITION_ACTIVATIONS, CONTIGUOUS_CHECKPOINTING, \
-            PA_TO_CPU, SYNCHRONIZE, PROFILE_TIME
+            PA_TO_CPU, ASYNC_PA_TO_CPU, PREFETCH_DEPTH, COMPRESSION, \
+            CHECKPOINT_LAYERS, SYNCHRONIZE, PROFILE_TIME
 
     _configure_defaults()
 
@@ -708,10 +846,30 @@ def configure(
     if profile is not None:
         PROFILE_TIME = profile
 
+    if async_checkpoint_in_cpu is not None:
+        ASYNC_PA_TO_CPU = async_checkpoint_in_cpu
+
+    if prefetch_depth is not None:
+        PREFETCH_DEPTH = prefetch_depth
+
+    if compression is not None:
+        COMPRESSION = compression
+
+    if checkpoint_layers is not None:
+        CHECKPOINT_LAYERS = checkpoint_layers
+
     if PA_TO_CPU or CONTIGUOUS_CHECKPOINTING:
         assert PARTITION_ACTIVATIONS, "CPU Checkpointing/Contiguous Checkpointing is only availble with partitioned activations. Set partitioned activations to true in deepspeed config"
+    if ASYNC_PA_TO_CPU:
+        assert PA_TO_CPU, "Asynchronous CPU Checkpointing is only available with CPU checkpointing. Set cpu checkpointing to true in deepspeed config"
     if CONTIGUOUS_CHECKPOINTING:
         assert num_layers is not None, "Must specify the number of layers with contiguous memory checkpointing"
+    if COMPRESSION != 'none':
+        assert PARTITION_ACTIVATIONS, "Checkpoint compression is only available with partitioned activations. Set partitioned activations to true in deepspeed config"
+        codecs = [COMPRESSION] if isinstance(COMPRESSION, str) else COMPRESSION
+        if 'lossless' in codecs:
+            assert PA_TO_CPU and not ASYNC_PA_TO_CPU, "Lossless checkpoint compression is only available with synchronous CPU checkpointing. Set cpu checkpointing to true and asynchronous cpu checkpointing to false in deepspeed config"
+        compressor = ActivationCompressor(COMPRESSION, synchronize=PROFILE_TIME)
 
 
 def is_configured():
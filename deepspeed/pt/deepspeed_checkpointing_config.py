@@ -18,6 +18,10 @@ Activation Checkpointing should be configured as:
     "number_checkpoints": 100,
     "contiguous_memory_optimization": [true|false],
     "cpu_checkpointing": [true|false]
+    "async_cpu_checkpointing": [true|false],
+    "prefetch_depth": 1,
+    "compression": ["none"|"int8"|"lossless"|list of them, one per layer],
+    "checkpoint_layers": [null|list of layer indices],
     "profile": [true|false],
     "synchronize_checkpoint_boundary": [true|false],
     }
@@ -42,6 +46,18 @@ ACT_CHKPT_PROFILE_DEFAULT = False
 ACT_CHKPT_CPU_CHECKPOINTING = 'cpu_checkpointing'
 ACT_CHKPT_CPU_CHECKPOINTING_DEFAULT = False
 
+ACT_CHKPT_ASYNC_CPU_CHECKPOINTING = 'async_cpu_checkpointing'
+ACT_CHKPT_ASYNC_CPU_CHECKPOINTING_DEFAULT = False
+
+ACT_CHKPT_PREFETCH_DEPTH = 'prefetch_depth'
+ACT_CHKPT_PREFETCH_DEPTH_DEFAULT = 1
+
+ACT_CHKPT_COMPRESSION = 'compression'
+ACT_CHKPT_COMPRESSION_DEFAULT = 'none'
+
+ACT_CHKPT_CHECKPOINT_LAYERS = 'checkpoint_layers'
+ACT_CHKPT_CHECKPOINT_LAYERS_DEFAULT = None
+
 ACT_CHKPT = 'activation_checkpointing'
 
 ACT_CHKPT_DEFAULT = {
@@ -52,7 +68,11 @@ ACT_CHKPT_DEFAULT = {
     ACT_CHKPT_SYNCHRONIZE_CHECKPOINT_BOUNDARY:
     ACT_CHKPT_SYNCHRONIZE_CHECKPOINT_BOUNDARY_DEFAULT,
     ACT_CHKPT_PROFILE: ACT_CHKPT_PROFILE_DEFAULT,
-    ACT_CHKPT_CPU_CHECKPOINTING: ACT_CHKPT_CPU_CHECKPOINTING_DEFAULT
+    ACT_CHKPT_CPU_CHECKPOINTING: ACT_CHKPT_CPU_CHECKPOINTING_DEFAULT,
+    ACT_CHKPT_ASYNC_CPU_CHECKPOINTING: ACT_CHKPT_ASYNC_CPU_CHECKPOINTING_DEFAULT,
+    ACT_CHKPT_PREFETCH_DEPTH: ACT_CHKPT_PREFETCH_DEPTH_DEFAULT,
+    ACT_CHKPT_COMPRESSION: ACT_CHKPT_COMPRESSION_DEFAULT,
+    ACT_CHKPT_CHECKPOINT_LAYERS: ACT_CHKPT_CHECKPOINT_LAYERS_DEFAULT
 }
 
 
@@ -63,6 +83,10 @@ class DeepSpeedActivationCheckpointingConfig(object):
         self.partition_activations = None
         self.contiguous_memory_optimization = None
         self.cpu_checkpointing = None
+        self.async_cpu_checkpointing = None
+        self.prefetch_depth = None
+        self.compression = None
+        self.checkpoint_layers = None
         self.number_checkpoints = None
         self.synchronize_checkpoint_boundary = None
         self.profile = None
@@ -96,6 +120,23 @@ class DeepSpeedActivationCheckpointingConfig(object):
                                                   ACT_CHKPT_CPU_CHECKPOINTING,
                                                   ACT_CHKPT_CPU_CHECKPOINTING_DEFAULT)
 
+        self.async_cpu_checkpointing = get_scalar_param(
+            act_chkpt_config_dict,
+            ACT_CHKPT_ASYNC_CPU_CHECKPOINTING,
+            ACT_CHKPT_ASYNC_CPU_CHECKPOINTING_DEFAULT)
+
+        self.prefetch_depth = get_scalar_param(act_chkpt_config_dict,
+                                               ACT_CHKPT_PREFETCH_DEPTH,
+                                               ACT_CHKPT_PREFETCH_DEPTH_DEFAULT)
+
+        self.compression = get_scalar_param(act_chkpt_config_dict,
+                                            ACT_CHKPT_COMPRESSION,
+                                            ACT_CHKPT_COMPRESSION_DEFAULT)
+
+        self.checkpoint_layers = get_scalar_param(act_chkpt_config_dict,
+                                                  ACT_CHKPT_CHECKPOINT_LAYERS,
+                                                  ACT_CHKPT_CHECKPOINT_LAYERS_DEFAULT)
+
         self.number_checkpoints = get_scalar_param(act_chkpt_config_dict,
                                                    ACT_CHKPT_NUMBER_CHECKPOINTS,
                                                    ACT_CHKPT_NUMBER_CHECKPOINTS_DEFAULT)
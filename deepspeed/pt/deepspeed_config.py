@@ -25,6 +25,24 @@ def get_fp16_enabled(param_dict):
         return False
 
 
+def get_bfloat16_enabled(param_dict):
+    if BFLOAT16 in param_dict.keys():
+        return get_scalar_param(param_dict[BFLOAT16],
+                                BFLOAT16_ENABLED,
+                                BFLOAT16_ENABLED_DEFAULT)
+    else:
+        return False
+
+
+def get_fp16_lazy_overflow(param_dict):
+    if get_fp16_enabled(param_dict):
+        return get_scalar_param(param_dict[FP16],
+                                FP16_LAZY_OVERFLOW,
+                                FP16_LAZY_OVERFLOW_DEFAULT)
+    else:
+        return FP16_LAZY_OVERFLOW_DEFAULT
+
+
 def get_loss_scale(param_dict):
     if get_fp16_enabled(param_dict):
         return get_scalar_param(param_dict[FP16],
@@ -243,6 +261,194 @@ def get_tensorboard_job_name(param_dict):
         return TENSORBOARD_JOB_NAME_DEFAULT
 
 
+def get_checkpoint_file_format(param_dict):
+    if CHECKPOINT in param_dict.keys():
+        file_format = get_scalar_param(param_dict[CHECKPOINT],
+                                       CHECKPOINT_FILE_FORMAT,
+                                       CHECKPOINT_FILE_FORMAT_DEFAULT)
+        assert file_format in [CHECKPOINT_FILE_FORMAT_TORCH,
+                               CHECKPOINT_FILE_FORMAT_FLAT], \
+            'Unknown checkpoint format {}'.format(file_format)
+        return file_format
+    else:
+        return CHECKPOINT_FILE_FORMAT_DEFAULT
+
+
+def get_checkpoint_async_save(param_dict):
+    if CHECKPOINT in param_dict.keys():
+        return get_scalar_param(param_dict[CHECKPOINT],
+                                CHECKPOINT_ASYNC_SAVE,
+                                CHECKPOINT_ASYNC_SAVE_DEFAULT)
+    else:
+        return CHECKPOINT_ASYNC_SAVE_DEFAULT
+
+
+def get_checkpoint_max_staging_mb(param_dict):
+    if CHECKPOINT in param_dict.keys():
+        return get_scalar_param(param_dict[CHECKPOINT],
+                                CHECKPOINT_MAX_STAGING_MB,
+                                CHECKPOINT_MAX_STAGING_MB_DEFAULT)
+    else:
+        return CHECKPOINT_MAX_STAGING_MB_DEFAULT
+
+
+def get_checkpoint_writer_threads(param_dict):
+    if CHECKPOINT in param_dict.keys():
+        return get_scalar_param(param_dict[CHECKPOINT],
+                                CHECKPOINT_WRITER_THREADS,
+                                CHECKPOINT_WRITER_THREADS_DEFAULT)
+    else:
+        return CHECKPOINT_WRITER_THREADS_DEFAULT
+
+
+def get_data_loader_prefetch_depth(param_dict):
+    if DATA_LOADER in param_dict.keys():
+        return get_scalar_param(param_dict[DATA_LOADER],
+                                DATA_LOADER_PREFETCH_DEPTH,
+                                DATA_LOADER_PREFETCH_DEPTH_DEFAULT)
+    else:
+        return DATA_LOADER_PREFETCH_DEPTH_DEFAULT
+
+
+def get_data_loader_copy_to_device(param_dict):
+    if DATA_LOADER in param_dict.keys():
+        return get_scalar_param(param_dict[DATA_LOADER],
+                                DATA_LOADER_COPY_TO_DEVICE,
+                                DATA_LOADER_COPY_TO_DEVICE_DEFAULT)
+    else:
+        return DATA_LOADER_COPY_TO_DEVICE_DEFAULT
+
+
+def get_data_loader_length_bucketing(param_dict):
+    if DATA_LOADER in param_dict.keys():
+        return get_scalar_param(param_dict[DATA_LOADER],
+                                DATA_LOADER_LENGTH_BUCKETING,
+                                DATA_LOADER_LENGTH_BUCKETING_DEFAULT)
+    else:
+        return DATA_LOADER_LENGTH_BUCKETING_DEFAULT
+
+
+def get_data_loader_bucket_size_multiplier(param_dict):
+    if DATA_LOADER in param_dict.keys():
+        return get_scalar_param(param_dict[DATA_LOADER],
+                                DATA_LOADER_BUCKET_SIZE_MULTIPLIER,
+                                DATA_LOADER_BUCKET_SIZE_MULTIPLIER_DEFAULT)
+    else:
+        return DATA_LOADER_BUCKET_SIZE_MULTIPLIER_DEFAULT
+
+
+def get_telemetry_enabled(param_dict):
+    if TELEMETRY in param_dict.keys():
+        return get_scalar_param(param_dict[TELEMETRY],
+                                TELEMETRY_ENABLED,
+                                TELEMETRY_ENABLED_DEFAULT)
+    else:
+        return False
+
+
+def get_telemetry_output_path(param_dict):
+    if TELEMETRY in param_dict.keys():
+        return get_scalar_param(param_dict[TELEMETRY],
+                                TELEMETRY_OUTPUT_PATH,
+                                TELEMETRY_OUTPUT_PATH_DEFAULT)
+    else:
+        return TELEMETRY_OUTPUT_PATH_DEFAULT
+
+
+def get_telemetry_file_format(param_dict):
+    if TELEMETRY in param_dict.keys():
+        file_format = get_scalar_param(param_dict[TELEMETRY],
+                                       TELEMETRY_FILE_FORMAT,
+                                       TELEMETRY_FILE_FORMAT_DEFAULT)
+        assert file_format in [TELEMETRY_FILE_FORMAT_JSONL,
+                               TELEMETRY_FILE_FORMAT_PROMETHEUS], \
+            'Unknown telemetry format {}'.format(file_format)
+        return file_format
+    else:
+        return TELEMETRY_FILE_FORMAT_DEFAULT
+
+
+def get_telemetry_interval_steps(param_dict):
+    if TELEMETRY in param_dict.keys():
+        return get_scalar_param(param_dict[TELEMETRY],
+                                TELEMETRY_INTERVAL_STEPS,
+                                TELEMETRY_INTERVAL_STEPS_DEFAULT)
+    else:
+        return TELEMETRY_INTERVAL_STEPS_DEFAULT
+
+
+def get_telemetry_flush_steps(param_dict):
+    if TELEMETRY in param_dict.keys():
+        return get_scalar_param(param_dict[TELEMETRY],
+                                TELEMETRY_FLUSH_STEPS,
+                                TELEMETRY_FLUSH_STEPS_DEFAULT)
+    else:
+        return TELEMETRY_FLUSH_STEPS_DEFAULT
+
+
+def get_telemetry_max_overhead(param_dict):
+    if TELEMETRY in param_dict.keys():
+        return get_scalar_param(param_dict[TELEMETRY],
+                                TELEMETRY_MAX_OVERHEAD,
+                                TELEMETRY_MAX_OVERHEAD_DEFAULT)
+    else:
+        return TELEMETRY_MAX_OVERHEAD_DEFAULT
+
+
+def get_telemetry_flops_per_sample(param_dict):
+    if TELEMETRY in param_dict.keys():
+        return get_scalar_param(param_dict[TELEMETRY],
+                                TELEMETRY_FLOPS_PER_SAMPLE,
+                                TELEMETRY_FLOPS_PER_SAMPLE_DEFAULT)
+    else:
+        return TELEMETRY_FLOPS_PER_SAMPLE_DEFAULT
+
+
+def get_telemetry_reset_device_peak(param_dict):
+    if TELEMETRY in param_dict.keys():
+        return get_scalar_param(param_dict[TELEMETRY],
+                                TELEMETRY_RESET_DEVICE_PEAK,
+                                TELEMETRY_RESET_DEVICE_PEAK_DEFAULT)
+    else:
+        return TELEMETRY_RESET_DEVICE_PEAK_DEFAULT
+
+
+def get_flops_profiler_enabled(param_dict):
+    if FLOPS_PROFILER in param_dict.keys():
+        return get_scalar_param(param_dict[FLOPS_PROFILER],
+                                FLOPS_PROFILER_ENABLED,
+                                FLOPS_PROFILER_ENABLED_DEFAULT)
+    else:
+        return False
+
+
+def get_flops_profiler_profile_step(param_dict):
+    if FLOPS_PROFILER in param_dict.keys():
+        return get_scalar_param(param_dict[FLOPS_PROFILER],
+                                FLOPS_PROFILER_PROFILE_STEP,
+                                FLOPS_PROFILER_PROFILE_STEP_DEFAULT)
+    else:
+        return FLOPS_PROFILER_PROFILE_STEP_DEFAULT
+
+
+def get_flops_profiler_module_depth(param_dict):
+    if FLOPS_PROFILER in param_dict.keys():
+        return get_scalar_param(param_dict[FLOPS_PROFILER],
+                                FLOPS_PROFILER_MODULE_DEPTH,
+                                FLOPS_PROFILER_MODULE_DEPTH_DEFAULT)
+    else:
+        return FLOPS_PROFILER_MODULE_DEPTH_DEFAULT
+
+
+def get_flops_profiler_top_modules(param_dict):
+    if FLOPS_PROFILER in param_dict.keys():
+        return get_scalar_param(param_dict[FLOPS_PROFILER],
+                                FLOPS_PROFILER_TOP_MODULES,
+                                FLOPS_PROFILER_TOP_MODULES_DEFAULT)
+    else:
+        return FLOPS_PROFILER_TOP_MODULES_DEFAULT
+
+
 '''Write deepspeed config files by modifying basic templates.
 Can be used for quicly changing parameters via command line parameters.'''
 
@@ -318,6 +524,8 @@ class DeepSpeedConfig(object):
         self.loss_scale = get_loss_scale(param_dict)
         self.initial_dynamic_scale = get_initial_dynamic_scale(param_dict)
         self.dynamic_loss_scale_args = get_dynamic_loss_scale_args(param_dict)
+        self.fp16_lazy_overflow = get_fp16_lazy_overflow(param_dict)
+        self.bfloat16_enabled = get_bfloat16_enabled(param_dict)
 
         self.optimizer_name = get_optimizer_name(param_dict)
         if self.optimizer_name is not None and \
@@ -339,6 +547,31 @@ class DeepSpeedConfig(object):
         self.tensorboard_output_path = get_tensorboard_output_path(param_dict)
         self.tensorboard_job_name = get_tensorboard_job_name(param_dict)
 
+        self.checkpoint_file_format = get_checkpoint_file_format(param_dict)
+        self.checkpoint_async_save = get_checkpoint_async_save(param_dict)
+        self.checkpoint_max_staging_mb = get_checkpoint_max_staging_mb(param_dict)
+        self.checkpoint_writer_threads = get_checkpoint_writer_threads(param_dict)
+
+        self.data_loader_prefetch_depth = get_data_loader_prefetch_depth(param_dict)
+        self.data_loader_copy_to_device = get_data_loader_copy_to_device(param_dict)
+        self.data_loader_length_bucketing = get_data_loader_length_bucketing(param_dict)
+        self.data_loader_bucket_size_multiplier = \
+            get_data_loader_bucket_size_multiplier(param_dict)
+
+        self.telemetry_enabled = get_telemetry_enabled(param_dict)
+        self.telemetry_output_path = get_telemetry_output_path(param_dict)
+        self.telemetry_file_format = get_telemetry_file_format(param_dict)
+        self.telemetry_interval_steps = get_telemetry_interval_steps(param_dict)
+        self.telemetry_flush_steps = get_telemetry_flush_steps(param_dict)
+        self.telemetry_max_overhead = get_telemetry_max_overhead(param_dict)
+        self.telemetry_flops_per_sample = get_telemetry_flops_per_sample(param_dict)
+        self.telemetry_reset_device_peak = get_telemetry_reset_device_peak(param_dict)
+
+        self.flops_profiler_enabled = get_flops_profiler_enabled(param_dict)
+        self.flops_profiler_profile_step = get_flops_profiler_profile_step(param_dict)
+        self.flops_profiler_module_depth = get_flops_profiler_module_depth(param_dict)
+        self.flops_profiler_top_modules = get_flops_profiler_top_modules(param_dict)
+
     def _batch_assertion(self):
 
         train_batch = self.train_batch_size
@@ -439,6 +672,10 @@ class DeepSpeedConfig(object):
             assert self.fp16_enabled, "DeepSpeedConfig: ZeRO is only supported if fp16 is enabled"
             assert self.zero_optimization_stage <= MAX_STAGE_ZERO_OPTIMIZATION, "DeepSpeedConfig: Maximum supported ZeRO stage is {}".format(MAX_STAGE_ZERO_OPTIMIZATION)
 
+        if self.bfloat16_enabled:
+            assert not self.fp16_enabled, "DeepSpeedConfig: fp16 and bf16 cannot both be enabled"
+            assert hasattr(torch, 'bfloat16'), "DeepSpeedConfig: bf16 requires a torch with bfloat16 support"
+
         assert self.train_micro_batch_size_per_gpu, "DeepSpeedConfig: {} is not defined".format(TRAIN_MICRO_BATCH_SIZE_PER_GPU)
 
         assert self.gradient_accumulation_steps, 'DeepSpeedConfig: {} is not defined'.format(
@@ -89,7 +89,8 @@ FP16 parameters should be of the format:
   "initial_scale_power": 32,
   "loss_scale_window": 1000,
   "hysteresis": 2,
-  "min_loss_scale": 1
+  "min_loss_scale": 1,
+  "lazy_overflow": false
 }
 '''
 FP16 = "fp16"
@@ -117,6 +118,26 @@ FP16_HYSTERESIS_DEFAULT = 2
 FP16_MIN_LOSS_SCALE = "min_loss_scale"
 FP16_MIN_LOSS_SCALE_DEFAULT = 1
 
+# FP16 overflow checked on the device, the loss scale updated one step later
+FP16_LAZY_OVERFLOW = "lazy_overflow"
+FP16_LAZY_OVERFLOW_DEFAULT = False
+
+#########################################
+# BFLOAT16 support
+#########################################
+# BFLOAT16 feature. By default, this feature is not enabled.
+# Users can configure in ds_config.json as below example:
+BFLOAT16_FORMAT = '''
+BFLOAT16 parameters should be of the format:
+"bf16": {
+  "enabled": true
+}
+'''
+BFLOAT16 = "bf16"
+
+BFLOAT16_ENABLED = "enabled"
+BFLOAT16_ENABLED_DEFAULT = False
+
 #########################################
 # Gradient clipping
 #########################################
@@ -266,3 +287,161 @@ TENSORBOARD_OUTPUT_PATH_DEFAULT = ""
 # Tensorboard job name
 TENSORBOARD_JOB_NAME = "job_name"
 TENSORBOARD_JOB_NAME_DEFAULT = "DeepSpeedJobName"
+
+#########################################
+# Checkpoint saving
+#########################################
+# Checkpoint saving. By default, checkpoints are written synchronously.
+# Users can configure in ds_config.json as below example:
+CHECKPOINT_FORMAT = '''
+Checkpoint saving can be specified as:
+"checkpoint": {
+  "format": "flat",
+  "async_save": true,
+  "max_staging_mb": 8192,
+  "writer_threads": 2
+}
+'''
+CHECKPOINT = "checkpoint"
+
+# File format of saved checkpoints, loading detects either format
+CHECKPOINT_FILE_FORMAT = "format"
+CHECKPOINT_FILE_FORMAT_TORCH = "torch"
+CHECKPOINT_FILE_FORMAT_FLAT = "flat"
+CHECKPOINT_FILE_FORMAT_DEFAULT = CHECKPOINT_FILE_FORMAT_TORCH
+
+# Write checkpoints from background threads
+CHECKPOINT_ASYNC_SAVE = "async_save"
+CHECKPOINT_ASYNC_SAVE_DEFAULT = False
+
+# Host memory used to stage asynchronous checkpoints
+CHECKPOINT_MAX_STAGING_MB = "max_staging_mb"
+CHECKPOINT_MAX_STAGING_MB_DEFAULT = 4096
+
+# Number of checkpoint files written in parallel
+CHECKPOINT_WRITER_THREADS = "writer_threads"
+CHECKPOINT_WRITER_THREADS_DEFAULT = 2
+
+#########################################
+# Data loader
+#########################################
+# Training data loader. By default, batches are collated by the DataLoader
+# workers and fetched when the training loop asks for them.
+# Users can configure in ds_config.json as below example:
+DATA_LOADER_FORMAT = '''
+The data loader can be specified as:
+"data_loader": {
+  "prefetch_depth": 2,
+  "copy_to_device": true,
+  "length_bucketing": true,
+  "bucket_size_multiplier": 100
+}
+'''
+DATA_LOADER = "data_loader"
+
+# Number of batches prepared ahead by a background thread, 0 disables it
+DATA_LOADER_PREFETCH_DEPTH = "prefetch_depth"
+DATA_LOADER_PREFETCH_DEPTH_DEFAULT = 0
+
+# Copy prefetched batches to the device of the engine
+DATA_LOADER_COPY_TO_DEVICE = "copy_to_device"
+DATA_LOADER_COPY_TO_DEVICE_DEFAULT = False
+
+# Batch training samples of similar length, needs a dataset with sizes
+DATA_LOADER_LENGTH_BUCKETING = "length_bucketing"
+DATA_LOADER_LENGTH_BUCKETING_DEFAULT = False
+
+# Number of global batches sorted by length together
+DATA_LOADER_BUCKET_SIZE_MULTIPLIER = "bucket_size_multiplier"
+DATA_LOADER_BUCKET_SIZE_MULTIPLIER_DEFAULT = 100
+
+#########################################
+# Telemetry
+#########################################
+# Per step performance records. By default, this feature is not enabled.
+# Users can configure in ds_config.json as below example:
+TELEMETRY_FORMAT = '''
+Telemetry can be specified as:
+"telemetry": {
+  "enabled": true,
+  "output_path": "/var/lib/node_exporter/deepspeed_{rank}.prom",
+  "format": "prometheus",
+  "interval_steps": 1,
+  "flush_steps": 10,
+  "max_overhead": 0.01,
+  "flops_per_sample": 0,
+  "reset_device_peak": false
+}
+'''
+TELEMETRY = "telemetry"
+
+# Telemetry enable signal
+TELEMETRY_ENABLED = "enabled"
+TELEMETRY_ENABLED_DEFAULT = False
+
+# File of the records, every rank writes its own if it has a {rank} field,
+# otherwise only rank 0 writes
+TELEMETRY_OUTPUT_PATH = "output_path"
+TELEMETRY_OUTPUT_PATH_DEFAULT = "deepspeed_telemetry.jsonl"
+
+# Format of the file
+TELEMETRY_FILE_FORMAT = "format"
+TELEMETRY_FILE_FORMAT_JSONL = "jsonl"
+TELEMETRY_FILE_FORMAT_PROMETHEUS = "prometheus"
+TELEMETRY_FILE_FORMAT_DEFAULT = TELEMETRY_FILE_FORMAT_JSONL
+
+# Record every so many training steps
+TELEMETRY_INTERVAL_STEPS = "interval_steps"
+TELEMETRY_INTERVAL_STEPS_DEFAULT = 1
+
+# Records buffered before they are written
+TELEMETRY_FLUSH_STEPS = "flush_steps"
+TELEMETRY_FLUSH_STEPS_DEFAULT = 10
+
+# Fraction of the step time recording may take before steps are recorded less
+# often
+TELEMETRY_MAX_OVERHEAD = "max_overhead"
+TELEMETRY_MAX_OVERHEAD_DEFAULT = 0.01
+
+# Training flops of a sample for the TFLOPs, 0 derives them from the
+# DeepSpeedTransformerLayer modules of the model
+TELEMETRY_FLOPS_PER_SAMPLE = "flops_per_sample"
+TELEMETRY_FLOPS_PER_SAMPLE_DEFAULT = 0
+
+# Reset the peak memory counters of the device at every record, so the peaks
+# are the ones since the previous record. The counters are shared with the
+# memory breakdown of the timers and see_memory_usage.
+TELEMETRY_RESET_DEVICE_PEAK = "reset_device_peak"
+TELEMETRY_RESET_DEVICE_PEAK_DEFAULT = False
+
+#########################################
+# Flops profiler
+#########################################
+# Flops profiler. By default, this feature is not enabled.
+# Users can configure in ds_config.json as below example:
+FLOPS_PROFILER_FORMAT = '''
+The flops profiler can be specified as:
+"flops_profiler": {
+  "enabled": true,
+  "profile_step": 1,
+  "module_depth": -1,
+  "top_modules": 3
+}
+'''
+FLOPS_PROFILER = "flops_profiler"
+
+# Flops profiler enable signal
+FLOPS_PROFILER_ENABLED = "enabled"
+FLOPS_PROFILER_ENABLED_DEFAULT = False
+
+# Training step whose first forward and backward are profiled
+FLOPS_PROFILER_PROFILE_STEP = "profile_step"
+FLOPS_PROFILER_PROFILE_STEP_DEFAULT = 1
+
+# Levels of modules printed, -1 for all of them
+FLOPS_PROFILER_MODULE_DEPTH = "module_depth"
+FLOPS_PROFILER_MODULE_DEPTH_DEFAULT = -1
+
+# Children with the most latency printed for every module
+FLOPS_PROFILER_TOP_MODULES = "top_modules"
+FLOPS_PROFILER_TOP_MODULES_DEFAULT = 3
@@ -0,0 +1,261 @@
+"""
+Copyright 2020 The Microsoft DeepSpeed Team
+
+CPU and NUMA placement of the local ranks started by deepspeed_launch.
+
+The topology is read from sysfs: the cpus of every NUMA node, the
+hyperthreads sharing a physical core and the NUMA node of every GPU. The
+physical cores the launcher may use are split evenly across the local ranks:
+  - when the NUMA nodes of the GPUs are known, each node hosts the ranks of
+    its GPUs, which split its cores
+  - otherwise, with at least as many ranks as nodes, each node hosts an equal
+    share of the ranks, which split its cores
+  - with fewer ranks, each rank gets an equal share of whole nodes
+Every rank gets the same number of cores, leftover cores stay unused.
+
+A rank is bound to the hyperthreads of its cores and allocates memory from
+its nodes only, and its OpenMP and intra-op thread pools get one thread per
+physical core.
+"""
+
+import ctypes
+import os
+import platform
+
+SYSFS_CPU = 'devices/system/cpu'
+SYSFS_NODE = 'devices/system/node'
+SYSFS_PCI = 'bus/pci/devices'
+
+# PCI vendor of the GPUs and classes of VGA and 3D controllers
+GPU_PCI_VENDOR = '0x10de'
+GPU_PCI_CLASSES = ['0x0300', '0x0302']
+
+# set_mempolicy(2)
+MPOL_BIND = 2
+SET_MEMPOLICY_SYSCALL = {'x86_64': 238, 'aarch64': 237, 'ppc64le': 261}
+
+THREAD_ENVS = ['OMP_NUM_THREADS', 'MKL_NUM_THREADS']
+
+
+def parse_cpulist(cpulist):
+    """Cpus of a sysfs cpu list, e.g. 0-3,8,10-11."""
+    cpus = []
+    for chunk in cpulist.strip().split(','):
+        if not chunk:
+            continue
+        if '-' in chunk:
+            first, last = chunk.split('-')
+            cpus.extend(range(int(first), int(last) + 1))
+        else:
+            cpus.append(int(chunk))
+    return cpus
+
+
+def format_cpulist(cpus):
+    """Inverse of parse_cpulist."""
+    ranges = []
+    for cpu in sorted(cpus):
+        if ranges and ranges[-1][1] == cpu - 1:
+            ranges[-1][1] = cpu
+        else:
+            ranges.append([cpu, cpu])
+    return ','.join(str(first) if first == last else '{}-{}'.format(first,
+                                                                     last)
+                    for first, last in ranges)
+
+
+def _read(path):
+    with open(path, 'r') as fd:
+        return fd.read()
+
+
+class CpuTopology(object):
+    """Physical cores of every NUMA node, each a list of its hyperthreads.
+
+    Arguments:
+        nodes: dict from NUMA node to its list of cores
+    """
+    def __init__(self, nodes):
+        self.nodes = nodes
+
+    @classmethod
+    def read(cls, sysfs='/sys', allowed_cpus=None):
+        """Topology of the cpus in allowed_cpus, by default the affinity of
+        this process, e.g. limited by taskset or a container."""
+        if allowed_cpus is None:
+            allowed_cpus = os.sched_getaffinity(0)
+        allowed_cpus = set(allowed_cpus)
+
+        node_dir = os.path.join(sysfs, SYSFS_NODE)
+        node_cpus = {}
+        if os.path.isdir(node_dir):
+            for name in os.listdir(node_dir):
+                if name.startswith('node') and name[4:].isdigit():
+                    cpulist = _read(os.path.join(node_dir, name, 'cpulist'))
+                    node_cpus[int(name[4:])] = parse_cpulist(cpulist)
+        if not node_cpus:
+            # kernels without NUMA support
+            online = _read(os.path.join(sysfs, SYSFS_CPU, 'online'))
+            node_cpus[0] = parse_cpulist(online)
+
+        nodes = {}
+        for node, cpus in sorted(node_cpus.items()):
+            cores = {}
+            for cpu in cpus:
+                if cpu not in allowed_cpus:
+                    continue
+                siblings = os.path.join(sysfs,
+                                        SYSFS_CPU,
+                                        'cpu{}'.format(cpu),
+                                        'topology',
+                                        'thread_siblings_list')
+                core = min(parse_cpulist(_read(siblings))) \
+                    if os.path.isfile(siblings) else cpu
+                cores.setdefault(core, []).append(cpu)
+            if cores:
+                nodes[node] = [cores[core] for core in sorted(cores)]
+        return cls(nodes)
+
+    def num_cores(self):
+        return sum(len(cores) for cores in self.nodes.values())
+
+
+def gpu_numa_nodes(sysfs='/sys'):
+    """NUMA node of every GPU of the host, in PCI bus order like the GPU
+    indices of nvidia-smi, -1 where the kernel does not know it."""
+    pci_dir = os.path.join(sysfs, SYSFS_PCI)
+    if not os.path.isdir(pci_dir):
+        return []
+    nodes = []
+    for address in sorted(os.listdir(pci_dir)):
+        device = os.path.join(pci_dir, address)
+        try:
+            vendor = _read(os.path.join(device, 'vendor')).strip()
+            device_class = _read(os.path.join(device, 'class')).strip()
+            node = int(_read(os.path.join(device, 'numa_node')))
+        except (IOError, ValueError):
+            continue
+        if vendor == GPU_PCI_VENDOR and device_class[:6] in GPU_PCI_CLASSES:
+            nodes.append(node)
+    return nodes
+
+
+def local_gpu_nodes(gpu_ids, sysfs='/sys'):
+    """NUMA nodes of the GPUs of the local ranks, or None if any is unknown."""
+    nodes = gpu_numa_nodes(sysfs)
+    if not all(0 <= gpu_id < len(nodes) and nodes[gpu_id] >= 0 for gpu_id in gpu_ids):
+        return None
+    return [nodes[gpu_id] for gpu_id in gpu_ids]
+
+
+class RankPlacement(object):
+    """Cpus and NUMA nodes of a rank, and the threads its pools should use."""
+    def __init__(self, cpus, numa_nodes, num_threads):
+        self.cpus = cpus
+        self.numa_nodes = numa_nodes
+        self.num_threads = num_threads
+
+    def __repr__(self):
+        return 'cpus {} on NUMA nodes {}, {} threads'.format(
+            format_cpulist(self.cpus),
+            format_cpulist(self.numa_nodes),
+            self.num_threads)
+
+
+def _split_node_cores(topology, node_ids, ranks_of_node, num_ranks):
+    rank_cores = [None] * num_ranks
+    for node, ranks in zip(node_ids, ranks_of_node):
+        if not ranks:
+            continue
+        cores = topology.nodes[node]
+        share = len(cores) // len(ranks)
+        for index, rank in enumerate(ranks):
+            rank_cores[rank] = cores[index * share:(index + 1) * share]
+    return rank_cores
+
+
+def partition(topology, num_ranks, gpu_nodes=None):
+    """RankPlacements of num_ranks local ranks, or None if there are fewer
+    cores than ranks.
+
+    Arguments:
+        topology: The CpuTopology of the host
+
+        num_ranks: The number of local ranks
+
+        gpu_nodes: Optional: The NUMA node of the GPU of every rank, see
+            local_gpu_nodes. Ignored if a node has none of the allowed cpus.
+    """
+    node_ids = sorted(topology.nodes)
+    num_nodes = len(node_ids)
+    if num_ranks <= 0 or topology.num_cores() < num_ranks:
+        return None
+
+    if gpu_nodes is not None and all(node in topology.nodes for node in gpu_nodes):
+        ranks_of_node = [[rank for rank in range(num_ranks) if gpu_nodes[rank] == node]
+                         for node in node_ids]
+        rank_cores = _split_node_cores(topology, node_ids, ranks_of_node, num_ranks)
+    elif num_ranks < num_nodes:
+        nodes_per_rank = num_nodes // num_ranks
+        rank_cores = [[
+            core for node in node_ids[rank * nodes_per_rank:(rank + 1) * nodes_per_rank]
+            for core in topology.nodes[node]
+        ] for rank in range(num_ranks)]
+    else:
+        # the ranks of each node, as evenly spread as possible
+        ranks_of_node = [[] for _ in node_ids]
+        for rank in range(num_ranks):
+            ranks_of_node[rank * num_nodes // num_ranks].append(rank)
+        rank_cores = _split_node_cores(topology, node_ids, ranks_of_node, num_ranks)
+    if not all(rank_cores):
+        # a node has more ranks than cores, spread them over all cores
+        cores = [core for node in node_ids for core in topology.nodes[node]]
+        share = len(cores) // num_ranks
+        rank_cores = [
+            cores[rank * share:(rank + 1) * share] for rank in range(num_ranks)
+        ]
+
+    cores_per_rank = min(len(cores) for cores in rank_cores)
+    return [_placement(topology, cores[:cores_per_rank]) for cores in rank_cores]
+
+
+def _placement(topology, cores):
+    cpus = sorted(cpu for core in cores for cpu in core)
+    nodes = [
+        node for node in sorted(topology.nodes)
+        if any(core in topology.nodes[node] for core in cores)
+    ]
+    return RankPlacement(cpus, nodes, len(cores))
+
+
+def thread_environment(placement, env):
+    """Thread pool sizes of the rank, unless env already sets them."""
+    return {
+        name: str(placement.num_threads)
+        for name in THREAD_ENVS if name not in env
+    }
+
+
+def _set_mempolicy(numa_nodes):
+    syscall = SET_MEMPOLICY_SYSCALL.get(platform.machine())
+    if syscall is None:
+        return False
+    mask_bits = 8 * ctypes.sizeof(ctypes.c_ulong)
+    max_node = max(numa_nodes) + 1
+    mask = (ctypes.c_ulong * (max_node // mask_bits + 1))()
+    for node in numa_nodes:
+        mask[node // mask_bits] |= 1 << (node % mask_bits)
+    libc = ctypes.CDLL(None, use_errno=True)
+    # maxnode counts bits, the kernel ignores the last one
+    return libc.syscall(syscall, MPOL_BIND, mask, len(mask) * mask_bits + 1) == 0
+
+
+def bind(placement):
+    """Binds the calling process to the cpus and memory of placement, which
+    children inherit. Returns False if the cpus or the memory policy could
+    not be set."""
+    try:
+        os.sched_setaffinity(0, placement.cpus)
+    except OSError:
+        return False
+    return _set_mempolicy(placement.numa_nodes)
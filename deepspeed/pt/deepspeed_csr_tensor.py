@@ -7,6 +7,11 @@ functionality to TensorFlow's IndexedSlices implementation.
 
 import torch
 
+try:
+    import deepspeed_sparse_cpu
+except ImportError:
+    deepspeed_sparse_cpu = None
+
 
 class CSRTensor(object):
     """ Compressed Sparse Row (CSR) Tensor """
@@ -17,10 +22,13 @@ class CSRTensor(object):
             self.indices = result.nonzero().flatten()
             self.values = dense_tensor[self.indices]
             self.dense_size = list(dense_tensor.size())
+            # nonzero returns every row once, in ascending order
+            self.coalesced = True
         else:
             self.indices = None
             self.values = None
             self.dense_size = None
+            self.coalesced = False
 
     @staticmethod
     def type():
@@ -34,6 +42,23 @@ class CSRTensor(object):
             full_indices,
             self.values)
 
+    def coalesce(self):
+        """Merge duplicate row indices by summing their rows. The resulting
+        indices are sorted in ascending order."""
+        if self.indices.is_cuda or deepspeed_sparse_cpu is None:
+            indices, inverse = torch.unique(self.indices,
+                                            sorted=True,
+                                            return_inverse=True)
+            values = self.values.new_zeros(indices.size(0), self.values.size(1))
+            values.index_add_(0, inverse, self.values)
+        else:
+            indices, values = deepspeed_sparse_cpu.coalesce(self.indices.contiguous(),
+                                                            self.values.contiguous())
+        self.indices = indices
+        self.values = values
+        self.coalesced = True
+        return self
+
     def sparse_size(self):
         index_size = list(self.indices.size())
         index_size = index_size[0]
@@ -46,6 +71,7 @@ class CSRTensor(object):
         assert self.dense_size == b.dense_size
         self.indices = torch.cat([self.indices, b.indices])
         self.values = torch.cat([self.values, b.values])
+        self.coalesced = False
 
     def __str__(self):
         sparse_size, dense_size = self.sparse_size()
@@ -0,0 +1,270 @@
+'''
+Copyright 2020 The Microsoft DeepSpeed Team
+
+Background prefetching of training batches. A thread pulls samples from the
+DataLoader workers, collates them into host buffers that are reused across
+batches and optionally copies them to the GPU, keeping a fixed number of
+batches ready before the training loop asks for them.
+'''
+
+import collections
+import queue
+import threading
+import time
+
+import torch
+
+from deepspeed.pt.log_utils import logger
+
+try:
+    import deepspeed_data_cpu
+except ImportError:
+    deepspeed_data_cpu = None
+
+
+def sample_list_collate(samples):
+    """collate_fn that returns the samples of a batch unchanged, so DataLoader
+    workers only fetch and the prefetcher collates into pooled buffers."""
+    return samples
+
+
+class PinnedBufferPool(object):
+    """Host buffers reused across batches, keyed by dtype and shape. With pin
+    set they are page locked, so copies to the GPU run asynchronously."""
+    def __init__(self, pin):
+        self.pin = pin
+        self.free = collections.defaultdict(list)
+        self.lock = threading.Lock()
+        self.allocated = 0
+
+    def acquire(self, shape, dtype):
+        key = (dtype, tuple(shape))
+        with self.lock:
+            if self.free[key]:
+                return self.free[key].pop()
+            self.allocated += 1
+        return torch.empty(shape, dtype=dtype, pin_memory=self.pin)
+
+    def release(self, buffers):
+        with self.lock:
+            for buffer in buffers:
+                self.free[(buffer.dtype, tuple(buffer.size()))].append(buffer)
+
+
+def collate_into_pool(samples, pool, buffers):
+    """Collates like torch's default_collate, but stacks tensor fields into
+    buffers taken from pool. Every buffer used is appended to buffers."""
+    first = samples[0]
+    if isinstance(first, torch.Tensor):
+        out = pool.acquire((len(samples), ) + tuple(first.size()), first.dtype)
+        buffers.append(out)
+        if deepspeed_data_cpu is not None:
+            deepspeed_data_cpu.collate(samples, out)
+        else:
+            torch.stack(samples, out=out)
+        return out
+    if hasattr(first, '__array_interface__') and not isinstance(first, (str, bytes)):
+        return collate_into_pool([torch.as_tensor(s) for s in samples], pool, buffers)
+    if isinstance(first, float):
+        return torch.tensor(samples, dtype=torch.float64)
+    if isinstance(first, int):
+        return torch.tensor(samples, dtype=torch.int64)
+    if isinstance(first, dict):
+        return {
+            key: collate_into_pool([s[key] for s in samples],
+                                   pool,
+                                   buffers)
+            for key in first
+        }
+    if isinstance(first, tuple) and hasattr(first, '_fields'):
+        return type(first)(*(collate_into_pool(list(field),
+                                               pool,
+                                               buffers) for field in zip(*samples)))
+    if isinstance(first, (list, tuple)):
+        return [collate_into_pool(list(field), pool, buffers) for field in zip(*samples)]
+    return samples
+
+
+def _batch_to_device(batch, device):
+    if isinstance(batch, torch.Tensor):
+        return batch.to(device, non_blocking=True)
+    if isinstance(batch, dict):
+        return {key: _batch_to_device(value, device) for key, value in batch.items()}
+    if isinstance(batch, tuple) and hasattr(batch, '_fields'):
+        return type(batch)(*(_batch_to_device(value, device) for value in batch))
+    if isinstance(batch, (list, tuple)):
+        return type(batch)(_batch_to_device(value, device) for value in batch)
+    return batch
+
+
+def _batch_tensors(batch):
+    if isinstance(batch, torch.Tensor):
+        yield batch
+    elif isinstance(batch, dict):
+        for value in batch.values():
+            yield from _batch_tensors(value)
+    elif isinstance(batch, (list, tuple)):
+        for value in batch:
+            yield from _batch_tensors(value)
+
+
+class PrefetchStats(object):
+    """Time spent per stage of the prefetch pipeline: fetching samples from
+    the DataLoader, collating them, copying batches to the device, and the
+    training loop waiting for a batch that was not ready yet."""
+    STAGES = ['fetch', 'collate', 'copy', 'wait']
+
+    def __init__(self):
+        self.lock = threading.Lock()
+        self.reset()
+
+    def reset(self):
+        with self.lock:
+            self.elapsed = {stage: 0.0 for stage in self.STAGES}
+            self.batches = 0
+
+    def add(self, stage, seconds):
+        with self.lock:
+            self.elapsed[stage] += seconds
+            if stage == 'wait':
+                self.batches += 1
+
+    def as_dict(self):
+        """Total milliseconds per stage and the number of batches consumed."""
+        with self.lock:
+            stats = {
+                '{}_ms'.format(stage): elapsed * 1000.0
+                for stage,
+                elapsed in self.elapsed.items()
+            }
+            stats['batches'] = self.batches
+        return stats
+
+    def log(self, reset=True):
+        stats = self.as_dict()
+        batches = max(stats['batches'], 1)
+        string = 'data time per batch (ms)'
+        for stage in self.STAGES:
+            string += ' | {}: {:.2f}'.format(stage, stats[stage + '_ms'] / batches)
+        logger.info(string)
+        if reset:
+            self.reset()
+
+
+class BatchPrefetcher(object):
+    """Iterator over batches produced by a background thread that stays up to
+    depth batches ahead of the consumer.
+
+    Items of source are turned into batches by collate_fn(item, pool, buffers),
+    e.g. collate_into_pool for lists of samples, which takes host buffers from
+    pool and appends them to buffers. Without collate_fn, source yields
+    finished batches. With device set, batches are copied to it on a separate
+    CUDA stream and the host buffers go back to the pool right away. Without
+    it, the consumer gets the pooled buffers, which are recycled once the
+    following batch is requested.
+    """
+    _END = object()
+
+    def __init__(self, source, depth, pool, stats, collate_fn=None, device=None):
+        assert depth > 0, 'prefetch depth must be positive'
+        self.source = source
+        self.pool = pool
+        self.stats = stats
+        self.collate_fn = collate_fn
+        self.device = device
+        self.stream = None
+        if device is not None and torch.device(device).type == 'cuda':
+            self.stream = torch.cuda.Stream(device=device)
+        self.queue = queue.Queue(maxsize=depth)
+        self.stop_event = threading.Event()
+        self.held = []
+        self.done = False
+        self.thread = threading.Thread(target=self._run, daemon=True)
+        self.thread.start()
+
+    def _put(self, item):
+        while not self.stop_event.is_set():
+            try:
+                self.queue.put(item, timeout=0.1)
+                return True
+            except queue.Full:
+                pass
+        return False
+
+    def _produce(self):
+        start = time.time()
+        try:
+            item = next(self.source)
+        except StopIteration:
+            return self._END
+        self.stats.add('fetch', time.time() - start)
+
+        buffers = []
+        if self.collate_fn is not None:
+            start = time.time()
+            item = self.collate_fn(item, self.pool, buffers)
+            self.stats.add('collate', time.time() - start)
+
+        if self.device is not None:
+            start = time.time()
+            if self.stream is not None:
+                with torch.cuda.stream(self.stream):
+                    item = _batch_to_device(item, self.device)
+                self.stream.synchronize()
+            else:
+                item = _batch_to_device(item, self.device)
+            self.stats.add('copy', time.time() - start)
+            self.pool.release(buffers)
+            buffers = []
+        return item, buffers
+
+    def _run(self):
+        while not self.stop_event.is_set():
+            try:
+                item = self._produce()
+            except Exception as e:
+                self._put(e)
+                return
+            if not self._put(item) or item is self._END:
+                return
+
+    def __iter__(self):
+        return self
+
+    def __next__(self):
+        if self.done:
+            raise StopIteration
+        self.pool.release(self.held)
+        self.held = []
+
+        start = time.time()
+        item = self.queue.get()
+        self.stats.add('wait', time.time() - start)
+
+        if item is self._END:
+            self.done = True
+            raise StopIteration
+        if isinstance(item, Exception):
+            self.done = True
+            raise item
+
+        batch, self.held = item
+        if self.stream is not None:
+            # the batch was allocated on the copy stream but is used on the
+            # current one, tell the caching allocator before it can be freed
+            current_stream = torch.cuda.current_stream(self.stream.device)
+            for tensor in _batch_tensors(batch):
+                if tensor.is_cuda:
+                    tensor.record_stream(current_stream)
+        return batch
+
+    def close(self):
+        """Stops the background thread, discarding batches not consumed."""
+        self.stop_event.set()
+        while self.thread.is_alive():
+            try:
+                self.queue.get(timeout=0.1)
+            except queue.Empty:
+                pass
+        self.thread.join()
+        self.done = True
@@ -3,9 +3,12 @@ Copyright 2019 The Microsoft DeepSpeed Team
 '''
 
 import torch
-from torch.utils.data import DataLoader, RandomSampler
+from torch.utils.data import BatchSampler, DataLoader, RandomSampler
 from torch.utils.data.distributed import DistributedSampler
 
+from deepspeed.pt.deepspeed_data_prefetcher import BatchPrefetcher, PinnedBufferPool, \
+    PrefetchStats, collate_into_pool, sample_list_collate
+
 
 class DeepSpeedDataLoader(object):
     def __init__(self,
@@ -18,7 +21,9 @@ class DeepSpeedDataLoader(object):
                  num_local_io_workers=None,
                  data_sampler=None,
                  data_parallel_world_size=None,
-                 data_parallel_rank=None):
+                 data_parallel_rank=None,
+                 prefetch_depth=0,
+                 device=None):
         self.tput_timer = tput_timer
         self.batch_size = batch_size
 
@@ -47,6 +52,21 @@ class DeepSpeedDataLoader(object):
         self.len = len(self.data_sampler)
         self.data = None
 
+        # Datasets such as MMapTokenDataset gather whole batches on threads of
+        # this process, no DataLoader workers are started for them.
+        self.assemble_batches = collate_fn is None and hasattr(dataset, 'assemble_batch')
+
+        # With prefetching, samples are collated into pooled host buffers by
+        # a background thread unless the user provides their own collate_fn.
+        self.prefetch_depth = prefetch_depth
+        self.device = device
+        self.prefetcher = None
+        self.prefetch_stats = None
+        if prefetch_depth > 0:
+            self.prefetch_stats = PrefetchStats()
+            self.buffer_pool = PinnedBufferPool(pin_memory
+                                                and torch.cuda.is_available())
+
     def __iter__(self):
         self._create_dataloader()
         return self
@@ -60,6 +80,12 @@ class DeepSpeedDataLoader(object):
         return next(self.data)
 
     def _create_dataloader(self):
+        if self.assemble_batches:
+            return self._create_batch_assembler()
+
+        if self.prefetch_depth > 0:
+            return self._create_prefetcher()
+
         if self.collate_fn is None:
             self.dataloader = DataLoader(self.dataset,
                                          batch_size=self.batch_size,
@@ -76,3 +102,40 @@ class DeepSpeedDataLoader(object):
         self.data = (x for x in self.dataloader)
 
         return self.dataloader
+
+    def _create_prefetcher(self):
+        collate = self.collate_fn is None
+        self.dataloader = DataLoader(
+            self.dataset,
+            batch_size=self.batch_size,
+            pin_memory=self.pin_memory and not collate and self.device is None,
+            sampler=self.data_sampler,
+            collate_fn=sample_list_collate if collate else self.collate_fn,
+            num_workers=self.num_local_io_workers)
+        self._start_prefetcher(iter(self.dataloader),
+                               collate_into_pool if collate else None)
+
+        return self.dataloader
+
+    def _create_batch_assembler(self):
+        self.dataloader = BatchSampler(self.data_sampler,
+                                       self.batch_size,
+                                       drop_last=False)
+        if self.prefetch_depth > 0:
+            self._start_prefetcher(iter(self.dataloader), self.dataset.assemble_batch)
+        else:
+            self.data = (self.dataset.assemble_batch(indices)
+                         for indices in self.dataloader)
+
+        return self.dataloader
+
+    def _start_prefetcher(self, source, collate_fn):
+        if self.prefetcher is not None:
+            self.prefetcher.close()
+        self.prefetcher = BatchPrefetcher(source,
+                                          self.prefetch_depth,
+                                          self.buffer_pool,
+                                          self.prefetch_stats,
+                                          collate_fn=collate_fn,
+                                          device=self.device)
+        self.data = self.prefetcher
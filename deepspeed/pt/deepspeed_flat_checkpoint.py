@@ -0,0 +1,199 @@
+'''
+Copyright 2020 The Microsoft DeepSpeed Team
+
+Flat checkpoint format that can be memory mapped.
+
+File layout:
+    magic | tensor blobs | pickled objects | JSON index | index offset | magic
+
+Every tensor is stored as raw bytes at an ALIGNMENT boundary. The pickled
+objects are the checkpoint state with each tensor replaced by a reference into
+the index, so arbitrary client state still round trips. The JSON index lists
+dtype, shape and offset of every tensor. It is written last and found through
+the fixed size trailer, which lets the writer stream the file in one pass.
+'''
+
+import io
+import copy
+import json
+import mmap
+import pickle
+import struct
+from concurrent.futures import ThreadPoolExecutor
+
+import numpy as np
+import torch
+
+FLAT_CHECKPOINT_MAGIC = b'DSFLAT01'
+FLAT_CHECKPOINT_VERSION = 1
+ALIGNMENT = 64
+
+# Elements copied per task by parallel_copy_
+PARALLEL_COPY_CHUNK = 16 * 1024 * 1024
+
+_TRAILER = struct.Struct('<Q8s')
+
+_DTYPES = {
+    torch.float16: np.float16,
+    torch.float32: np.float32,
+    torch.float64: np.float64,
+    torch.uint8: np.uint8,
+    torch.int8: np.int8,
+    torch.int16: np.int16,
+    torch.int32: np.int32,
+    torch.int64: np.int64,
+    torch.bool: np.bool_,
+}
+
+# numpy has no bfloat16, so these are stored as the bits of another dtype
+_BIT_DTYPES = {}
+if hasattr(torch, 'bfloat16'):
+    _BIT_DTYPES[torch.bfloat16] = torch.int16
+    _DTYPES[torch.bfloat16] = np.int16
+
+
+class _TensorRef(object):
+    """Placeholder for a tensor in the pickled checkpoint state."""
+    def __init__(self, index):
+        self.index = index
+
+
+def _map_tensors(obj, fn):
+    if torch.is_tensor(obj) or isinstance(obj, _TensorRef):
+        return fn(obj)
+    if isinstance(obj, dict):
+        mapped = copy.copy(obj)
+        for k, v in obj.items():
+            mapped[k] = _map_tensors(v, fn)
+        return mapped
+    if isinstance(obj, (list, tuple)) and not hasattr(obj, '_fields'):
+        return type(obj)(_map_tensors(v, fn) for v in obj)
+    return obj
+
+
+def _pad(f, offset):
+    padding = (ALIGNMENT - offset % ALIGNMENT) % ALIGNMENT
+    f.write(b'\0' * padding)
+    return offset + padding
+
+
+def save_flat_checkpoint(state, f):
+    """Save state in the flat format to f, a path or a binary file object."""
+    if not hasattr(f, 'write'):
+        with open(f, 'wb') as fd:
+            return save_flat_checkpoint(state, fd)
+
+    f.write(FLAT_CHECKPOINT_MAGIC)
+    offset = len(FLAT_CHECKPOINT_MAGIC)
+
+    entries = []
+    refs = {}
+
+    def write_tensor(t):
+        if id(t) in refs:
+            return refs[id(t)]
+        assert t.dtype in _DTYPES, \
+            'flat checkpoint does not support {}'.format(t.dtype)
+        bits = t.detach().cpu().contiguous()
+        if t.dtype in _BIT_DTYPES:
+            bits = bits.view(_BIT_DTYPES[t.dtype])
+        array = bits.numpy()
+
+        nonlocal offset
+        offset = _pad(f, offset)
+        f.write(array.tobytes() if array.ndim == 0 else memoryview(array).cast('B'))
+        dtype_name = str(t.dtype).split('.')[-1]
+        entries.append({'dtype': dtype_name, 'shape': list(t.size()), 'offset': offset})
+        offset += array.nbytes
+
+        refs[id(t)] = _TensorRef(len(entries) - 1)
+        return refs[id(t)]
+
+    skeleton = _map_tensors(state, write_tensor)
+
+    objects = pickle.dumps(skeleton, protocol=pickle.HIGHEST_PROTOCOL)
+    objects_offset = offset
+    f.write(objects)
+    offset += len(objects)
+
+    index = json.dumps({
+        'version': FLAT_CHECKPOINT_VERSION,
+        'alignment': ALIGNMENT,
+        'tensors': entries,
+        'objects_offset': objects_offset,
+        'objects_nbytes': len(objects)
+    }).encode('utf-8')
+    f.write(index)
+    f.write(_TRAILER.pack(offset, FLAT_CHECKPOINT_MAGIC))
+
+
+def is_flat_checkpoint(path):
+    """True if path holds a checkpoint written by save_flat_checkpoint."""
+    with open(path, 'rb') as f:
+        return f.read(len(FLAT_CHECKPOINT_MAGIC)) == FLAT_CHECKPOINT_MAGIC
+
+
+def parallel_copy_(dst, src, num_threads=4):
+    """dst.copy_(src) split in chunks over num_threads threads. Copies from a
+    memory mapped checkpoint are bound by page faults, which do overlap when
+    issued from several threads."""
+    if (num_threads <= 1 or dst.numel() <= PARALLEL_COPY_CHUNK
+            or not dst.is_contiguous() or not src.is_contiguous()):
+        dst.copy_(src)
+        return
+
+    flat_dst = dst.view(-1)
+    flat_src = src.view(-1)
+    numel = dst.numel()
+
+    def copy_chunk(start):
+        length = min(PARALLEL_COPY_CHUNK, numel - start)
+        flat_dst.narrow(0, start, length).copy_(flat_src.narrow(0, start, length))
+
+    with ThreadPoolExecutor(max_workers=num_threads) as executor:
+        list(executor.map(copy_chunk, range(0, numel, PARALLEL_COPY_CHUNK)))
+
+
+def load_flat_checkpoint(path, map_location=None, num_threads=4):
+    """Load a checkpoint written by save_flat_checkpoint.
+
+    With map_location None the returned tensors are copy-on-write views of the
+    memory mapped file: nothing is read until a tensor is used, and pages that
+    are only read (e.g. weights for inference) are shared with the page cache
+    instead of being copied. Otherwise every tensor is copied to map_location,
+    using num_threads threads for large tensors.
+    """
+    with open(path, 'rb') as f:
+        mapped = mmap.mmap(f.fileno(), 0, access=mmap.ACCESS_COPY)
+
+    assert mapped[:len(FLAT_CHECKPOINT_MAGIC)] == FLAT_CHECKPOINT_MAGIC, \
+        '{} is not a flat checkpoint'.format(path)
+    index_offset, magic = _TRAILER.unpack(mapped[len(mapped) - _TRAILER.size:])
+    assert magic == FLAT_CHECKPOINT_MAGIC, '{} is truncated'.format(path)
+
+    index = json.loads(
+        mapped[index_offset:len(mapped) - _TRAILER.size].decode('utf-8'))
+    assert index['version'] == FLAT_CHECKPOINT_VERSION, \
+        'unsupported flat checkpoint version {}'.format(index['version'])
+
+    tensors = []
+    for entry in index['tensors']:
+        dtype = getattr(torch, entry['dtype'])
+        count = int(np.prod(entry['shape'])) if entry['shape'] else 1
+        array = np.frombuffer(mapped,
+                              dtype=_DTYPES[dtype],
+                              count=count,
+                              offset=entry['offset'])
+        tensor = torch.from_numpy(array).view(entry['shape'])
+        if dtype in _BIT_DTYPES:
+            tensor = tensor.view(dtype)
+        if map_location is not None:
+            target = torch.empty(entry['shape'], dtype=dtype, device=map_location)
+            parallel_copy_(target, tensor, num_threads)
+            tensor = target
+        tensors.append(tensor)
+
+    start = index['objects_offset']
+    skeleton = pickle.load(io.BytesIO(mapped[start:start + index['objects_nbytes']]))
+
+    return _map_tensors(skeleton, lambda ref: tensors[ref.index])
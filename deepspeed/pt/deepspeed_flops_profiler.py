@@ -0,0 +1,424 @@
+'''
+Copyright 2020 The Microsoft DeepSpeed Team
+
+Counts the flops, parameters, activation bytes and latency of every module in
+a profiled forward pass, to tell how close a model runs to the device peak.
+
+Flops are counted as the operations run: while profiling, torch.matmul, bmm,
+mm, addmm, baddbmm and common torch.nn.functional ops are wrapped to add their
+flops to the innermost running module. Modules whose work is a single fused
+kernel, like DeepSpeedTransformerLayer, get theirs from the exact gemm shapes. A
+multiply-add counts as two flops. Latency is measured around each module's
+forward, synchronizing the device, so only the profiled step is slower.
+
+The backward latency of a module is measured by gradient hooks on the tensors
+of its profiled forward calls, from the gradient of its first output to the
+last gradient of its inputs, or of its parameters for modules whose inputs
+take no gradient. A module called several times gets the span from the first
+of these hooks to the last one.
+'''
+
+import time
+import torch
+import torch.nn.functional as F
+
+from deepspeed.pt.log_utils import logger
+
+# flops per element of the elementwise ops
+ELEMENTWISE_FLOPS = {
+    'relu': 1,
+    'dropout': 1,
+    'tanh': 1,
+    'gelu': 8,
+    'softmax': 5,
+    'log_softmax': 5,
+    'layer_norm': 7,
+}
+
+
+def transformer_layer_flops(batch_size,
+                            seq_length,
+                            hidden_size,
+                            heads,
+                            intermediate_size=None):
+    """Forward flops of the gemms of a DeepSpeedTransformerLayer, by fused op.
+    The attention batched gemms run per head on hidden_size / heads columns,
+    which sum up to hidden_size."""
+    tokens = batch_size * seq_length
+    intermediate_size = intermediate_size or 4 * hidden_size
+    head_size = hidden_size // heads
+    return {
+        'qkv': 2 * tokens * hidden_size * 3 * hidden_size,
+        'attention_scores': 2 * batch_size * heads * seq_length * seq_length *
+        head_size,
+        'attention_context': 2 * batch_size * heads * seq_length * seq_length *
+        head_size,
+        'attention_output': 2 * tokens * hidden_size * hidden_size,
+        'ff1': 2 * tokens * hidden_size * intermediate_size,
+        'ff2': 2 * tokens * intermediate_size * hidden_size
+    }
+
+
+def _is_fused_transformer_layer(module):
+    return hasattr(module, 'attn_qkvw') and hasattr(module, 'inter_w') and \
+        hasattr(getattr(module, 'config', None), 'heads')
+
+
+def _tensor_bytes(value):
+    if torch.is_tensor(value):
+        return value.numel() * value.element_size()
+    if isinstance(value, (list, tuple)):
+        return sum(_tensor_bytes(item) for item in value)
+    if isinstance(value, dict):
+        return sum(_tensor_bytes(item) for item in value.values())
+    return 0
+
+
+def _tensors(value):
+    if torch.is_tensor(value):
+        return [value]
+    if isinstance(value, (list, tuple)):
+        return [tensor for item in value for tensor in _tensors(item)]
+    if isinstance(value, dict):
+        return [tensor for item in value.values() for tensor in _tensors(item)]
+    return []
+
+
+def _numel(shape):
+    numel = 1
+    for size in shape:
+        numel *= size
+    return numel
+
+
+def _matmul_flops(input, other, *args, output=None):
+    return 2 * output.numel() * input.shape[-1]
+
+
+def _linear_flops(input, weight, bias=None, *args, output=None):
+    flops = 2 * input.numel() * weight.shape[0]
+    if bias is not None:
+        flops += output.numel()
+    return flops
+
+
+def _addmm_flops(bias, input, other, *args, output=None):
+    return _matmul_flops(input, other, output=output) + output.numel()
+
+
+def _conv_flops(input, weight, bias=None, *args, output=None):
+    # every output element is a dot product over the kernel and the input
+    # channels of its group
+    flops = 2 * output.numel() * _numel(weight.shape[1:])
+    if bias is not None:
+        flops += output.numel()
+    return flops
+
+
+def _elementwise_flops(name):
+    def flops(input, *args, output=None):
+        return ELEMENTWISE_FLOPS[name] * output.numel()
+
+    return flops
+
+
+class ModuleProfile(object):
+    """Counters of a module, flops excluding its children."""
+    def __init__(self, name, module):
+        self.name = name
+        self.module = module
+        self.calls = 0
+        self.flops = 0
+        self.latency = 0.0
+        self.activation_bytes = 0
+        self.fused_flops = {}
+        self.start = None
+        # host times of the first and the last backward hook
+        self.backward_start = None
+        self.backward_end = None
+        self.parameter_hooks = False
+
+    @property
+    def backward_latency(self):
+        if self.backward_start is None or self.backward_end is None:
+            return 0.0
+        return max(0.0, self.backward_end - self.backward_start)
+
+
+class ProfiledModule(object):
+    """Counters of a module including its children, as reported."""
+    def __init__(self, profile, params, param_bytes, flops, children):
+        self.name = profile.name
+        self.type = type(profile.module).__name__
+        self.calls = profile.calls
+        self.latency = profile.latency
+        self.backward_latency = profile.backward_latency
+        self.activation_bytes = profile.activation_bytes
+        self.fused_flops = profile.fused_flops
+        self.params = params
+        self.param_bytes = param_bytes
+        self.flops = flops
+        self.children = children
+
+    @property
+    def tflops(self):
+        return self.flops / self.latency / 1e12 if self.latency > 0 else 0.0
+
+    @property
+    def bytes_per_flop(self):
+        """Parameter and activation bytes per flop, a lower bound of the
+        memory traffic of the module."""
+        if not self.flops:
+            return 0.0
+        return (self.param_bytes + self.activation_bytes) / self.flops
+
+
+class FlopsProfiler(object):
+    """Profiles the forward passes of model between start_profile and
+    stop_profile, and the backward passes of their outputs until end_profile.
+    The whole backward pass is timed by the caller with record_backward, its
+    flops being twice the forward flops.
+
+    Arguments:
+        model: torch.nn.Module to profile
+    """
+    def __init__(self, model):
+        self.model = model
+        self.profiles = {}
+        self.stack = []
+        self.hooks = []
+        # parameter gradient hooks, which outlive the backward pass
+        self.backward_hooks = []
+        self.patched = []
+        # ops running inside a wrapped op, whose flops it counts
+        self.op_depth = 0
+        self.backward_latency = None
+        self.started = False
+
+    def _synchronize(self):
+        if torch.cuda.is_available():
+            torch.cuda.synchronize()
+
+    def _pre_hook(self, module, input):
+        profile = self.profiles[module]
+        self.stack.append(profile)
+        if _is_fused_transformer_layer(module):
+            batch_size, seq_length = input[0].shape[0], input[0].shape[1]
+            config = module.config
+            fused = transformer_layer_flops(batch_size,
+                                            seq_length,
+                                            config.hidden_size,
+                                            config.heads,
+                                            module.inter_w.shape[0])
+            for op, flops in fused.items():
+                profile.fused_flops[op] = profile.fused_flops.get(op, 0) + flops
+            profile.flops += sum(fused.values())
+        self._synchronize()
+        profile.start = time.time()
+
+    def _post_hook(self, module, input, output):
+        self._synchronize()
+        profile = self.stack.pop()
+        profile.latency += time.time() - profile.start
+        profile.calls += 1
+        profile.activation_bytes += _tensor_bytes(output)
+        if torch.is_grad_enabled():
+            self._hook_backward(profile, module, input, output)
+
+    def _backward_hook(self, profile, end):
+        def hook(grad):
+            self._synchronize()
+            now = time.time()
+            if end:
+                profile.backward_end = max(profile.backward_end or now, now)
+            elif profile.backward_start is None:
+                profile.backward_start = now
+
+        return hook
+
+    def _hook_backward(self, profile, module, input, output):
+        for tensor in _tensors(output):
+            if tensor.requires_grad:
+                tensor.register_hook(self._backward_hook(profile, end=False))
+        inputs = [tensor for tensor in _tensors(input) if tensor.requires_grad]
+        for tensor in inputs:
+            tensor.register_hook(self._backward_hook(profile, end=True))
+        if not inputs and not profile.parameter_hooks:
+            profile.parameter_hooks = True
+            for param in module.parameters():
+                if param.requires_grad:
+                    self.backward_hooks.append(
+                        param.register_hook(self._backward_hook(profile,
+                                                                end=True)))
+
+    def _add_flops(self, flops):
+        if self.stack:
+            self.stack[-1].flops += flops
+
+    def _wrap(self, owner, name, flops_fn):
+        function = getattr(owner, name)
+
+        def wrapper(*args, **kwargs):
+            self.op_depth += 1
+            try:
+                output = function(*args, **kwargs)
+            finally:
+                self.op_depth -= 1
+            if self.op_depth == 0 and torch.is_tensor(output):
+                self._add_flops(flops_fn(*args, output=output))
+            return output
+
+        setattr(owner, name, wrapper)
+        self.patched.append((owner, name, function))
+
+    def _patch(self):
+        self._wrap(F, 'linear', _linear_flops)
+        for name in ['conv1d', 'conv2d', 'conv3d']:
+            self._wrap(F, name, _conv_flops)
+        for name in ELEMENTWISE_FLOPS:
+            if hasattr(F, name):
+                self._wrap(F, name, _elementwise_flops(name))
+        for name in ['matmul', 'bmm', 'mm']:
+            self._wrap(torch, name, _matmul_flops)
+        for name in ['addmm', 'baddbmm']:
+            self._wrap(torch, name, _addmm_flops)
+
+    def _unpatch(self):
+        for owner, name, function in reversed(self.patched):
+            setattr(owner, name, function)
+        self.patched = []
+
+    def start_profile(self):
+        """Counts the forward passes of the model from now on."""
+        assert not self.started, 'profiler has already been started'
+        self.profiles = {
+            module: ModuleProfile(name,
+                                  module)
+            for name,
+            module in self.model.named_modules()
+        }
+        self.stack = []
+        self.backward_latency = None
+        for module in self.profiles:
+            self.hooks.append(module.register_forward_pre_hook(self._pre_hook))
+            self.hooks.append(module.register_forward_hook(self._post_hook))
+        self._patch()
+        self.started = True
+
+    def stop_profile(self):
+        """Stops counting, keeping the counters for the report."""
+        if not self.started:
+            return
+        for hook in self.hooks:
+            hook.remove()
+        self.hooks = []
+        self._unpatch()
+        self.started = False
+
+    def record_backward(self, latency):
+        self.backward_latency = latency
+
+    def _profiled(self, module):
+        profile = self.profiles[module]
+        children = [self._profiled(child) for child in module.children()]
+        params = list(module.parameters(recurse=False))
+        return ProfiledModule(
+            profile,
+            sum(param.numel() for param in params) + sum(child.params
+                                                         for child in children),
+            _tensor_bytes(params) + sum(child.param_bytes for child in children),
+            profile.flops + sum(child.flops for child in children),
+            children)
+
+    def get_profile(self):
+        """Counters of the model as a ProfiledModule tree."""
+        return self._profiled(self.model)
+
+    def get_total_flops(self):
+        return self.get_profile().flops
+
+    def get_total_params(self):
+        return self.get_profile().params
+
+    def summary(self, module_depth=-1, top_modules=3):
+        """Lines of the model's totals, then a tree of the top_modules
+        children with the most latency at every level, module_depth levels
+        deep or all levels with -1."""
+        model = self.get_profile()
+        lines = [
+            'DeepSpeed Flops Profiler: {} params, forward {} in {:.2f} ms, '
+            '{:.2f} TFLOPS'.format(_count(model.params),
+                                   _flops(model.flops),
+                                   model.latency * 1000.0,
+                                   model.tflops)
+        ]
+        if self.backward_latency:
+            # the gemms of the backward pass compute the input and the weight
+            # gradients, twice the forward flops
+            lines.append('backward {} in {:.2f} ms, {:.2f} TFLOPS'.format(
+                _flops(2 * model.flops),
+                self.backward_latency * 1000.0,
+                2 * model.flops / self.backward_latency / 1e12))
+        lines.append('Top modules by forward latency:')
+        self._summary(model, model.latency, 0, module_depth, top_modules, lines)
+        return lines
+
+    def _summary(self, module, total_latency, depth, module_depth, top_modules, lines):
+        name = module.name or 'model'
+        share = module.latency / total_latency if total_latency else 0
+        line = '{}{} ({}): {} params, {}, {:.2f} ms ({:.1%}), {:.2f} TFLOPS, ' \
+            '{:.2f} B/FLOP'.format('  ' * depth,
+                                   name,
+                                   module.type,
+                                   _count(module.params),
+                                   _flops(module.flops),
+                                   module.latency * 1000.0,
+                                   share,
+                                   module.tflops,
+                                   module.bytes_per_flop)
+        if module.backward_latency:
+            line += ', backward {:.2f} ms'.format(module.backward_latency * 1000.0)
+        if module.fused_flops:
+            line += ' [{}]'.format(', '.join(
+                '{} {}'.format(op,
+                               _flops(flops)) for op,
+                flops in module.fused_flops.items()))
+        lines.append(line)
+        if depth == module_depth:
+            return
+        children = sorted([child for child in module.children if child.calls > 0],
+                          key=lambda child: child.latency,
+                          reverse=True)
+        for child in children[:top_modules]:
+            self._summary(child,
+                          total_latency,
+                          depth + 1,
+                          module_depth,
+                          top_modules,
+                          lines)
+
+    def print_model_profile(self, module_depth=-1, top_modules=3):
+        for line in self.summary(module_depth, top_modules):
+            logger.info(line)
+
+    def end_profile(self):
+        """Stops counting and drops the counters."""
+        self.stop_profile()
+        for hook in self.backward_hooks:
+            hook.remove()
+        self.backward_hooks = []
+        self.profiles = {}
+
+
+def _count(number):
+    for scale, unit in [(1e9, ' G'), (1e6, ' M'), (1e3, ' k')]:
+        if number >= scale:
+            return '{:.2f}{}'.format(number / scale, unit)
+    return str(number)
+
+
+def _flops(flops):
+    for scale, unit in [(1e12, ' TFLOPs'), (1e9, ' GFLOPs'), (1e6, ' MFLOPs')]:
+        if flops >= scale:
+            return '{:.2f}{}'.format(flops / scale, unit)
+    return '{} FLOPs'.format(flops)
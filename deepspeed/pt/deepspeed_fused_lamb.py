@@ -8,11 +8,21 @@ This file is adapted from NVIDIA/apex/optimizer/fused_adam and implements the LA
 import types
 import torch
 import importlib
+from deepspeed.pt.deepspeed_stochastic_rounding import stochastic_rounding_seed
+
+try:
+    import deepspeed_lamb_cpu
+except ImportError:
+    deepspeed_lamb_cpu = None
+
+# Elements sharing one scale in the 8-bit optimizer states, must match
+# OPTIMIZER_8BIT_BLOCK_SIZE in csrc/includes/optimizer_8bit.h
+OPTIMIZER_8BIT_BLOCK_SIZE = 2048
 
 
 class FusedLamb(torch.optim.Optimizer):
-    """Implements LAMB algorithm. Currently GPU-only.  Requires DeepSpeed adapted Apex to be installed via
-    ``python setup.py install --cuda_ext --cpp_ext``.
+    """Implements LAMB algorithm. Parameters on the GPU use the deepspeed_lamb_cuda
+    extension and parameters on the CPU use deepspeed_lamb_cpu.
 
     For usage example please see, TODO DeepSpeed Tutorial
 
@@ -38,12 +48,29 @@ class FusedLamb(torch.optim.Optimizer):
             adds eps to the bias-corrected second moment estimate before
             evaluating square root instead of adding it to the square root of
             second moment estimate as in the original paper. (default: False)
+        state_bits (int, optional): 32 keeps exp_avg and exp_avg_sq in fp32, 8
+            stores them blockwise quantized to one byte per element with one
+            fp32 scale per OPTIMIZER_8BIT_BLOCK_SIZE elements. The states are
+            dequantized, updated and requantized inside the fused kernel and
+            are checkpointed in the quantized form. (default: 32)
+        stochastic_rounding (boolean, optional): round the reduced precision
+            copies passed as output_params to step() stochastically instead of
+            to nearest, so updates smaller than their precision are kept in
+            expectation. The random numbers are a function of the step and
+            the position of the parameter only. (default: False)
+        async_lamb_coeffs (boolean, optional): copy the trust ratios of every
+            step to pinned host memory asynchronously. get_lamb_coeffs() then
+            returns the ratios of the previous step without waiting for the
+            current one. (default: False)
 
     .. _Adam\: A Method for Stochastic Optimization:
         https://arxiv.org/abs/1412.6980
     .. _On the Convergence of Adam and Beyond:
         https://openreview.net/forum?id=ryQu7f-RZ
     """
+    # step() takes a device flag that turns it into a no-op, see PredicatedStep
+    accepts_skip_flag = True
+
     def __init__(self,
                  params,
                  lr=1e-3,
@@ -56,12 +83,19 @@ class FusedLamb(torch.optim.Optimizer):
                  max_grad_norm=0.,
                  max_coeff=10.0,
                  min_coeff=0.01,
-                 amsgrad=False):
+                 amsgrad=False,
+                 state_bits=32,
+                 stochastic_rounding=False,
+                 async_lamb_coeffs=False):
         global fused_lamb_cuda
-        fused_lamb_cuda = importlib.import_module("deepspeed_lamb_cuda")
+        fused_lamb_cuda = importlib.import_module(
+            "deepspeed_lamb_cuda") if torch.cuda.is_available() else None
 
         if amsgrad:
             raise RuntimeError('FusedLamb does not support the AMSGrad variant.')
+        if state_bits not in [8, 32]:
+            raise ValueError('FusedLamb state_bits must be 8 or 32, got {}'.format(
+                state_bits))
         defaults = dict(lr=lr,
                         bias_correction=bias_correction,
                         betas=betas,
@@ -72,14 +106,86 @@ class FusedLamb(torch.optim.Optimizer):
                         min_coeff=min_coeff)
         super(FusedLamb, self).__init__(params, defaults)
         self.eps_mode = 0 if eps_inside_sqrt else 1
-        self.lamb_coeffs = []
+        self.state_bits = state_bits
+        self.stochastic_rounding = stochastic_rounding
+        self.async_lamb_coeffs = async_lamb_coeffs
+
+        # The kernels write the trust ratio of every parameter into its slot of
+        # one buffer, so reading them costs one copy instead of one sync each.
+        self.lamb_coeffs = None
+        self.lamb_coeff_indices = []
+        # Asynchronous host copies of the buffer, double buffered by step:
+        # (pinned buffer, event, slots written in that step)
+        self.host_lamb_coeffs = [None, None]
+        self.lamb_coeff_steps = 0
+
+    def _init_state(self, p, state):
+        state['step'] = 0
+        if self.state_bits == 8:
+            num_blocks = (p.numel() + OPTIMIZER_8BIT_BLOCK_SIZE -
+                          1) // OPTIMIZER_8BIT_BLOCK_SIZE
+            # Blockwise quantized exponential moving averages of gradient and
+            # squared gradient values, see csrc/includes/optimizer_8bit.h
+            state['exp_avg'] = torch.zeros_like(p.data, dtype=torch.int8)
+            state['exp_avg_absmax'] = torch.zeros(num_blocks,
+                                                  dtype=torch.float,
+                                                  device=p.device)
+            state['exp_avg_sq'] = torch.zeros_like(p.data, dtype=torch.uint8)
+            state['exp_avg_sq_absmax'] = torch.zeros(num_blocks,
+                                                     dtype=torch.float,
+                                                     device=p.device)
+        else:
+            # Exponential moving average of gradient values
+            state['exp_avg'] = torch.zeros_like(p.data)
+            # Exponential moving average of squared gradient values
+            state['exp_avg_sq'] = torch.zeros_like(p.data)
+
+    @staticmethod
+    def _backend(p):
+        backend = fused_lamb_cuda if p.is_cuda else deepspeed_lamb_cpu
+        assert backend is not None, \
+            'FusedLamb extension for {} parameters is not installed'.format(
+                p.device.type)
+        return backend
+
+    def _lamb_coeff_buffer(self, device):
+        if self.lamb_coeffs is None:
+            num_params = sum([len(group['params']) for group in self.param_groups])
+            self.lamb_coeffs = torch.zeros(num_params, dtype=torch.float, device=device)
+        return self.lamb_coeffs
+
+    def _copy_lamb_coeffs_to_host(self):
+        if self.lamb_coeffs is None or not self.lamb_coeffs.is_cuda:
+            return
+        slot = self.lamb_coeff_steps % 2
+        if self.host_lamb_coeffs[slot] is None:
+            host = torch.empty(self.lamb_coeffs.size(),
+                               dtype=torch.float,
+                               pin_memory=True)
+        else:
+            host, _, _ = self.host_lamb_coeffs[slot]
+        host.copy_(self.lamb_coeffs, non_blocking=True)
+        event = torch.cuda.Event()
+        event.record()
+        self.host_lamb_coeffs[slot] = (host, event, self.lamb_coeff_indices)
+
+    def load_state_dict(self, state_dict):
+        super(FusedLamb, self).load_state_dict(state_dict)
+        # torch.optim.Optimizer casts every state tensor to the dtype of its
+        # floating point parameter, restore the quantized moments
+        if self.state_bits == 8:
+            for state in self.state.values():
+                if 'exp_avg_absmax' in state:
+                    state['exp_avg'] = state['exp_avg'].to(torch.int8)
+                    state['exp_avg_sq'] = state['exp_avg_sq'].to(torch.uint8)
 
     def step(self,
              closure=None,
              grads=None,
              output_params=None,
              scale=1.,
-             grad_norms=None):
+             grad_norms=None,
+             skip=None):
         """Performs a single optimization step.
 
         Arguments:
@@ -93,6 +199,10 @@ class FusedLamb(torch.optim.Optimizer):
                 updated weights. Have to be of same type as gradients. (default: None)
             scale (float, optional): factor to divide gradient tensor values
                 by before applying to weights. (default: 1)
+            skip (tensor, optional): a bool flag, the kernels leave the weights,
+                the states and the trust ratios unchanged when it is set. It is
+                read on the device, so the step does not wait for it. The step
+                counts are advanced on the host either way. (default: None)
         """
         loss = None
         if closure is not None:
@@ -122,7 +232,17 @@ class FusedLamb(torch.optim.Optimizer):
             grad_norms = [None] * len(self.param_groups)
 
         #remove the previous coeffs
-        del self.lamb_coeffs[:]
+        self.lamb_coeff_indices = []
+
+        # position of the parameter in the optimizer, seeds stochastic rounding
+        param_index = -1
+
+        # the flag as one byte on the device of each parameter
+        skip_flags = {}
+        if skip is None:
+            skip = torch.empty(0, dtype=torch.uint8)
+        else:
+            skip = skip.reshape(1)
 
         for group, grads_this_group, output_params_this_group, grad_norm_group in zip(self.param_groups, grads_group, output_params_group, grad_norms):
             if grads_this_group is None:
@@ -138,6 +258,7 @@ class FusedLamb(torch.optim.Optimizer):
             bias_correction = 1 if group['bias_correction'] else 0
 
             for p, grad, output_param, grad_norm in zip(group['params'], grads_this_group, output_params_this_group, grad_norm_group):
+                param_index += 1
 
                 # compute combined scale factor for this group
                 combined_scale = scale
@@ -161,11 +282,7 @@ class FusedLamb(torch.optim.Optimizer):
 
                 # State initialization
                 if len(state) == 0:
-                    state['step'] = 0
-                    # Exponential moving average of gradient values
-                    state['exp_avg'] = torch.zeros_like(p.data)
-                    # Exponential moving average of squared gradient values
-                    state['exp_avg_sq'] = torch.zeros_like(p.data)
+                    self._init_state(p, state)
 
                 exp_avg, exp_avg_sq = state['exp_avg'], state['exp_avg_sq']
                 beta1, beta2 = group['betas']
@@ -177,25 +294,87 @@ class FusedLamb(torch.optim.Optimizer):
                 out_p = torch.tensor(
                     [],
                     dtype=torch.float) if output_param is None else output_param
-                lamb_coeff = fused_lamb_cuda.lamb(p.data,
-                                                  out_p,
-                                                  exp_avg,
-                                                  exp_avg_sq,
-                                                  grad,
-                                                  group['lr'],
-                                                  beta1,
-                                                  beta2,
-                                                  max_coeff,
-                                                  min_coeff,
-                                                  group['eps'],
-                                                  combined_scale,
-                                                  state['step'],
-                                                  self.eps_mode,
-                                                  bias_correction,
-                                                  group['weight_decay'])
-                self.lamb_coeffs.append(lamb_coeff)
+                seed = stochastic_rounding_seed(state['step'], param_index)
+                lamb_coeffs = self._lamb_coeff_buffer(p.device)
+                if lamb_coeffs.device == p.device:
+                    lamb_coeff = lamb_coeffs.narrow(0, param_index, 1)
+                else:
+                    # starts from the previous ratio, which a skipped step keeps
+                    lamb_coeff = lamb_coeffs.narrow(0, param_index, 1).to(p.device)
+
+                backend = self._backend(p)
+                skip_flag = skip
+                if skip.numel() > 0 and skip.device != p.device:
+                    if p.device not in skip_flags:
+                        skip_flags[p.device] = skip.to(p.device)
+                    skip_flag = skip_flags[p.device]
+                if self.state_bits == 8:
+                    backend.lamb_8bit(p.data,
+                                      out_p,
+                                      exp_avg,
+                                      state['exp_avg_absmax'],
+                                      exp_avg_sq,
+                                      state['exp_avg_sq_absmax'],
+                                      grad,
+                                      group['lr'],
+                                      beta1,
+                                      beta2,
+                                      max_coeff,
+                                      min_coeff,
+                                      group['eps'],
+                                      combined_scale,
+                                      state['step'],
+                                      self.eps_mode,
+                                      bias_correction,
+                                      group['weight_decay'],
+                                      self.stochastic_rounding,
+                                      seed,
+                                      lamb_coeff,
+                                      skip_flag)
+                else:
+                    backend.lamb(p.data,
+                                 out_p,
+                                 exp_avg,
+                                 exp_avg_sq,
+                                 grad,
+                                 group['lr'],
+                                 beta1,
+                                 beta2,
+                                 max_coeff,
+                                 min_coeff,
+                                 group['eps'],
+                                 combined_scale,
+                                 state['step'],
+                                 self.eps_mode,
+                                 bias_correction,
+                                 group['weight_decay'],
+                                 self.stochastic_rounding,
+                                 seed,
+                                 lamb_coeff,
+                                 skip_flag)
+                if lamb_coeff.device != lamb_coeffs.device:
+                    lamb_coeffs[param_index].copy_(lamb_coeff[0])
+                self.lamb_coeff_indices.append(param_index)
+
+        self.lamb_coeff_steps += 1
+        if self.async_lamb_coeffs:
+            self._copy_lamb_coeffs_to_host()
         return loss
 
     def get_lamb_coeffs(self):
-        lamb_coeffs = [lamb_coeff.item() for lamb_coeff in self.lamb_coeffs]
-        return lamb_coeffs
+        """Trust ratios of the parameters updated by the last step, in update
+        order. With async_lamb_coeffs the ratios of the step before the last
+        one are returned instead: their copy to the host was queued behind
+        that step, so reading them does not wait for the last step."""
+        if self.lamb_coeffs is None:
+            return []
+        if not self.async_lamb_coeffs or not self.lamb_coeffs.is_cuda:
+            values = self.lamb_coeffs.tolist()
+            return [values[i] for i in self.lamb_coeff_indices]
+
+        if self.lamb_coeff_steps < 2:
+            return []
+        host, event, indices = self.host_lamb_coeffs[(self.lamb_coeff_steps - 1) % 2]
+        event.synchronize()
+        values = host.tolist()
+        return [values[i] for i in indices]
@@ -0,0 +1,208 @@
+'''
+Copyright 2020 The Microsoft DeepSpeed Team
+
+Key/value cache of autoregressive decoding. Decoding a token runs every layer
+on that token alone: its key and value are appended to the cache of the
+layer and its query attends to the keys and values of all the tokens of its
+sequence so far, so a token costs time linear in the sequence length instead
+of recomputing the whole sequence.
+
+The cache is paged: the keys and values of every layer live in a pool of
+fixed size blocks of block_size tokens, and a sequence takes a block when it
+fills the previous one and returns its blocks when it ends. Memory is thus
+only held for the tokens of the running sequences rather than reserved for
+the maximum length of every sequence. All layers share the block tables, a
+sequence owning the same blocks in the pool of each layer.
+
+Attention against the cache runs in csrc/inference/kv_cache_cpu.cpp for float
+host tensors and with torch ops otherwise.
+'''
+
+import collections
+import torch
+
+try:
+    import deepspeed_kv_cache_cpu
+except ImportError:
+    deepspeed_kv_cache_cpu = None
+
+KV_CACHE_BLOCK_SIZE = 16
+
+
+class DecodeStep(object):
+    """Where the sequences of a decoding step write their new token, as
+    tensors on the device of the cache.
+
+    Attributes:
+        seq_ids: The sequences of the batch, in batch order
+        slots: int64 [batch], the slot of the new token in the block pool,
+            block * block_size + offset
+        block_tables: int32 [batch, max blocks], the blocks of every
+            sequence, padded with zeros
+        lengths: int32 [batch], the tokens of every sequence including the
+            new one
+    """
+    def __init__(self, seq_ids, slots, block_tables, lengths):
+        self.seq_ids = seq_ids
+        self.slots = slots
+        self.block_tables = block_tables
+        self.lengths = lengths
+
+
+def paged_attention(query, key_blocks, value_blocks, block_tables, lengths, scale):
+    """Single query attention of every sequence against its cached tokens.
+
+    Arguments:
+        query: [batch, heads, head_size]
+        key_blocks, value_blocks: the pool of a layer, [num_blocks, block_size,
+            heads, head_size]
+        block_tables: int32 [batch, max blocks]
+        lengths: int32 [batch], the cached tokens every query attends to
+        scale: factor of the scores, 1 / sqrt(head_size) in BERT
+
+    Returns:
+        The attention output of every query, [batch, heads, head_size]
+    """
+    if deepspeed_kv_cache_cpu is not None and not query.is_cuda and \
+            query.dtype == torch.float32 and key_blocks.dtype == torch.float32:
+        output = torch.empty_like(query)
+        deepspeed_kv_cache_cpu.paged_attention(query.contiguous(),
+                                               key_blocks,
+                                               value_blocks,
+                                               block_tables,
+                                               lengths,
+                                               scale,
+                                               output)
+        return output
+
+    block_size, heads, head_size = key_blocks.shape[1:]
+    keys = key_blocks.view(-1, heads, head_size)
+    values = value_blocks.view(-1, heads, head_size)
+    output = torch.zeros_like(query)
+    for b, length in enumerate(lengths.tolist()):
+        if length == 0:
+            continue
+        positions = torch.arange(length, device=query.device)
+        slots = block_tables[b].long()[positions // block_size] * block_size + \
+            positions % block_size
+        scores = torch.einsum('hd,thd->ht', query[b].float(), keys[slots].float())
+        probs = torch.softmax(scores * scale, dim=-1)
+        output[b] = torch.einsum('ht,thd->hd', probs, values[slots].float())
+    return output
+
+
+class PagedKVCache(object):
+    """Preallocated paged key/value cache of the layers of a model.
+
+    Arguments:
+        num_layers: Layers of the model, indexed by their layer_id
+
+        heads: Heads of every layer held by this rank
+
+        head_size: The size of a head
+
+        num_blocks: Blocks of the pool of every layer
+
+        block_size: Optional: Tokens per block
+
+        dtype: Optional: The type of the cached keys and values
+
+        device: Optional: The device of the cache
+    """
+    def __init__(self,
+                 num_layers,
+                 heads,
+                 head_size,
+                 num_blocks,
+                 block_size=KV_CACHE_BLOCK_SIZE,
+                 dtype=torch.float32,
+                 device='cpu'):
+        self.block_size = block_size
+        self.num_blocks = num_blocks
+        self.device = torch.device(device)
+        shape = (num_layers, num_blocks, block_size, heads, head_size)
+        self.key_blocks = torch.zeros(shape, dtype=dtype, device=self.device)
+        self.value_blocks = torch.zeros(shape, dtype=dtype, device=self.device)
+        # popped from the end, so blocks are taken in order
+        self.free_blocks = list(range(num_blocks - 1, -1, -1))
+        self.block_tables = {}
+        self.lengths = {}
+
+    def num_free_blocks(self):
+        return len(self.free_blocks)
+
+    def add_sequence(self, seq_id):
+        assert seq_id not in self.lengths, 'sequence {} is cached already'.format(seq_id)
+        self.block_tables[seq_id] = []
+        self.lengths[seq_id] = 0
+
+    def free_sequence(self, seq_id):
+        """Returns the blocks of a finished sequence to the pool."""
+        self.free_blocks.extend(reversed(self.block_tables.pop(seq_id)))
+        del self.lengths[seq_id]
+
+    def _num_blocks(self, length):
+        return (length + self.block_size - 1) // self.block_size
+
+    def reserve(self, seq_ids):
+        """Makes room for one more token of each of seq_ids, taking a block
+        for every sequence whose blocks are full, and counts the token.
+
+        Returns:
+            The DecodeStep of the tokens
+        """
+        # a sequence listed k times takes k tokens, so count the blocks those
+        # tokens start once per sequence
+        needed = 0
+        for seq_id, count in collections.Counter(seq_ids).items():
+            length = self.lengths[seq_id]
+            needed += self._num_blocks(length + count) - self._num_blocks(length)
+        if needed > len(self.free_blocks):
+            raise RuntimeError('KV cache is out of blocks, {} needed and {} free'.format(
+                needed,
+                len(self.free_blocks)))
+
+        slots = []
+        for seq_id in seq_ids:
+            length = self.lengths[seq_id]
+            table = self.block_tables[seq_id]
+            if length % self.block_size == 0:
+                table.append(self.free_blocks.pop())
+            slots.append(table[-1] * self.block_size + length % self.block_size)
+            self.lengths[seq_id] = length + 1
+
+        max_blocks = max(len(self.block_tables[seq_id]) for seq_id in seq_ids)
+        block_tables = torch.zeros(len(seq_ids), max_blocks, dtype=torch.int32)
+        for b, seq_id in enumerate(seq_ids):
+            table = self.block_tables[seq_id]
+            block_tables[b, :len(table)] = torch.tensor(table, dtype=torch.int32)
+        lengths = torch.tensor([self.lengths[seq_id] for seq_id in seq_ids],
+                               dtype=torch.int32)
+        return DecodeStep(list(seq_ids),
+                          torch.tensor(slots,
+                                       dtype=torch.int64).to(self.device),
+                          block_tables.to(self.device),
+                          lengths.to(self.device))
+
+    def append(self, layer_id, step, key, value):
+        """Writes the key and value of the new tokens, [batch, heads,
+        head_size], into the cache of a layer."""
+        heads, head_size = self.key_blocks.shape[-2:]
+        self.key_blocks[layer_id].view(-1, heads, head_size).index_copy_(
+            0,
+            step.slots,
+            key.detach().to(self.key_blocks.dtype))
+        self.value_blocks[layer_id].view(-1, heads, head_size).index_copy_(
+            0,
+            step.slots,
+            value.detach().to(self.value_blocks.dtype))
+
+    def attention(self, layer_id, step, query, scale):
+        """Attention of the new tokens' queries, [batch, heads, head_size], to
+        their sequences in the cache of a layer, new tokens included."""
+        return paged_attention(query,
+                               self.key_blocks[layer_id],
+                               self.value_blocks[layer_id],
+                               step.block_tables,
+                               step.lengths,
+                               scale)
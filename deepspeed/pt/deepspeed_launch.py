@@ -11,6 +11,7 @@ from collections import defaultdict
 from argparse import ArgumentParser, REMAINDER
 
 from deepspeed.pt.log_utils import logger
+from deepspeed.pt import deepspeed_cpu_affinity as cpu_affinity
 
 
 def parse_args():
@@ -41,6 +42,11 @@ def parse_args():
                         default="None",
                         type=str,
                         help="world info base64 encoded dictionary")
+    parser.add_argument("--bind_cpus",
+                        action="store_true",
+                        help="Split the cpus and NUMA nodes of the node across"
+                        " the local processes, next to their GPUs, and bind"
+                        " them")
 
     # positional
     parser.add_argument("training_script",
@@ -55,6 +61,14 @@ def parse_args():
     return parser.parse_args()
 
 
+def bind_local_rank(local_rank, placement):
+    # runs in the child before exec, the launcher has no other threads
+    if not cpu_affinity.bind(placement):
+        logger.warning("local_rank={} could not be bound to {}".format(
+            local_rank,
+            placement))
+
+
 def main():
     args = parse_args()
     current_env = os.environ.copy()
@@ -101,6 +115,17 @@ def main():
     current_env["MASTER_PORT"] = str(args.master_port)
     current_env["WORLD_SIZE"] = str(dist_world_size)
 
+    placements = None
+    if args.bind_cpus:
+        gpu_nodes = cpu_affinity.local_gpu_nodes(local_gpu_ids)
+        if gpu_nodes is None:
+            logger.info("NUMA nodes of the GPUs unknown, splitting the cpus evenly")
+        placements = cpu_affinity.partition(cpu_affinity.CpuTopology.read(),
+                                            num_local_procs,
+                                            gpu_nodes)
+        if placements is None:
+            logger.warning("Fewer cpus than local processes, not binding them")
+
     processes = []
     for local_rank in range(0, num_local_procs):
         # each process's rank
@@ -114,7 +139,17 @@ def main():
             args.training_script,
             "--local_rank={}".format(local_rank)
         ] + args.training_script_args
-        process = subprocess.Popen(cmd, env=current_env)
+
+        rank_env = current_env
+        preexec_fn = None
+        if placements is not None:
+            placement = placements[local_rank]
+            logger.info("local_rank={} bound to {}".format(local_rank, placement))
+            rank_env = dict(current_env)
+            rank_env.update(cpu_affinity.thread_environment(placement, current_env))
+            preexec_fn = lambda local_rank=local_rank, placement=placement: \
+                bind_local_rank(local_rank, placement)
+        process = subprocess.Popen(cmd, env=rank_env, preexec_fn=preexec_fn)
         processes.append(process)
 
     for process in processes:
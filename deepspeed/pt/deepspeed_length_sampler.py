@@ -0,0 +1,157 @@
+'''
+Copyright 2020 The Microsoft DeepSpeed Team
+
+Distributed sampler that groups samples of similar length into the same
+batches, so batches padded to their longest sample waste few tokens.
+'''
+
+import numpy as np
+from torch.utils.data import Sampler
+
+from deepspeed.pt.log_utils import logger
+
+
+def padded_length(length, max_length=None, pad_to_multiple_of=None):
+    """Row length of a batch whose longest sample has length tokens."""
+    if pad_to_multiple_of:
+        length = -(-length // pad_to_multiple_of) * pad_to_multiple_of
+    if max_length is not None:
+        length = np.minimum(length, max_length)
+    return length
+
+
+class LengthBucketingSampler(Sampler):
+    """Samples global batches of batch_size * num_replicas indices of similar
+    length and gives every rank batch_size of them per step.
+
+    Each epoch the indices are shuffled with a generator seeded by seed and the
+    epoch, split into chunks of bucket_size_multiplier global batches, sorted
+    by length within a chunk and cut into global batches, whose order is then
+    shuffled again. Every rank computes the same plan without communication.
+    Ranks take interleaved samples of each global batch, so their longest
+    samples, and thereby their step times, stay close.
+
+    Like DistributedSampler, the indices are padded by repeating some of them
+    to fill the last global batch unless drop_last is set, and set_epoch must
+    be called before each epoch to change the order.
+
+    Arguments:
+        lengths: number of tokens of every sample, e.g. MMapTokenDataset.sizes
+        batch_size: per rank batch size
+        max_length, pad_to_multiple_of, pad_to_longest: how batches are
+            padded, only used to report the padding fraction. Batches are
+            padded to their longest sample, or to max_length without
+            pad_to_longest, like MMapTokenDataset without pad_to_multiple_of
+    """
+    def __init__(self,
+                 lengths,
+                 batch_size,
+                 num_replicas=1,
+                 rank=0,
+                 shuffle=True,
+                 seed=0,
+                 bucket_size_multiplier=100,
+                 drop_last=False,
+                 max_length=None,
+                 pad_to_multiple_of=None,
+                 pad_to_longest=True):
+        assert 0 <= rank < num_replicas, 'invalid rank {} of {}'.format(
+            rank,
+            num_replicas)
+        assert pad_to_longest or max_length is not None, \
+            'batches not padded to their longest sample need a max_length'
+        self.lengths = np.asarray(lengths, dtype=np.int64)
+        self.batch_size = batch_size
+        self.num_replicas = num_replicas
+        self.rank = rank
+        self.shuffle = shuffle
+        self.seed = seed
+        self.bucket_size_multiplier = bucket_size_multiplier
+        self.drop_last = drop_last
+        self.max_length = max_length
+        self.pad_to_multiple_of = pad_to_multiple_of
+        self.pad_to_longest = pad_to_longest
+        self.epoch = 0
+
+        global_batch_size = batch_size * num_replicas
+        if drop_last:
+            self.num_global_batches = len(self.lengths) // global_batch_size
+        else:
+            self.num_global_batches = -(-len(self.lengths) // global_batch_size)
+
+    def set_epoch(self, epoch):
+        self.epoch = epoch
+
+    def __len__(self):
+        return self.num_global_batches * self.batch_size
+
+    def global_batches(self, shuffle=None):
+        """The plan of the current epoch, a [num_batches, batch_size *
+        num_replicas] array of sample indices."""
+        shuffle = self.shuffle if shuffle is None else shuffle
+        rng = np.random.RandomState((self.seed + self.epoch) % 2**32)
+        indices = rng.permutation(len(self.lengths)) if shuffle \
+            else np.arange(len(self.lengths))
+
+        global_batch_size = self.batch_size * self.num_replicas
+        total = self.num_global_batches * global_batch_size
+        if total <= len(indices):
+            indices = indices[:total]
+        elif len(indices) > 0:
+            indices = np.resize(indices, total)
+
+        chunk_size = global_batch_size * self.bucket_size_multiplier
+        chunks = []
+        for start in range(0, total, chunk_size):
+            chunk = indices[start:start + chunk_size]
+            chunks.append(chunk[np.argsort(self.lengths[chunk], kind='stable')])
+        batches = np.concatenate(chunks).reshape(-1, global_batch_size) if chunks \
+            else np.zeros((0, global_batch_size), dtype=np.int64)
+
+        if shuffle:
+            batches = batches[rng.permutation(len(batches))]
+        return batches
+
+    def __iter__(self):
+        batches = self.global_batches()
+        if self.rank == 0:
+            stats = self.padding_stats(batches)
+            logger.info('length bucketing epoch {}: padding fraction {:.3f}, '
+                        'without bucketing {:.3f}'.format(
+                            self.epoch,
+                            stats['padding_fraction'],
+                            stats['unbucketed_padding_fraction']))
+        return iter(batches[:, self.rank::self.num_replicas].reshape(-1).tolist())
+
+    def _padding_fraction(self, batches):
+        if batches.size == 0:
+            return 0.0
+        lengths = self.lengths[batches]
+        if self.max_length is not None:
+            lengths = np.minimum(lengths, self.max_length)
+        if self.pad_to_longest:
+            # per rank batches, each padded to its own longest sample
+            rank_lengths = lengths.reshape(len(batches),
+                                           self.batch_size,
+                                           self.num_replicas)
+            widths = padded_length(rank_lengths.max(axis=1),
+                                   self.max_length,
+                                   self.pad_to_multiple_of)
+            padded = widths.sum() * self.batch_size
+        else:
+            padded = lengths.size * self.max_length
+        return float(padded - lengths.sum()) / max(float(padded), 1.0)
+
+    def padding_stats(self, batches=None):
+        """Fraction of the tokens of all ranks' batches in the current epoch
+        that are padding, with this plan and with the same batches drawn
+        without length bucketing. Both are the same unless batches are padded
+        to their longest sample."""
+        if batches is None:
+            batches = self.global_batches()
+        rng = np.random.RandomState((self.seed + self.epoch) % 2**32)
+        unbucketed = rng.permutation(batches.reshape(-1)).reshape(batches.shape)
+        return {
+            'padding_fraction': self._padding_fraction(batches),
+            'unbucketed_padding_fraction': self._padding_fraction(unbucketed)
+        }
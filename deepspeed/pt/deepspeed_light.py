@@ -2,8 +2,11 @@
 Copyright 2019 The Microsoft DeepSpeed Team
 '''
 
+import copy
 import torch
 import os
+import time
+import atexit
 import warnings
 import torch.distributed as dist
 from torch.nn.modules import Module
@@ -24,9 +27,17 @@ from deepspeed.pt.deepspeed_config import DeepSpeedConfig, \
     ADAM_OPTIMIZER, LAMB_OPTIMIZER, DEEPSPEED_OPTIMIZERS
 
 from deepspeed.pt.deepspeed_dataloader import DeepSpeedDataLoader
+from deepspeed.pt.deepspeed_length_sampler import LengthBucketingSampler
+from deepspeed.pt.deepspeed_checkpoint_writer import AsyncCheckpointWriter
+from deepspeed.pt.deepspeed_flat_checkpoint import save_flat_checkpoint, \
+    load_flat_checkpoint, is_flat_checkpoint
+from deepspeed.pt.deepspeed_flops_profiler import FlopsProfiler
+from deepspeed.pt.deepspeed_telemetry import StepTelemetry, JsonLinesSink, \
+    PrometheusTextfileSink, model_flops_per_sample
 from deepspeed.pt.deepspeed_constants import \
     ROUTE_TRAIN, ROUTE_PREDICT, ROUTE_EVAL, \
-    TORCH_DISTRIBUTED_DEFAULT_PORT, \
+    TORCH_DISTRIBUTED_DEFAULT_PORT, CHECKPOINT_FILE_FORMAT_FLAT, \
+    TELEMETRY_FILE_FORMAT_PROMETHEUS, \
     ZERO_OPTIMIZATION_OPTIMIZER_STATES, ZERO_OPTIMIZATION_GRADIENTS
 
 import deepspeed.pt.deepspeed_lr_schedules as lr_schedules
@@ -53,6 +64,7 @@ except ImportError:
 def split_half_float_double_csr(tensors):
     dtypes = [
         "torch.cuda.HalfTensor",
+        "torch.cuda.BFloat16Tensor",
         "torch.cuda.FloatTensor",
         "torch.cuda.DoubleTensor",
         CSRTensor.type()
@@ -153,18 +165,26 @@ class DeepSpeedLight(Module):
         # Configure wall clock timer
         self.timers = SynchronizedWallClockTimer()
 
+        self.flops_profiler = FlopsProfiler(
+            self.module) if self.flops_profiler_enabled() else None
+
         # Throughput timer
         self.tput_timer = ThroughputTimer(
             batch_size=self.train_micro_batch_size_per_gpu(),
             num_workers=self.dp_world_size,
             monitor_memory=False)
 
+        # Per step performance records
+        self.telemetry = self._configure_telemetry()
+
         self.training_dataloader = self.deepspeed_io(
             training_data) if training_data else None
 
         # Configure optimizer and scheduler
         self.optimizer = None
         self.lr_scheduler = None
+        # state of the scheduler before its latest step, see _undo_lr_scheduler_step
+        self.lr_scheduler_before_step = None
         if model_parameters or optimizer:
             self._configure_optimizer(optimizer, model_parameters)
             self._configure_lr_scheduler(lr_scheduler)
@@ -235,6 +255,66 @@ class DeepSpeedLight(Module):
     def tensorboard_job_name(self):
         return self._config.tensorboard_job_name
 
+    def checkpoint_file_format(self):
+        return self._config.checkpoint_file_format
+
+    def checkpoint_async_save(self):
+        return self._config.checkpoint_async_save
+
+    def checkpoint_max_staging_mb(self):
+        return self._config.checkpoint_max_staging_mb
+
+    def checkpoint_writer_threads(self):
+        return self._config.checkpoint_writer_threads
+
+    def data_loader_prefetch_depth(self):
+        return self._config.data_loader_prefetch_depth
+
+    def data_loader_copy_to_device(self):
+        return self._config.data_loader_copy_to_device
+
+    def data_loader_length_bucketing(self):
+        return self._config.data_loader_length_bucketing
+
+    def data_loader_bucket_size_multiplier(self):
+        return self._config.data_loader_bucket_size_multiplier
+
+    def telemetry_enabled(self):
+        return self._config.telemetry_enabled
+
+    def telemetry_output_path(self):
+        return self._config.telemetry_output_path
+
+    def telemetry_file_format(self):
+        return self._config.telemetry_file_format
+
+    def telemetry_interval_steps(self):
+        return self._config.telemetry_interval_steps
+
+    def telemetry_flush_steps(self):
+        return self._config.telemetry_flush_steps
+
+    def telemetry_max_overhead(self):
+        return self._config.telemetry_max_overhead
+
+    def telemetry_flops_per_sample(self):
+        return self._config.telemetry_flops_per_sample
+
+    def telemetry_reset_device_peak(self):
+        return self._config.telemetry_reset_device_peak
+
+    def flops_profiler_enabled(self):
+        return self._config.flops_profiler_enabled
+
+    def flops_profiler_profile_step(self):
+        return self._config.flops_profiler_profile_step
+
+    def flops_profiler_module_depth(self):
+        return self._config.flops_profiler_module_depth
+
+    def flops_profiler_top_modules(self):
+        return self._config.flops_profiler_top_modules
+
     def get_summary_writer(self,
                            name="DeepSpeedJobName",
                            base=os.environ["HOME"] + "/tensorboard"):
@@ -312,9 +392,15 @@ class DeepSpeedLight(Module):
     def fp16_enabled(self):
         return self._config.fp16_enabled
 
+    def bfloat16_enabled(self):
+        return self._config.bfloat16_enabled
+
     def loss_scale(self):
         return self._config.loss_scale
 
+    def fp16_lazy_overflow(self):
+        return self._config.fp16_lazy_overflow
+
     def gradient_accumulation_steps(self):
         return self._config.gradient_accumulation_steps
 
@@ -376,6 +462,48 @@ class DeepSpeedLight(Module):
             # optimizer state checkpoints for zero
             self.save_zero_checkpoint = (pp_rank == dp_rank)
 
+        self.checkpoint_writer = None
+        if self.checkpoint_async_save() and (self.save_non_zero_checkpoint
+                                             or self.save_zero_checkpoint):
+            self.checkpoint_writer = AsyncCheckpointWriter(
+                self.checkpoint_max_staging_mb() * 1024 * 1024,
+                num_threads=self.checkpoint_writer_threads())
+
+    def _configure_telemetry(self):
+        if not self.telemetry_enabled():
+            return None
+
+        path = self.telemetry_output_path()
+        if '{rank}' in path:
+            path = path.replace('{rank}', str(self.global_rank))
+        elif self.global_rank != 0:
+            return None
+
+        if self.telemetry_file_format() == TELEMETRY_FILE_FORMAT_PROMETHEUS:
+            sink = PrometheusTextfileSink(path, labels={'rank': self.global_rank})
+        else:
+            sink = JsonLinesSink(path)
+
+        flops_per_sample = self.telemetry_flops_per_sample()
+        if not flops_per_sample:
+            flops_per_sample = model_flops_per_sample(self.module)
+        logger.info('Writing telemetry to {}, {:.3f} GFLOPs per sample'.format(
+            path,
+            flops_per_sample / 1e9))
+
+        telemetry = StepTelemetry(sink,
+                                  samples_per_step=self.train_batch_size(),
+                                  flops_per_sample=flops_per_sample,
+                                  data_parallel_size=self.dp_world_size,
+                                  interval_steps=self.telemetry_interval_steps(),
+                                  flush_steps=self.telemetry_flush_steps(),
+                                  max_overhead=self.telemetry_max_overhead(),
+                                  clock=self.timers.clock,
+                                  reset_device_peak=self.telemetry_reset_device_peak())
+        # buffered records are written at exit
+        atexit.register(telemetry.flush)
+        return telemetry
+
     def _scheduler_from_config(self, optimizer):
         scheduler_name = self.scheduler_name()
         if scheduler_name is not None:
@@ -453,6 +581,8 @@ class DeepSpeedLight(Module):
         self.module = model
         if self.fp16_enabled():
             self.module.half()
+        elif self.bfloat16_enabled():
+            self.module.bfloat16()
         self.module.to(self.device)
         if self.mpu is None:
             self.data_parallel_group = _initialize_parameter_parallel_groups()
@@ -496,6 +626,8 @@ class DeepSpeedLight(Module):
             self.optimizer = self._configure_zero_optimizer(basic_optimizer)
         elif self.fp16_enabled():
             self.optimizer = self._configure_fp16_optimizer(basic_optimizer)
+        elif self.bfloat16_enabled():
+            self.optimizer = self._configure_bfloat16_optimizer(basic_optimizer)
         else:
             self.optimizer = basic_optimizer
 
@@ -508,8 +640,15 @@ class DeepSpeedLight(Module):
                 "'max_grad_norm' is not supported as an optimizer parameter, please switch to using the deepspeed parameter 'gradient_clipping' see: https://www.deepspeed.ai/docs/config-json/#gradient-clipping for more details"
             )
         if self.optimizer_name() == ADAM_OPTIMIZER:
-            from apex.optimizers.fused_adam import FusedAdam
-            optimizer = FusedAdam(model_parameters, **optimizer_parameters)
+            if optimizer_parameters.get('state_bits', 32) != 32:
+                # Adam is LAMB with the trust ratio pinned to 1, which lets
+                # Adam use the blockwise 8-bit states of the fused LAMB kernel
+                lamb_parameters = {'max_coeff': 1.0, 'min_coeff': 1.0}
+                lamb_parameters.update(optimizer_parameters)
+                optimizer = FusedLamb(model_parameters, **lamb_parameters)
+            else:
+                from apex.optimizers.fused_adam import FusedAdam
+                optimizer = FusedAdam(model_parameters, **optimizer_parameters)
         elif self.optimizer_name() == LAMB_OPTIMIZER:
             optimizer = FusedLamb(model_parameters, **optimizer_parameters)
         else:
@@ -533,7 +672,8 @@ class DeepSpeedLight(Module):
                     mpu=self.mpu,
                     clip_grad=clip_grad,
                     fused_adam_legacy=self.optimizer_legacy_fusion(),
-                    timers=timers)
+                    timers=timers,
+                    lazy_overflow=self.fp16_lazy_overflow())
             else:
                 logger.info('Creating fp16 optimizer with static loss scale: {}'.format(
                     self.loss_scale()))
@@ -542,7 +682,8 @@ class DeepSpeedLight(Module):
                     static_loss_scale=self.loss_scale(),
                     mpu=self.mpu,
                     clip_grad=clip_grad,
-                    fused_adam_legacy=self.optimizer_legacy_fusion())
+                    fused_adam_legacy=self.optimizer_legacy_fusion(),
+                    lazy_overflow=self.fp16_lazy_overflow())
         else:
             logger.info('Creating fp16 unfused optimizer with dynamic loss scale')
             optimizer = FP16_UnfusedOptimizer(
@@ -555,6 +696,29 @@ class DeepSpeedLight(Module):
 
         return optimizer
 
+    def _configure_bfloat16_optimizer(self, optimizer):
+        # bf16 has the exponent range of fp32, so the loss is not scaled and
+        # the fp16 wrappers only keep the fp32 master weights
+        clip_grad = self.gradient_clipping()
+        if self.optimizer_name() == ADAM_OPTIMIZER:
+            logger.info('Creating bf16 optimizer')
+            timers = self.timers if self.wall_clock_breakdown() else None
+            optimizer = FP16_Optimizer(optimizer,
+                                       static_loss_scale=1.0,
+                                       mpu=self.mpu,
+                                       clip_grad=clip_grad,
+                                       timers=timers)
+        else:
+            logger.info('Creating bf16 unfused optimizer')
+            optimizer = FP16_UnfusedOptimizer(
+                optimizer,
+                static_loss_scale=1.0,
+                mpu=self.mpu,
+                clip_grad=clip_grad,
+                fused_lamb_legacy=self.optimizer_name() == LAMB_OPTIMIZER)
+
+        return optimizer
+
     def _configure_zero_optimizer(self, optimizer):
         zero_stage = self.zero_optimization_stage()
         logger.info('Creating fp16 ZeRO stage {} optimizer'.format(zero_stage))
@@ -571,7 +735,9 @@ class DeepSpeedLight(Module):
                 allgather_size=self.zero_allgather_bucket_size(),
                 max_elements_per_comm=self.zero_reduce_bucket_size(),
                 dp_process_group=self.data_parallel_group,
-                mpu=self.mpu)
+                mpu=self.mpu,
+                telemetry=self.telemetry,
+                lazy_overflow=self.fp16_lazy_overflow())
         elif zero_stage == ZERO_OPTIMIZATION_GRADIENTS:
             assert self.gradient_accumulation_steps() == 1, "ZeRO stage 2 does not support gradient accumulation, if you need gradient accumulation please use stage 1"
             optimizer = FP16_DeepSpeedZeroOptimizer(
@@ -589,7 +755,9 @@ class DeepSpeedLight(Module):
                 overlap_comm=self.zero_overlap_comm(),
                 mpu=self.mpu,
                 postscale_gradients=self.postscale_gradients(),
-                gradient_predivide_factor=self.gradient_predivide_factor())
+                gradient_predivide_factor=self.gradient_predivide_factor(),
+                telemetry=self.telemetry,
+                lazy_overflow=self.fp16_lazy_overflow())
         else:
             raise NotImplementedError("ZeRO stage {} not implemented".format(zero_stage))
 
@@ -627,6 +795,17 @@ class DeepSpeedLight(Module):
             data_parallel_world_size = mpu.get_data_parallel_world_size()
             data_parallel_rank = mpu.get_data_parallel_rank()
 
+        if data_sampler is None and route == ROUTE_TRAIN \
+                and self.data_loader_length_bucketing():
+            data_sampler = self._length_bucketing_sampler(dataset, batch_size)
+
+        # Prefetched training batches can be copied to the device in the
+        # background as well, as long as the model lives on a single GPU
+        prefetch_device = None
+        if route == ROUTE_TRAIN and self.data_loader_copy_to_device() \
+                and self.local_rank >= 0:
+            prefetch_device = self.device
+
         return DeepSpeedDataLoader(dataset=dataset,
                                    batch_size=batch_size,
                                    pin_memory=pin_memory,
@@ -636,7 +815,36 @@ class DeepSpeedLight(Module):
                                    num_local_io_workers=num_local_io_workers,
                                    data_sampler=data_sampler,
                                    data_parallel_world_size=data_parallel_world_size,
-                                   data_parallel_rank=data_parallel_rank)
+                                   data_parallel_rank=data_parallel_rank,
+                                   prefetch_depth=self.data_loader_prefetch_depth(),
+                                   device=prefetch_device)
+
+    def _length_bucketing_sampler(self, dataset, batch_size):
+        if not hasattr(dataset, 'sizes'):
+            raise ValueError(
+                "length_bucketing needs a dataset with the sample lengths in 'sizes'")
+
+        # MMapTokenDataset pads every batch to seq_length without pad_to_multiple_of
+        max_length = getattr(dataset, 'seq_length', None)
+        pad_to_multiple_of = getattr(dataset, 'pad_to_multiple_of', None)
+        pad_to_longest = max_length is None or pad_to_multiple_of is not None
+
+        num_replicas = 1
+        rank = 0
+        if self.local_rank >= 0:
+            num_replicas = self.dp_world_size
+            rank = self.mpu.get_data_parallel_rank() if self.mpu is not None \
+                else self.global_rank
+
+        return LengthBucketingSampler(
+            dataset.sizes,
+            batch_size,
+            num_replicas=num_replicas,
+            rank=rank,
+            bucket_size_multiplier=self.data_loader_bucket_size_multiplier(),
+            max_length=max_length,
+            pad_to_multiple_of=pad_to_multiple_of,
+            pad_to_longest=pad_to_longest)
 
     def train(self):
         r"""
@@ -686,14 +894,28 @@ class DeepSpeedLight(Module):
 
         if self.training_dataloader is None:
             self.tput_timer.start()
+
+        if self._is_flops_profiled_step():
+            self.flops_profiler.start_profile()
+
+        deepspeed_activation_checkpointing.start_forward()
         loss = self.module(*inputs, **kwargs)
 
+        if self.flops_profiler is not None and self.flops_profiler.started:
+            self.flops_profiler.stop_profile()
+
         if self.wall_clock_breakdown():
             self.timers('forward').stop()
             self.timers('forward_microstep').stop()
 
         return loss
 
+    def _is_flops_profiled_step(self):
+        # the first micro step of the profiled training step
+        return self.flops_profiler is not None and self.module.training and \
+            self.micro_steps == self.flops_profiler_profile_step() * \
+            self.gradient_accumulation_steps()
+
     def allreduce_gradients(self, bucket_size=MEMORY_OPT_ALLREDUCE_SIZE):
         if self.is_gradient_accumulation_boundary():
             if self.zero_optimization_stage() == ZERO_OPTIMIZATION_OPTIMIZER_STATES:
@@ -746,9 +968,14 @@ class DeepSpeedLight(Module):
             self.timers('backward_inner_microstep').start()
             self.timers('backward_inner').start()
 
+        profile_backward = self._is_flops_profiled_step()
+        if profile_backward:
+            self.flops_profiler._synchronize()
+            backward_start = time.time()
+
         if self.zero_optimization():
             self.optimizer.backward(loss)
-        elif self.fp16_enabled():
+        elif self.fp16_enabled() or self.bfloat16_enabled():
             self.optimizer.backward(loss)
 
             # TODO: Use new AMP semantics as below
@@ -757,6 +984,15 @@ class DeepSpeedLight(Module):
         else:
             loss.backward()
 
+        if profile_backward:
+            self.flops_profiler._synchronize()
+            self.flops_profiler.record_backward(time.time() - backward_start)
+            if self.global_rank == 0:
+                self.flops_profiler.print_model_profile(
+                    module_depth=self.flops_profiler_module_depth(),
+                    top_modules=self.flops_profiler_top_modules())
+            self.flops_profiler.end_profile()
+
         if self.wall_clock_breakdown():
             self.timers('backward_inner').stop()
             self.timers('backward_inner_microstep').stop()
@@ -804,14 +1040,22 @@ class DeepSpeedLight(Module):
 
         if self.is_gradient_accumulation_boundary():
 
-            if not self.fp16_enabled() and self.gradient_clipping() > 0.0:
+            if not (self.fp16_enabled() or self.bfloat16_enabled()) and \
+                    self.gradient_clipping() > 0.0:
                 self.clip_fp32_gradients()
 
+            if self.telemetry is not None:
+                self.telemetry.optimizer_timer.start()
+
             self.optimizer.step()
 
+            if self.telemetry is not None:
+                self.telemetry.optimizer_timer.stop()
+
             #zero grad in basic optimizer could be unreliable and may not exhibit
             #the behaviour that we want
-            if not self.zero_optimization() and not self.fp16_enabled():
+            if not self.zero_optimization() and not (self.fp16_enabled()
+                                                     or self.bfloat16_enabled()):
                 self.zero_grad()
             else:
                 self.optimizer.zero_grad()
@@ -821,17 +1065,30 @@ class DeepSpeedLight(Module):
             if hasattr(self.optimizer, 'overflow'):
                 overflow = self.optimizer.overflow
 
+            # with a lazy overflow check the overflow is the one of the
+            # previous step, and the flag of this step is read at the next one
+            lazy_overflow = getattr(self.optimizer, 'lazy_overflow', False)
             if overflow:
                 self.skipped_steps += 1
-            else:
-                if self.lr_scheduler is not None:
-                    self.lr_scheduler.step()
+                if lazy_overflow:
+                    self._undo_lr_scheduler_step()
+            if lazy_overflow or not overflow:
+                self._lr_scheduler_step()
+            if not overflow:
                 if report_progress and (self.global_steps +
                                         1) % self.steps_per_print() == 0:
                     self._report_progress(self.global_steps + 1)
 
             self.global_steps += 1
 
+            if self.telemetry is not None:
+                self.telemetry.step(self.global_steps,
+                                    overflow=overflow,
+                                    skipped_steps=self.skipped_steps,
+                                    loss_scale=getattr(self.optimizer,
+                                                       'cur_scale',
+                                                       None))
+
         self.tput_timer.stop(report_progress)
 
         # Log learning rate
@@ -861,11 +1118,11 @@ class DeepSpeedLight(Module):
             if self.is_gradient_accumulation_boundary():
                 if self.tensorboard_enabled():
                     if self.global_rank == 0:
-                        self.summary_events = [(f'Train/Samples/elapsed_time_ms_forward', self.timers('forward').elapsed(reset=False) * 1000.0, self.sample_count), \
-                                                (f'Train/Samples/elapsed_time_ms_backward', self.timers('backward').elapsed(reset=False) * 1000.0, self.sample_count), \
-                                                (f'Train/Samples/elapsed_time_ms_backward_inner', self.timers('backward_inner').elapsed(reset=False) * 1000.0, self.sample_count), \
-                                                (f'Train/Samples/elapsed_time_ms_backward_allreduce', self.timers('backward_allreduce').elapsed(reset=False) * 1000.0, self.sample_count), \
-                                                (f'Train/Samples/elapsed_time_ms_step', self.timers('step').elapsed(reset=False) * 1000.0, self.sample_count)
+                        self.summary_events = [(f'Train/Samples/elapsed_time_ms_forward', self.timers('forward').elapsed(reset=False, block=False) * 1000.0, self.sample_count), \
+                                                (f'Train/Samples/elapsed_time_ms_backward', self.timers('backward').elapsed(reset=False, block=False) * 1000.0, self.sample_count), \
+                                                (f'Train/Samples/elapsed_time_ms_backward_inner', self.timers('backward_inner').elapsed(reset=False, block=False) * 1000.0, self.sample_count), \
+                                                (f'Train/Samples/elapsed_time_ms_backward_allreduce', self.timers('backward_allreduce').elapsed(reset=False, block=False) * 1000.0, self.sample_count), \
+                                                (f'Train/Samples/elapsed_time_ms_step', self.timers('step').elapsed(reset=False, block=False) * 1000.0, self.sample_count)
                                                 ]
                         for event in self.summary_events:  # write_summary_events
                             self.summary_writer.add_scalar(event[0], event[1], event[2])
@@ -880,8 +1137,35 @@ class DeepSpeedLight(Module):
                     'step'
                 ])
 
+            if self.training_dataloader is not None \
+                    and self.training_dataloader.prefetch_stats is not None:
+                self.training_dataloader.prefetch_stats.log()
+
         self.micro_steps += 1
 
+    def _lr_scheduler_param_groups(self):
+        return getattr(self.lr_scheduler, 'optimizer', self.optimizer).param_groups
+
+    def _lr_scheduler_step(self):
+        if self.lr_scheduler is None:
+            return
+        if getattr(self.optimizer, 'lazy_overflow', False):
+            state = copy.deepcopy(self.lr_scheduler.state_dict())
+            lrs = [group['lr'] for group in self._lr_scheduler_param_groups()]
+            self.lr_scheduler_before_step = (state, lrs)
+        self.lr_scheduler.step()
+
+    def _undo_lr_scheduler_step(self):
+        """Restores the scheduler and learning rates to before the scheduler's
+        latest step, which followed the optimizer step found to overflow."""
+        if self.lr_scheduler is None or self.lr_scheduler_before_step is None:
+            return
+        state, lrs = self.lr_scheduler_before_step
+        self.lr_scheduler_before_step = None
+        self.lr_scheduler.load_state_dict(state)
+        for group, lr in zip(self._lr_scheduler_param_groups(), lrs):
+            group['lr'] = lr
+
     def _get_optimizer_param(self, param_name):
         result = []
         if not self.optimizer:
@@ -931,6 +1215,9 @@ class DeepSpeedLight(Module):
             tensor_to_allreduce.div_(self.dp_world_size)
             dist.all_reduce(tensor_to_allreduce, group=self.data_parallel_group)
 
+        if self.telemetry is not None:
+            self.telemetry.add_allreduce(tensor_to_allreduce)
+
         if self.allreduce_always_fp32() and tensor is not tensor_to_allreduce:
             tensor.copy_(tensor_to_allreduce)
 
@@ -991,6 +1278,14 @@ class DeepSpeedLight(Module):
         # Pre-divide for fp16 stability
         csr.values.div_(self.dp_world_size)
 
+        # Merge repeated rows left by CSRTensor.add so each row is communicated
+        # once. Tensors built from a dense gradient already have unique rows.
+        if not csr.coalesced:
+            csr.coalesce()
+
+        if self.telemetry is not None:
+            self.telemetry.add_allreduce(csr.indices, csr.values)
+
         indices_device_list = self.csr_all_gather(csr.indices)
         values_device_list = self.csr_all_gather(csr.values)
 
@@ -1083,6 +1378,9 @@ class DeepSpeedLight(Module):
             client_state: State dictionary used for loading required training states in the client code.
         """
 
+        # make sure checkpoints still being written by this process are visible
+        self.wait_for_checkpoint()
+
         load_path, client_states = self._load_checkpoint(load_dir,
                                                          tag,
                                                          load_module_strict=load_module_strict,
@@ -1112,7 +1410,7 @@ class DeepSpeedLight(Module):
             return None, None
 
         logger.info('Loading checkpoint: {}'.format(load_path))
-        checkpoint = torch.load(load_path, map_location=lambda storage, loc: storage)
+        checkpoint = self._read_checkpoint_file(load_path)
 
         self.load_module_state_dict(state_dict=checkpoint['module'],
                                     strict=load_module_strict)
@@ -1151,7 +1449,7 @@ class DeepSpeedLight(Module):
                 .format(zero_checkpoint_name))
             return None
 
-        zero_sd = torch.load(zero_checkpoint_name, map_location='cpu')
+        zero_sd = self._read_checkpoint_file(zero_checkpoint_name)
         self.optimizer.load_state_dict(zero_sd['optimizer_state_dict'],
                                        load_optimizer_states=load_optimizer_states)
         logger.info('loading zero checkpoint {}'.format(zero_checkpoint_name))
@@ -1165,6 +1463,14 @@ class DeepSpeedLight(Module):
             client_state: Optional. State dictionary used for saving required training states in the client code.
         """
 
+        # the loss scale and the optimizer states of the latest step are final
+        # once its overflow flag is read
+        if getattr(self.optimizer, 'lazy_overflow', False):
+            self.optimizer.resolve_overflow()
+            if self.optimizer.overflow:
+                self.skipped_steps += 1
+                self._undo_lr_scheduler_step()
+
         #This is to make sure the checkpoint names are created without collision
         #There seems to be issue creating them in parallel
         self._create_checkpoint_files(save_dir, tag)
@@ -1177,6 +1483,18 @@ class DeepSpeedLight(Module):
 
         return True
 
+    def wait_for_checkpoint(self):
+        r"""Block until checkpoints saved with async_save enabled are on disk.
+        Does nothing when checkpoints are written synchronously.
+        """
+        if self.checkpoint_writer is not None:
+            self.checkpoint_writer.wait()
+
+    def checkpoint_is_complete(self):
+        r"""Return True if no checkpoint is still being written in the background.
+        """
+        return self.checkpoint_writer is None or self.checkpoint_writer.is_complete()
+
     def _create_checkpoint_files(self, save_dir, tag):
         #checkpoint files are created sequentially
         for rank in range(self.world_size):
@@ -1218,11 +1536,28 @@ class DeepSpeedLight(Module):
         state.update(client_state)
 
         logger.info('Saving model checkpoint: {}'.format(save_path))
-        torch.save(state, save_path)
+        self._write_checkpoint_file(state, save_path)
 
     def _save_zero_checkpoint(self, save_path, tag):
         zero_checkpoint_name = self._get_zero_ckpt_name(save_path, tag)
         #self._ensure_directory_exists(zero_checkpoint_name)
         zero_sd = {'optimizer_state_dict': self.optimizer.state_dict()}
-        torch.save(zero_sd, zero_checkpoint_name)
+        self._write_checkpoint_file(zero_sd, zero_checkpoint_name)
         logger.info('zero checkpoint saved {}'.format(zero_checkpoint_name))
+
+    def _write_checkpoint_file(self, state, path):
+        save_fn = torch.save
+        if self.checkpoint_file_format() == CHECKPOINT_FILE_FORMAT_FLAT:
+            save_fn = save_flat_checkpoint
+
+        if self.checkpoint_writer is not None:
+            self.checkpoint_writer.save(state, path, save_fn=save_fn)
+        else:
+            save_fn(state, path)
+
+    def _read_checkpoint_file(self, path):
+        # Tensors of flat checkpoints are views of the mapped file, they are read
+        # straight into the parameters and partitions by load_state_dict
+        if is_flat_checkpoint(path):
+            return load_flat_checkpoint(path)
+        return torch.load(path, map_location=lambda storage, loc: storage)
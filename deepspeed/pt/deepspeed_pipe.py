@@ -0,0 +1,474 @@
+'''
+Copyright 2020 The Microsoft DeepSpeed Team
+
+Pipeline parallelism for sequential models. The layers of the model are split
+into stages of contiguous layers, each run by its own group of data parallel
+ranks. A batch is split into micro-batches which are run by every stage with
+a 1F1B schedule: after a warmup of forward passes, every stage alternates one
+forward and one backward pass, so a stage holds the activations of at most
+num_stages micro-batches. Activations go to the next stage and gradients to
+the previous one with point to point sends, which needs the gloo backend or a
+PyTorch with NCCL send/recv.
+
+The stages are idle while the pipeline fills and drains. With equal forward
+and backward times on every stage, the idle fraction of a stage, the bubble,
+is (num_stages - 1) / (micro_batches + num_stages - 1).
+'''
+
+import time
+import torch
+import torch.distributed as dist
+
+from deepspeed.pt.deepspeed_light import DeepSpeedLight
+from deepspeed.pt.deepspeed_zero_config import ZERO_OPTIMIZATION_OPTIMIZER_STATES
+from deepspeed.pt.log_utils import logger
+
+PARTITION_UNIFORM = 'uniform'
+PARTITION_PARAMETERS = 'parameters'
+PARTITION_TIME = 'time'
+
+# dtypes of the activations sent between stages, by code in the header
+_DTYPES = [torch.float32, torch.float16, torch.float64, torch.int64, torch.int32]
+if hasattr(torch, 'bfloat16'):
+    _DTYPES.append(torch.bfloat16)
+_MAX_DIMS = 8
+
+
+def partition_balanced(weights, num_parts):
+    """Splits weights into num_parts contiguous, non-empty parts with the
+    smallest maximum sum.
+
+    Returns:
+        The num_parts + 1 boundaries of the parts, part i being
+        weights[boundaries[i]:boundaries[i + 1]].
+    """
+    count = len(weights)
+    assert count >= num_parts, \
+        'cannot split {} layers into {} stages'.format(count, num_parts)
+    prefix = [0]
+    for weight in weights:
+        prefix.append(prefix[-1] + weight)
+
+    # cost[k][i] is the smallest maximum sum of the first i weights in k parts
+    cost = [[float('inf')] * (count + 1) for _ in range(num_parts + 1)]
+    split = [[0] * (count + 1) for _ in range(num_parts + 1)]
+    cost[0][0] = 0
+    for k in range(1, num_parts + 1):
+        for i in range(k, count - (num_parts - k) + 1):
+            for j in range(k - 1, i):
+                part_cost = max(cost[k - 1][j], prefix[i] - prefix[j])
+                if part_cost < cost[k][i]:
+                    cost[k][i] = part_cost
+                    split[k][i] = j
+
+    boundaries = [count]
+    for k in range(num_parts, 0, -1):
+        boundaries.append(split[k][boundaries[-1]])
+    return boundaries[::-1]
+
+
+def _layer_times(layers, profile_input, repeat=3):
+    """Forward time of every layer on profile_input, the input of the first
+    layer."""
+    times = []
+    x = profile_input
+    with torch.no_grad():
+        for layer in layers:
+            start = time.time()
+            for _ in range(repeat):
+                output = layer(x)
+            if torch.cuda.is_available():
+                torch.cuda.synchronize()
+            times.append((time.time() - start) / repeat)
+            x = output
+    return times
+
+
+def partition_layers(layers,
+                     num_stages,
+                     method=PARTITION_PARAMETERS,
+                     profile_input=None):
+    """Boundaries of the stages of layers, see partition_balanced.
+
+    Arguments:
+        layers: list of torch.nn.Module run in sequence
+        num_stages: number of pipeline stages
+        method: 'uniform' for the same number of layers per stage,
+            'parameters' for the same number of parameters or 'time' for the
+            same forward time, measured on profile_input
+    """
+    if method == PARTITION_UNIFORM:
+        weights = [1] * len(layers)
+    elif method == PARTITION_PARAMETERS:
+        weights = [sum(p.numel() for p in layer.parameters()) for layer in layers]
+    elif method == PARTITION_TIME:
+        assert profile_input is not None, 'partitioning by time needs a profile_input'
+        weights = _layer_times(layers, profile_input)
+    else:
+        raise ValueError('unknown partition method {}'.format(method))
+    return partition_balanced(weights, num_stages)
+
+
+class PipelineGrid(object):
+    """Ranks of the pipeline stages and of their data parallel groups. Rank r
+    runs stage r // data_parallel_size, next to the other ranks of its data
+    parallel group.
+
+    Implements the model parallelism unit interface of deepspeed.initialize,
+    the stages of a pipeline being its model parallel group, so the gradient
+    norm and the overflow check of the fp16 optimizers span all the stages.
+    torch.distributed must be initialized first.
+    """
+    def __init__(self, num_stages):
+        world_size = dist.get_world_size()
+        assert world_size % num_stages == 0, \
+            'world size {} is not a multiple of {} stages'.format(world_size, num_stages)
+        self.num_stages = num_stages
+        self.data_parallel_size = world_size // num_stages
+        rank = dist.get_rank()
+        self.stage_id = rank // self.data_parallel_size
+        self.data_parallel_id = rank % self.data_parallel_size
+
+        # every rank creates every group
+        for stage in range(num_stages):
+            ranks = [
+                stage * self.data_parallel_size + i
+                for i in range(self.data_parallel_size)
+            ]
+            group = dist.new_group(ranks)
+            if stage == self.stage_id:
+                self.data_parallel_group = group
+        for i in range(self.data_parallel_size):
+            ranks = [
+                stage * self.data_parallel_size + i for stage in range(num_stages)
+            ]
+            group = dist.new_group(ranks)
+            if i == self.data_parallel_id:
+                self.pipe_group = group
+
+    def stage_to_rank(self, stage_id):
+        return stage_id * self.data_parallel_size + self.data_parallel_id
+
+    @property
+    def prev_rank(self):
+        return self.stage_to_rank(self.stage_id - 1)
+
+    @property
+    def next_rank(self):
+        return self.stage_to_rank(self.stage_id + 1)
+
+    def is_first_stage(self):
+        return self.stage_id == 0
+
+    def is_last_stage(self):
+        return self.stage_id == self.num_stages - 1
+
+    def get_model_parallel_rank(self):
+        return self.stage_id
+
+    def get_model_parallel_world_size(self):
+        return self.num_stages
+
+    def get_model_parallel_group(self):
+        return self.pipe_group
+
+    def get_data_parallel_rank(self):
+        return self.data_parallel_id
+
+    def get_data_parallel_world_size(self):
+        return self.data_parallel_size
+
+    def get_data_parallel_group(self):
+        return self.data_parallel_group
+
+
+class PipelineModule(torch.nn.Module):
+    """The layers of a sequential model that run on the stage of this rank.
+
+    Layers are named by their index in the model, so the checkpoints of the
+    stages, one per stage, name every layer the same way for any partition.
+    Their parameters are marked model parallel, the stages holding different
+    parameters.
+
+    Arguments:
+        layers: list of torch.nn.Module, the model being their composition
+        num_stages: number of pipeline stages
+        loss_fn: loss of the output of the last layer and the labels
+        partition_method: 'uniform', 'parameters' or 'time', see
+            partition_layers
+        profile_input: input of the first layer to time the layers with
+        grid: PipelineGrid, created for num_stages by default
+    """
+    def __init__(self,
+                 layers,
+                 num_stages,
+                 loss_fn=None,
+                 partition_method=PARTITION_PARAMETERS,
+                 profile_input=None,
+                 grid=None):
+        super(PipelineModule, self).__init__()
+        self.grid = grid if grid is not None else PipelineGrid(num_stages)
+        assert self.grid.num_stages == num_stages
+        self.loss_fn = loss_fn
+        self.boundaries = partition_layers(layers,
+                                           num_stages,
+                                           partition_method,
+                                           profile_input)
+        self.stage_id = self.grid.stage_id
+        start = self.boundaries[self.stage_id]
+        end = self.boundaries[self.stage_id + 1]
+        self.layer_ids = list(range(start, end))
+        for layer_id in self.layer_ids:
+            self.add_module(str(layer_id), layers[layer_id])
+        for p in self.parameters():
+            p.model_parallel = True
+        if self.grid.data_parallel_id == 0:
+            logger.info('Pipeline stage {} runs layers [{}, {})'.format(
+                self.stage_id,
+                start,
+                end))
+
+    def forward(self, x):
+        for layer in self.children():
+            x = layer(x)
+        return x
+
+
+class PipeInstruction(object):
+    """A pass of a stage over a micro-batch."""
+    def __init__(self, micro_batch):
+        self.micro_batch = micro_batch
+
+    def __repr__(self):
+        return '{}({})'.format(type(self).__name__, self.micro_batch)
+
+    def __eq__(self, other):
+        return type(self) == type(other) and self.micro_batch == other.micro_batch
+
+
+class ForwardPass(PipeInstruction):
+    pass
+
+
+class BackwardPass(PipeInstruction):
+    pass
+
+
+class TrainSchedule(object):
+    """1F1B schedule of the passes of a stage over micro_batches: the stages
+    after this one need a forward pass each before the first backward pass
+    reaches this stage, then forward and backward passes alternate."""
+    def __init__(self, micro_batches, num_stages, stage_id):
+        self.micro_batches = micro_batches
+        self.num_stages = num_stages
+        self.stage_id = stage_id
+
+    @property
+    def warmup_steps(self):
+        return min(self.num_stages - self.stage_id - 1, self.micro_batches)
+
+    def num_buffers(self):
+        """Micro-batches whose activations are held at once."""
+        return min(self.warmup_steps + 1, self.micro_batches)
+
+    def steps(self):
+        warmup = self.warmup_steps
+        steps = [ForwardPass(i) for i in range(warmup)]
+        for i in range(self.micro_batches - warmup):
+            steps.append(ForwardPass(warmup + i))
+            steps.append(BackwardPass(i))
+        steps.extend(
+            BackwardPass(i) for i in range(self.micro_batches - warmup,
+                                           self.micro_batches))
+        return steps
+
+
+def bubble_fraction(micro_batches, num_stages):
+    """Idle fraction of a stage of a 1F1B schedule whose stages take the same
+    time per pass."""
+    return (num_stages - 1) / (micro_batches + num_stages - 1)
+
+
+class PipelineExecutor(object):
+    """Runs the TrainSchedule of the stage of module, sending activations and
+    gradients to the neighbouring stages. Accumulates the gradients of all
+    the micro-batches; reducing and applying them is left to the caller.
+
+    Arguments:
+        module: PipelineModule
+        device: device of the activations, the CPU by default
+        backward_fn: runs the backward pass of the loss on the last stage,
+            e.g. to scale it for fp16
+    """
+    def __init__(self, module, device=None, backward_fn=None):
+        self.module = module
+        self.grid = module.grid
+        self.device = device if device is not None else torch.device('cpu')
+        self.backward_fn = backward_fn if backward_fn is not None else \
+            (lambda loss: loss.backward())
+        self.sends = []
+        # passes run by the latest batch, and their compute time
+        self.executed = []
+        self.busy_seconds = 0.0
+        self.total_seconds = 0.0
+
+    @property
+    def bubble(self):
+        """Idle fraction of the latest batch: waiting for the other stages or
+        the data."""
+        if not self.total_seconds:
+            return 0.0
+        return 1.0 - self.busy_seconds / self.total_seconds
+
+    def _send(self, tensor, rank):
+        # the tensor is kept until the send completes
+        tensor = tensor.contiguous()
+        self.sends.append((dist.isend(tensor, rank), tensor))
+
+    def _send_activation(self, tensor, requires_grad):
+        # the header holds the dtype code, the number of dims, the shape and
+        # whether a gradient comes back for the tensor
+        assert tensor.dim() <= _MAX_DIMS
+        header = torch.zeros(_MAX_DIMS + 3, dtype=torch.long)
+        header[0] = _DTYPES.index(tensor.dtype)
+        header[1] = tensor.dim()
+        header[2:2 + tensor.dim()] = torch.tensor(tensor.shape, dtype=torch.long)
+        header[-1] = int(requires_grad)
+        self._send(header.to(self.device), self.grid.next_rank)
+        self._send(tensor, self.grid.next_rank)
+
+    def _recv_activation(self):
+        header = torch.zeros(_MAX_DIMS + 3, dtype=torch.long, device=self.device)
+        dist.recv(header, self.grid.prev_rank)
+        header = header.tolist()
+        shape = header[2:2 + header[1]]
+        tensor = torch.empty(shape, dtype=_DTYPES[header[0]], device=self.device)
+        dist.recv(tensor, self.grid.prev_rank)
+        if header[-1]:
+            tensor.requires_grad_()
+        return tensor
+
+    @staticmethod
+    def _needs_grad(tensor):
+        # token ids, masks and outputs that do not depend on the parameters
+        # have no gradient to send back
+        return tensor.is_floating_point() and tensor.requires_grad
+
+    def _load(self, data_iter):
+        inputs, labels = next(data_iter)
+        return inputs.to(self.device), labels.to(self.device)
+
+    def _forward(self, buffers, micro_batch, data_iter, micro_batches):
+        first, last = self.grid.is_first_stage(), self.grid.is_last_stage()
+        if first or last:
+            inputs, labels = self._load(data_iter)
+        if not first:
+            inputs = self._recv_activation()
+
+        start = time.time()
+        outputs = self.module(inputs)
+        if last:
+            # the gradients of the micro-batches add up to the batch mean
+            outputs = self.module.loss_fn(outputs, labels) / micro_batches
+        self.busy_seconds += time.time() - start
+
+        if not last:
+            self._send_activation(outputs.detach(), self._needs_grad(outputs))
+        buffers[micro_batch] = (inputs, outputs)
+
+    def _backward(self, buffers, micro_batch):
+        inputs, outputs = buffers.pop(micro_batch)
+        if self.grid.is_last_stage():
+            start = time.time()
+            self.backward_fn(outputs)
+            self.busy_seconds += time.time() - start
+        elif self._needs_grad(outputs):
+            grad = torch.empty_like(outputs)
+            dist.recv(grad, self.grid.next_rank)
+            start = time.time()
+            torch.autograd.backward(outputs, grad)
+            self.busy_seconds += time.time() - start
+
+        if not self.grid.is_first_stage() and inputs.requires_grad:
+            grad = inputs.grad
+            if grad is None:
+                # the outputs do not depend on the inputs
+                grad = torch.zeros_like(inputs)
+            self._send(grad, self.grid.prev_rank)
+
+    def train_batch(self, data_iter, micro_batches):
+        """Runs the forward and backward passes of micro_batches batches of
+        data_iter, an iterator of (inputs, labels) read by the first and the
+        last stage only.
+
+        Returns:
+            The loss of the batch on the last stage, None on the others.
+        """
+        schedule = TrainSchedule(micro_batches, self.grid.num_stages, self.grid.stage_id)
+        buffers = {}
+        self.executed = []
+        self.busy_seconds = 0.0
+        start = time.time()
+        loss = None
+        for step in schedule.steps():
+            if isinstance(step, ForwardPass):
+                self._forward(buffers, step.micro_batch, data_iter, micro_batches)
+            else:
+                if self.grid.is_last_stage():
+                    step_loss = buffers[step.micro_batch][1].detach().float()
+                    loss = step_loss if loss is None else loss + step_loss
+                self._backward(buffers, step.micro_batch)
+            self.executed.append(step)
+
+        for work, _ in self.sends:
+            work.wait()
+        self.sends = []
+        self.total_seconds = time.time() - start
+        return loss
+
+
+class PipelineEngine(DeepSpeedLight):
+    """DeepSpeed engine training a PipelineModule with a 1F1B schedule.
+
+    A batch is gradient_accumulation_steps micro-batches of
+    train_micro_batch_size_per_gpu samples, run by train_batch. Gradients are
+    reduced across the data parallel ranks of every stage and applied by the
+    fp16 or ZeRO stage 1 optimizers, the stages agreeing on the gradient norm
+    and overflows. Every stage saves its own checkpoint, as a model parallel
+    rank.
+    """
+    def __init__(self, *args, **kwargs):
+        model = kwargs['model']
+        assert isinstance(model, PipelineModule), 'model must be a PipelineModule'
+        assert kwargs.get('mpu') is None, 'the pipeline grid is the model parallel unit'
+        kwargs['mpu'] = model.grid
+        super(PipelineEngine, self).__init__(*args, **kwargs)
+        assert self.zero_optimization_stage() <= ZERO_OPTIMIZATION_OPTIMIZER_STATES, \
+            'pipeline parallelism supports up to ZeRO stage 1'
+        self.executor = PipelineExecutor(self.module,
+                                         device=self.device,
+                                         backward_fn=self._backward_loss)
+
+    def _backward_loss(self, loss):
+        if self.zero_optimization() or self.fp16_enabled() or self.bfloat16_enabled():
+            self.optimizer.backward(loss)
+        else:
+            loss.backward()
+
+    def train_batch(self, data_iter):
+        """Trains on gradient_accumulation_steps micro-batches of data_iter,
+        an iterator of (inputs, labels), and steps the optimizer.
+
+        Returns:
+            The mean loss of the micro-batches on the last stage, None on the
+            other stages.
+        """
+        self.module.train()
+        self.tput_timer.start()
+        loss = self.executor.train_batch(data_iter, self.gradient_accumulation_steps())
+
+        # the micro-batches make a single accumulation boundary
+        self.micro_steps += self.gradient_accumulation_steps() - 1
+        self.allreduce_gradients()
+        self.step()
+        return loss
@@ -0,0 +1,305 @@
+'''
+Copyright 2020 The Microsoft DeepSpeed Team
+
+Weight-quantized inference of the transformer layer gemms on the CPU, where
+serving is bound by the memory traffic of the weights.
+
+Weights are quantized offline: int8 with one scale per output channel, or
+int4 with one scale per group of group_size inputs of a channel. The scales
+are calibrated per channel (or group) by searching the clipping range with
+the smallest squared error of the quantized weights, or set by the absolute
+maximum. Activations are quantized per row when the layer runs. The int32
+sums are dequantized with the bias and the GeLU of the first feed forward
+gemm fused in, in csrc/inference/quantized_gemm_cpu.cpp, which uses the
+AVX512-VNNI int8 dot product when built for it. Without the extension, or on
+the GPU, the same math runs with torch ops.
+
+quantization_report compares a quantized transformer layer against its fp32
+weights for accuracy and latency.
+'''
+
+import copy
+import time
+import torch
+
+from deepspeed.pt.log_utils import logger
+
+try:
+    import deepspeed_quantized_gemm_cpu
+except ImportError:
+    deepspeed_quantized_gemm_cpu = None
+
+CALIBRATION_ABSMAX = 'absmax'
+CALIBRATION_MSE = 'mse'
+
+# fractions of the absolute maximum the mse calibration tries as clipping range
+CALIBRATION_CLIP_RATIOS = [1.0, 0.95, 0.9, 0.85, 0.8, 0.75, 0.7, 0.6, 0.5]
+
+# output channels and inputs of a packed int8 tile, as in quantized_gemm.h
+INT8_TILE_N = 16
+INT8_TILE_K = 4
+INT8_ACTIVATION_SHIFT = 128
+
+INT4_GROUP_SIZE = 128
+
+
+def _max_code(bits):
+    return 2**(bits - 1) - 1
+
+
+def _grouped(weight, bits, group_size):
+    """The weight as [channels, groups, inputs per group] for the scales it is
+    quantized by, one group per channel for int8. The last group is padded
+    with zeros."""
+    if bits == 8:
+        return weight.unsqueeze(1)
+    channels, inputs = weight.shape
+    groups = -(-inputs // group_size)
+    padded = weight.new_zeros(channels, groups * group_size)
+    padded[:, :inputs] = weight
+    return padded.view(channels, groups, group_size)
+
+
+def _quantize(grouped, scales, bits):
+    max_code = _max_code(bits)
+    inverse = torch.where(scales > 0, 1.0 / scales, torch.zeros_like(scales))
+    return torch.clamp(torch.round(grouped * inverse.unsqueeze(-1)), -max_code, max_code)
+
+
+def calibrate_weight_scales(weight,
+                            bits=8,
+                            group_size=INT4_GROUP_SIZE,
+                            calibration=CALIBRATION_MSE):
+    """Scales of the weight's codes, [channels] for int8 and [channels,
+    groups] for int4. With mse calibration every channel or group keeps the
+    clipping range of CALIBRATION_CLIP_RATIOS with the smallest squared error,
+    trading the error of the few largest weights for the resolution of all."""
+    assert bits in [4, 8], 'weights are quantized to 4 or 8 bits, not {}'.format(bits)
+    assert calibration in [CALIBRATION_ABSMAX, CALIBRATION_MSE], \
+        'unknown calibration {}'.format(calibration)
+    grouped = _grouped(weight.detach().float(), bits, group_size)
+    absmax = grouped.abs().max(dim=-1)[0]
+    scales = absmax / _max_code(bits)
+    if calibration == CALIBRATION_MSE:
+        best_error = None
+        for ratio in CALIBRATION_CLIP_RATIOS:
+            candidate = absmax * ratio / _max_code(bits)
+            codes = _quantize(grouped, candidate, bits)
+            error = ((codes * candidate.unsqueeze(-1) - grouped)**2).sum(dim=-1)
+            if best_error is None:
+                best_error = error
+                continue
+            better = error < best_error
+            scales = torch.where(better, candidate, scales)
+            best_error = torch.where(better, error, best_error)
+    return scales.squeeze(1) if bits == 8 else scales
+
+
+def quantize_weight(weight, scales, bits=8, group_size=INT4_GROUP_SIZE):
+    """The int8 codes of weight [channels, inputs] for its scales."""
+    grouped = _grouped(weight.detach().float(), bits, group_size)
+    if bits == 8:
+        scales = scales.unsqueeze(1)
+    codes = _quantize(grouped, scales, bits).view(weight.shape[0], -1)
+    return codes[:, :weight.shape[1]].to(torch.int8)
+
+
+def pack_int8_weight(codes):
+    """Packs int8 codes [N, K] in the [N / 16, K / 4, 16, 4] tiles of the
+    native gemm. Returns the tiles and the compensation of the activation
+    shift, 128 * sum_k codes[n, k]."""
+    channels, inputs = codes.shape
+    padded = codes.new_zeros(-(-channels // INT8_TILE_N) * INT8_TILE_N,
+                             -(-inputs // INT8_TILE_K) * INT8_TILE_K)
+    padded[:channels, :inputs] = codes
+    packed = padded.view(padded.shape[0] // INT8_TILE_N,
+                         INT8_TILE_N,
+                         padded.shape[1] // INT8_TILE_K,
+                         INT8_TILE_K).permute(0,
+                                              2,
+                                              1,
+                                              3).contiguous()
+    compensation = INT8_ACTIVATION_SHIFT * codes.int().sum(dim=1)
+    return packed, compensation.int()
+
+
+def unpack_int8_weight(packed, channels, inputs):
+    tiles, steps = packed.shape[0], packed.shape[1]
+    codes = packed.permute(0, 2, 1, 3).reshape(tiles * INT8_TILE_N, steps * INT8_TILE_K)
+    return codes[:channels, :inputs]
+
+
+def pack_int4_weight(codes):
+    """Packs int4 codes [N, K] in [-7, 7] two per byte, [N, K / 2], the even
+    input in the low nibble, as code + 8."""
+    channels, inputs = codes.shape
+    padded = torch.full((channels,
+                         inputs + inputs % 2),
+                        8,
+                        dtype=torch.uint8,
+                        device=codes.device)
+    padded[:, :inputs] = (codes.int() + 8).to(torch.uint8)
+    return padded[:, 0::2] | (padded[:, 1::2] << 4)
+
+
+def unpack_int4_weight(packed, inputs):
+    low = (packed & 0xF).to(torch.int8) - 8
+    high = (packed >> 4).to(torch.int8) - 8
+    return torch.stack([low, high], dim=-1).view(packed.shape[0], -1)[:, :inputs]
+
+
+def quantize_activations(input):
+    """Per row int8 codes of input [rows, inputs] and their fp32 scales, like
+    the native gemm. The codes are float64, whose products sum up exactly."""
+    absmax = input.abs().max(dim=-1, keepdim=True)[0]
+    inverse = torch.where(absmax > 0, 127.0 / absmax, torch.zeros_like(absmax))
+    codes = torch.clamp(torch.round(input * inverse), -127, 127)
+    return codes.double(), absmax.squeeze(-1) / 127.0
+
+
+def tanh_gelu(x):
+    # the tanh approximation of the fused kernels
+    return x * 0.5 * (1.0 + torch.tanh(0.79788456080286535587989211986876 *
+                                       (x + 0.044715 * x * x * x)))
+
+
+class QuantizedLinear(torch.nn.Module):
+    """A linear layer of quantized weights for inference. The bias, and a
+    GeLU of the output, are applied by the gemm's epilogue.
+
+    Arguments:
+        weight: The fp32 weight, [out_features, in_features]
+
+        bits: Optional: 8 for per channel int8, 4 for group-wise int4 weights
+
+        group_size: Optional: Inputs sharing an int4 scale
+
+        calibration: Optional: 'mse' or 'absmax' scales
+    """
+    def __init__(self,
+                 weight,
+                 bits=8,
+                 group_size=INT4_GROUP_SIZE,
+                 calibration=CALIBRATION_MSE):
+        super(QuantizedLinear, self).__init__()
+        self.bits = bits
+        self.group_size = group_size
+        self.out_features, self.in_features = weight.shape
+        scales = calibrate_weight_scales(weight, bits, group_size, calibration)
+        codes = quantize_weight(weight, scales, bits, group_size)
+        self.register_buffer('scales', scales.contiguous())
+        if bits == 8:
+            packed, compensation = pack_int8_weight(codes)
+            self.register_buffer('packed', packed)
+            self.register_buffer('compensation', compensation)
+        else:
+            self.register_buffer('packed', pack_int4_weight(codes))
+
+    def weight_bytes(self):
+        return sum(buffer.numel() * buffer.element_size() for buffer in self.buffers())
+
+    def _native(self, input, bias, gelu):
+        bias = bias.detach().float().contiguous() if bias is not None else torch.empty(0)
+        if self.bits == 8:
+            return deepspeed_quantized_gemm_cpu.int8_linear(input,
+                                                            self.packed,
+                                                            self.compensation,
+                                                            self.scales,
+                                                            bias,
+                                                            gelu)
+        return deepspeed_quantized_gemm_cpu.int4_linear(input,
+                                                        self.packed,
+                                                        self.scales,
+                                                        self.group_size,
+                                                        bias,
+                                                        gelu)
+
+    def _torch(self, input, bias, gelu):
+        codes, input_scales = quantize_activations(input)
+        if self.bits == 8:
+            weight = unpack_int8_weight(self.packed, self.out_features, self.in_features)
+            output = torch.matmul(codes, weight.double().t()).float() * self.scales
+        else:
+            weight = unpack_int4_weight(self.packed, self.in_features).double()
+            groups = self.scales.shape[1]
+            output = 0
+            for g in range(groups):
+                inputs = slice(g * self.group_size, (g + 1) * self.group_size)
+                sums = torch.matmul(codes[:, inputs], weight[:, inputs].t()).float()
+                output = output + sums * self.scales[:, g]
+        output = output * input_scales.unsqueeze(-1)
+        if bias is not None:
+            output = output + bias
+        return tanh_gelu(output) if gelu else output
+
+    def forward(self, input, bias=None, gelu=False):
+        shape = input.shape
+        input = input.detach().reshape(-1, self.in_features).float().contiguous()
+        if deepspeed_quantized_gemm_cpu is not None and not input.is_cuda:
+            output = self._native(input, bias, gelu)
+        else:
+            output = self._torch(input, bias, gelu)
+        return output.view(*shape[:-1], self.out_features)
+
+
+def quantization_report(layer,
+                        input,
+                        input_mask=None,
+                        bits=8,
+                        group_size=INT4_GROUP_SIZE,
+                        calibration=CALIBRATION_MSE,
+                        repeat=10):
+    """Runs a transformer layer with fp32 and with quantized weights, a
+    quantized copy, on input and compares their outputs and latencies.
+
+    Returns:
+        A dict of the errors of the quantized output, its relative error
+        ||q - f|| / ||f||, the mean seconds per forward pass of both and the
+        bytes of both weights of the four gemms.
+    """
+    # the copy shares the process group
+    quantized = copy.deepcopy(layer, memo={id(layer.group): layer.group})
+    quantized.quantize(bits, group_size, calibration)
+    layer.eval()
+    quantized.eval()
+
+    def run(module):
+        with torch.no_grad():
+            output = module(input, input_mask)
+            start = time.time()
+            for _ in range(repeat):
+                module(input, input_mask)
+            return output.float(), (time.time() - start) / repeat
+
+    expected, fp32_seconds = run(layer)
+    output, quantized_seconds = run(quantized)
+    error = output - expected
+    return {
+        'bits': bits,
+        'max_abs_error': error.abs().max().item(),
+        'relative_error': (error.norm() / expected.norm()).item(),
+        'fp32_seconds': fp32_seconds,
+        'quantized_seconds': quantized_seconds,
+        'speedup': fp32_seconds / quantized_seconds,
+        'fp32_weight_bytes': sum(
+            getattr(layer,
+                    name).numel() * getattr(layer,
+                                            name).element_size()
+            for name in quantized.quantized),
+        'quantized_weight_bytes': sum(linear.weight_bytes()
+                                      for linear in quantized.quantized.values())
+    }
+
+
+def print_quantization_report(report):
+    logger.info(
+        'int{} weights: {:.2f} MB instead of {:.2f} MB, forward {:.2f} ms instead of '
+        '{:.2f} ms ({:.2f}x), relative error {:.2e}, max abs error {:.2e}'.format(
+            report['bits'],
+            report['quantized_weight_bytes'] / 2**20,
+            report['fp32_weight_bytes'] / 2**20,
+            report['quantized_seconds'] * 1000.0,
+            report['fp32_seconds'] * 1000.0,
+            report['speedup'],
+            report['relative_error'],
+            report['max_abs_error']))
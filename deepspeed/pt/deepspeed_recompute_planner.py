@@ -0,0 +1,276 @@
+'''
+Copyright 2020 The Microsoft DeepSpeed Team
+
+Selective recomputation planner.
+
+Memory of the activations kept for backward can be traded for recomputation
+at two granularities:
+  - a whole layer, by wrapping it in deepspeed.checkpointing.checkpoint: only
+    its input is kept and the layer runs forward again during backward
+  - buffers inside a DeepSpeedTransformerLayer, by the knobs of the CUDA
+    kernels: attn_dropout_checkpoint, normalize_invertible, gelu_checkpoint
+
+Given a profile of every layer, its activation memory and forward time and
+the size and recompute time of the buffers its knobs drop, the planner picks
+the combination that fits a memory budget with the least recompute time. It
+is a multiple choice knapsack, solved exactly by dynamic programming over the
+budget split into resolution units, with sizes rounded up so the plan never
+exceeds the budget.
+
+The plan is emitted as the activation_checkpointing section of the DeepSpeed
+config, whose checkpoint_layers are consumed by
+deepspeed.checkpointing.checkpoint_layer, and as the knobs of every layer,
+set on its DeepSpeedTransformerConfig which passes them on to the C++ layer.
+'''
+
+import copy
+import itertools
+import json
+import time
+
+import numpy as np
+
+ATTN_DROPOUT_CHECKPOINT = 'attn_dropout_checkpoint'
+NORMALIZE_INVERTIBLE = 'normalize_invertible'
+GELU_CHECKPOINT = 'gelu_checkpoint'
+TRANSFORMER_KNOBS = [ATTN_DROPOUT_CHECKPOINT, NORMALIZE_INVERTIBLE, GELU_CHECKPOINT]
+
+
+class BufferProfile(object):
+    """A buffer a knob drops from the activations of a layer, which backward
+    then recomputes in recompute_time seconds."""
+    def __init__(self, knob, nbytes, recompute_time):
+        self.knob = knob
+        self.nbytes = nbytes
+        self.recompute_time = recompute_time
+
+
+class LayerProfile(object):
+    """Activation memory of a layer and the cost of recomputing it.
+
+    Arguments:
+        input_bytes: memory kept when the layer is checkpointed
+        activation_bytes: memory the layer keeps for backward otherwise,
+            including the buffers
+        forward_time: seconds to recompute the layer when it is checkpointed
+        buffers: BufferProfiles of the knobs of the layer
+    """
+    def __init__(self, input_bytes, activation_bytes, forward_time, buffers=()):
+        self.input_bytes = input_bytes
+        self.activation_bytes = activation_bytes
+        self.forward_time = forward_time
+        self.buffers = list(buffers)
+
+
+def transformer_layer_profile(config,
+                              batch_size=None,
+                              forward_time=None,
+                              flops_per_second=100e12,
+                              bytes_per_second=900e9):
+    """Profile of a DeepSpeedTransformerLayer. Buffer sizes follow the tensors
+    the layer saves for backward. Times are estimated from the flops and the
+    memory traffic unless forward_time is measured, e.g. by profile_layer.
+    The defaults roughly match a V100 in fp16."""
+    batch_size = batch_size or config.batch_size
+    element_size = 2 if config.fp16 else 4
+    hidden = config.hidden_size
+    tokens = batch_size * config.max_seq_length
+    # hidden states and attention scores
+    n = tokens * hidden
+    a = batch_size * config.heads * config.max_seq_length * config.max_seq_length
+
+    # output, inp_norm, qkv, softmax output and its dropout, attention output,
+    # residual, ff1 input, gelu input and output, and the uint8 dropout masks
+    activation_bytes = (17 * n + 2 * a) * element_size + a + 2 * n
+    if forward_time is None:
+        # the six projections and the two attention batched gemms
+        flops = 24 * tokens * hidden * hidden
+        flops += 4 * tokens * config.max_seq_length * hidden
+        forward_time = flops / flops_per_second + activation_bytes / bytes_per_second
+
+    buffers = [
+        # dropout of the attention probabilities is applied again with its mask
+        BufferProfile(ATTN_DROPOUT_CHECKPOINT,
+                      a * element_size,
+                      (2 * a * element_size + a) / bytes_per_second),
+        # the residual sum is recovered by inverting the layer norm
+        BufferProfile(NORMALIZE_INVERTIBLE,
+                      n * element_size,
+                      2 * n * element_size / bytes_per_second),
+        # gelu runs again on its output's input
+        BufferProfile(GELU_CHECKPOINT,
+                      4 * n * element_size,
+                      8 * n * element_size / bytes_per_second)
+    ]
+    return LayerProfile(n * element_size, activation_bytes, forward_time, buffers)
+
+
+def profile_layer(function, *args, iterations=3):
+    """Measures the forward time and the activation memory of function on CUDA
+    inputs, for layers without knobs."""
+    import torch
+
+    outputs = function(*args)
+    torch.cuda.synchronize()
+    start = time.time()
+    for _ in range(iterations):
+        with torch.no_grad():
+            function(*args)
+    torch.cuda.synchronize()
+    forward_time = (time.time() - start) / iterations
+
+    del outputs
+    torch.cuda.synchronize()
+    before = torch.cuda.memory_allocated()
+    outputs = function(*args)
+    torch.cuda.synchronize()
+    activation_bytes = torch.cuda.memory_allocated() - before
+    input_bytes = sum(arg.numel() * arg.element_size() for arg in args
+                      if torch.is_tensor(arg))
+    del outputs
+    return LayerProfile(input_bytes, max(activation_bytes, input_bytes), forward_time)
+
+
+class RecomputePlan(object):
+    """Which layers are checkpointed and which knobs the others use.
+
+    Arguments:
+        checkpoint_layers: indices of the checkpointed layers
+        knobs: per layer, a dict of the transformer knobs
+        memory: activation memory of the plan in bytes
+        recompute_time: seconds spent recomputing per iteration
+    """
+    def __init__(self, checkpoint_layers, knobs, memory, recompute_time):
+        self.checkpoint_layers = checkpoint_layers
+        self.knobs = knobs
+        self.memory = memory
+        self.recompute_time = recompute_time
+
+    def activation_checkpointing_config(self):
+        """The activation_checkpointing section of the DeepSpeed config."""
+        return {
+            'checkpoint_layers': self.checkpoint_layers,
+            'number_checkpoints': len(self.checkpoint_layers)
+        }
+
+    def to_dict(self):
+        return {
+            'activation_checkpointing': self.activation_checkpointing_config(),
+            'transformer_layers': self.knobs,
+            'memory': self.memory,
+            'recompute_time': self.recompute_time
+        }
+
+    def save(self, path):
+        with open(path, 'w') as writer:
+            json.dump(self.to_dict(), writer, indent=2)
+
+    @classmethod
+    def load(cls, path):
+        with open(path, 'r') as reader:
+            plan = json.load(reader)
+        return cls(plan['activation_checkpointing']['checkpoint_layers'],
+                   plan['transformer_layers'],
+                   plan['memory'],
+                   plan['recompute_time'])
+
+    def transformer_config(self, config, layer_id):
+        """A copy of the DeepSpeedTransformerConfig config with the knobs of
+        layer layer_id, to create that layer with."""
+        config = copy.deepcopy(config)
+        for knob, value in self.knobs[layer_id].items():
+            setattr(config, knob, value)
+        return config
+
+
+def _options(layer, allow_checkpoint=True):
+    """(memory, recompute time, checkpointed, knobs) of every way to run
+    layer, without options another one beats on both memory and time. The
+    checkpoint option is left out before pruning unless allow_checkpoint, so
+    it cannot hide a knob option it beats."""
+    options = []
+    if allow_checkpoint:
+        options.append((layer.input_bytes, layer.forward_time, True, ()))
+    for count in range(len(layer.buffers) + 1):
+        for buffers in itertools.combinations(layer.buffers, count):
+            options.append((layer.activation_bytes - sum(b.nbytes for b in buffers),
+                            sum(b.recompute_time for b in buffers),
+                            False,
+                            tuple(b.knob for b in buffers)))
+    return [
+        option for option in options
+        if not any(other[0] <= option[0] and other[1] <= option[1] and other != option
+                   and (other[0] < option[0] or other[1] < option[1])
+                   for other in options)
+    ]
+
+
+def _solve(layers, budget, resolution, allow_checkpoint):
+    unit = max(float(budget) / resolution, 1.0)
+    size = int(budget // unit) + 1
+    cost = np.zeros(size)
+    choices = []
+    for layer in layers:
+        options = _options(layer, allow_checkpoint)
+        best = np.full(size, np.inf)
+        choice = np.full(size, -1, dtype=np.int64)
+        for index, (memory, recompute_time, _, _) in enumerate(options):
+            units = int(np.ceil(memory / unit))
+            if units >= size:
+                continue
+            candidate = np.full(size, np.inf)
+            candidate[units:] = cost[:size - units] + recompute_time
+            better = candidate < best
+            best[better] = candidate[better]
+            choice[better] = index
+        cost = best
+        choices.append((options, choice))
+
+    if not np.isfinite(cost[-1]):
+        return None
+    remaining = size - 1
+    picked = []
+    for options, choice in reversed(choices):
+        option = options[choice[remaining]]
+        picked.append(option)
+        remaining -= int(np.ceil(option[0] / unit))
+    return list(reversed(picked))
+
+
+def plan_recomputation(layers, memory_budget, resolution=4096):
+    """Returns the RecomputePlan for layers, a list of LayerProfiles in
+    forward order, that keeps at most memory_budget bytes of activations with
+    the least recompute time.
+
+    A checkpointed layer holds all its activations again while it is
+    recomputed, so plans that checkpoint reserve the largest activation_bytes
+    of the layers on top of the checkpoints. Raises ValueError if no plan
+    fits."""
+    plans = []
+    reserve = max(layer.activation_bytes for layer in layers) if layers else 0
+    for allow_checkpoint in (False, True):
+        budget = memory_budget - reserve if allow_checkpoint else memory_budget
+        if budget < 0:
+            continue
+        picked = _solve(layers, budget, resolution, allow_checkpoint)
+        if picked is not None:
+            plans.append(picked)
+    if not plans:
+        minimum = sum(min(o[0] for o in _options(layer)) for layer in layers) + reserve
+        raise ValueError('activations need at least {} bytes, the budget is {}'.format(
+            minimum,
+            memory_budget))
+
+    picked = min(plans, key=lambda options: sum(o[1] for o in options))
+    checkpoint_layers = [i for i, option in enumerate(picked) if option[2]]
+    knobs = [{
+        knob: knob in option[3] and not option[2]
+        for knob in [b.knob for b in layer.buffers]
+    } for layer, option in zip(layers, picked)]
+    memory = sum(option[0] for option in picked)
+    if checkpoint_layers:
+        memory += reserve
+    return RecomputePlan(checkpoint_layers,
+                         knobs,
+                         memory,
+                         sum(option[1] for option in picked))
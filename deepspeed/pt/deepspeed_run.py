@@ -77,6 +77,12 @@ def parse_args(args=None):
                         help="(optional) IP address of node 0, will be "
                         "inferred via 'hostname -I' if not specified.")
 
+    parser.add_argument("--bind_cpus",
+                        action="store_true",
+                        help="(optional) Split the cpus and NUMA nodes of each "
+                        "node across its processes, next to their GPUs, and "
+                        "bind them.")
+
     parser.add_argument("user_script",
                         type=str,
                         help="User script to launch, followed by any required "
@@ -287,6 +293,8 @@ def main(args=None):
             "--master_addr={}".format(args.master_addr),
             "--master_port={}".format(args.master_port)
         ]
+        if args.bind_cpus:
+            deepspeed_launch.append("--bind_cpus")
         cmd = deepspeed_launch + [args.user_script] + args.user_args
     else:
         env['PDSH_RCMD_TYPE'] = 'ssh'
@@ -329,6 +337,8 @@ def main(args=None):
             "--master_addr={}".format(args.master_addr),
             "--master_port={}".format(args.master_port)
         ]
+        if args.bind_cpus:
+            deepspeed_launch.append("--bind_cpus")
         user_args = list(
             map(lambda x: x if x.startswith("-") else "'{}'".format(x),
                 args.user_args))
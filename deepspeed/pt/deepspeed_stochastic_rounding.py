@@ -0,0 +1,73 @@
+'''
+Copyright 2020 The Microsoft DeepSpeed Team
+
+Reference implementation of the stochastic rounding done by the fused optimizer
+kernels when they write reduced precision parameter copies, see
+csrc/includes/stochastic_rounding.h. Both produce identical results for the
+same seed.
+'''
+
+import torch
+
+_MASK32 = 0xFFFFFFFF
+
+_BITS_DTYPES = {torch.float16: torch.int16}
+if hasattr(torch, 'bfloat16'):
+    _BITS_DTYPES[torch.bfloat16] = torch.int16
+
+
+def stochastic_rounding_seed(step, index):
+    """Seed of the index-th tensor updated by an optimizer at step, so every
+    tensor and every step draws different random numbers."""
+    return (step * 0x9E3779B1 + index) & _MASK32
+
+
+def _hash(x):
+    # lowbias32 on uint32 values, either python ints or int64 tensors whose
+    # products wrap in int64 and are masked back to their low 32 bits
+    x = x ^ (x >> 16)
+    x = (x * 0x7feb352d) & _MASK32
+    x = x ^ (x >> 15)
+    x = (x * 0x846ca68b) & _MASK32
+    return x ^ (x >> 16)
+
+
+def stochastic_rounding_bits(seed, numel, device=None):
+    """The 32 random bits used for elements 0..numel-1, as int64."""
+    key = _hash(seed & _MASK32)
+    index = torch.arange(numel, dtype=torch.int64, device=device)
+    return _hash(index ^ key)
+
+
+def stochastic_round(x, dtype, seed):
+    """Round the fp32 tensor x to dtype, rounding up with a probability equal to
+    the distance from the value below in units of the gap between them."""
+    assert x.dtype == torch.float32
+    assert dtype in _BITS_DTYPES, 'stochastic rounding to {} is not supported'.format(
+        dtype)
+    flat = x.reshape(-1)
+
+    nearest = flat.to(dtype)
+    rounded = nearest.float()
+    bits = nearest.view(_BITS_DTYPES[dtype]).to(torch.int32) & 0xFFFF
+
+    # the representable neighbour on the other side of x
+    away = flat.abs() > rounded.abs()
+    other_bits = torch.where(away, bits + 1, bits - 1)
+    other_bits = torch.where(rounded == 0,
+                             torch.where(flat < 0,
+                                         torch.full_like(bits, 0x8001),
+                                         torch.full_like(bits, 0x0001)),
+                             other_bits)
+    # int16 holds the bit pattern, values above 0x7FFF wrap to negative
+    other_bits = torch.where(other_bits > 0x7FFF, other_bits - 0x10000, other_bits)
+    other = other_bits.to(torch.int16).view(dtype)
+    other_fp32 = other.float()
+
+    random = stochastic_rounding_bits(seed, flat.numel(), device=x.device)
+    u = (random >> 8).float() * (1.0 / 16777216.0)
+    take_other = u < (flat - rounded) / (other_fp32 - rounded)
+    take_other &= (rounded != flat) & torch.isfinite(rounded)
+    take_other &= torch.isfinite(other_fp32)
+
+    return torch.where(take_other, other, nearest).view(x.size())
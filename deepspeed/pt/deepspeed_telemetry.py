@@ -0,0 +1,262 @@
+'''
+Copyright 2020 The Microsoft DeepSpeed Team
+
+Structured per step performance records for dashboards. Every recorded step
+has the training throughput, the model TFLOPs of the transformer layers, the
+bytes all-reduced per gradient bucket, the optimizer step time, loss scale
+skips and the host and device memory high-water marks. The records go to a
+local file in one of two formats:
+
+    jsonl       one JSON object per step appended to the file
+    prometheus  the latest step as gauges, for the node_exporter textfile
+                collector
+
+Recording does not synchronize the device. Records are buffered and written
+every flush_steps records, and the time spent recording and writing is
+measured and reported in the records. When it exceeds max_overhead of the
+step time, steps are recorded less often.
+'''
+
+import json
+import os
+import resource
+import time
+import psutil
+import torch
+
+from deepspeed.pt.deepspeed_flops_profiler import transformer_layer_flops
+from deepspeed.pt.deepspeed_timer import SynchronizedWallClockTimer
+from deepspeed.pt.log_utils import logger
+
+PROMETHEUS_PREFIX = 'deepspeed_'
+
+
+def transformer_flops_per_sample(config, seq_length=None):
+    """Training flops of one sample through a DeepSpeedTransformerLayer with
+    config, the backward pass taking twice the forward flops."""
+    intermediate_size = config.intermediate_size
+    if intermediate_size is not None and intermediate_size <= 0:
+        intermediate_size = None
+    forward = transformer_layer_flops(1,
+                                      seq_length or config.max_seq_length,
+                                      config.hidden_size,
+                                      config.heads,
+                                      intermediate_size)
+    return 3 * sum(forward.values())
+
+
+def _is_transformer_config(config):
+    return all(
+        isinstance(getattr(config,
+                           attr,
+                           None),
+                   int) and getattr(config,
+                                    attr) > 0
+        for attr in ['hidden_size',
+                     'max_seq_length',
+                     'heads'])
+
+
+def model_flops_per_sample(model):
+    """Training flops of one sample through the transformer layers of model,
+    found by their config, at their maximum sequence length."""
+    flops = 0
+    for module in model.modules():
+        config = getattr(module, 'config', None)
+        if _is_transformer_config(config):
+            flops += transformer_flops_per_sample(config)
+    return flops
+
+
+class JsonLinesSink(object):
+    """Appends every record as a line of JSON."""
+    def __init__(self, path):
+        self.path = path
+
+    def write(self, records):
+        with open(self.path, 'a') as fd:
+            for record in records:
+                fd.write(json.dumps(record) + '\n')
+
+
+class PrometheusTextfileSink(object):
+    """Writes the latest record as gauges in the Prometheus text format. The
+    file is replaced, never written in place, so a scrape does not read a
+    partial file."""
+    def __init__(self, path, labels=None):
+        self.path = path
+        self.labels = labels or {}
+
+    def _labels(self, extra=None):
+        labels = dict(self.labels)
+        labels.update(extra or {})
+        if not labels:
+            return ''
+        return '{' + ','.join('{}="{}"'.format(key,
+                                               value)
+                              for key,
+                              value in sorted(labels.items())) + '}'
+
+    def format(self, record):
+        lines = []
+        for key, value in sorted(record.items()):
+            if value is None or isinstance(value, str):
+                continue
+            name = PROMETHEUS_PREFIX + key
+            lines.append('# TYPE {} gauge'.format(name))
+            if isinstance(value, list):
+                for index, item in enumerate(value):
+                    lines.append('{}{} {}'.format(name,
+                                                  self._labels({'bucket': index}),
+                                                  float(item)))
+            else:
+                lines.append('{}{} {}'.format(name, self._labels(), float(value)))
+        return '\n'.join(lines) + '\n'
+
+    def write(self, records):
+        temp_path = self.path + '.tmp'
+        with open(temp_path, 'w') as fd:
+            fd.write(self.format(records[-1]))
+        os.replace(temp_path, self.path)
+
+
+def host_memory():
+    """Resident and peak resident bytes of this process."""
+    rss = psutil.Process().memory_info().rss
+    # kilobytes on Linux
+    peak = resource.getrusage(resource.RUSAGE_SELF).ru_maxrss * 1024
+    return rss, max(rss, peak)
+
+
+def device_memory(reset=False):
+    """Peak allocated and cached bytes of the current device since the last
+    reset, which are host side counters shared by the whole process. With
+    reset they are reset after reading, for every caller."""
+    if not torch.cuda.is_available():
+        return None, None
+    allocated = torch.cuda.max_memory_allocated()
+    cached = torch.cuda.max_memory_cached()
+    if reset:
+        torch.cuda.reset_max_memory_allocated()
+        torch.cuda.reset_max_memory_cached()
+    return allocated, cached
+
+
+class StepTelemetry(object):
+    """Records performance counters of the training steps to sink.
+
+    Arguments:
+        sink: JsonLinesSink or PrometheusTextfileSink
+        samples_per_step: samples of a training step across data parallel ranks
+        flops_per_sample: training flops of a sample, for TFLOPs
+        data_parallel_size: ranks the samples of a step are split across, the
+            TFLOPs are the ones of a rank
+        interval_steps: record every interval_steps steps
+        flush_steps: records buffered before they are written
+        max_overhead: fraction of the step time recording may take before
+            interval_steps is doubled
+        clock: clock of the optimizer step timer, see deepspeed_timer
+        reset_device_peak: reset the peak memory counters of the device at
+            every record, which also resets them for other readers, such as
+            the memory breakdown of SynchronizedWallClockTimer
+    """
+    def __init__(self,
+                 sink,
+                 samples_per_step,
+                 flops_per_sample=0,
+                 data_parallel_size=1,
+                 interval_steps=1,
+                 flush_steps=10,
+                 max_overhead=0.01,
+                 clock=None,
+                 reset_device_peak=False):
+        self.sink = sink
+        self.samples_per_step = samples_per_step
+        self.flops_per_sample = flops_per_sample
+        self.data_parallel_size = data_parallel_size
+        self.interval_steps = max(1, interval_steps)
+        self.flush_steps = max(1, flush_steps)
+        self.max_overhead = max_overhead
+        self.reset_device_peak = reset_device_peak
+        # only the latest optimizer step read is kept
+        self.timers = SynchronizedWallClockTimer(clock=clock, window=1)
+        self.records = []
+        self.bucket_bytes = []
+        self.last_step_time = None
+        self.last_step = None
+        self.overhead_seconds = 0.0
+        self.total_overhead_seconds = 0.0
+
+    @property
+    def optimizer_timer(self):
+        return self.timers('optimizer_step')
+
+    def add_allreduce(self, *tensors):
+        """Counts tensors as one bucket reduced across data parallel ranks."""
+        self.bucket_bytes.append(
+            sum(tensor.numel() * tensor.element_size() for tensor in tensors))
+
+    def _optimizer_step_time(self):
+        """The latest optimizer step completed on the device, which may be
+        the one of an earlier step."""
+        timer = self.optimizer_timer
+        timer.elapsed(reset=True, block=False)
+        durations = timer.intervals.durations.values
+        return durations[-1] if durations else None
+
+    def step(self, step, overflow=False, skipped_steps=0, loss_scale=None):
+        """Ends training step, recording it every interval_steps steps."""
+        now = time.time()
+        if self.last_step_time is None or step % self.interval_steps != 0:
+            # the time of a recorded step starts when the previous step ended
+            if (step + 1) % self.interval_steps == 0:
+                self.last_step_time = now
+                self.last_step = step
+            self.bucket_bytes = []
+            return
+
+        start = time.time()
+        step_time = (now - self.last_step_time) / (step - self.last_step)
+        samples_per_sec = self.samples_per_step / step_time
+        host_rss, host_peak = host_memory()
+        device_allocated, device_cached = device_memory(self.reset_device_peak)
+        self.records.append({
+            'step': step,
+            'time': now,
+            'step_time': step_time,
+            'samples_per_sec': samples_per_sec,
+            'tflops': self.flops_per_sample * samples_per_sec /
+            self.data_parallel_size / 1e12,
+            'allreduce_bytes': sum(self.bucket_bytes),
+            'allreduce_bucket_bytes': self.bucket_bytes,
+            'optimizer_step_time': self._optimizer_step_time(),
+            'overflow': int(overflow),
+            'skipped_steps': skipped_steps,
+            'loss_scale': loss_scale,
+            'host_rss_bytes': host_rss,
+            'host_peak_rss_bytes': host_peak,
+            'device_peak_allocated_bytes': device_allocated,
+            'device_peak_cached_bytes': device_cached,
+            'telemetry_seconds': self.overhead_seconds,
+            'telemetry_overhead': self.overhead_seconds / step_time
+        })
+        self.bucket_bytes = []
+        if len(self.records) >= self.flush_steps:
+            self.flush()
+        self.overhead_seconds = time.time() - start
+        self.total_overhead_seconds += self.overhead_seconds
+
+        # amortized over the steps between records
+        if self.overhead_seconds > self.max_overhead * step_time * self.interval_steps:
+            self.interval_steps *= 2
+            logger.info('Telemetry took {:.3f}ms of a {:.3f}ms step, recording every '
+                        '{} steps'.format(self.overhead_seconds * 1000.0,
+                                          step_time * 1000.0,
+                                          self.interval_steps))
+        self.last_step_time = time.time()
+        self.last_step = step
+
+    def flush(self):
+        if self.records:
+            self.sink.write(self.records)
+            self.records = []
@@ -0,0 +1,437 @@
+'''
+Copyright 2020 The Microsoft DeepSpeed Team
+
+Tensor (intra-layer) model parallelism of the BERT transformer layer, to train
+layers whose weights and activations do not fit one device. Every rank of the
+model parallel group holds a slice of the weights:
+
+  - the QKV and the first feed forward gemms are split by output columns, each
+    rank computing the query, key and value of its own heads and its part of
+    the intermediate activation,
+  - the attention output and the second feed forward gemms are split by input
+    rows, each rank computing a partial sum of the output, which is summed
+    with one all-reduce.
+
+The layer norms, the biases of the row split gemms and the residual stream
+are replicated. The input of each block is copied into the column split gemm
+and its gradient all-reduced in the backward pass, so a layer runs one
+all-reduce per block in each direction. The hidden dropout of the replicated
+stream draws its masks from a random state the ranks share, a named state of
+the cuda rng tracker that activation checkpointing replays, and
+allreduce_replicated_gradients averages the gradients of the replicated
+parameters after the backward pass. The ops are ATen ops, which run on the
+CPU, e.g. across gloo processes, as well as on the GPU. The math follows the
+fused DeepSpeedTransformerLayer, with the same parameter names.
+
+For autoregressive decoding, decode runs the layer on one new token per
+sequence against the keys and values of the earlier tokens kept in a
+PagedKVCache, see deepspeed_kv_cache.py. For inference on the CPU, quantize
+replaces the gemm weights by int8 or int4 weights, see
+deepspeed_quantized_inference.py.
+'''
+
+import contextlib
+import math
+import torch
+import torch.distributed as dist
+import torch.nn.functional as F
+from torch import nn
+from torch.autograd import Function
+from torch._utils import _flatten_dense_tensors, _unflatten_dense_tensors
+
+from deepspeed.pt.deepspeed_checkpointing import get_cuda_rng_tracker, \
+    _set_cuda_rng_state
+from deepspeed.pt.deepspeed_quantized_inference import QuantizedLinear, tanh_gelu, \
+    INT4_GROUP_SIZE, CALIBRATION_MSE
+
+# epsilon of the layer norms of the fused kernels
+LAYER_NORM_EPSILON = 1e-12
+
+# parameters split by output rows and by input columns across the ranks
+COLUMN_PARALLEL_PARAMS = ['attn_qkvw', 'attn_qkvb', 'inter_w', 'inter_b']
+ROW_PARALLEL_PARAMS = ['attn_ow', 'output_w']
+# parameters every rank holds whole
+REPLICATED_PARAMS = ['attn_ob', 'attn_nw', 'attn_nb', 'output_b', 'norm_w', 'norm_b']
+
+# offset of the seed of the hidden dropout from the seed of the weights, apart
+# from the offset of model_parallel_cuda_manual_seed
+DROPOUT_SEED_OFFSET = 3371
+
+# state of the cuda rng tracker the hidden dropout of all layers draws from
+HIDDEN_DROPOUT_RNG_TRACKER_NAME = 'tensor-parallel-hidden-dropout'
+
+
+class _CopyToModelParallelRegion(Function):
+    """Identity in the forward pass, all-reduces the gradient."""
+    @staticmethod
+    def forward(ctx, input, group):
+        ctx.group = group
+        return input
+
+    @staticmethod
+    def backward(ctx, grad_output):
+        grad_output = grad_output.contiguous()
+        dist.all_reduce(grad_output, group=ctx.group)
+        return grad_output, None
+
+
+class _ReduceFromModelParallelRegion(Function):
+    """All-reduces the partial sums of the forward pass, identity gradient."""
+    @staticmethod
+    def forward(ctx, input, group):
+        output = input.contiguous()
+        dist.all_reduce(output, group=group)
+        return output
+
+    @staticmethod
+    def backward(ctx, grad_output):
+        return grad_output, None
+
+
+def copy_to_model_parallel_region(input, group):
+    return _CopyToModelParallelRegion.apply(input, group)
+
+
+def reduce_from_model_parallel_region(input, group):
+    return _ReduceFromModelParallelRegion.apply(input, group)
+
+
+def _add_hidden_dropout_rng_state(seed):
+    """Adds the hidden dropout state to the cuda rng tracker unless it holds
+    it. Unlike CudaRNGStatesTracker.add, adding it again after the tracker was
+    reset, or set to states from before it was added, e.g. by the recompute of
+    a checkpoint, is fine and starts over from the same seed."""
+    tracker = get_cuda_rng_tracker()
+    states = tracker.get_states()
+    if HIDDEN_DROPOUT_RNG_TRACKER_NAME in states:
+        return
+    original = torch.cuda.get_rng_state()
+    torch.cuda.manual_seed(seed)
+    states[HIDDEN_DROPOUT_RNG_TRACKER_NAME] = torch.cuda.get_rng_state()
+    _set_cuda_rng_state(original)
+    tracker.set_states(states)
+
+
+def split_transformer_weights(weights, rank, world_size):
+    """Slices the weights of a whole transformer layer, a dict of tensors by
+    parameter name like the state_dict of DeepSpeedTransformerLayer, into the
+    weights of a DeepSpeedTensorParallelTransformerLayer of rank.
+
+    The query, key and value rows of attn_qkvw and attn_qkvb are split
+    separately, keeping them in that order, so a rank gets whole heads."""
+    split = {}
+    for name, weight in weights.items():
+        if name in ['attn_qkvw', 'attn_qkvb']:
+            qkv = weight.view(3, weight.shape[0] // 3, *weight.shape[1:])
+            part = qkv.shape[1] // world_size
+            split[name] = qkv[:, rank * part:(rank + 1) * part].reshape(
+                3 * part,
+                *weight.shape[1:]).clone()
+        elif name in COLUMN_PARALLEL_PARAMS:
+            part = weight.shape[0] // world_size
+            split[name] = weight[rank * part:(rank + 1) * part].clone()
+        elif name in ROW_PARALLEL_PARAMS:
+            part = weight.shape[1] // world_size
+            split[name] = weight[:, rank * part:(rank + 1) * part].clone()
+        else:
+            split[name] = weight.clone()
+    return split
+
+
+class DeepSpeedTensorParallelTransformerLayer(nn.Module):
+    """Initialize a transformer layer split across the model parallel ranks.
+
+        Arguments:
+            layer_id: The layer index starting from 0
+
+            config: An object of DeepSpeedTransformerConfig. The heads and the
+                intermediate size must divide by the model parallel world size.
+                The dropout ratios, pre_layer_norm, initializer_range,
+                adjust_init_range and seed are used, the options of the fused
+                kernels are not.
+
+            mpu: Optional: An object implementing the model parallel interface
+                of the engine, get_model_parallel_group, _rank and _world_size.
+                All ranks make up the group by default, and the layer is whole
+                without torch.distributed.
+
+            initial_weights: Optional: The weights of the whole layer, a dict
+                by parameter name, split with split_transformer_weights
+    """
+    def __init__(self, layer_id, config, mpu=None, initial_weights=None):
+        super(DeepSpeedTensorParallelTransformerLayer, self).__init__()
+        self.config = config
+        self.layer_id = layer_id
+
+        if mpu is None and not dist.is_initialized():
+            self.group = None
+            self.rank = 0
+            self.world_size = 1
+        elif mpu is None:
+            self.group = dist.group.WORLD
+            self.rank = dist.get_rank()
+            self.world_size = dist.get_world_size()
+        else:
+            self.group = mpu.get_model_parallel_group()
+            self.rank = mpu.get_model_parallel_rank()
+            self.world_size = mpu.get_model_parallel_world_size()
+
+        hidden_size = config.hidden_size
+        intermediate_size = config.intermediate_size \
+            if config.intermediate_size > 0 else 4 * hidden_size
+        assert config.heads % self.world_size == 0, \
+            'heads {} do not divide by the model parallel size {}'.format(
+                config.heads, self.world_size)
+        assert intermediate_size % self.world_size == 0, \
+            'intermediate size {} does not divide by the model parallel size {}'.format(
+                intermediate_size, self.world_size)
+        self.head_size = hidden_size // config.heads
+        self.local_heads = config.heads // self.world_size
+        local_hidden = self.local_heads * self.head_size
+        local_intermediate = intermediate_size // self.world_size
+
+        self.attn_qkvw = nn.Parameter(torch.Tensor(3 * local_hidden, hidden_size))
+        self.attn_qkvb = nn.Parameter(torch.Tensor(3 * local_hidden))
+        self.attn_ow = nn.Parameter(torch.Tensor(hidden_size, local_hidden))
+        self.attn_ob = nn.Parameter(torch.Tensor(hidden_size))
+        self.attn_nw = nn.Parameter(torch.Tensor(hidden_size))
+        self.attn_nb = nn.Parameter(torch.Tensor(hidden_size))
+        self.inter_w = nn.Parameter(torch.Tensor(local_intermediate, hidden_size))
+        self.inter_b = nn.Parameter(torch.Tensor(local_intermediate))
+        self.output_w = nn.Parameter(torch.Tensor(hidden_size, local_intermediate))
+        self.output_b = nn.Parameter(torch.Tensor(hidden_size))
+        self.norm_w = nn.Parameter(torch.Tensor(hidden_size))
+        self.norm_b = nn.Parameter(torch.Tensor(hidden_size))
+
+        # the split weights are private to the rank, for the gradient norm
+        for name in COLUMN_PARALLEL_PARAMS + ROW_PARALLEL_PARAMS:
+            getattr(self, name).model_parallel = True
+        # QuantizedLinear of every gemm weight once quantized for inference
+        self.quantized = None
+        # seed of the hidden dropout, the same on all ranks
+        self.dropout_seed = self._replicated_dropout_seed()
+        # state of the hidden dropout on the CPU, where there is no tracker
+        self.cpu_dropout_rng_state = None
+
+        if initial_weights is None:
+            self.init_transformer_weights(config.adjust_init_range)
+        else:
+            split = split_transformer_weights(initial_weights,
+                                              self.rank,
+                                              self.world_size)
+            with torch.no_grad():
+                for name, param in self.named_parameters():
+                    param.copy_(split[name])
+
+    def init_transformer_weights(self, adjust_init_range=False):
+        output_std = self.config.initializer_range
+        if adjust_init_range:
+            output_std = self.config.initializer_range / math.sqrt(
+                2.0 * self.config.num_hidden_layers)
+
+        # every layer and rank draws its own slices, the same on every run
+        seed = self.config.seed if self.config.seed >= 0 else torch.initial_seed()
+        generator = torch.Generator()
+        generator.manual_seed(((seed * 1009 + self.layer_id) * 1009 + self.rank) % 2**63)
+        with torch.no_grad():
+            for name, std in [('attn_qkvw', self.config.initializer_range),
+                              ('attn_ow', output_std),
+                              ('inter_w', self.config.initializer_range),
+                              ('output_w', output_std)]:
+                param = getattr(self, name)
+                param.copy_(torch.empty(param.shape).normal_(mean=0.0,
+                                                             std=std,
+                                                             generator=generator))
+        for name in ['attn_qkvb', 'attn_ob', 'attn_nb', 'inter_b', 'output_b', 'norm_b']:
+            getattr(self, name).data.zero_()
+        self.attn_nw.data.fill_(1.0)
+        self.norm_w.data.fill_(1.0)
+
+    def _replicated_dropout_seed(self):
+        """The seed of the hidden dropout. Without a seed in the config the
+        ranks agree on the largest of their initial seeds."""
+        seed = self.config.seed if self.config.seed >= 0 else torch.initial_seed()
+        seed = (seed + DROPOUT_SEED_OFFSET) % 2**62
+        if self.world_size == 1:
+            return seed
+        device = torch.device('cuda', torch.cuda.current_device()) \
+            if dist.get_backend(self.group) == dist.Backend.NCCL else torch.device('cpu')
+        seed_tensor = torch.tensor([seed], dtype=torch.long, device=device)
+        dist.all_reduce(seed_tensor, op=dist.ReduceOp.MAX, group=self.group)
+        return seed_tensor.item()
+
+    def _replicated_rng(self, device):
+        """Forks the random state of device to the hidden dropout state. On
+        the GPU it is a state of the cuda rng tracker, which CheckpointFunction
+        saves and restores, so a checkpointed layer recomputes the same masks."""
+        if device.type == 'cuda':
+            _add_hidden_dropout_rng_state(self.dropout_seed)
+            return get_cuda_rng_tracker().fork(HIDDEN_DROPOUT_RNG_TRACKER_NAME)
+        return self._fork_cpu_rng()
+
+    @contextlib.contextmanager
+    def _fork_cpu_rng(self):
+        # CheckpointFunction only runs on the GPU, the layer keeps its state
+        if self.cpu_dropout_rng_state is None:
+            self.cpu_dropout_rng_state = torch.Generator().manual_seed(
+                self.dropout_seed).get_state()
+        original = torch.get_rng_state()
+        torch.set_rng_state(self.cpu_dropout_rng_state)
+        try:
+            yield
+        finally:
+            self.cpu_dropout_rng_state = torch.get_rng_state()
+            torch.set_rng_state(original)
+
+    def allreduce_replicated_gradients(self):
+        """Averages the gradients of the replicated parameters across the
+        ranks, with one all-reduce. Every rank computes them from the same
+        activations, but nondeterministic kernels may still round them
+        differently, so call this after the backward pass to keep the
+        replicated weights from drifting apart in the optimizer step."""
+        if self.world_size == 1:
+            return
+        params = [getattr(self, name) for name in REPLICATED_PARAMS]
+        grads = [param.grad for param in params if param.grad is not None]
+        if not grads:
+            return
+        flat = _flatten_dense_tensors(grads)
+        dist.all_reduce(flat, group=self.group)
+        flat.div_(self.world_size)
+        for grad, synced in zip(grads, _unflatten_dense_tensors(flat, grads)):
+            grad.copy_(synced)
+
+    def _layer_norm(self, input, weight, bias):
+        return F.layer_norm(input,
+                            input.shape[-1:],
+                            weight,
+                            bias,
+                            eps=LAYER_NORM_EPSILON)
+
+    def _copy_to_region(self, input):
+        if self.world_size == 1:
+            return input
+        return copy_to_model_parallel_region(input, self.group)
+
+    def _reduce_from_region(self, input):
+        if self.world_size == 1:
+            return input
+        return reduce_from_model_parallel_region(input, self.group)
+
+    def quantize(self, bits=8, group_size=INT4_GROUP_SIZE, calibration=CALIBRATION_MSE):
+        """Replaces the weights of the four gemms by int8 weights, or int4
+        with bits=4, for inference. The layer can no longer be trained; the
+        fp32 weights are dropped."""
+        self.quantized = nn.ModuleDict()
+        for name in ['attn_qkvw', 'attn_ow', 'inter_w', 'output_w']:
+            self.quantized[name] = QuantizedLinear(getattr(self, name),
+                                                   bits,
+                                                   group_size,
+                                                   calibration)
+            delattr(self, name)
+
+    def _linear(self, input, name, bias=None, gelu=False):
+        if self.quantized is not None:
+            return self.quantized[name](input, bias, gelu)
+        output = F.linear(input, getattr(self, name), bias)
+        return tanh_gelu(output) if gelu else output
+
+    def _qkv(self, input):
+        """The query, key and value of the local heads, [batch, local heads,
+        seq, head size] each."""
+        batch_size, seq_length = input.shape[0], input.shape[1]
+        qkv = self._linear(self._copy_to_region(input), 'attn_qkvw', self.attn_qkvb)
+        return [
+            x.view(batch_size,
+                   seq_length,
+                   self.local_heads,
+                   self.head_size).transpose(1,
+                                             2) for x in qkv.chunk(3,
+                                                                   dim=-1)
+        ]
+
+    def _attention_output(self, context):
+        output = self._reduce_from_region(self._linear(context, 'attn_ow'))
+        return output + self.attn_ob
+
+    def _attention(self, input, input_mask):
+        batch_size, seq_length = input.shape[0], input.shape[1]
+        query, key, value = self._qkv(input)
+        scores = torch.matmul(query, key.transpose(-1, -2)) / math.sqrt(self.head_size)
+        if input_mask is not None:
+            scores = scores + input_mask
+        probs = F.dropout(F.softmax(scores,
+                                    dim=-1),
+                          p=self.config.attn_dropout_ratio,
+                          training=self.training)
+        context = torch.matmul(probs, value).transpose(1, 2).reshape(
+            batch_size,
+            seq_length,
+            self.local_heads * self.head_size)
+        return self._attention_output(context)
+
+    def _cached_attention(self, input, cache, step):
+        batch_size = input.shape[0]
+        query, key, value = [x[:, :, 0] for x in self._qkv(input)]
+        cache.append(self.layer_id, step, key, value)
+        context = cache.attention(self.layer_id,
+                                  step,
+                                  query,
+                                  1.0 / math.sqrt(self.head_size))
+        return self._attention_output(
+            context.to(input.dtype).view(batch_size,
+                                         1,
+                                         self.local_heads * self.head_size))
+
+    def _feed_forward(self, input):
+        intermediate = self._linear(self._copy_to_region(input),
+                                    'inter_w',
+                                    self.inter_b,
+                                    gelu=True)
+        output = self._reduce_from_region(self._linear(intermediate, 'output_w'))
+        return output + self.output_b
+
+    def _hidden_dropout(self, input):
+        # the stream is replicated, so every rank has to drop the same values
+        if not self.training or self.config.hidden_dropout_ratio == 0:
+            return input
+        with self._replicated_rng(input.device):
+            return F.dropout(input, p=self.config.hidden_dropout_ratio, training=True)
+
+    def _layer(self, input, attention):
+        if self.config.pre_layer_norm:
+            attention_input = self._layer_norm(input, self.norm_w, self.norm_b)
+        else:
+            attention_input = input
+        add_res = input + self._hidden_dropout(attention(attention_input))
+        ff_input = self._layer_norm(add_res, self.attn_nw, self.attn_nb)
+        ff_output = self._hidden_dropout(self._feed_forward(ff_input))
+        if self.config.pre_layer_norm:
+            return add_res + ff_output
+        return self._layer_norm(ff_input + ff_output, self.norm_w, self.norm_b)
+
+    def forward(self, input, input_mask):
+        """Runs the layer on the whole input, replicated on every rank, with
+        the additive attention mask of the fused layer, [batch, 1, 1, seq].
+        Every rank returns the whole output.
+
+        The hidden dropout draws the same masks on every rank from its own
+        random state, leaving the default one alone. The attention dropout
+        of the local heads draws from the default random state of the rank.
+        When training, call allreduce_replicated_gradients after the backward
+        pass."""
+        return self._layer(input, lambda x: self._attention(x, input_mask))
+
+    def decode(self, input, cache, step):
+        """Runs the layer on one new token of each sequence, [batch, 1,
+        hidden], attending to the tokens of the sequence before it and to
+        itself, like a causal decoder.
+
+        Arguments:
+            input: The new tokens, in the order of step.seq_ids
+            cache: The PagedKVCache of the model, holding the local heads of
+                layer_id. The key and value of the tokens are appended to it.
+            step: The DecodeStep returned by cache.reserve for the tokens,
+                shared by all the layers
+        """
+        return self._layer(input, lambda x: self._cached_attention(x, cache, step))
@@ -0,0 +1,54 @@
+'''
+Copyright 2020 The Microsoft DeepSpeed Team
+
+The host thread pool the DeepSpeed CPU kernels share, see
+csrc/includes/thread_pool.h. It has OMP_NUM_THREADS threads by default, which
+deepspeed_launch sets to the cores of each rank.
+'''
+
+from deepspeed.pt.log_utils import logger
+
+try:
+    import deepspeed_thread_pool_cpu
+except ImportError:
+    deepspeed_thread_pool_cpu = None
+
+
+def is_available():
+    return deepspeed_thread_pool_cpu is not None
+
+
+def get_num_threads():
+    """Threads of the pool, including the thread calling a kernel."""
+    return deepspeed_thread_pool_cpu.get_num_threads() if is_available() else 1
+
+
+def set_num_threads(num_threads):
+    """Resizes the pool, 0 restores the default. Must not be called while CPU
+    kernels run on other threads."""
+    if is_available():
+        deepspeed_thread_pool_cpu.set_num_threads(num_threads)
+
+
+def get_utilization(reset=False):
+    """Per worker dicts of its numa_node, busy_seconds, tasks run, tasks
+    stolen from other workers (steals), and utilization, the fraction of the
+    time since the last reset it was busy."""
+    if not is_available():
+        return []
+    return deepspeed_thread_pool_cpu.get_utilization(reset)
+
+
+def log_utilization(reset=True):
+    workers = get_utilization(reset)
+    if not workers:
+        return
+    mean = sum(worker['utilization'] for worker in workers) / len(workers)
+    logger.info('CPU thread pool: {} workers, utilization mean {:.1%} min {:.1%} '
+                'max {:.1%}, {} tasks, {} stolen'.format(
+                    len(workers),
+                    mean,
+                    min(worker['utilization'] for worker in workers),
+                    max(worker['utilization'] for worker in workers),
+                    int(sum(worker['tasks'] for worker in workers)),
+                    int(sum(worker['steals'] for worker in workers))))
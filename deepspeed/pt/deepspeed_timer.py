@@ -1,7 +1,20 @@
 '''
 Copyright 2019 The Microsoft DeepSpeed Team
+
+Timers record a timestamp when a phase starts and stops and read the elapsed
+time only when it is logged, so timing does not synchronize the device. The
+timestamps come from a clock:
+
+    CudaEventClock  CUDA events recorded on the current stream, the default
+                    when CUDA is available
+    HostClock       the host wall clock, for CPU runs
+
+Intervals still running on the device when the timers are logged are not
+waited for but reported at the next log. Besides the totals, every timer
+keeps the durations of its recent intervals for percentiles.
 '''
 
+import collections
 import time
 import psutil
 import torch
@@ -17,57 +30,161 @@ def print_rank_0(message):
         logger.info(message)
 
 
+class HostClock(object):
+    """Timestamps of the host wall clock."""
+    def record(self):
+        return time.time()
+
+    def ready(self, mark):
+        return True
+
+    def elapsed(self, start, end):
+        return end - start
+
+
+class CudaEventClock(object):
+    """Timestamps as CUDA events on the current stream. Events are reused once
+    their interval is read."""
+    def __init__(self):
+        self.free_events = []
+
+    def record(self):
+        event = self.free_events.pop() if self.free_events else torch.cuda.Event(
+            enable_timing=True)
+        event.record()
+        return event
+
+    def ready(self, mark):
+        return mark.query()
+
+    def elapsed(self, start, end):
+        # waits for end only if it did not complete yet
+        end.synchronize()
+        seconds = start.elapsed_time(end) / 1000.0
+        self.free_events.extend([start, end])
+        return seconds
+
+
+def default_clock():
+    return CudaEventClock() if torch.cuda.is_available() else HostClock()
+
+
+class RollingPercentiles(object):
+    """Percentiles of the last window values."""
+    def __init__(self, window=1000):
+        self.values = collections.deque(maxlen=window)
+
+    def add(self, value):
+        self.values.append(value)
+
+    def __len__(self):
+        return len(self.values)
+
+    def percentile(self, p):
+        """The p-th percentile, 0 <= p <= 100, interpolating linearly between
+        the closest values, or None without values."""
+        if not self.values:
+            return None
+        values = sorted(self.values)
+        rank = (len(values) - 1) * p / 100.0
+        low = int(rank)
+        high = min(low + 1, len(values) - 1)
+        return values[low] + (values[high] - values[low]) * (rank - low)
+
+
+class _Intervals(object):
+    """Intervals between timestamps of clock, read as they complete."""
+    def __init__(self, clock, window):
+        self.clock = clock
+        self.pending = collections.deque()
+        self.durations = RollingPercentiles(window)
+
+    def add(self, start, end):
+        self.pending.append((start, end))
+
+    def resolve(self, block=False):
+        """Durations of the pending intervals that completed, all of them if
+        block, in the order they were added."""
+        durations = []
+        while self.pending and (block or self.clock.ready(self.pending[0][1])):
+            start, end = self.pending.popleft()
+            duration = self.clock.elapsed(start, end)
+            self.durations.add(duration)
+            durations.append(duration)
+        return durations
+
+
 class SynchronizedWallClockTimer:
-    """Group of timers. Borrowed from Nvidia Megatron code"""
+    """Group of timers. Borrowed from Nvidia Megatron code, timing with the
+    timestamps of clock instead of synchronizing the device.
+
+    Arguments:
+        clock: HostClock or CudaEventClock, by default the latter with CUDA
+        window: intervals per timer kept for percentiles
+    """
     class Timer:
         """Timer."""
-        def __init__(self, name):
+        def __init__(self, name, clock=None, window=1000):
             self.name_ = name
             self.elapsed_ = 0.0
             self.started_ = False
-            self.start_time = time.time()
+            self.clock = clock if clock is not None else default_clock()
+            self.intervals = _Intervals(self.clock, window)
+            self.start_time = None
 
         def start(self):
             """Start the timer."""
             assert not self.started_, 'timer has already been started'
-            torch.cuda.synchronize()
-            self.start_time = time.time()
+            self.start_time = self.clock.record()
             self.started_ = True
 
         def stop(self):
             """Stop the timer."""
             assert self.started_, 'timer is not started'
-            torch.cuda.synchronize()
-            self.elapsed_ += (time.time() - self.start_time)
+            self.intervals.add(self.start_time, self.clock.record())
             self.started_ = False
+            # keeps the pending intervals few without waiting
+            self._resolve(block=False)
+
+        def _resolve(self, block):
+            self.elapsed_ += sum(self.intervals.resolve(block))
 
         def reset(self):
             """Reset timer."""
             self.elapsed_ = 0.0
             self.started_ = False
+            self.intervals.pending.clear()
 
-        def elapsed(self, reset=True):
-            """Calculate the elapsed time."""
+        def elapsed(self, reset=True, block=True):
+            """Calculate the elapsed time. Without block, intervals still
+            running on the device are left for the next call."""
             started_ = self.started_
             # If the timing in progress, end it first.
             if self.started_:
                 self.stop()
+            self._resolve(block)
             # Get the elapsed time.
             elapsed_ = self.elapsed_
             # Reset the elapsed time
             if reset:
-                self.reset()
+                self.elapsed_ = 0.0
             # If timing was in progress, set it back.
             if started_:
                 self.start()
             return elapsed_
 
-    def __init__(self):
+        def percentile(self, p):
+            """p-th percentile in seconds of the recent intervals read."""
+            return self.intervals.durations.percentile(p)
+
+    def __init__(self, clock=None, window=1000):
         self.timers = {}
+        self.clock = clock if clock is not None else default_clock()
+        self.window = window
 
     def __call__(self, name):
         if name not in self.timers:
-            self.timers[name] = self.Timer(name)
+            self.timers[name] = self.Timer(name, self.clock, self.window)
         return self.timers[name]
 
     @staticmethod
@@ -82,13 +199,24 @@ class SynchronizedWallClockTimer:
             torch.cuda.max_memory_cached() / (1024 * 1024 * 1024))
         return " | {} | {} | {} | {}".format(alloc, max_alloc, cache, max_cache)
 
-    def log(self, names, normalizer=1.0, reset=True, memory_breakdown=False):
-        """Log a group of timers."""
+    def log(self,
+            names,
+            normalizer=1.0,
+            reset=True,
+            memory_breakdown=False,
+            percentiles=True):
+        """Log a group of timers, with the p50 and p99 of their recent
+        intervals if percentiles. Does not wait for the device."""
         assert normalizer > 0.0
         string = 'time (ms)'
         for name in names:
-            elapsed_time = self.timers[name].elapsed(reset=reset) * 1000.0 / normalizer
+            timer = self.timers[name]
+            elapsed_time = timer.elapsed(reset=reset, block=False) * 1000.0 / normalizer
             string += ' | {}: {:.2f}'.format(name, elapsed_time)
+            if percentiles and len(timer.intervals.durations) > 0:
+                string += ' (p50 {:.2f}, p99 {:.2f})'.format(
+                    timer.percentile(50) * 1000.0,
+                    timer.percentile(99) * 1000.0)
         if memory_breakdown:
             string += self.memory_usage()
         print_rank_0(string)
@@ -101,7 +229,9 @@ class ThroughputTimer():
                  start_step=2,
                  steps_per_output=50,
                  monitor_memory=True,
-                 logging_fn=None):
+                 logging_fn=None,
+                 clock=None,
+                 window=1000):
         self.start_time = 0
         self.end_time = 0
         self.started = False
@@ -114,11 +244,15 @@ class ThroughputTimer():
         self.local_step_count = 0
         self.total_step_count = 0
         self.total_elapsed_time = 0
+        # steps whose time is read, the latest ones may still be running
+        self.timed_step_count = 0
         self.steps_per_output = steps_per_output
         self.monitor_memory = monitor_memory
         self.logging = logging_fn
         if self.logging is None:
             self.logging = logger.info
+        self.clock = clock if clock is not None else default_clock()
+        self.intervals = _Intervals(self.clock, window)
         self.initialized = False
 
     def update_epoch_count(self):
@@ -132,8 +266,7 @@ class ThroughputTimer():
         self._init_timer()
         self.started = True
         if self.total_step_count >= self.start_step:
-            torch.cuda.synchronize()
-            self.start_time = time.time()
+            self.start_time = self.clock.record()
 
     def stop(self, report_speed=True):
         if not self.started:
@@ -142,16 +275,16 @@ class ThroughputTimer():
         self.total_step_count += 1
         self.local_step_count += 1
         if self.total_step_count > self.start_step:
-            torch.cuda.synchronize()
-            self.end_time = time.time()
-            duration = self.end_time - self.start_time
-            self.total_elapsed_time += duration
+            self.end_time = self.clock.record()
+            self.intervals.add(self.start_time, self.end_time)
+            self._resolve()
             if self.local_step_count % self.steps_per_output == 0:
                 if report_speed:
-                    self.logging("{}/{}, SamplesPerSec={}".format(
+                    self.logging("{}/{}, SamplesPerSec={}{}".format(
                         self.epoch_count,
                         self.local_step_count,
-                        self.avg_samples_per_sec()))
+                        self.avg_samples_per_sec(),
+                        self._step_time_percentiles()))
                 if self.monitor_memory:
                     virt_mem = psutil.virtual_memory()
                     swap = psutil.swap_memory()
@@ -161,11 +294,28 @@ class ThroughputTimer():
                         virt_mem.percent,
                         swap.percent))
 
+    def _resolve(self):
+        durations = self.intervals.resolve()
+        self.total_elapsed_time += sum(durations)
+        self.timed_step_count += len(durations)
+
+    def _step_time_percentiles(self):
+        if len(self.intervals.durations) == 0:
+            return ''
+        return ', StepTimeMs p50={:.2f} p99={:.2f}'.format(
+            self.step_time_percentile(50) * 1000.0,
+            self.step_time_percentile(99) * 1000.0)
+
+    def step_time_percentile(self, p):
+        """p-th percentile in seconds of the recent step times."""
+        self._resolve()
+        return self.intervals.durations.percentile(p)
+
     def avg_samples_per_sec(self):
-        if self.total_step_count > 0:
+        self._resolve()
+        if self.timed_step_count > 0:
             samples_per_step = self.batch_size * self.num_workers
-            total_step_offset = self.total_step_count - self.start_step
-            avg_time_per_step = self.total_elapsed_time / total_step_offset
+            avg_time_per_step = self.total_elapsed_time / self.timed_step_count
             # training samples per second
             return samples_per_step / avg_time_per_step
         return float("-inf")
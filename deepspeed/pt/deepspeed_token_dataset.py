@@ -0,0 +1,190 @@
+'''
+Copyright 2020 The Microsoft DeepSpeed Team
+
+Memory mapped dataset of pretokenized sequences.
+
+A dataset is stored as two files next to each other:
+    <prefix>.idx    magic | version | token dtype | count | offsets
+    <prefix>.bin    token ids of all samples back to back
+
+offsets holds count + 1 int64 token positions, sample k being the tokens
+between offsets[k] and offsets[k + 1]. Both files are memory mapped, so
+opening a dataset reads nothing and DataLoader workers are not needed: whole
+batches are gathered from the mapping by the deepspeed_data_cpu extension on
+threads, straight into preallocated [batch, seq_length] tensors.
+'''
+
+import mmap
+import struct
+
+import numpy as np
+import torch
+from torch.utils.data import Dataset
+
+from deepspeed.pt.deepspeed_data_prefetcher import deepspeed_data_cpu
+from deepspeed.pt.deepspeed_length_sampler import padded_length
+
+TOKEN_INDEX_MAGIC = b'DSTOKIDX'
+TOKEN_INDEX_VERSION = 1
+
+_HEADER = struct.Struct('<8sIIQ')
+
+# Supported token dtypes by their code in the index header. uint16 covers the
+# vocabularies of BERT and GPT-2 at half the size of int32.
+_TOKEN_DTYPES = {1: np.uint16, 2: np.int32}
+_TOKEN_DTYPE_CODES = {np.dtype(v): k for k, v in _TOKEN_DTYPES.items()}
+
+# torch has no uint16, the native gather reads uint16 tokens through int16
+_TORCH_TOKEN_VIEWS = {np.dtype(np.uint16): np.int16, np.dtype(np.int32): np.int32}
+
+
+def _index_path(prefix):
+    return prefix + '.idx'
+
+
+def _data_path(prefix):
+    return prefix + '.bin'
+
+
+class MMapTokenDatasetBuilder(object):
+    """Writes a dataset readable by MMapTokenDataset, one sample at a time."""
+    def __init__(self, path_prefix, dtype=np.uint16):
+        assert np.dtype(dtype) in _TOKEN_DTYPE_CODES, \
+            'unsupported token dtype {}'.format(dtype)
+        self.path_prefix = path_prefix
+        self.dtype = np.dtype(dtype)
+        self.data_file = open(_data_path(path_prefix), 'wb')
+        self.offsets = [0]
+
+    def add(self, tokens):
+        """Append one sample, a sequence of token ids."""
+        if torch.is_tensor(tokens):
+            tokens = tokens.cpu().numpy()
+        tokens = np.asarray(tokens)
+        if tokens.size and (tokens.min() < np.iinfo(self.dtype).min
+                            or tokens.max() > np.iinfo(self.dtype).max):
+            raise ValueError('token ids do not fit in {}'.format(self.dtype))
+        self.data_file.write(tokens.astype(self.dtype).tobytes())
+        self.offsets.append(self.offsets[-1] + tokens.size)
+
+    def finalize(self):
+        self.data_file.close()
+        with open(_index_path(self.path_prefix), 'wb') as f:
+            f.write(
+                _HEADER.pack(TOKEN_INDEX_MAGIC,
+                             TOKEN_INDEX_VERSION,
+                             _TOKEN_DTYPE_CODES[self.dtype],
+                             len(self.offsets) - 1))
+            f.write(np.asarray(self.offsets, dtype=np.int64).tobytes())
+
+
+def _map_file(path):
+    with open(path, 'rb') as f:
+        # an empty file cannot be mapped, datasets of empty samples have none
+        if f.seek(0, 2) == 0:
+            return bytearray()
+        return mmap.mmap(f.fileno(), 0, access=mmap.ACCESS_COPY)
+
+
+class MMapTokenDataset(Dataset):
+    """Dataset over files written by MMapTokenDatasetBuilder.
+
+    Samples are returned as {'input_ids', 'attention_mask'}, int64 tensors of
+    seq_length tokens. Longer samples are truncated and shorter ones padded
+    with pad_token_id and masked out. DeepSpeedDataLoader assembles whole
+    batches with assemble_batch instead of indexing sample by sample.
+
+    With pad_to_multiple_of set, a batch is only padded to its longest sample,
+    rounded up to a multiple of pad_to_multiple_of and at most seq_length,
+    which pairs with LengthBucketingSampler.
+    """
+    def __init__(self, path_prefix, seq_length, pad_token_id=0, pad_to_multiple_of=None):
+        self.path_prefix = path_prefix
+        self.seq_length = seq_length
+        self.pad_token_id = pad_token_id
+        self.pad_to_multiple_of = pad_to_multiple_of
+
+        self.index_map = _map_file(_index_path(path_prefix))
+        magic, version, dtype_code, count = _HEADER.unpack_from(self.index_map, 0)
+        assert magic == TOKEN_INDEX_MAGIC, \
+            '{} is not a token dataset index'.format(_index_path(path_prefix))
+        assert version == TOKEN_INDEX_VERSION, \
+            'unsupported token dataset version {}'.format(version)
+        self.offsets = np.frombuffer(self.index_map,
+                                     dtype=np.int64,
+                                     count=count + 1,
+                                     offset=_HEADER.size)
+
+        dtype = np.dtype(_TOKEN_DTYPES[dtype_code])
+        self.data_map = _map_file(_data_path(path_prefix))
+        self.tokens = np.frombuffer(self.data_map, dtype=dtype)
+        assert self.offsets[0] == 0 and self.offsets[-1] == len(self.tokens) \
+            and np.all(np.diff(self.offsets) >= 0), \
+            'token dataset {} is corrupted'.format(path_prefix)
+
+        self.offsets_tensor = torch.from_numpy(self.offsets)
+        self.tokens_tensor = torch.from_numpy(
+            self.tokens.view(_TORCH_TOKEN_VIEWS[dtype]))
+
+    def __getstate__(self):
+        # DataLoader worker processes map the files again
+        return (self.path_prefix,
+                self.seq_length,
+                self.pad_token_id,
+                self.pad_to_multiple_of)
+
+    def __setstate__(self, state):
+        self.__init__(*state)
+
+    def __len__(self):
+        return len(self.offsets) - 1
+
+    @property
+    def sizes(self):
+        """Number of tokens of every sample, before truncation."""
+        return np.diff(self.offsets)
+
+    def __getitem__(self, index):
+        batch = self.assemble_batch([index])
+        return {key: value[0] for key, value in batch.items()}
+
+    def assemble_batch(self, indices, pool=None, buffers=None):
+        """Gather the samples in indices into a batch. Its tensors come from
+        pool when given, see deepspeed_data_prefetcher, and are then appended
+        to buffers."""
+        seq_length = self.seq_length
+        if self.pad_to_multiple_of is not None and len(indices) > 0:
+            rows = np.asarray(indices)
+            longest = (self.offsets[rows + 1] - self.offsets[rows]).max()
+            seq_length = int(
+                padded_length(longest,
+                              self.seq_length,
+                              self.pad_to_multiple_of))
+        shape = (len(indices), seq_length)
+        if pool is not None:
+            input_ids = pool.acquire(shape, torch.int64)
+            attention_mask = pool.acquire(shape, torch.int64)
+            buffers.extend([input_ids, attention_mask])
+        else:
+            input_ids = torch.empty(shape, dtype=torch.int64)
+            attention_mask = torch.empty(shape, dtype=torch.int64)
+
+        if deepspeed_data_cpu is not None:
+            deepspeed_data_cpu.gather_tokens(self.tokens_tensor,
+                                             self.offsets_tensor,
+                                             torch.as_tensor(indices,
+                                                             dtype=torch.int64),
+                                             input_ids,
+                                             attention_mask,
+                                             self.pad_token_id)
+        else:
+            input_ids.fill_(self.pad_token_id)
+            attention_mask.zero_()
+            for row, index in enumerate(indices):
+                start = self.offsets[index]
+                length = min(self.offsets[index + 1] - start, seq_length)
+                tokens = self.tokens[start:start + length].astype(np.int64)
+                input_ids[row, :length] = torch.from_numpy(tokens)
+                attention_mask[row, :length] = 1
+
+        return {'input_ids': input_ids, 'attention_mask': attention_mask}
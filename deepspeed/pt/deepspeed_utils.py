@@ -6,11 +6,22 @@ Copyright NVIDIA/Megatron
 Helper functions and classes from multiple sources.
 '''
 
+import math
 import torch
 from torch._six import inf
 
 from deepspeed.pt.log_utils import logger
 
+try:
+    import deepspeed_multi_tensor_cpu
+except ImportError:
+    deepspeed_multi_tensor_cpu = None
+
+try:
+    import deepspeed_multi_tensor_cuda
+except ImportError:
+    deepspeed_multi_tensor_cuda = None
+
 
 class CheckOverflow(object):
     '''Checks for overflow in gradient across parallel process'''
@@ -244,6 +255,177 @@ def get_weight_norm(parameters, norm_type=2, mpu=None):
     return total_norm
 
 
+def get_norms_and_overflow(tensor_groups, norm_masks=None):
+    """Computes the squared L2 norm of each group of tensors and checks all of
+    them for inf/nan in a single read of the tensors.
+
+    Arguments:
+        tensor_groups (list of lists of Tensors): tensors to reduce, by group
+        norm_masks (list of lists of bool, optional): False excludes the
+            tensor from its group norm; it is still checked for inf/nan
+
+    Returns:
+        A float64 tensor on the device of the inputs holding the squared norm
+        of every group followed by an overflow flag (nonzero if any tensor has
+        an inf or nan). It is not read back, so it can be all-reduced with
+        ReduceOp.SUM before unpack_norms_and_overflow does the one host sync.
+    """
+    tensors = []
+    group_ids = []
+    for i, group in enumerate(tensor_groups):
+        masks = norm_masks[i] if norm_masks is not None else [True] * len(group)
+        for t, in_norm in zip(group, masks):
+            tensors.append(t.contiguous())
+            group_ids.append(i if in_norm else -1)
+
+    if len(tensors) == 0:
+        return torch.zeros(len(tensor_groups) + 1, dtype=torch.double)
+
+    device = tensors[0].device
+    if deepspeed_multi_tensor_cpu is not None and device.type == 'cpu':
+        return deepspeed_multi_tensor_cpu.norm_and_overflow(tensors,
+                                                            group_ids,
+                                                            len(tensor_groups))
+    if deepspeed_multi_tensor_cuda is not None and device.type == 'cuda':
+        return deepspeed_multi_tensor_cuda.norm_and_overflow(tensors,
+                                                             group_ids,
+                                                             len(tensor_groups))
+
+    norms = torch.stack([torch.norm(t.float(), 2) for t in tensors]).double()
+    ids = torch.tensor(group_ids, device=device)
+    in_norm = ids >= 0
+    result = torch.zeros(len(tensor_groups) + 1, dtype=torch.double, device=device)
+    result[:-1].index_add_(0, ids[in_norm], norms[in_norm]**2)
+    result[-1] = (~torch.isfinite(norms)).any().double()
+    return result
+
+
+def unpack_norms_and_overflow(norms_and_overflow):
+    """Reads the result of get_norms_and_overflow back to the host. Returns the
+    L2 norm of each group, -1 for non-finite norms as in get_grad_norm, and
+    whether any tensor overflowed."""
+    values = norms_and_overflow.tolist()
+    overflow = values[-1] > 0
+    norms = []
+    for sum_squares in values[:-1]:
+        if overflow or sum_squares == float('inf') or sum_squares != sum_squares:
+            norms.append(-1)
+        else:
+            norms.append(math.sqrt(sum_squares))
+    return norms, overflow
+
+
+def multi_tensor_scale_(tensors, scale):
+    """Multiplies every tensor by scale in place."""
+    if len(tensors) == 0:
+        return
+    device = tensors[0].device
+    same_device = all(t.device == device and t.is_contiguous() for t in tensors)
+    if deepspeed_multi_tensor_cpu is not None and same_device and device.type == 'cpu':
+        deepspeed_multi_tensor_cpu.scale_(tensors, scale)
+    elif deepspeed_multi_tensor_cuda is not None and same_device \
+            and device.type == 'cuda':
+        deepspeed_multi_tensor_cuda.scale_(tensors, scale)
+    else:
+        for t in tensors:
+            t.mul_(scale)
+
+
+def unscale_and_clip_(tensors, sum_squares, loss_scale, clip_grad=0.0):
+    """Divides the gradients by the loss scale, and by the clip factor if
+    their norm exceeds clip_grad, without reading the norm back to the host.
+
+    Arguments:
+        tensors (list of Tensors): scaled gradients, scaled in place
+        sum_squares (Tensor): squared L2 norm of the scaled gradients, on the
+            device of the gradients
+        loss_scale (float): loss scale the gradients were computed with
+        clip_grad (float): maximum L2 norm of the gradients, 0 for no clipping
+    """
+    combined_scale = torch.full_like(sum_squares, loss_scale)
+    if clip_grad > 0.:
+        # norm is in fact norm*scale
+        clip = ((sum_squares.sqrt() / loss_scale) + 1e-6) / clip_grad
+        combined_scale = combined_scale * clip.clamp(min=1.0)
+    inverse_scale = combined_scale.reciprocal().float()
+    for t in tensors:
+        t.mul_(inverse_scale.to(t.dtype))
+
+
+class PredicatedStep(object):
+    """Runs steps of an optimizer that are no-ops on the device when a skip
+    flag is set, so the host does not wait for the flag before the step.
+
+    The optimizer's kernels read the flag and leave the parameters and states
+    untouched, see FusedLamb.step. Counters the optimizer keeps on the host,
+    like the step of the bias correction, cannot wait for the flag;
+    undo_host_state reverts them once the flag is read.
+    """
+    def __init__(self, optimizer):
+        assert getattr(optimizer, 'accepts_skip_flag', False), \
+            'lazy overflow check requires an optimizer whose step takes a device ' \
+            'skip flag, Lamb or Adam with state_bits 8, not {}'.format(
+                type(optimizer).__name__)
+        self.optimizer = optimizer
+
+    def _host_state(self):
+        state = {}
+        for p, values in self.optimizer.state.items():
+            for key, value in values.items():
+                if isinstance(value, (int, float)) and not isinstance(value, bool):
+                    state[(p, key)] = value
+        return state
+
+    def step(self, skip, *args, **kwargs):
+        """Steps the optimizer unless skip, a bool tensor, is set. Returns the
+        changes of the host state, for undo_host_state."""
+        host_state = self._host_state()
+        self.optimizer.step(*args, skip=skip, **kwargs)
+
+        changes = {}
+        for key, value in self._host_state().items():
+            if value != host_state.get(key, 0):
+                changes[key] = value - host_state.get(key, 0)
+        return changes
+
+    def undo_host_state(self, changes):
+        for (p, key), change in changes.items():
+            if p in self.optimizer.state and key in self.optimizer.state[p]:
+                self.optimizer.state[p][key] -= change
+
+
+class DeferredOverflow(object):
+    """Overflow flag of the latest step kept on the device and read back at
+    the next step, when the device is normally done with it."""
+    def __init__(self):
+        self.pending = None
+
+    def record(self, flag, context=None):
+        """Starts reading flag, a bool tensor, and returns the overflow and
+        context of the previous step, or None for the first one."""
+        if flag.is_cuda:
+            host = torch.empty(flag.shape, dtype=flag.dtype, pin_memory=True)
+            host.copy_(flag, non_blocking=True)
+            event = torch.cuda.Event()
+            event.record()
+        else:
+            host, event = flag.clone(), None
+        previous = self.resolve()
+        self.pending = (host, event, context)
+        return previous
+
+    def resolve(self):
+        """Overflow and context of the step pending, None if there is none.
+        Waits for the device if it is not done with the flag."""
+        if self.pending is None:
+            return None
+        host, event, context = self.pending
+        self.pending = None
+        if event is not None:
+            event.synchronize()
+        return bool(host.any()), context
+
+
 def is_model_parallel_parameter(p):
     return hasattr(p, 'model_parallel') and p.model_parallel
 
@@ -12,6 +12,13 @@ from torch.autograd import Variable
 
 from deepspeed.pt.loss_scaler import LossScaler, DynamicLossScaler
 from deepspeed.pt.deepspeed_utils import see_memory_usage, is_model_parallel_parameter
+from deepspeed.pt.deepspeed_utils import get_norms_and_overflow, multi_tensor_scale_
+from deepspeed.pt.deepspeed_utils import unpack_norms_and_overflow
+from deepspeed.pt.deepspeed_utils import unscale_and_clip_, PredicatedStep, \
+    DeferredOverflow
+from deepspeed.pt.zero_utils import get_aligned_numel, move_to_flat_buffer
+from deepspeed.pt.zero_utils import flatten_dense_tensors_into
+from deepspeed.pt.deepspeed_flat_checkpoint import parallel_copy_
 
 #Toggle this to true to enable correctness test
 #with gradient partitioning and without
@@ -61,33 +68,6 @@ def lcm(x, y):
     return x * y // gcd(x, y)
 
 
-#create a flat tensor aligned at the alignment boundary
-def flatten_dense_tensors_aligned(tensor_list, alignment, pg):
-    num_elements = 0
-    for tensor in tensor_list:
-        num_elements = num_elements + tensor.numel()
-
-    remaining = num_elements % alignment
-
-    if remaining:
-        elements_to_add = alignment - remaining
-        pad_tensor = torch.zeros(elements_to_add,
-                                 device=tensor_list[0].device,
-                                 dtype=tensor_list[0].dtype)
-        padded_tensor_list = tensor_list + [pad_tensor]
-
-        num_elements = num_elements + elements_to_add
-    else:
-        padded_tensor_list = tensor_list
-
-    return _flatten_dense_tensors(padded_tensor_list)
-
-
-def move_to_cpu(tensor_list):
-    for tensor in tensor_list:
-        tensor.data = tensor.data.cpu()
-
-
 class FP16_DeepSpeedZeroOptimizer(object):
     """
     DeepSpeedZeroOptimizer designed to reduce the memory footprint
@@ -116,7 +96,9 @@ class FP16_DeepSpeedZeroOptimizer(object):
                  clip_grad=0.0,
                  allreduce_always_fp32=False,
                  postscale_gradients=True,
-                 gradient_predivide_factor=1.0):
+                 gradient_predivide_factor=1.0,
+                 telemetry=None,
+                 lazy_overflow=False):
 
         if dist.get_rank() == 0:
             logger.info(f"Reduce bucket size {reduce_bucket_size}")
@@ -136,6 +118,9 @@ class FP16_DeepSpeedZeroOptimizer(object):
 
         self.timers = timers
 
+        # counts the bytes of the reduced buckets
+        self.telemetry = telemetry
+
         self.reduce_scatter = reduce_scatter
 
         self.overlap_comm = overlap_comm
@@ -203,28 +188,21 @@ class FP16_DeepSpeedZeroOptimizer(object):
             #not sure why apex was cloning the weights before flattening
             #removing cloning here
 
-            see_memory_usage(f"Before moving param group {i} to CPU")
-            #move all the parameters to cpu to free up GPU space for creating flat buffer
-            move_to_cpu(self.fp16_groups[i])
-            see_memory_usage(f"After moving param group {i} to CPU")
+            see_memory_usage(f"Before flattening param group {i}")
 
-            #create flat buffer in CPU and move to GPU
+            #stage the weights to host, allocate the aligned flat buffer on GPU and move
+            #the weights into it one at a time, so model fp16 weights become slices of
+            #the flat buffer without a second full copy of the group on host or device
+            num_elements = sum([p.numel() for p in self.fp16_groups[i]])
             self.fp16_groups_flat.append(
-                flatten_dense_tensors_aligned(
+                move_to_flat_buffer(
                     self.fp16_groups[i],
-                    dist.get_world_size(group=self.dp_process_group),
-                    self.dp_process_group).cuda(torch.cuda.current_device()))
-            see_memory_usage(f"After flattening and moving param group {i} to GPU")
+                    get_aligned_numel(num_elements,
+                                      dist.get_world_size(group=self.dp_process_group)),
+                    torch.cuda.current_device()))
 
             if dist.get_rank(group=self.dp_process_group) == 0:
-                see_memory_usage(
-                    f"After Flattening and after emptying param group {i} cache")
-
-            # set model fp16 weight to slices of flattened buffer
-            updated_params = _unflatten_dense_tensors(self.fp16_groups_flat[i],
-                                                      self.fp16_groups[i])
-            for p, q in zip(self.fp16_groups[i], updated_params):
-                p.data = q.data
+                see_memory_usage(f"After flattening param group {i}")
 
             #divide the flat weights into near equal paritition equal to the data parallel degree
             #each process will compute on a different part of the partition
@@ -341,6 +319,12 @@ class FP16_DeepSpeedZeroOptimizer(object):
             self.loss_scaler = LossScaler(scale=static_loss_scale)
             self.cur_iter = 0
 
+        # the overflow flag is read one step later, see FP16_Optimizer._lazy_step
+        self.lazy_overflow = lazy_overflow
+        if self.lazy_overflow:
+            self.predicated_step = PredicatedStep(self.optimizer)
+            self.deferred_overflow = DeferredOverflow()
+
         see_memory_usage("Before initializing optimizer states")
         self.initialize_optimizer_states()
         see_memory_usage("After initializing optimizer states")
@@ -609,6 +593,8 @@ class FP16_DeepSpeedZeroOptimizer(object):
 
         with torch.cuda.stream(stream):
             if not self.reduce_scatter:
+                if self.telemetry is not None:
+                    self.telemetry.add_allreduce(tensor)
                 self.gradient_reduction_w_predivide(tensor)
                 return
 
@@ -652,6 +638,9 @@ class FP16_DeepSpeedZeroOptimizer(object):
                     prev_id = partition_id
             tensor.div_(dist.get_world_size(group=self.dp_process_group))
 
+            if self.telemetry is not None:
+                self.telemetry.add_allreduce(tensor.narrow(0, 0, int(curr_size)))
+
             async_handles = []
             for dst, bucket_offset, numel in rank_and_offsets:
                 grad_slice = tensor.narrow(0, int(bucket_offset), int(numel))
@@ -814,6 +803,9 @@ class FP16_DeepSpeedZeroOptimizer(object):
             global_rank = _get_global_rank(self.dp_process_group, rank)
             dist.reduce(tensor_to_allreduce, global_rank, group=self.dp_process_group)
 
+        if self.telemetry is not None:
+            self.telemetry.add_allreduce(tensor_to_allreduce)
+
         if allreduce_always_fp32 and tensor is not tensor_to_allreduce:
             if rank is None or rank == dist.get_rank(group=self.dp_process_group):
                 tensor.copy_(tensor_to_allreduce)
@@ -1007,6 +999,40 @@ class FP16_DeepSpeedZeroOptimizer(object):
 
         return total_norm
 
+    def get_partitioned_grad_norms_and_overflow(self):
+        """Fused replacement for has_overflow followed by get_grad_norm_direct on
+        every group: the partitioned gradients are read once, the squared norms
+        and the overflow flag share one all-reduce and there is a single host
+        sync instead of one per gradient.
+
+        Returns:
+            The L2 norm of every group (-1 on overflow) and the overflow flag.
+        """
+        return unpack_norms_and_overflow(self._partitioned_grad_norms_and_overflow())
+
+    def _partitioned_grad_norms_and_overflow(self):
+        grad_groups = []
+        norm_masks = []
+        for i in range(len(self.fp16_groups)):
+            grads = []
+            masks = []
+            for g, p in zip(self.averaged_gradients[i], self.params_in_partition[i]):
+                if g is not None:
+                    grads.append(g.data)
+                    masks.append(is_model_parallel_parameter(p)
+                                 or (self.model_parallel_rank == 0))
+            grad_groups.append(grads)
+            norm_masks.append(masks)
+
+        norms_and_overflow = get_norms_and_overflow(grad_groups, norm_masks)
+        norms_and_overflow = norms_and_overflow.to(torch.cuda.current_device())
+        torch.distributed.all_reduce(norms_and_overflow,
+                                     op=torch.distributed.ReduceOp.SUM,
+                                     group=self.dp_process_group)
+        self._model_parallel_all_reduce(tensor=norms_and_overflow,
+                                        op=torch.distributed.ReduceOp.SUM)
+        return norms_and_overflow
+
     #creates a flat fused tensor from the tensor list starting at the first_offset
     #in the first tensor of the list. If there are not enough elements in the tensor
     #list then the flat tensor will be padded with zeros
@@ -1068,14 +1094,20 @@ class FP16_DeepSpeedZeroOptimizer(object):
         """
         see_memory_usage(f"In step before checking overflow")
 
-        # First compute norm for all group so we know if there is overflow
-        self.check_overflow()
-
         timers = self.timers
 
-        prev_scale = self.loss_scale
-        self._update_scale(self.overflow)
-        if self.overflow:
+        # First compute norm for all group so we know if there is overflow
+        if self.lazy_overflow:
+            # not read back, the optimizer skips the step on the device on overflow
+            norms_and_overflow = self._partitioned_grad_norms_and_overflow()
+            skip = norms_and_overflow[-1] > 0
+            prev_scale = self.loss_scale
+        else:
+            norm_groups, self.overflow = self.get_partitioned_grad_norms_and_overflow()
+            prev_scale = self.loss_scale
+            self._update_scale(self.overflow)
+
+        if not self.lazy_overflow and self.overflow:
             see_memory_usage('After overflow before clearing gradients')
             self.zero_grad()
             see_memory_usage('After overflow after clearing gradients')
@@ -1091,31 +1123,18 @@ class FP16_DeepSpeedZeroOptimizer(object):
             timers('optimizer_allgather').stop()
             return
 
-        norm_groups = []
         single_partition_grad_groups = []
-        skip = False
         partition_id = dist.get_rank(group=self.dp_process_group)
         for i, group in enumerate(self.fp16_groups):
-
-            norm_groups.append(
-                self.get_grad_norm_direct(self.averaged_gradients[i],
-                                          self.params_in_partition[i]))
-
             #free gradients for all the prameters that are not updated by this process
             self.free_grad_in_param_list(self.params_not_in_partition[i])
 
             #create a flat gradients for parameters updated by this process
-            # If we are last partition, ensure we have same size grads and partition size, if not pad with zero tensors
-            if partition_id == dist.get_world_size(group=self.dp_process_group) - 1:
-                single_grad_partition = flatten_dense_tensors_aligned(
-                    self.averaged_gradients[i],
-                    int(self.partition_size[i]),
-                    self.dp_process_group).to(
-                        self.single_partition_of_fp32_groups[i].dtype)
-            else:
-                single_grad_partition = _flatten_dense_tensors(
-                    self.averaged_gradients[i]).to(
-                        self.single_partition_of_fp32_groups[i].dtype)
+            #grads are converted while copied, the last partition is zero padded
+            single_grad_partition = flatten_dense_tensors_into(
+                self.averaged_gradients[i],
+                int(self.partition_size[i]),
+                self.single_partition_of_fp32_groups[i].dtype)
             assert single_grad_partition.numel() == self.partition_size[i], \
                 "averaged gradients have different number of elements that partition size {} {} {} {}".format(single_grad_partition.numel(), self.partition_size[i], i, partition_id)
 
@@ -1127,15 +1146,21 @@ class FP16_DeepSpeedZeroOptimizer(object):
 
             single_partition_grad_groups.append(single_grad_partition)
 
-        self.unscale_and_clip_grads(single_partition_grad_groups, norm_groups)
-
         timers('optimizer_step').start()
-        self.optimizer.step()
+        if self.lazy_overflow:
+            unscale_and_clip_(single_partition_grad_groups,
+                              norms_and_overflow[:-1].sum(),
+                              self.loss_scale,
+                              self.clip_grad)
+            host_changes = self.predicated_step.step(skip)
+        else:
+            self.unscale_and_clip_grads(single_partition_grad_groups, norm_groups)
+            self.optimizer.step()
         #get rid of the fp32 gradients. Not needed anymore
         for group in self.single_partition_of_fp32_groups:
             group.grad = None
 
-        for i in range(len(norm_groups)):
+        for i in range(len(self.fp16_groups)):
             for fp16_partitions, fp32_partition in zip(self.parallel_partitioned_fp16_groups, self.single_partition_of_fp32_groups):
                 fp16_partitions[partition_id].data.copy_(fp32_partition.data)
         timers('optimizer_step').stop()
@@ -1175,16 +1200,41 @@ class FP16_DeepSpeedZeroOptimizer(object):
                                 group=self.dp_process_group)
         timers('optimizer_allgather').stop()
 
-        # TODO: we probably don't need this? just to be safe
-        for i in range(len(norm_groups)):
-            updated_params = _unflatten_dense_tensors(self.fp16_groups_flat[i],
-                                                      self.fp16_groups[i])
-            for p, q in zip(self.fp16_groups[i], updated_params):
-                p.data = q.data
+        # model fp16 weights are views of fp16_groups_flat (see move_to_flat_buffer),
+        # so the gathered weights are already visible through the parameters
+
+        if self.lazy_overflow:
+            self._resolve_overflow(
+                self.deferred_overflow.record(skip,
+                                              (prev_scale,
+                                               host_changes)))
 
         see_memory_usage('After zero_optimizer step')
         return
 
+    def _resolve_overflow(self, previous):
+        if previous is None:
+            self.overflow = False
+            return
+        self.overflow, (scale, host_changes) = previous
+        if self.overflow:
+            self.predicated_step.undo_host_state(host_changes)
+        # a step run before the scale was reduced for an earlier overflow
+        # neither reduces it again nor counts as a step without overflow
+        if not self.overflow or scale == self.loss_scale:
+            self._update_scale(self.overflow)
+        if self.overflow:
+            logger.info("[deepscale] OVERFLOW! Rank {} Skipped step. Attempted loss "
+                        "scale: {}, now {}".format(dist.get_rank(),
+                                                  scale,
+                                                  self.loss_scale))
+
+    def resolve_overflow(self):
+        """Reads the overflow flag of the latest step with a lazy overflow
+        check, waiting for the device, e.g. before saving a checkpoint."""
+        if self.lazy_overflow:
+            self._resolve_overflow(self.deferred_overflow.resolve())
+
     def unscale_and_clip_grads(self, grad_groups_flat, norm_groups):
         total_norm = 0.0
         for norm in norm_groups:
@@ -1199,13 +1249,13 @@ class FP16_DeepSpeedZeroOptimizer(object):
             if clip > 1:
                 combined_scale = clip * self.loss_scale
 
+        grads = []
         for grad in grad_groups_flat:
             if isinstance(grad, list):
-                sub_partitions = grad
-                for g in sub_partitions:
-                    g.data.mul_(1. / combined_scale)
+                grads.extend([g.data for g in grad])
             else:
-                grad.data.mul_(1. / combined_scale)
+                grads.append(grad.data)
+        multi_tensor_scale_(grads, 1. / combined_scale)
 
     def _check_overflow(self, partition_gradients=True):
         self.overflow = self.has_overflow(partition_gradients)
@@ -1404,7 +1454,7 @@ class FP16_DeepSpeedZeroOptimizer(object):
                 'partition_count'] == self.partition_count:
             # Use option 2
             for current, saved in zip(self.single_partition_of_fp32_groups, state_dict['single_partition_of_fp32_groups']):
-                current.data.copy_(saved.data)
+                parallel_copy_(current.data, saved.data)
         else:
             # Use option 1
             partition_id = dist.get_rank(group=self.dp_process_group)
@@ -9,7 +9,12 @@ import torch
 import math
 from torch._utils import _flatten_dense_tensors, _unflatten_dense_tensors
 
-from deepspeed.pt.deepspeed_utils import get_grad_norm, CheckOverflow, get_weight_norm
+from deepspeed.pt.deepspeed_utils import CheckOverflow, get_weight_norm
+from deepspeed.pt.deepspeed_utils import get_norms_and_overflow, multi_tensor_scale_
+from deepspeed.pt.deepspeed_utils import unpack_norms_and_overflow, \
+    is_model_parallel_parameter
+from deepspeed.pt.deepspeed_utils import unscale_and_clip_, PredicatedStep, \
+    DeferredOverflow
 from deepspeed.pt.loss_scaler import INITIAL_LOSS_SCALE, SCALE_WINDOW, MIN_LOSS_SCALE
 from deepspeed.pt.log_utils import logger
 
@@ -30,7 +35,8 @@ class FP16_Optimizer(object):
                  mpu=None,
                  clip_grad=0.0,
                  fused_adam_legacy=False,
-                 timers=None):
+                 timers=None,
+                 lazy_overflow=False):
 
         self.fused_adam_legacy = fused_adam_legacy
         self.timers = timers
@@ -97,11 +103,19 @@ class FP16_Optimizer(object):
             self.clip_grad_norm = torch.nn.utils.clip_grad_norm_
 
         #model parallel object
-        self.mpu = None
+        self.mpu = mpu
 
         self.overflow = False
         self.overflow_checker = CheckOverflow(self.fp16_groups, mpu=self.mpu)
 
+        # the overflow flag is read one step later, see _lazy_step
+        self.lazy_overflow = lazy_overflow
+        if self.lazy_overflow:
+            assert not self.fused_adam_legacy, \
+                'lazy overflow check is not supported with the legacy fused Adam'
+            self.predicated_step = PredicatedStep(self.optimizer)
+            self.deferred_overflow = DeferredOverflow()
+
     def zero_grad(self, set_grads_to_None=True):
         """
         Zero FP16 parameter grads.
@@ -207,12 +221,37 @@ class FP16_Optimizer(object):
 
             self.fp32_groups_flat[i].grad = grads_groups_flat[i]
 
+        # The norm and the overflow flag come from a single read of the grads and
+        # share one all-reduce. As in get_grad_norm, replicated params count
+        # towards the norm on model parallel rank 0 only and model parallel ones
+        # on every rank, so other ranks split the flat grads per param
         self.start_timers([COMPUTE_NORM])
-        all_groups_norm = get_grad_norm(self.fp32_groups_flat, mpu=self.mpu)
+        if self.mpu is None or self.mpu.get_model_parallel_rank() == 0:
+            norm_tensors = [g.grad for g in self.fp32_groups_flat]
+            in_norm = [True] * len(norm_tensors)
+        else:
+            norm_tensors = []
+            in_norm = []
+            for i, group in enumerate(self.fp16_groups):
+                norm_tensors.extend(
+                    _unflatten_dense_tensors(grads_groups_flat[i],
+                                             group))
+                in_norm.extend(is_model_parallel_parameter(p) for p in group)
+        norms_and_overflow = get_norms_and_overflow([norm_tensors], [in_norm])
+        if self.mpu is not None:
+            torch.distributed.all_reduce(norms_and_overflow,
+                                         op=torch.distributed.ReduceOp.SUM,
+                                         group=self.mpu.get_model_parallel_group())
         self.stop_timers([COMPUTE_NORM])
 
+        if self.lazy_overflow:
+            self._lazy_step(grads_groups_flat, norms_and_overflow)
+            self.log_timers([COMPUTE_NORM])
+            return self.overflow
+
         self.start_timers([OVERFLOW_CHECK])
-        self.overflow = self.overflow_checker.check_using_norm([all_groups_norm])
+        norms, self.overflow = unpack_norms_and_overflow(norms_and_overflow)
+        all_groups_norm = norms[0]
         self.stop_timers([OVERFLOW_CHECK])
 
         prev_scale = self.cur_scale
@@ -250,6 +289,53 @@ class FP16_Optimizer(object):
 
         return self.overflow
 
+    def _lazy_step(self, grads_groups_flat, norms_and_overflow):
+        """Steps without waiting for the overflow flag: on overflow the
+        optimizer's kernels skip the step on the device. The flag is read and
+        the loss scale updated at the next step, so self.overflow is the one
+        of the previous step."""
+        skip = norms_and_overflow[-1] > 0
+        unscale_and_clip_(grads_groups_flat,
+                          norms_and_overflow[:-1].sum(),
+                          self.cur_scale,
+                          self.clip_grad)
+        host_changes = self.predicated_step.step(skip)
+
+        for group in self.fp32_groups_flat:
+            group.grad = None
+
+        for i in range(len(self.fp16_groups)):
+            updated_params = _unflatten_dense_tensors(self.fp32_groups_flat[i],
+                                                      self.fp16_groups[i])
+            for p, q in zip(self.fp16_groups[i], updated_params):
+                p.data.copy_(q.data)
+
+        self._resolve_overflow(
+            self.deferred_overflow.record(skip,
+                                          (self.cur_scale,
+                                           host_changes)))
+
+    def _resolve_overflow(self, previous):
+        if previous is None:
+            self.overflow = False
+            return
+        self.overflow, (scale, host_changes) = previous
+        if self.overflow:
+            self.predicated_step.undo_host_state(host_changes)
+        # a step run before the scale was reduced for an earlier overflow
+        # neither reduces it again nor counts as a step without overflow
+        if not self.overflow or scale == self.cur_scale:
+            self._update_scale(self.overflow)
+        if self.overflow and self.verbose:
+            logger.info("[deepspeed] OVERFLOW! Skipped step. Attempted loss "
+                        "scale: {}, now {}".format(scale, self.cur_scale))
+
+    def resolve_overflow(self):
+        """Reads the overflow flag of the latest step with a lazy overflow
+        check, waiting for the device, e.g. before saving a checkpoint."""
+        if self.lazy_overflow:
+            self._resolve_overflow(self.deferred_overflow.resolve())
+
     def unscale_and_clip_grads(self, grad_groups_flat, norm_groups, apply_scale=True):
         total_norm = 0.0
         for norm in norm_groups:
@@ -265,8 +351,8 @@ class FP16_Optimizer(object):
                 combined_scale = clip * self.cur_scale
 
         if apply_scale:
-            for grad in grad_groups_flat:
-                grad.data.mul_(1. / combined_scale)
+            multi_tensor_scale_([grad.data for grad in grad_groups_flat],
+                                1. / combined_scale)
 
         return combined_scale
 
@@ -5,19 +5,18 @@ from torch._utils import _flatten_dense_tensors, _unflatten_dense_tensors
 from collections import defaultdict
 
 from deepspeed.pt.zero_utils import _initialize_parameter_parallel_groups
+from deepspeed.pt.zero_utils import move_to_flat_buffer
 from deepspeed.pt.log_utils import log_dist, logger
 from deepspeed.pt.loss_scaler import LossScaler, DynamicLossScaler
 from deepspeed.pt.deepspeed_utils import get_grad_norm, CheckOverflow
+from deepspeed.pt.deepspeed_utils import get_norms_and_overflow, unscale_and_clip_, \
+    PredicatedStep, DeferredOverflow
 
 
-def flatten_dense_tensors_sub_partition_aligned(tensor_list,
-                                                dp,
-                                                max_elements_per_comm,
-                                                pg):
+def get_sub_partition_aligned_numel(num_elements, dp, max_elements_per_comm):
     assert (max_elements_per_comm >= dp,
             f"max_elements_per_comm {max_elements_per_comm} < dp {dp}")
 
-    num_elements = sum(t.numel() for t in tensor_list)
     log_dist("Total number of elements in model: {}, max elements per com: {}".format(
         num_elements,
         max_elements_per_comm),
@@ -47,15 +46,7 @@ def flatten_dense_tensors_sub_partition_aligned(tensor_list,
         f"number of elements with padding: {num_elements} + {padding} = {num_elements + padding}",
         ranks=[0])
 
-    if padding == 0:
-        aligned_tensor_list = tensor_list
-    else:
-        pad_tensor = torch.zeros(padding,
-                                 device=tensor_list[0].device,
-                                 dtype=tensor_list[0].dtype)
-        aligned_tensor_list = tensor_list + [pad_tensor]
-
-    return _flatten_dense_tensors(aligned_tensor_list)
+    return num_elements + padding
 
 
 def _single_range_check(current_index, start_index, end_index, tensor_size):
@@ -105,7 +96,9 @@ class FP16_DeepSpeedZeroOptimizer_Stage1(object):
                  all_gather_partitions=True,
                  allgather_size=500000000,
                  clip_grad=0.0,
-                 max_elements_per_comm=5e8):
+                 max_elements_per_comm=5e8,
+                 telemetry=None,
+                 lazy_overflow=False):
 
         if dp_process_group is not None and partition_size is not None:
             raise ValueError("Cannot specify both dp_process_group "
@@ -128,6 +121,9 @@ class FP16_DeepSpeedZeroOptimizer_Stage1(object):
         self.max_elements_per_comm = max_elements_per_comm
         logger.info("max_elements_per_comm={}".format(max_elements_per_comm))
 
+        # counts the bytes of the reduced buckets
+        self.telemetry = telemetry
+
         # param flattened by groups
         self.fp16_groups = []
         self.fp16_groups_flat = []
@@ -171,19 +167,16 @@ class FP16_DeepSpeedZeroOptimizer_Stage1(object):
 
             # flattens all tensors into single 1d tensor aligned with sub-partition size for later dividing
             # RS: create aligned sub-partitions
+            # model fp16 weights are moved into the flat buffer and become slices of it
+            num_elements = sum([p.numel() for p in self.fp16_groups[i]])
             self.fp16_groups_flat.append(
-                flatten_dense_tensors_sub_partition_aligned(
-                    tensor_list=self.fp16_groups[i],
-                    dp=dist.get_world_size(group=self.dp_process_group),
-                    max_elements_per_comm=self.max_elements_per_comm,
-                    pg=self.dp_process_group))
-
-            # TODO: I don't think this does anything?
-            # set model fp16 weight to slices of flattened buffer
-            updated_params = _unflatten_dense_tensors(self.fp16_groups_flat[i],
-                                                      self.fp16_groups[i])
-            for p, q in zip(self.fp16_groups[i], updated_params):
-                p.data = q.data
+                move_to_flat_buffer(
+                    self.fp16_groups[i],
+                    get_sub_partition_aligned_numel(
+                        num_elements=num_elements,
+                        dp=dist.get_world_size(group=self.dp_process_group),
+                        max_elements_per_comm=self.max_elements_per_comm),
+                    self.fp16_groups[i][0].device))
 
             # divide the flat weights into near equal partition equal to the data parallel degree
             # each process will compute on a different part of the partition
@@ -256,6 +249,17 @@ class FP16_DeepSpeedZeroOptimizer_Stage1(object):
                                               mpu=self.mpu,
                                               zero_reduce_scatter=True)
 
+        # the overflow flag is read one step later, see FP16_Optimizer._lazy_step
+        self.lazy_overflow = lazy_overflow
+        if self.lazy_overflow:
+            # the norm of the local sub partitions counts the parameters
+            # replicated across model parallel ranks more than once
+            assert self.mpu is None or self.clip_grad == 0, \
+                'lazy overflow check does not support gradient clipping with ' \
+                'model parallelism'
+            self.predicated_step = PredicatedStep(self.optimizer)
+            self.deferred_overflow = DeferredOverflow()
+
     @staticmethod
     def get_data_parallel_sub_partitions(tensor,
                                          max_elements_per_comm,
@@ -540,6 +544,8 @@ class FP16_DeepSpeedZeroOptimizer_Stage1(object):
                 dist.reduce_scatter(output=single_comm_all_partitions[local_rank],
                                     input_list=single_comm_all_partitions,
                                     group=self.dp_process_group)
+                if self.telemetry is not None:
+                    self.telemetry.add_allreduce(*single_comm_all_partitions)
 
                 if gradient_average:
                     for partition in single_comm_all_partitions:
@@ -568,6 +574,8 @@ class FP16_DeepSpeedZeroOptimizer_Stage1(object):
 
     def step(self, closure=None):
         # First compute norm for all group so we know if there is overflow
+        if self.lazy_overflow:
+            return self._lazy_step()
 
         self.overflow = self.overflow_checker.check()
 
@@ -583,14 +591,83 @@ class FP16_DeepSpeedZeroOptimizer_Stage1(object):
             return self.overflow
 
         norm_groups = []
-        local_sub_partitions_grad_groups = []
-
-        partition_id = dist.get_rank(group=self.dp_process_group)
         for i, group in enumerate(self.fp16_groups):
-
             #TODO RS: update get grad norm to support sub partitions
             norm_groups.append(get_grad_norm(group, mpu=self.mpu))
 
+        local_sub_partitions_grad_groups = self._local_sub_partition_grads()
+
+        #RS: update unscale/clip with sub partitions
+        self.unscale_and_clip_grads(local_sub_partitions_grad_groups, norm_groups)
+
+        self.optimizer.step()
+
+        self._update_fp16_partitions()
+
+        return self.overflow
+
+    def _lazy_step(self):
+        """Steps without waiting for the overflow flag, which is checked on
+        the local sub partitions of the gradients: on overflow the optimizer's
+        kernels skip the step on the device. The flag is read and the loss
+        scale updated at the next step, so self.overflow is the one of the
+        previous step."""
+        local_sub_partitions_grad_groups = self._local_sub_partition_grads()
+
+        norms_and_overflow = get_norms_and_overflow(local_sub_partitions_grad_groups)
+        dist.all_reduce(norms_and_overflow,
+                        op=dist.ReduceOp.SUM,
+                        group=self.dp_process_group)
+        if self.mpu is not None:
+            dist.all_reduce(norms_and_overflow,
+                            op=dist.ReduceOp.SUM,
+                            group=self.mpu.get_model_parallel_group())
+        skip = norms_and_overflow[-1] > 0
+
+        grads = [g for group in local_sub_partitions_grad_groups for g in group]
+        unscale_and_clip_(grads,
+                          norms_and_overflow[:-1].sum(),
+                          self.loss_scale,
+                          self.clip_grad)
+        host_changes = self.predicated_step.step(skip)
+
+        self._update_fp16_partitions()
+
+        self._resolve_overflow(
+            self.deferred_overflow.record(skip,
+                                          (self.loss_scale,
+                                           host_changes)))
+        return self.overflow
+
+    def _resolve_overflow(self, previous):
+        if previous is None:
+            self.overflow = False
+            return
+        self.overflow, (scale, host_changes) = previous
+        if self.overflow:
+            self.predicated_step.undo_host_state(host_changes)
+        # a step run before the scale was reduced for an earlier overflow
+        # neither reduces it again nor counts as a step without overflow
+        if not self.overflow or scale == self.loss_scale:
+            self._update_scale(self.overflow)
+        if self.overflow and self.verbose:
+            logger.info("[deepspeed] OVERFLOW! Skipped step. Attempted loss "
+                        "scale: {}, now {}".format(scale,
+                                                  self.loss_scale))
+
+    def resolve_overflow(self):
+        """Reads the overflow flag of the latest step with a lazy overflow
+        check, waiting for the device, e.g. before saving a checkpoint."""
+        if self.lazy_overflow:
+            self._resolve_overflow(self.deferred_overflow.resolve())
+
+    def _local_sub_partition_grads(self):
+        """Moves the gradients of the local sub partitions to their fp32
+        copies, freeing all the fp16 gradients, and returns them by group."""
+        local_sub_partitions_grad_groups = []
+
+        partition_id = dist.get_rank(group=self.dp_process_group)
+        for i, group in enumerate(self.fp16_groups):
             #RS: update free grads w.r.t. sub partitions
             #free gradients for all the parameters that are not updated by this process
             self.free_grad_in_param_list(self.params_not_local[i])
@@ -627,10 +704,12 @@ class FP16_DeepSpeedZeroOptimizer_Stage1(object):
 
             local_sub_partitions_grad_groups.append(local_grad_sub_partitions)
 
-        #RS: update unscale/clip with sub partitions
-        self.unscale_and_clip_grads(local_sub_partitions_grad_groups, norm_groups)
+        return local_sub_partitions_grad_groups
 
-        self.optimizer.step()
+    def _update_fp16_partitions(self):
+        """Copies the updated fp32 sub partitions to the fp16 weights and
+        gathers them from every rank."""
+        partition_id = dist.get_rank(group=self.dp_process_group)
 
         #RS: clear our sub partition grads
         #get rid of the fp32 gradients. Not needed anymore
@@ -655,14 +734,8 @@ class FP16_DeepSpeedZeroOptimizer_Stage1(object):
                                 sub_partitions[partition_id],
                                 group=self.dp_process_group)
 
-        # TODO: we probably don't need this? just to be safe
-        for i in range(len(norm_groups)):
-            updated_params = _unflatten_dense_tensors(self.fp16_groups_flat[i],
-                                                      self.fp16_groups[i])
-            for p, q in zip(self.fp16_groups[i], updated_params):
-                p.data = q.data
-
-        return self.overflow
+        # model fp16 weights are views of fp16_groups_flat (see move_to_flat_buffer),
+        # so the gathered weights are already visible through the parameters
 
     def unscale_and_clip_grads(self, grad_groups_flat, norm_groups):
         total_norm = 0.0
@@ -20,3 +20,67 @@ def _initialize_parameter_parallel_groups(parameter_parallel_size=None):
         if rank in ranks:
             my_group = group
     return my_group
+
+
+def get_aligned_numel(num_elements, alignment):
+    """Round num_elements up to the next multiple of alignment."""
+    remaining = num_elements % alignment
+    if remaining:
+        return num_elements + alignment - remaining
+    return num_elements
+
+
+def move_to_flat_buffer(tensor_list, flat_numel, device):
+    """Allocate one flat buffer of flat_numel elements and move the tensors into it.
+
+    Tensors on the GPU are first staged to host memory one at a time, each
+    freeing its device storage before the next is copied, so the buffer is
+    allocated once the group has left the device. The device peak is thus the
+    size of the group, as with move_to_cpu before flattening, instead of twice
+    that. Each tensor's data is then rebound to its view of the buffer. Unlike
+    flattening on the host, no flat host copy of the group is made. Elements
+    past the tensors are zeroed padding.
+    """
+    for tensor in tensor_list:
+        if tensor.is_cuda:
+            tensor.data = tensor.data.cpu()
+
+    flat_buffer = torch.empty(flat_numel, dtype=tensor_list[0].dtype, device=device)
+
+    offset = 0
+    for tensor in tensor_list:
+        numel = tensor.numel()
+        assert offset + numel <= flat_numel, \
+            'flat buffer of {} elements is too small'.format(flat_numel)
+        view = flat_buffer.narrow(0, offset, numel).view_as(tensor.data)
+        view.copy_(tensor.data)
+        tensor.data = view
+        offset += numel
+
+    if offset < flat_numel:
+        flat_buffer.narrow(0, offset, flat_numel - offset).zero_()
+
+    return flat_buffer
+
+
+def flatten_dense_tensors_into(tensor_list, flat_numel, dtype, device=None):
+    """Copy tensors back to back into a new flat buffer of the given dtype,
+    zero-padding up to flat_numel. Unlike _flatten_dense_tensors followed by
+    .to(dtype), the tensors are converted while being copied so no intermediate
+    flat copy is allocated."""
+    if device is None:
+        device = tensor_list[0].device
+    flat_buffer = torch.empty(flat_numel, dtype=dtype, device=device)
+
+    offset = 0
+    for tensor in tensor_list:
+        numel = tensor.numel()
+        assert offset + numel <= flat_numel, \
+            'flat buffer of {} elements is too small'.format(flat_numel)
+        flat_buffer.narrow(0, offset, numel).copy_(tensor.contiguous().view(-1))
+        offset += numel
+
+    if offset < flat_numel:
+        flat_buffer.narrow(0, offset, flat_numel - offset).zero_()
+
+    return flat_buffer
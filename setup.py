@@ -11,7 +11,7 @@ The wheel will be located at: dist/*.whl
 import os
 import torch
 from setuptools import setup, find_packages
-from torch.utils.cpp_extension import CUDAExtension, BuildExtension
+from torch.utils.cpp_extension import CUDAExtension, CppExtension, BuildExtension
 
 cmdclass = {}
 cmdclass['build_ext'] = BuildExtension
@@ -40,7 +40,31 @@ if (TORCH_MAJOR > 1) or (TORCH_MAJOR == 1 and TORCH_MINOR > 4):
     version_ge_1_5 = ['-DVERSION_GE_1_5']
 version_dependent_macros = version_ge_1_1 + version_ge_1_3 + version_ge_1_5
 
+# Host-side kernels pick their SIMD width from the target flags, see
+# csrc/includes/simd.h. The default build runs on any CPU of the architecture;
+# DS_BUILD_NATIVE=1 targets the instruction set of the build machine, e.g.
+# AVX512, and the extensions then only run on CPUs that have it.
+cpu_arch_args = []
+if os.environ.get('DS_BUILD_NATIVE', '0') == '1':
+    cpu_arch_args = ['-march=native']
+cpu_extension_args = ['-O3',
+                      '-std=c++14',
+                      '-g',
+                      '-Wno-reorder'] + cpu_arch_args + version_dependent_macros
+
 ext_modules = [
+    CUDAExtension(
+        name='deepspeed_multi_tensor_cuda',
+        sources=['csrc/multi_tensor/multi_tensor_cuda.cpp',
+                 'csrc/multi_tensor/multi_tensor_cuda_kernel.cu'],
+        include_dirs=['csrc/includes'],
+        extra_compile_args={
+            'cxx': [
+                '-O3',
+            ] + version_dependent_macros,
+            'nvcc': ['-O3',
+                     '--use_fast_math'] + version_dependent_macros
+        }),
     CUDAExtension(
         name='deepspeed_lamb_cuda',
         sources=['csrc/lamb/fused_lamb_cuda.cpp',
@@ -114,6 +138,38 @@ ext_modules = [
                           '-D__STOCHASTIC_MODE__'
                       ]
                   }),
+    CppExtension(name='deepspeed_thread_pool_cpu',
+                 sources=['csrc/thread_pool/thread_pool_cpu.cpp'],
+                 include_dirs=['csrc/includes'],
+                 extra_compile_args={'cxx': cpu_extension_args}),
+    CppExtension(name='deepspeed_sparse_cpu',
+                 sources=['csrc/sparse/csr_reduce.cpp'],
+                 include_dirs=['csrc/includes'],
+                 extra_compile_args={'cxx': cpu_extension_args}),
+    CppExtension(name='deepspeed_multi_tensor_cpu',
+                 sources=['csrc/multi_tensor/multi_tensor_cpu.cpp'],
+                 include_dirs=['csrc/includes'],
+                 extra_compile_args={'cxx': cpu_extension_args}),
+    CppExtension(name='deepspeed_lamb_cpu',
+                 sources=['csrc/lamb/fused_lamb_cpu.cpp'],
+                 include_dirs=['csrc/includes'],
+                 extra_compile_args={'cxx': cpu_extension_args}),
+    CppExtension(name='deepspeed_data_cpu',
+                 sources=['csrc/data/collate_cpu.cpp'],
+                 include_dirs=['csrc/includes'],
+                 extra_compile_args={'cxx': cpu_extension_args}),
+    CppExtension(name='deepspeed_compression_cpu',
+                 sources=['csrc/compression/activation_compression_cpu.cpp'],
+                 include_dirs=['csrc/includes'],
+                 extra_compile_args={'cxx': cpu_extension_args}),
+    CppExtension(name='deepspeed_kv_cache_cpu',
+                 sources=['csrc/inference/kv_cache_cpu.cpp'],
+                 include_dirs=['csrc/includes'],
+                 extra_compile_args={'cxx': cpu_extension_args}),
+    CppExtension(name='deepspeed_quantized_gemm_cpu',
+                 sources=['csrc/inference/quantized_gemm_cpu.cpp'],
+                 include_dirs=['csrc/includes'],
+                 extra_compile_args={'cxx': cpu_extension_args}),
 ]
 
 setup(name='deepspeed',
@@ -0,0 +1,116 @@
+import pytest
+import torch
+import deepspeed.pt.deepspeed_activation_compression as compression
+import deepspeed.pt.deepspeed_checkpointing as checkpointing
+from deepspeed.pt.deepspeed_activation_compression import ActivationCompressor, \
+    CompressedTensor, payload_tensors, with_payload_tensors
+
+native = pytest.mark.skipif(compression.deepspeed_compression_cpu is None,
+                            reason='native compression codecs are not built')
+
+
+def _activations(numel, dtype=torch.float32, seed=0):
+    torch.manual_seed(seed)
+    x = torch.randn(numel) * 0.1
+    # every third value zero, like after ReLU or dropout
+    x[::3] = 0
+    return x.to(dtype)
+
+
+@pytest.mark.parametrize('numel', [1, 2048, 5000])
+def test_int8_round_trip(numel):
+    x = _activations(numel)
+    q, absmax = compression.quantize_int8(x)
+    assert q.dtype == torch.int8 and q.numel() == numel
+    assert absmax.numel() == -(-numel // 2048)
+
+    y = compression.dequantize_int8(q, absmax, x.dtype)
+    # off by at most half a quantization step of the block
+    step = torch.cat([s.expand(2048) for s in absmax / 127])[:numel]
+    assert ((y - x).abs() <= step / 2 + 1e-7).all()
+
+
+@native
+@pytest.mark.parametrize('dtype', [torch.float32, torch.float16])
+def test_int8_native_matches_torch(dtype, monkeypatch):
+    x = _activations(5000, dtype)
+    q, absmax = compression.quantize_int8(x)
+    y = compression.dequantize_int8(q, absmax, dtype)
+
+    monkeypatch.setattr(compression, 'deepspeed_compression_cpu', None)
+    q_reference, absmax_reference = compression.quantize_int8(x)
+    assert torch.equal(q, q_reference)
+    assert torch.equal(absmax, absmax_reference)
+    y_reference = compression.dequantize_int8(q_reference, absmax_reference, dtype)
+    assert torch.equal(y, y_reference)
+
+
+@native
+@pytest.mark.parametrize('dtype', [torch.float32, torch.float16])
+@pytest.mark.parametrize('numel', [0, 1, 4096, 10001])
+def test_lossless_round_trip(dtype, numel):
+    x = _activations(numel, dtype)
+    index, data = compression.encode_lossless(x)
+    y = compression.decode_lossless(index, data, numel, dtype)
+    assert torch.equal(x, y)
+    if numel > 4096:
+        assert data.numel() < 0.8 * numel * x.element_size()
+
+
+def test_compressor_policy():
+    compressor = ActivationCompressor(['int8', 'none'])
+    x = _activations(4096)
+    compressed = compressor.compress(x, 0)
+    assert isinstance(compressed, CompressedTensor)
+    assert compressor.compress(x, 1) is x
+    assert compressor.compress(x, 5) is x
+    assert compressor.num_uncompressed(4) == 3
+
+    y = compressor.decompress(compressed)
+    assert y.size() == x.size() and y.dtype == x.dtype
+    stats = compressor.stats.as_dict()
+    assert stats['compression_ratio'] == pytest.approx(4.0, rel=0.01)
+    assert stats['raw_MB'] == 4096 * 4 / 1e6
+    compressor.stats.log()
+    assert compressor.stats.raw_bytes == 0
+
+
+def test_lossless_needs_native_codec(monkeypatch):
+    monkeypatch.setattr(compression, 'deepspeed_compression_cpu', None)
+    compressor = ActivationCompressor('lossless')
+    x = _activations(100)
+    assert compressor.compress(x, 0) is x
+    assert compressor.stats.skipped == 1
+
+
+@pytest.mark.parametrize('policy', ['lossless', ['int8', 'lossless']])
+def test_lossless_needs_sync_cpu_checkpointing(policy):
+    with pytest.raises(AssertionError):
+        checkpointing.configure(None,
+                                partition_activations=True,
+                                checkpoint_in_cpu=True,
+                                async_checkpoint_in_cpu=True,
+                                compression=policy)
+    with pytest.raises(AssertionError):
+        checkpointing.configure(None, partition_activations=True, compression=policy)
+    checkpointing.configure(None,
+                            partition_activations=True,
+                            checkpoint_in_cpu=True,
+                            compression=policy)
+    assert checkpointing.compressor.codec(1) == 'lossless'
+    checkpointing.configure(None)
+
+
+def test_payload_round_trip():
+    compressor = ActivationCompressor('int8')
+    x = _activations(3000)
+    labels = torch.arange(10)
+    items = [compressor.compress(x, 0), compressor.compress(labels, 0)]
+    assert items[1] is labels
+
+    # e.g. offloaded and fetched back
+    tensors = payload_tensors(items)
+    assert len(tensors) == 3
+    copies = with_payload_tensors(items, [tensor.clone() for tensor in tensors])
+    assert torch.equal(compressor.decompress(copies[0]), compressor.decompress(items[0]))
+    assert torch.equal(copies[1], labels)
@@ -0,0 +1,96 @@
+import pytest
+import torch
+from deepspeed.pt.deepspeed_activation_offload import ActivationOffloader, \
+    SimulatedOffloadBackend
+
+
+def _layers(num_layers, seed=0):
+    torch.manual_seed(seed)
+    return [[torch.randn(4, 8), torch.randn(16)] for _ in range(num_layers)]
+
+
+def _forward_backward(offloader, layers):
+    checkpoints = [offloader.offload(tensors) for tensors in layers]
+    for checkpoint, tensors in reversed(list(zip(checkpoints, layers))):
+        fetched = offloader.fetch(checkpoint)
+        assert len(fetched) == len(tensors)
+        for a, b in zip(fetched, tensors):
+            assert a.size() == b.size()
+            assert torch.equal(a, b)
+
+
+@pytest.mark.parametrize('prefetch_depth', [0, 1, 3])
+def test_offload_round_trip(prefetch_depth):
+    offloader = ActivationOffloader(SimulatedOffloadBackend(), prefetch_depth)
+    _forward_backward(offloader, _layers(6))
+
+    # only the last layer, which backward starts with, cannot be prefetched
+    if prefetch_depth == 0:
+        assert offloader.fetch_misses == 6
+    else:
+        assert offloader.fetch_misses == 1
+        assert offloader.fetch_hits == 5
+
+
+def test_prefetch_depth_limits_copies_in_flight():
+    backend = SimulatedOffloadBackend()
+    offloader = ActivationOffloader(backend, prefetch_depth=2)
+    checkpoints = [offloader.offload(tensors) for tensors in _layers(6)]
+
+    offloader.fetch(checkpoints[5])
+    prefetched = [c.prefetched is not None for c in checkpoints]
+    assert prefetched == [False, False, False, True, True, False]
+
+    offloader.fetch(checkpoints[4])
+    prefetched = [c.prefetched is not None for c in checkpoints]
+    assert prefetched == [False, False, True, True, False, False]
+
+    # copies back to the device wait for the offload and run on their own stream
+    copies = [op for op in backend.ops if op[0] == 'copy_to_device']
+    assert {stream for _, stream in copies} == {offloader.prefetch_stream.name}
+    offload_streams = [stream for op, stream in backend.ops if op == 'copy_to_host']
+    assert set(offload_streams) == {offloader.offload_stream.name}
+
+
+def test_host_memory_is_reused():
+    offloader = ActivationOffloader(SimulatedOffloadBackend(), prefetch_depth=1)
+    # the first step grows the arena chunk by chunk, the second merges them
+    for step in range(4):
+        _forward_backward(offloader, _layers(5, seed=step))
+        if step == 1:
+            allocations = offloader.host_allocations()
+        elif step > 1:
+            assert offloader.host_allocations() == allocations
+
+
+def test_reset_after_forward_only():
+    offloader = ActivationOffloader(SimulatedOffloadBackend(), prefetch_depth=1)
+    _forward_backward(offloader, _layers(4))
+    _forward_backward(offloader, _layers(4))
+    allocations = offloader.host_allocations()
+
+    # evaluation runs forward without backward, reset makes the memory reusable
+    for step in range(3):
+        for tensors in _layers(4, seed=step):
+            offloader.offload(tensors)
+        offloader.reset()
+    assert offloader.host_allocations() == allocations
+
+    _forward_backward(offloader, _layers(4, seed=5))
+    assert offloader.host_allocations() == allocations
+
+
+def test_growing_checkpoints_are_merged():
+    offloader = ActivationOffloader(SimulatedOffloadBackend(), prefetch_depth=1)
+    _forward_backward(offloader, _layers(2))
+    _forward_backward(offloader, _layers(2))
+    allocations = offloader.host_allocations()
+
+    # more layers than fit the arena add chunks, which are merged into one
+    _forward_backward(offloader, _layers(9))
+    _forward_backward(offloader, _layers(9, seed=1))
+    grown = offloader.host_allocations()
+    assert grown > allocations
+    _forward_backward(offloader, _layers(9, seed=2))
+    _forward_backward(offloader, _layers(3, seed=3))
+    assert offloader.host_allocations() == grown
@@ -12,6 +12,9 @@ import json
 import os
 import numbers
 from common import distributed_test
+from deepspeed.pt.deepspeed_checkpoint_writer import AsyncCheckpointWriter
+from deepspeed.pt.deepspeed_flat_checkpoint import save_flat_checkpoint, \
+    load_flat_checkpoint, is_flat_checkpoint
 from simple_model import SimpleModel, random_dataloader, args_from_dict
 
 
@@ -95,10 +98,12 @@ def checkpoint_correctness_verification(args,
     ds_model, _, _,_ = deepspeed.initialize(args=args,
                                             model=model,
                                             model_parameters=model.parameters())
-    data_loader = random_dataloader(model=ds_model,
-                                    total_samples=50,
-                                    hidden_dim=hidden_dim,
-                                    device=ds_model.device)
+    data_loader = random_dataloader(
+        model=ds_model,
+        total_samples=50,
+        hidden_dim=hidden_dim,
+        device=ds_model.device,
+        dtype=torch.bfloat16 if ds_model.bfloat16_enabled() else torch.half)
     for n, batch in enumerate(data_loader):
         loss = ds_model(batch[0], batch[1])
         ds_model.backward(loss)
@@ -420,3 +425,204 @@ def test_checkpoint_no_lr_scheduler(tmpdir, zero_stage):
                                      hidden_dim=hidden_dim,
                                      load_optimizer_states=False,
                                      load_lr_scheduler_states=False)
+
+
+@pytest.mark.parametrize("zero_stage", [0, 2])
+def test_checkpoint_async_save(tmpdir, zero_stage):
+    config_dict = {
+        "train_batch_size": 2,
+        "steps_per_print": 1,
+        "optimizer": {
+            "type": "Adam",
+            "params": {
+                "lr": 0.00015
+            }
+        },
+        "fp16": {
+            "enabled": True
+        },
+        "zero_optimization": {
+            "stage": zero_stage
+        },
+        "checkpoint": {
+            "async_save": True,
+            "max_staging_mb": 1
+        }
+    }
+    args = args_from_dict(tmpdir, config_dict)
+    hidden_dim = 10
+
+    model = SimpleModel(hidden_dim, empty_grad=False)
+
+    @distributed_test(world_size=[2])
+    def _test_checkpoint_async_save(args, model, hidden_dim):
+        checkpoint_correctness_verification(args,
+                                            model,
+                                            hidden_dim,
+                                            tmpdir,
+                                            load_optimizer_states=True)
+
+    _test_checkpoint_async_save(args=args, model=model, hidden_dim=hidden_dim)
+
+
+def test_async_checkpoint_writer(tmpdir):
+    weight = torch.randn(64, 64)
+    state = {'weight': weight, 'tied': weight, 'step': 3, 'list': [torch.ones(5)]}
+    path = os.path.join(tmpdir, 'ckpt.pt')
+
+    # cap below the size of one snapshot, saves must still go through one at a time
+    writer = AsyncCheckpointWriter(max_staging_bytes=1024, num_threads=2)
+    writer.save(state, path)
+    expected = weight.clone()
+    weight.add_(1.0)
+    writer.save(state, path + '.2')
+    writer.wait()
+
+    assert writer.is_complete()
+    assert not os.path.exists(path + '.tmp')
+    loaded = torch.load(path)
+    assert torch.equal(loaded['weight'], expected)
+    assert loaded['tied'] is loaded['weight']
+    assert loaded['step'] == 3
+    assert torch.equal(loaded['list'][0], torch.ones(5))
+    assert torch.equal(torch.load(path + '.2')['weight'], weight)
+
+
+def test_async_checkpoint_writer_prunes_futures(tmpdir):
+    path = os.path.join(tmpdir, 'ckpt.pt')
+    writer = AsyncCheckpointWriter(max_staging_bytes=1024)
+    for i in range(4):
+        writer.save({'step': i}, path)
+        writer.futures[-1].result()
+    # only the latest write is tracked, the finished ones were dropped
+    assert len(writer.futures) == 1
+    assert writer.is_complete() and writer.futures == []
+
+    def fail(state, f):
+        raise IOError('disk full')
+
+    writer.save({'step': 4}, path + '.bad', save_fn=fail)
+    assert isinstance(writer.futures[-1].exception(), IOError)
+    writer.save({'step': 5}, path)
+    # a failed write is kept until wait() raises it
+    with pytest.raises(IOError):
+        writer.wait()
+    assert writer.futures == []
+
+
+@pytest.mark.parametrize("zero_stage", [0, 2])
+def test_checkpoint_flat_format(tmpdir, zero_stage):
+    config_dict = {
+        "train_batch_size": 2,
+        "steps_per_print": 1,
+        "optimizer": {
+            "type": "Adam",
+            "params": {
+                "lr": 0.00015
+            }
+        },
+        "fp16": {
+            "enabled": True
+        },
+        "zero_optimization": {
+            "stage": zero_stage
+        },
+        "checkpoint": {
+            "format": "flat"
+        }
+    }
+    args = args_from_dict(tmpdir, config_dict)
+    hidden_dim = 10
+
+    model = SimpleModel(hidden_dim, empty_grad=False)
+
+    @distributed_test(world_size=[2])
+    def _test_checkpoint_flat_format(args, model, hidden_dim):
+        checkpoint_correctness_verification(args,
+                                            model,
+                                            hidden_dim,
+                                            tmpdir,
+                                            load_optimizer_states=True)
+
+    _test_checkpoint_flat_format(args=args, model=model, hidden_dim=hidden_dim)
+
+
+@pytest.mark.skipif(not hasattr(torch, 'bfloat16'), reason='requires bfloat16')
+@pytest.mark.parametrize("checkpoint_format", ["torch", "flat"])
+def test_checkpoint_bfloat16(tmpdir, checkpoint_format):
+    config_dict = {
+        "train_batch_size": 2,
+        "steps_per_print": 1,
+        "optimizer": {
+            "type": "Adam",
+            "params": {
+                "lr": 0.00015
+            }
+        },
+        "gradient_clipping": 1.0,
+        "bf16": {
+            "enabled": True
+        },
+        "checkpoint": {
+            "format": checkpoint_format
+        }
+    }
+    args = args_from_dict(tmpdir, config_dict)
+    hidden_dim = 10
+
+    model = SimpleModel(hidden_dim, empty_grad=False)
+
+    @distributed_test(world_size=[2])
+    def _test_checkpoint_bfloat16(args, model, hidden_dim):
+        checkpoint_correctness_verification(args,
+                                            model,
+                                            hidden_dim,
+                                            tmpdir,
+                                            load_optimizer_states=True)
+        assert next(model.parameters()).dtype == torch.bfloat16
+
+    _test_checkpoint_bfloat16(args=args, model=model, hidden_dim=hidden_dim)
+
+
+def test_flat_checkpoint_round_trip(tmpdir):
+    weight = torch.randn(33, 7).half()
+    state = {
+        'weight': weight,
+        'tied': weight,
+        'scalar': torch.tensor(2.5),
+        'steps': torch.arange(10),
+        'nested': [(torch.ones(3, dtype=torch.bool), 'name')],
+        'step': 3
+    }
+    path = os.path.join(tmpdir, 'ckpt.flat')
+
+    save_flat_checkpoint(state, path)
+    assert is_flat_checkpoint(path)
+
+    loaded = load_flat_checkpoint(path)
+    assert torch.equal(loaded['weight'], weight)
+    assert loaded['tied'] is loaded['weight']
+    assert loaded['scalar'].item() == 2.5
+    assert torch.equal(loaded['steps'], torch.arange(10))
+    assert torch.equal(loaded['nested'][0][0], torch.ones(3, dtype=torch.bool))
+    assert loaded['nested'][0][1] == 'name'
+    assert loaded['step'] == 3
+
+    # mapped tensors are copy-on-write, updates do not reach the file
+    loaded['weight'].zero_()
+    assert torch.equal(load_flat_checkpoint(path)['weight'], weight)
+
+    copied = load_flat_checkpoint(path, map_location='cpu', num_threads=2)
+    assert torch.equal(copied['weight'], weight)
+
+
+@pytest.mark.skipif(not hasattr(torch, 'bfloat16'), reason='requires bfloat16')
+def test_flat_checkpoint_bfloat16(tmpdir):
+    weight = torch.randn(5, 3).bfloat16()
+    path = os.path.join(tmpdir, 'ckpt.flat')
+
+    save_flat_checkpoint({'weight': weight}, path)
+
+    for loaded in [load_flat_checkpoint(path), load_flat_checkpoint(path, map_location='cpu')]:
+        assert loaded['weight'].dtype == torch.bfloat16
+        assert torch.equal(loaded['weight'], weight)
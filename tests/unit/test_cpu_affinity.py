@@ -0,0 +1,135 @@
+import os
+import pytest
+from deepspeed.pt import deepspeed_cpu_affinity as cpu_affinity
+from deepspeed.pt.deepspeed_cpu_affinity import CpuTopology
+
+
+def _sysfs(tmpdir, num_nodes, cores_per_node, threads_per_core=2):
+    '''Fake sysfs of a host whose cpu n + k * num_cores is hyperthread k of core n,
+    like Linux numbers them.'''
+    root = str(tmpdir)
+    num_cores = num_nodes * cores_per_node
+    for node in range(num_nodes):
+        cores = range(node * cores_per_node, (node + 1) * cores_per_node)
+        cpus = [core + thread * num_cores for thread in range(threads_per_core)
+                for core in cores]
+        path = os.path.join(root, cpu_affinity.SYSFS_NODE, 'node{}'.format(node))
+        os.makedirs(path)
+        with open(os.path.join(path, 'cpulist'), 'w') as fd:
+            fd.write(cpu_affinity.format_cpulist(cpus) + '\n')
+        for cpu in cpus:
+            core = cpu % num_cores
+            path = os.path.join(root,
+                                cpu_affinity.SYSFS_CPU,
+                                'cpu{}'.format(cpu),
+                                'topology')
+            os.makedirs(path)
+            with open(os.path.join(path, 'thread_siblings_list'), 'w') as fd:
+                siblings = range(core, num_cores * threads_per_core, num_cores)
+                fd.write(','.join(map(str, siblings)) + '\n')
+    return root
+
+
+def test_cpulist():
+    assert cpu_affinity.parse_cpulist('0-3,8,10-11\n') == [0, 1, 2, 3, 8, 10, 11]
+    assert cpu_affinity.format_cpulist([11, 0, 1, 2, 3, 8, 10]) == '0-3,8,10-11'
+
+
+def test_read_topology(tmpdir):
+    topology = CpuTopology.read(_sysfs(tmpdir, 2, 4), allowed_cpus=range(16))
+    assert sorted(topology.nodes) == [0, 1]
+    assert topology.nodes[1] == [[4, 12], [5, 13], [6, 14], [7, 15]]
+    assert topology.num_cores() == 8
+
+    # only the allowed cpus, e.g. under taskset
+    topology = CpuTopology.read(_sysfs(tmpdir.mkdir('a'), 2, 4), allowed_cpus=[0, 8, 1])
+    assert topology.nodes == {0: [[0, 8], [1]]}
+
+
+@pytest.mark.parametrize('num_ranks', [1, 2, 4, 8])
+def test_ranks_split_nodes(tmpdir, num_ranks):
+    topology = CpuTopology.read(_sysfs(tmpdir, 2, 8), allowed_cpus=range(32))
+    placements = cpu_affinity.partition(topology, num_ranks)
+    assert len(placements) == num_ranks
+
+    cpus = [cpu for placement in placements for cpu in placement.cpus]
+    assert len(cpus) == len(set(cpus)) == 32
+    for placement in placements:
+        assert placement.num_threads == 16 // num_ranks
+        assert len(placement.cpus) == 2 * placement.num_threads
+        # siblings stay together, ranks stay on one node if they can
+        assert all(cpu + 16 in placement.cpus for cpu in placement.cpus if cpu < 16)
+        assert len(placement.numa_nodes) == (2 if num_ranks == 1 else 1)
+    if num_ranks > 1:
+        assert [p.numa_nodes[0] for p in placements] == sorted(
+            [0, 1] * (num_ranks // 2))
+
+
+def test_uneven_ranks(tmpdir):
+    topology = CpuTopology.read(_sysfs(tmpdir, 2, 4, threads_per_core=1),
+                                allowed_cpus=range(8))
+    # node 0 hosts two of the three ranks, all get two cores
+    placements = cpu_affinity.partition(topology, 3)
+    assert [p.cpus for p in placements] == [[0, 1], [2, 3], [4, 5]]
+    assert [p.numa_nodes for p in placements] == [[0], [0], [1]]
+
+    # more ranks than cores on a node
+    placements = cpu_affinity.partition(topology, 6)
+    assert [p.num_threads for p in placements] == [1] * 6
+
+    assert cpu_affinity.partition(topology, 9) is None
+
+
+def test_thread_environment(tmpdir):
+    topology = CpuTopology.read(_sysfs(tmpdir, 1, 8), allowed_cpus=range(16))
+    placement = cpu_affinity.partition(topology, 2)[1]
+    assert cpu_affinity.thread_environment(placement, {}) == {
+        'OMP_NUM_THREADS': '4',
+        'MKL_NUM_THREADS': '4'
+    }
+    env = cpu_affinity.thread_environment(placement, {'OMP_NUM_THREADS': '1'})
+    assert env == {'MKL_NUM_THREADS': '4'}
+
+
+def _pci_devices(root, devices):
+    for address, (vendor, device_class, node) in devices.items():
+        path = os.path.join(root, cpu_affinity.SYSFS_PCI, address)
+        os.makedirs(path)
+        files = {'vendor': vendor, 'class': device_class, 'numa_node': node}
+        for name, value in files.items():
+            with open(os.path.join(path, name), 'w') as fd:
+                fd.write('{}\n'.format(value))
+
+
+def test_gpu_numa_nodes(tmpdir):
+    root = str(tmpdir)
+    _pci_devices(
+        root,
+        {
+            '0000:b1:00.0': ('0x10de', '0x030200', 1),
+            '0000:3b:00.0': ('0x10de', '0x030200', 0),
+            # a NVSwitch bridge and the host's VGA controller
+            '0000:05:00.0': ('0x10de', '0x068000', 0),
+            '0000:02:00.0': ('0x1a03', '0x030000', 0),
+            '0000:d8:00.0': ('0x10de', '0x030200', -1)
+        })
+    assert cpu_affinity.gpu_numa_nodes(root) == [0, 1, -1]
+    assert cpu_affinity.local_gpu_nodes([1, 0], root) == [1, 0]
+    assert cpu_affinity.local_gpu_nodes([0, 2], root) is None
+    assert cpu_affinity.local_gpu_nodes([3], root) is None
+
+
+def test_ranks_follow_gpus(tmpdir):
+    topology = CpuTopology.read(_sysfs(tmpdir, 2, 4, threads_per_core=1),
+                                allowed_cpus=range(8))
+    # both GPUs of the ranks on node 1, node 0 stays unused
+    placements = cpu_affinity.partition(topology, 2, gpu_nodes=[1, 1])
+    assert [p.cpus for p in placements] == [[4, 5], [6, 7]]
+    assert [p.numa_nodes for p in placements] == [[1], [1]]
+
+    placements = cpu_affinity.partition(topology, 3, gpu_nodes=[1, 0, 1])
+    assert [p.cpus for p in placements] == [[4, 5], [0, 1], [6, 7]]
+
+    # a GPU node without allowed cpus falls back to the even split
+    placements = cpu_affinity.partition(topology, 2, gpu_nodes=[1, 2])
+    assert [p.numa_nodes for p in placements] == [[0], [1]]
@@ -48,3 +48,21 @@ def test_csr_addition_different():
     cx.add(cy)
 
     assert torch.all(dense_sum == cx.to_dense())
+
+
+def test_csr_coalesce():
+    dense_x = torch.zeros(10, 5)
+    dense_x[1] = 1
+    dense_x[4] = 2
+    dense_x[7] = 3
+    cx = CSRTensor(dense_x)
+    assert cx.coalesced
+    cx.add(CSRTensor(dense_x))
+    cx.add(CSRTensor(dense_x))
+    assert cx.indices.numel() == 9
+    assert not cx.coalesced
+
+    cx.coalesce()
+    assert cx.indices.tolist() == [1, 4, 7]
+    assert torch.all(dense_x * 3 == cx.to_dense())
+
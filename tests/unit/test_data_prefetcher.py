@@ -0,0 +1,116 @@
+import pytest
+import torch
+from torch.utils.data import Dataset, SequentialSampler
+from deepspeed.pt.deepspeed_dataloader import DeepSpeedDataLoader
+from deepspeed.pt.deepspeed_data_prefetcher import deepspeed_data_cpu
+
+
+class SimpleDataset(Dataset):
+    def __init__(self, size=37, fail_at=None):
+        torch.manual_seed(0)
+        self.inputs = torch.randn(size, 3, 5)
+        self.fail_at = fail_at
+
+    def __len__(self):
+        return len(self.inputs)
+
+    def __getitem__(self, index):
+        if index == self.fail_at:
+            raise RuntimeError('bad sample {}'.format(index))
+        return {'x': self.inputs[index], 'label': index, 'weight': float(index) / 2}
+
+
+def _make_loader(dataset, prefetch_depth, batch_size=4):
+    return DeepSpeedDataLoader(dataset=dataset,
+                               batch_size=batch_size,
+                               pin_memory=False,
+                               local_rank=0,
+                               tput_timer=None,
+                               num_local_io_workers=0,
+                               data_sampler=SequentialSampler(dataset),
+                               prefetch_depth=prefetch_depth)
+
+
+def _assert_batches_equal(a, b):
+    assert a.keys() == b.keys()
+    for key in a:
+        assert a[key].dtype == b[key].dtype
+        assert torch.equal(a[key], b[key])
+
+
+@pytest.mark.parametrize('prefetch_depth', [1, 3])
+def test_prefetch_matches_default_collate(prefetch_depth):
+    dataset = SimpleDataset()
+    expected = list(_make_loader(dataset, 0))
+
+    loader = _make_loader(dataset, prefetch_depth)
+    count = 0
+    for batch, reference in zip(loader, expected):
+        # pooled batches are only valid until the next one is requested
+        _assert_batches_equal(batch, reference)
+        count += 1
+    assert count == len(expected) == 10
+
+
+def test_prefetch_reuses_buffers():
+    dataset = SimpleDataset(size=200)
+    loader = _make_loader(dataset, 2)
+    for _ in range(2):
+        for batch in loader:
+            pass
+    # one buffer per queued batch, one being collated and one held by the loop
+    assert loader.buffer_pool.allocated <= 2 + 2
+
+
+def test_prefetch_stats():
+    dataset = SimpleDataset()
+    loader = _make_loader(dataset, 2)
+    for batch in loader:
+        pass
+    stats = loader.prefetch_stats.as_dict()
+    # ten batches plus the wait that ends the epoch
+    assert stats['batches'] == 10 + 1
+    assert stats['fetch_ms'] > 0
+    assert stats['collate_ms'] > 0
+    assert stats['copy_ms'] == 0
+
+    loader.prefetch_stats.log()
+    assert loader.prefetch_stats.as_dict()['batches'] == 0
+
+
+def test_prefetch_raises_dataset_errors():
+    loader = _make_loader(SimpleDataset(fail_at=9), 2)
+    iterator = iter(loader)
+    next(iterator)
+    next(iterator)
+    with pytest.raises(RuntimeError, match='bad sample 9'):
+        next(iterator)
+    with pytest.raises(StopIteration):
+        next(iterator)
+
+
+def test_prefetch_restart_mid_epoch():
+    dataset = SimpleDataset()
+    loader = _make_loader(dataset, 2)
+    first = next(iter(loader))['label'].clone()
+    next(loader)
+
+    # starting a new epoch stops the old prefetch thread and starts over
+    assert torch.equal(next(iter(loader))['label'], first)
+    assert len(list(b['label'].clone() for b in loader)) == 9
+
+
+@pytest.mark.skipif(deepspeed_data_cpu is None,
+                    reason='deepspeed_data_cpu is not installed')
+def test_native_collate():
+    samples = [torch.randn(6, 7) for _ in range(5)]
+    samples.append(torch.randn(7, 6).t())
+    out = torch.empty(6, 6, 7)
+    deepspeed_data_cpu.collate(samples, out)
+    assert torch.equal(out, torch.stack(samples))
+
+    with pytest.raises(RuntimeError):
+        deepspeed_data_cpu.collate([s.double() for s in samples], out)
+    # same number of elements, different shape
+    with pytest.raises(RuntimeError):
+        deepspeed_data_cpu.collate(samples[:5] + [torch.randn(7, 6)], out)
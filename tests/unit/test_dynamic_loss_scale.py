@@ -165,6 +165,80 @@ def test_fused_some_overflow(tmpdir):
     _test_fused_some_overflow(args)
 
 
+def test_fused_lazy_overflow(tmpdir):
+    config_dict = {
+        "train_batch_size": 1,
+        "steps_per_print": 1,
+        "optimizer": {
+            "type": "Lamb",
+            "params": {
+                "lr": 0.00015
+            }
+        },
+        "scheduler": {
+            "type": "WarmupLR",
+            "params": {
+                "warmup_min_lr": 0,
+                "warmup_max_lr": 0.001,
+                "warmup_num_steps": 10
+            }
+        },
+        "fp16": {
+            "enabled": True,
+            "loss_scale": 0,
+            "initial_scale_power": 8,
+            "loss_scale_window": 100,
+            "lazy_overflow": True
+        }
+    }
+    args = args_from_dict(tmpdir, config_dict)
+
+    @distributed_test(world_size=1)
+    def _test_fused_lazy_overflow(args):
+        hidden_dim = 1
+        model = SimpleModel(hidden_dim, empty_grad=True)
+        model, optim, _, _ = deepspeed.initialize(args=args,
+                                                  model=model,
+                                                  model_parameters=model.parameters())
+        assert optim.lazy_overflow
+        params = [p.detach().clone() for p in model.parameters()]
+        first_iteration = model.lr_scheduler.last_batch_iteration
+
+        # the overflow is read, and the scale reduced, at the next step
+        run_model_step(model, [float('inf')])
+        assert not optim.overflow
+        assert optim.cur_scale == 2**8
+        assert all(torch.equal(p, q) for p, q in zip(model.parameters(), params))
+
+        run_model_step(model, [float('nan')])
+        assert optim.overflow
+        assert optim.cur_scale == 2**7
+        assert all(torch.equal(p, q) for p, q in zip(model.parameters(), params))
+
+        # the nan step ran with the scale of the first overflow, which is
+        # neither reduced again nor counted as an iteration without overflow
+        run_model_step(model, [0.1])
+        assert optim.overflow
+        assert optim.cur_scale == 2**7
+        assert optim.cur_iter == 1
+        assert not all(torch.equal(p, q) for p, q in zip(model.parameters(), params))
+
+        # saving reads the flag of the latest step and takes back the
+        # scheduler step that followed it
+        run_model_step(model, [float('inf')])
+        assert model.lr_scheduler.last_batch_iteration == first_iteration + 2
+        model.save_checkpoint(tmpdir, 'lazy')
+        assert optim.cur_scale == 2**6
+        assert model.skipped_steps == 3
+        assert model.lr_scheduler.last_batch_iteration == first_iteration + 1
+
+        # only the step without overflow is counted by the optimizer
+        for state in optim.optimizer.state.values():
+            assert int(state['step']) == 1
+
+    _test_fused_lazy_overflow(args)
+
+
 def test_unfused_no_overflow(tmpdir):
     config_dict = {
         "train_batch_size": 1,
@@ -0,0 +1,137 @@
+import pytest
+import torch
+from deepspeed.pt.deepspeed_flops_profiler import FlopsProfiler, transformer_layer_flops
+
+
+class Attention(torch.nn.Module):
+    def __init__(self, hidden_size):
+        super(Attention, self).__init__()
+        self.query = torch.nn.Linear(hidden_size, hidden_size, bias=False)
+
+    def forward(self, x):
+        query = self.query(x)
+        scores = torch.matmul(query, x.transpose(-1, -2))
+        return torch.matmul(scores, x)
+
+
+class FusedLayerConfig(object):
+    def __init__(self, hidden_size, heads):
+        self.hidden_size = hidden_size
+        self.heads = heads
+
+
+class FusedLayer(torch.nn.Module):
+    '''Shaped like DeepSpeedTransformerLayer, its work hidden from the hooks.'''
+    def __init__(self, hidden_size, heads):
+        super(FusedLayer, self).__init__()
+        self.config = FusedLayerConfig(hidden_size, heads)
+        self.attn_qkvw = torch.nn.Parameter(torch.zeros(3 * hidden_size, hidden_size))
+        self.inter_w = torch.nn.Parameter(torch.zeros(4 * hidden_size, hidden_size))
+
+    def forward(self, x, mask=None):
+        return x + 1
+
+
+def test_linear_flops():
+    model = torch.nn.Sequential(torch.nn.Linear(8,
+                                                16),
+                                torch.nn.ReLU(),
+                                torch.nn.Linear(16,
+                                                4))
+    profiler = FlopsProfiler(model)
+    profiler.start_profile()
+    model(torch.randn(2, 8))
+    profiler.stop_profile()
+
+    # multiply-adds and biases, one flop per relu output
+    flops = (2 * 2 * 8 * 16 + 2 * 16) + 2 * 16 + (2 * 2 * 16 * 4 + 2 * 4)
+    assert profiler.get_total_flops() == flops
+    assert profiler.get_total_params() == 8 * 16 + 16 + 16 * 4 + 4
+    first = profiler.get_profile().children[0]
+    assert first.flops == 2 * 2 * 8 * 16 + 2 * 16
+    assert first.activation_bytes == 2 * 16 * 4
+    assert first.bytes_per_flop == pytest.approx((first.params * 4 + 2 * 16 * 4) /
+                                                 first.flops)
+
+    # nothing is counted once stopped
+    model(torch.randn(2, 8))
+    assert profiler.get_total_flops() == flops
+    profiler.end_profile()
+
+
+def test_functional_flops_go_to_running_module():
+    model = torch.nn.Sequential(Attention(8))
+    profiler = FlopsProfiler(model)
+    profiler.start_profile()
+    model(torch.randn(2, 5, 8))
+    profiler.stop_profile()
+
+    attention = profiler.get_profile().children[0]
+    matmuls = 2 * (2 * 2 * 5 * 5 * 8)
+    assert attention.children[0].flops == 2 * 2 * 5 * 8 * 8
+    assert attention.flops == matmuls + attention.children[0].flops
+    assert profiler.get_total_flops() == attention.flops
+
+
+def test_fused_transformer_layer():
+    model = torch.nn.Sequential(FusedLayer(64, heads=4), FusedLayer(64, heads=4))
+    profiler = FlopsProfiler(model)
+    profiler.start_profile()
+    model(torch.randn(3, 16, 64))
+    profiler.stop_profile()
+
+    fused = transformer_layer_flops(3, 16, 64, 4)
+    # 24 * tokens * h^2 + 4 * b * s^2 * h
+    assert sum(fused.values()) == 24 * 48 * 64 * 64 + 4 * 3 * 16 * 16 * 64
+    assert profiler.get_total_flops() == 2 * sum(fused.values())
+    layer = profiler.get_profile().children[0]
+    assert layer.fused_flops == fused
+
+
+def test_backward_hooks():
+    model = torch.nn.Sequential(torch.nn.Linear(8,
+                                                16),
+                                torch.nn.ReLU(),
+                                torch.nn.Linear(16,
+                                                4))
+    profiler = FlopsProfiler(model)
+    profiler.start_profile()
+    output = model(torch.randn(2, 8))
+    profiler.stop_profile()
+    output.sum().backward()
+
+    first, relu, last = [profiler.profiles[module] for module in model]
+    # the input of the model takes no gradient, the weights of the first layer end it
+    assert len(profiler.backward_hooks) == 2
+    for profile in [first, relu, last]:
+        assert profile.backward_end >= profile.backward_start
+    # backward runs from the last layer to the first one
+    assert last.backward_start <= relu.backward_start <= first.backward_start
+
+    profiler.end_profile()
+    assert profiler.backward_hooks == []
+
+
+def test_summary_tree():
+    model = torch.nn.Sequential(torch.nn.Sequential(Attention(8),
+                                                    Attention(8),
+                                                    torch.nn.ReLU()),
+                                torch.nn.ReLU())
+    profiler = FlopsProfiler(model)
+    profiler.start_profile()
+    model(torch.randn(2, 5, 8))
+    profiler.stop_profile()
+    profiler.record_backward(0.01)
+
+    lines = profiler.summary(module_depth=1, top_modules=1)
+    assert lines[0].startswith('DeepSpeed Flops Profiler')
+    assert lines[1].startswith('backward')
+    tree = lines[3:]
+    assert tree[0].startswith('model (Sequential)')
+    # one child, one level deep
+    assert len(tree) == 2 and tree[1].startswith('  ')
+    assert 'TFLOPS' in tree[1] and 'B/FLOP' in tree[1]
+
+    assert len(profiler.summary(top_modules=3)) > len(lines)
+    profiler.print_model_profile()
+    profiler.end_profile()
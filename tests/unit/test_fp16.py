@@ -79,6 +79,45 @@ def test_lamb_fp16_basic(tmpdir):
     _test_lamb_fp16_basic(args=args, model=model, hidden_dim=hidden_dim)
 
 
+def test_adam_8bit_fp16_coeff_params(tmpdir):
+    config_dict = {
+        "train_batch_size": 2,
+        "steps_per_print": 1,
+        "optimizer": {
+            "type": "Adam",
+            "params": {
+                "lr": 0.00015,
+                "state_bits": 8,
+                "max_coeff": 1.0
+            }
+        },
+        "gradient_clipping": 1.0,
+        "fp16": {
+            "enabled": True
+        }
+    }
+    args = args_from_dict(tmpdir, config_dict)
+    hidden_dim = 10
+
+    model = SimpleModel(hidden_dim, empty_grad=False)
+
+    @distributed_test(world_size=[1])
+    def _test_adam_8bit_fp16_coeff_params(args, model, hidden_dim):
+        model, _, _,_ = deepspeed.initialize(args=args,
+                                             model=model,
+                                             model_parameters=model.parameters())
+        data_loader = random_dataloader(model=model,
+                                        total_samples=10,
+                                        hidden_dim=hidden_dim,
+                                        device=model.device)
+        for n, batch in enumerate(data_loader):
+            loss = model(batch[0], batch[1])
+            model.backward(loss)
+            model.step()
+
+    _test_adam_8bit_fp16_coeff_params(args=args, model=model, hidden_dim=hidden_dim)
+
+
 def test_lamb_fp16_empty_grad(tmpdir):
     config_dict = {
         "train_batch_size": 1,
@@ -0,0 +1,77 @@
+import pytest
+import torch
+from deepspeed.pt.deepspeed_fused_lamb import FusedLamb, deepspeed_lamb_cpu
+
+
+def _step(optimizer, params, grads):
+    for p, g in zip(params, grads):
+        p.grad = g
+    optimizer.step()
+
+
+def _lamb_coeff(p, grad):
+    # trust ratio of the first step with the default betas and no weight decay
+    update = 0.1 * grad / ((0.001 * grad * grad).sqrt() + 1e-8)
+    return min(max((p.norm() / update.norm()).item(), 0.01), 10.0)
+
+
+@pytest.mark.skipif(not torch.cuda.is_available(), reason='requires CUDA')
+def test_lamb_coeffs_async():
+    torch.manual_seed(0)
+    params = [torch.nn.Parameter(torch.randn(100).cuda()) for _ in range(3)]
+    optimizer = FusedLamb(params, async_lamb_coeffs=True)
+
+    grads = [torch.randn(100).cuda(), None, torch.randn(100).cuda()]
+    expected = [
+        _lamb_coeff(params[0].data,
+                    grads[0]),
+        _lamb_coeff(params[2].data,
+                    grads[2])
+    ]
+    _step(optimizer, params, grads)
+    assert optimizer.get_lamb_coeffs() == []
+
+    _step(optimizer, params, [torch.randn(100).cuda() for _ in range(3)])
+    coeffs = optimizer.get_lamb_coeffs()
+    assert len(coeffs) == 2
+    for c, e in zip(coeffs, expected):
+        assert abs(c - e) < 1e-3 * e
+
+
+@pytest.mark.skipif(deepspeed_lamb_cpu is None,
+                    reason='deepspeed_lamb_cpu is not installed')
+def test_lamb_coeffs_sync():
+    torch.manual_seed(0)
+    params = [torch.nn.Parameter(torch.randn(100)) for _ in range(3)]
+    optimizer = FusedLamb(params)
+
+    grads = [torch.randn(100), None, torch.randn(100)]
+    expected = [
+        _lamb_coeff(params[0].data,
+                    grads[0]),
+        _lamb_coeff(params[2].data,
+                    grads[2])
+    ]
+    _step(optimizer, params, grads)
+
+    coeffs = optimizer.get_lamb_coeffs()
+    assert len(coeffs) == 2
+    for c, e in zip(coeffs, expected):
+        assert abs(c - e) < 1e-3 * e
+
+
+@pytest.mark.skipif(deepspeed_lamb_cpu is None or not hasattr(torch, 'bfloat16'),
+                    reason='requires deepspeed_lamb_cpu and bfloat16')
+def test_bfloat16_grads():
+    torch.manual_seed(0)
+    grad = torch.randn(3000).bfloat16()
+    params = [torch.nn.Parameter(torch.randn(3000)) for _ in range(2)]
+    params[1].data.copy_(params[0].data)
+    output_param = torch.empty(3000, dtype=torch.bfloat16)
+
+    FusedLamb(params[:1]).step(grads=[grad], output_params=[output_param])
+    FusedLamb(params[1:]).step(grads=[grad.float()])
+
+    # same update as fp32 gradients of the same values, rounded once
+    assert torch.allclose(params[0], params[1])
+    assert torch.equal(output_param, params[0].data.bfloat16())
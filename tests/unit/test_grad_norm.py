@@ -0,0 +1,142 @@
+import math
+import pytest
+import torch
+import torch.distributed as dist
+from common import distributed_test
+import deepspeed.pt.deepspeed_utils as ds_utils
+from deepspeed.pt.deepspeed_utils import get_norms_and_overflow, multi_tensor_scale_
+from deepspeed.pt.deepspeed_utils import unpack_norms_and_overflow
+from deepspeed.pt.fp16_optimizer import FP16_Optimizer
+
+
+def test_norms_by_group():
+    torch.manual_seed(0)
+    a = [torch.randn(100, 30), torch.randn(70000)]
+    b = [torch.randn(5).half(), torch.randn(33)]
+
+    norms, overflow = unpack_norms_and_overflow(get_norms_and_overflow([a, b]))
+
+    assert not overflow
+    expected_a = math.sqrt(sum(float(t.double().norm()**2) for t in a))
+    expected_b = math.sqrt(sum(float(t.double().norm()**2) for t in b))
+    assert math.isclose(norms[0], expected_a, rel_tol=1e-5)
+    assert math.isclose(norms[1], expected_b, rel_tol=1e-5)
+
+
+def test_norm_mask():
+    a = [torch.ones(4), torch.ones(9)]
+
+    norms, overflow = unpack_norms_and_overflow(
+        get_norms_and_overflow([a], [[True, False]]))
+
+    assert not overflow
+    assert norms == [2.0]
+
+
+def test_overflow_in_masked_tensor():
+    for bad in [float('inf'), float('-inf'), float('nan')]:
+        a = [torch.ones(4), torch.ones(70000)]
+        a[1][12345] = bad
+
+        norms, overflow = unpack_norms_and_overflow(
+            get_norms_and_overflow([a], [[True, False]]))
+
+        assert overflow
+        assert norms == [-1]
+
+
+def test_overflow_half():
+    a = [torch.ones(1000).half()]
+    a[0][999] = float('inf')
+
+    _, overflow = unpack_norms_and_overflow(get_norms_and_overflow([a]))
+
+    assert overflow
+
+
+def test_multi_tensor_scale():
+    tensors = [torch.ones(70001), torch.ones(3, 3).half()]
+
+    multi_tensor_scale_(tensors, 0.5)
+
+    assert torch.all(tensors[0] == 0.5)
+    assert torch.all(tensors[1] == 0.5)
+
+
+@pytest.mark.skipif(not hasattr(torch, 'bfloat16'), reason='requires bfloat16')
+def test_norms_and_overflow_bfloat16():
+    torch.manual_seed(0)
+    a = [torch.randn(70001).bfloat16(), torch.randn(31).bfloat16()]
+
+    norms, overflow = unpack_norms_and_overflow(get_norms_and_overflow([a]))
+
+    assert not overflow
+    expected = math.sqrt(sum(float(t.double().norm()**2) for t in a))
+    assert math.isclose(norms[0], expected, rel_tol=1e-5)
+
+    a[0][40000] = float('nan')
+    _, overflow = unpack_norms_and_overflow(get_norms_and_overflow([a]))
+    assert overflow
+
+
+@pytest.mark.skipif(ds_utils.deepspeed_multi_tensor_cuda is None
+                    or not torch.cuda.is_available(),
+                    reason='deepspeed_multi_tensor_cuda is not built')
+def test_cuda_kernel_matches_torch(monkeypatch):
+    torch.manual_seed(0)
+    a = [torch.randn(100, 30).cuda(), torch.randn(200000).cuda()]
+    b = [torch.randn(5).half().cuda(), torch.randn(33).cuda(), torch.randn(70).cuda()]
+    masks = [[True, True], [True, False, True]]
+
+    result = get_norms_and_overflow([a, b], masks)
+    assert result.is_cuda
+    monkeypatch.setattr(ds_utils, 'deepspeed_multi_tensor_cuda', None)
+    expected = get_norms_and_overflow([a, b], masks)
+    assert torch.allclose(result, expected, rtol=1e-5)
+    monkeypatch.undo()
+
+    b[2][7] = float('nan')
+    _, overflow = unpack_norms_and_overflow(get_norms_and_overflow([a, b], masks))
+    assert overflow
+
+    tensors = [torch.ones(70001).cuda(), torch.ones(3, 3).half().cuda()]
+    multi_tensor_scale_(tensors, 0.5)
+    assert torch.all(tensors[0] == 0.5)
+    assert torch.all(tensors[1] == 0.5)
+
+
+class _WorldModelParallelUnit(object):
+    def get_model_parallel_rank(self):
+        return dist.get_rank()
+
+    def get_model_parallel_world_size(self):
+        return dist.get_world_size()
+
+    def get_model_parallel_group(self):
+        return dist.group.WORLD
+
+
+def test_fp16_optimizer_model_parallel_norm():
+    @distributed_test(world_size=2, backend='gloo')
+    def _test_fp16_optimizer_model_parallel_norm():
+        # one group holding a model parallel and a replicated param
+        sharded = torch.nn.Parameter(torch.zeros(4))
+        sharded.model_parallel = True
+        replicated = torch.nn.Parameter(torch.zeros(9))
+        optimizer = FP16_Optimizer(torch.optim.SGD([sharded,
+                                                    replicated],
+                                                   lr=1.0),
+                                   mpu=_WorldModelParallelUnit(),
+                                   clip_grad=1.0,
+                                   verbose=False)
+        sharded.grad = torch.full((4, ), dist.get_rank() + 1.0)
+        replicated.grad = torch.ones(9)
+        optimizer.step()
+
+        # the shards of both ranks count, the replicated param once
+        norm = math.sqrt(4 * 1 + 4 * 4 + 9)
+        expected = -(dist.get_rank() + 1.0) / norm
+        assert torch.allclose(sharded.data, torch.full((4, ), expected))
+        assert torch.allclose(replicated.data, torch.full((9, ), -1.0 / norm))
+
+    _test_fp16_optimizer_model_parallel_norm()
@@ -0,0 +1,131 @@
+import pytest
+import torch
+import deepspeed.pt.deepspeed_kv_cache as kv_cache
+from deepspeed.pt.deepspeed_cuda import DeepSpeedTransformerConfig
+from deepspeed.pt.deepspeed_kv_cache import PagedKVCache, paged_attention
+from deepspeed.pt.deepspeed_tensor_parallel import \
+    DeepSpeedTensorParallelTransformerLayer
+
+
+def _config(pre_layer_norm):
+    return DeepSpeedTransformerConfig(batch_size=2,
+                                      max_seq_length=16,
+                                      hidden_size=16,
+                                      heads=4,
+                                      attn_dropout_ratio=0.1,
+                                      hidden_dropout_ratio=0.1,
+                                      num_hidden_layers=2,
+                                      initializer_range=0.2,
+                                      seed=3,
+                                      pre_layer_norm=pre_layer_norm)
+
+
+def test_block_allocation():
+    cache = PagedKVCache(num_layers=1, heads=2, head_size=4, num_blocks=3, block_size=2)
+    cache.add_sequence('a')
+    cache.add_sequence('b')
+    step = cache.reserve(['a', 'b'])
+    assert step.slots.tolist() == [0, 2]
+    # 'a' fills its block, then takes the last one
+    step = cache.reserve(['a'])
+    assert step.slots.tolist() == [1] and cache.num_free_blocks() == 1
+    step = cache.reserve(['a', 'b'])
+    assert step.slots.tolist() == [4, 3]
+    assert step.block_tables.tolist() == [[0, 2], [1, 0]]
+    assert step.lengths.tolist() == [3, 2]
+
+    # no partial reservation when the pool runs out
+    cache.reserve(['a'])
+    with pytest.raises(RuntimeError):
+        cache.reserve(['a', 'b'])
+    assert cache.lengths == {'a': 4, 'b': 2}
+
+    cache.free_sequence('a')
+    assert cache.num_free_blocks() == 2
+    cache.add_sequence('c')
+    assert cache.reserve(['c', 'b']).slots.tolist() == [0, 4]
+
+
+def test_reserve_repeated_sequence():
+    cache = PagedKVCache(num_layers=1, heads=2, head_size=4, num_blocks=2, block_size=2)
+    cache.add_sequence('a')
+    cache.reserve(['a'])
+    # the second token fills the block of 'a', the third needs a new one
+    assert cache.reserve(['a', 'a']).slots.tolist() == [1, 2]
+    assert cache.num_free_blocks() == 0
+    # the first token fills the second block, the others need a third one
+    with pytest.raises(RuntimeError):
+        cache.reserve(['a', 'a', 'a'])
+    assert cache.lengths == {'a': 3}
+
+
+@pytest.mark.parametrize('native', [True, False])
+def test_paged_attention(native, monkeypatch):
+    if native and kv_cache.deepspeed_kv_cache_cpu is None:
+        pytest.skip('deepspeed_kv_cache_cpu is not built')
+    if not native:
+        monkeypatch.setattr(kv_cache, 'deepspeed_kv_cache_cpu', None)
+    torch.manual_seed(0)
+    heads, head_size, block_size = 3, 8, 4
+    key_blocks = torch.randn(6, block_size, heads, head_size)
+    value_blocks = torch.randn(6, block_size, heads, head_size)
+    block_tables = torch.tensor([[5, 2, 0], [1, 0, 0], [3, 4, 0]], dtype=torch.int32)
+    lengths = torch.tensor([9, 3, 0], dtype=torch.int32)
+    query = torch.randn(3, heads, head_size)
+    output = paged_attention(query, key_blocks, value_blocks, block_tables, lengths, 0.5)
+
+    for b in range(2):
+        length = lengths[b].item()
+        blocks = block_tables[b].long()
+        keys = key_blocks[blocks].view(-1, heads, head_size)[:length]
+        values = value_blocks[blocks].view(-1, heads, head_size)[:length]
+        probs = torch.softmax(0.5 * torch.einsum('hd,thd->ht', query[b], keys), dim=-1)
+        expected = torch.einsum('ht,thd->hd', probs, values)
+        assert torch.allclose(output[b], expected, atol=1e-5)
+    # a sequence without tokens attends to nothing
+    assert torch.all(output[2] == 0)
+
+
+@pytest.mark.parametrize('pre_layer_norm', [True, False])
+def test_decode_matches_causal_forward(pre_layer_norm):
+    config = _config(pre_layer_norm)
+    layers = [DeepSpeedTensorParallelTransformerLayer(i, config) for i in range(2)]
+    for layer in layers:
+        layer.eval()
+    head_size = config.hidden_size // config.heads
+
+    # sequences of different lengths decoded in one batch, the shorter one
+    # joining later
+    torch.manual_seed(1)
+    lengths = {'long': 7, 'short': 3}
+    inputs = {seq: torch.randn(1, n, config.hidden_size) for seq, n in lengths.items()}
+    cache = PagedKVCache(2, config.heads, head_size, num_blocks=4, block_size=4)
+    outputs = {seq: [] for seq in lengths}
+    with torch.no_grad():
+        for t in range(lengths['long']):
+            seq_ids = ['long'] if t < 4 else ['long', 'short']
+            if t == 4:
+                cache.add_sequence('short')
+            if t == 0:
+                cache.add_sequence('long')
+            step = cache.reserve(seq_ids)
+            positions = {'long': t, 'short': t - 4}
+            hidden = torch.cat([inputs[seq][:, positions[seq]:positions[seq] + 1]
+                                for seq in seq_ids])
+            for layer in layers:
+                hidden = layer.decode(hidden, cache, step)
+            for b, seq in enumerate(seq_ids):
+                outputs[seq].append(hidden[b])
+        # two blocks of the long sequence, one of the short one
+        assert cache.num_free_blocks() == 1
+
+        for seq, n in lengths.items():
+            causal = torch.triu(torch.full((n, n), -10000.0), diagonal=1)
+            expected = inputs[seq]
+            for layer in layers:
+                expected = layer(expected, causal.view(1, 1, n, n))
+            decoded = torch.cat(outputs[seq]).unsqueeze(0)
+            assert torch.allclose(decoded, expected, atol=1e-5)
+
+        cache.free_sequence('long')
+        assert cache.num_free_blocks() == 3
@@ -0,0 +1,87 @@
+import copy
+import pytest
+import torch
+from deepspeed.pt.deepspeed_fused_lamb import FusedLamb, deepspeed_lamb_cpu
+
+pytestmark = pytest.mark.skipif(deepspeed_lamb_cpu is None,
+                                reason='deepspeed_lamb_cpu is not installed')
+
+
+def _run(optimizer, params, grads):
+    for g in grads:
+        for p in params:
+            p.grad = g.clone()
+        optimizer.step()
+
+
+def _make_params(seed=0):
+    torch.manual_seed(seed)
+    return [torch.nn.Parameter(torch.randn(5000)), torch.nn.Parameter(torch.randn(7))]
+
+
+def _make_grads(steps, seed=1):
+    torch.manual_seed(seed)
+    return [torch.randn(5000) * 0.1 for _ in range(steps)]
+
+
+def test_8bit_state_layout():
+    params = _make_params()
+    optimizer = FusedLamb(params, state_bits=8)
+    params[0].grad = torch.randn(5000)
+    params[1].grad = None
+    optimizer.step()
+
+    state = optimizer.state[params[0]]
+    assert state['exp_avg'].dtype == torch.int8
+    assert state['exp_avg_sq'].dtype == torch.uint8
+    assert state['exp_avg_absmax'].numel() == 3
+    assert state['exp_avg_sq_absmax'].numel() == 3
+
+
+def test_8bit_tracks_fp32():
+    params_32 = _make_params()
+    params_8 = _make_params()
+    optimizer_32 = FusedLamb(params_32, lr=1e-3, weight_decay=0.01)
+    optimizer_8 = FusedLamb(params_8, lr=1e-3, weight_decay=0.01, state_bits=8)
+
+    grads = _make_grads(20)
+    _run(optimizer_32, params_32[:1], grads)
+    _run(optimizer_8, params_8[:1], grads)
+
+    start = _make_params()[0]
+    moved_32 = (params_32[0] - start).norm()
+    moved_8 = (params_8[0] - start).norm()
+    assert (params_32[0] - params_8[0]).norm() < 0.1 * moved_32
+    assert abs(moved_8 - moved_32) < 0.1 * moved_32
+
+
+def test_8bit_adam_mode():
+    params = _make_params()
+    optimizer = FusedLamb(params, max_coeff=1.0, min_coeff=1.0, state_bits=8)
+    _run(optimizer, params[:1], _make_grads(2))
+    assert optimizer.get_lamb_coeffs() == [1.0]
+
+
+def test_8bit_state_dict_round_trip():
+    params = _make_params()
+    optimizer = FusedLamb(params, state_bits=8)
+    grads = _make_grads(6)
+    _run(optimizer, params[:1], grads[:3])
+
+    saved_params = copy.deepcopy(params)
+    saved_state = copy.deepcopy(optimizer.state_dict())
+    _run(optimizer, params[:1], grads[3:])
+
+    restored = FusedLamb(saved_params, state_bits=8)
+    restored.load_state_dict(saved_state)
+    state = restored.state[saved_params[0]]
+    assert state['exp_avg'].dtype == torch.int8
+    assert state['exp_avg_sq'].dtype == torch.uint8
+
+    _run(restored, saved_params[:1], grads[3:])
+    assert torch.equal(params[0], saved_params[0])
+
+
+def test_invalid_state_bits():
+    with pytest.raises(ValueError):
+        FusedLamb(_make_params(), state_bits=4)
@@ -0,0 +1,96 @@
+import math
+import pytest
+import torch
+from deepspeed.pt.deepspeed_utils import get_norms_and_overflow, unscale_and_clip_, \
+    PredicatedStep, DeferredOverflow
+from deepspeed.pt.deepspeed_fused_lamb import FusedLamb, deepspeed_lamb_cpu
+
+requires_lamb_cpu = pytest.mark.skipif(deepspeed_lamb_cpu is None,
+                                       reason='deepspeed_lamb_cpu is not installed')
+
+
+def _lamb(params, state_bits=32):
+    return FusedLamb(params, lr=0.1, state_bits=state_bits)
+
+
+def _step(optimizer, params, grad):
+    for p in params:
+        p.grad = torch.full_like(p, grad)
+    predicated = PredicatedStep(optimizer)
+    grads = [[p.grad for p in params]]
+    skip = get_norms_and_overflow(grads)[-1] > 0
+    return predicated, predicated.step(skip)
+
+
+def test_unscale_and_clip():
+    grads = [torch.full((4, ), 8.0), torch.full((5, ), 8.0)]
+    sum_squares = get_norms_and_overflow([grads])[0]
+
+    unscale_and_clip_(grads, sum_squares, loss_scale=4.0)
+    assert all(torch.all(g == 2.0) for g in grads)
+
+    # unscaled norm of 6, clipped to 3
+    unscale_and_clip_(grads, sum_squares / 16, loss_scale=1.0, clip_grad=3.0)
+    assert all(torch.allclose(g, torch.full_like(g, 1.0), rtol=1e-5) for g in grads)
+
+    # no clipping below the maximum norm
+    clipped = [g.clone() for g in grads]
+    unscale_and_clip_(grads, sum_squares / 64, loss_scale=1.0, clip_grad=100.0)
+    assert all(torch.equal(g, c) for g, c in zip(grads, clipped))
+
+
+@requires_lamb_cpu
+@pytest.mark.parametrize('state_bits', [8, 32])
+def test_predicated_step_skips_on_overflow(state_bits):
+    params = [torch.nn.Parameter(torch.ones(3)), torch.nn.Parameter(torch.ones(2, 2))]
+    optimizer = _lamb(params, state_bits)
+
+    # the first step creates the states, which stay zero
+    predicated, changes = _step(optimizer, params, float('inf'))
+    assert all(torch.all(p == 1.0) for p in params)
+    for p in params:
+        assert torch.all(optimizer.state[p]['exp_avg'] == 0)
+    predicated.undo_host_state(changes)
+
+    _, changes = _step(optimizer, params, 1.0)
+    stepped = [p.detach().clone() for p in params]
+    exp_avg = [optimizer.state[p]['exp_avg'].clone() for p in params]
+    assert all(torch.all(p < 1.0) for p in params)
+
+    predicated, changes = _step(optimizer, params, float('nan'))
+    for p, before, avg in zip(params, stepped, exp_avg):
+        assert torch.equal(p, before)
+        assert torch.equal(optimizer.state[p]['exp_avg'], avg)
+    predicated.undo_host_state(changes)
+    # only the step that was not skipped is counted
+    assert all(int(optimizer.state[p]['step']) == 1 for p in params)
+
+
+@requires_lamb_cpu
+def test_predicated_step_matches_optimizer():
+    torch.manual_seed(0)
+    params = [torch.nn.Parameter(torch.randn(10))]
+    reference = [torch.nn.Parameter(params[0].detach().clone())]
+    optimizer, reference_optimizer = _lamb(params), _lamb(reference)
+
+    for grad in [0.5, -1.0, 2.0]:
+        _step(optimizer, params, grad)
+        reference[0].grad = torch.full_like(reference[0], grad)
+        reference_optimizer.step()
+    assert torch.allclose(params[0], reference[0])
+
+
+def test_predicated_step_requires_skip_flag():
+    # the optimizer has to skip the step itself, nothing is copied to undo it
+    with pytest.raises(AssertionError):
+        PredicatedStep(torch.optim.Adam([torch.nn.Parameter(torch.ones(3))]))
+
+
+def test_deferred_overflow():
+    deferred = DeferredOverflow()
+    assert deferred.resolve() is None
+
+    assert deferred.record(torch.tensor(True), context='first') is None
+    assert deferred.record(torch.tensor(False), context='second') == (True, 'first')
+    assert deferred.resolve() == (False, 'second')
+    assert deferred.resolve() is None
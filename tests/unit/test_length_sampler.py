@@ -0,0 +1,90 @@
+import numpy as np
+import pytest
+from deepspeed.pt.deepspeed_length_sampler import LengthBucketingSampler
+
+
+def _lengths(num_samples=1000, seed=0):
+    rng = np.random.RandomState(seed)
+    return rng.randint(1, 512, size=num_samples)
+
+
+def _samplers(lengths, num_replicas, **kwargs):
+    return [
+        LengthBucketingSampler(lengths,
+                               8,
+                               num_replicas=num_replicas,
+                               rank=rank,
+                               bucket_size_multiplier=10,
+                               **kwargs) for rank in range(num_replicas)
+    ]
+
+
+@pytest.mark.parametrize('num_replicas', [1, 4])
+def test_ranks_cover_epoch(num_replicas):
+    lengths = _lengths()
+    samplers = _samplers(lengths, num_replicas)
+    per_rank = [list(sampler) for sampler in samplers]
+
+    assert all(len(indices) == len(samplers[0]) for indices in per_rank)
+    all_indices = sum(per_rank, [])
+    # padded to full global batches by repeating a few samples
+    assert set(all_indices) == set(range(len(lengths)))
+    assert len(all_indices) - len(lengths) < 8 * num_replicas
+
+
+def test_deterministic_per_epoch():
+    lengths = _lengths()
+    first, second = _samplers(lengths, 1) + _samplers(lengths, 1)
+    assert list(first) == list(second)
+
+    first.set_epoch(1)
+    assert list(first) != list(second)
+    second.set_epoch(1)
+    assert list(first) == list(second)
+
+
+def test_drop_last():
+    lengths = _lengths(num_samples=100)
+    sampler = LengthBucketingSampler(lengths, 8, num_replicas=2, rank=1, drop_last=True)
+    indices = list(sampler)
+    assert len(indices) == len(sampler) == 6 * 8
+    assert len(set(indices)) == len(indices)
+
+
+def test_steps_have_similar_lengths():
+    lengths = _lengths()
+    samplers = _samplers(lengths, 4)
+    per_rank = [np.array(list(sampler)).reshape(-1, 8) for sampler in samplers]
+
+    # the longest samples of the ranks in the same step stay close
+    longest = np.stack([lengths[batches].max(axis=1) for batches in per_rank])
+    spread = longest.max(axis=0) - longest.min(axis=0)
+    assert spread.mean() < 25
+
+
+def test_padding_fraction():
+    lengths = _lengths()
+    sampler = _samplers(lengths, 2, max_length=384, pad_to_multiple_of=8)[0]
+    stats = sampler.padding_stats()
+    assert 0 <= stats['padding_fraction'] < 0.1
+    assert stats['unbucketed_padding_fraction'] > 3 * stats['padding_fraction']
+
+    # batches of identical samples need no padding at all
+    sampler = LengthBucketingSampler(np.full(64, 16), 8, num_replicas=2)
+    assert sampler.padding_stats()['padding_fraction'] == 0.0
+    assert sampler.padding_stats()['unbucketed_padding_fraction'] == 0.0
+
+
+def test_padding_fraction_fixed_length():
+    lengths = _lengths()
+    # batches always padded to max_length, e.g. MMapTokenDataset without
+    # pad_to_multiple_of, bucketing saves nothing
+    sampler = _samplers(lengths, 2, max_length=384, pad_to_longest=False)[0]
+    stats = sampler.padding_stats()
+    indices = sampler.global_batches().reshape(-1)
+    expected = 1.0 - np.minimum(lengths[indices], 384).mean() / 384
+    assert stats['padding_fraction'] == pytest.approx(expected)
+    assert stats['unbucketed_padding_fraction'] == pytest.approx(expected)
+
+    with pytest.raises(AssertionError):
+        LengthBucketingSampler(lengths, 8, pad_to_longest=False)
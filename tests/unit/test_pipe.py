@@ -0,0 +1,284 @@
+import copy
+import time
+import pytest
+import torch
+import torch.distributed as dist
+import deepspeed
+from common import distributed_test
+from simple_model import args_from_dict
+from deepspeed.pt.deepspeed_pipe import partition_balanced, partition_layers, \
+    bubble_fraction, TrainSchedule, ForwardPass, BackwardPass, PipelineModule, \
+    PipelineExecutor, PipelineEngine
+
+
+class Sleep(torch.autograd.Function):
+    @staticmethod
+    def forward(ctx, x, seconds):
+        ctx.seconds = seconds
+        time.sleep(seconds)
+        return x.clone()
+
+    @staticmethod
+    def backward(ctx, grad):
+        # backward passes take twice the forward time
+        time.sleep(2 * ctx.seconds)
+        return grad, None
+
+
+class SleepLayer(torch.nn.Module):
+    def __init__(self, seconds):
+        super(SleepLayer, self).__init__()
+        self.seconds = seconds
+        self.weight = torch.nn.Parameter(torch.ones(1))
+
+    def forward(self, x):
+        return Sleep.apply(x * self.weight, self.seconds)
+
+
+class NextToken(torch.nn.Module):
+    """Shifts token ids, a first stage without parameters or gradients."""
+    def __init__(self, vocab_size):
+        super(NextToken, self).__init__()
+        self.vocab_size = vocab_size
+
+    def forward(self, x):
+        return torch.remainder(x + 1, self.vocab_size)
+
+
+def _layers(hidden_dim, count):
+    torch.manual_seed(0)
+    layers = []
+    for _ in range(count):
+        layers.append(torch.nn.Linear(hidden_dim, hidden_dim))
+        layers.append(torch.nn.Tanh())
+    return layers
+
+
+def _batches(hidden_dim, micro_batches, batch_size=3):
+    torch.manual_seed(1)
+    return [(torch.randn(batch_size,
+                         hidden_dim),
+             torch.randn(batch_size,
+                         hidden_dim)) for _ in range(micro_batches)]
+
+
+def test_partition_balanced():
+    assert partition_balanced([1, 1, 1, 1], 2) == [0, 2, 4]
+    assert partition_balanced([4, 1, 1, 1, 1], 2) == [0, 1, 5]
+    assert partition_balanced([1, 2, 3, 4, 5, 6], 3) == [0, 3, 5, 6]
+    # every part gets a layer
+    assert partition_balanced([10, 0, 0], 3) == [0, 1, 2, 3]
+    with pytest.raises(AssertionError):
+        partition_balanced([1], 2)
+
+    layers = [torch.nn.Linear(16, 16), torch.nn.Linear(16, 2), torch.nn.Linear(2, 2)]
+    assert partition_layers(layers, 2, 'parameters') == [0, 1, 3]
+    assert partition_layers(layers, 3, 'uniform') == [0, 1, 2, 3]
+
+
+def test_train_schedule():
+    micro_batches, num_stages = 6, 4
+    for stage_id in range(num_stages):
+        steps = TrainSchedule(micro_batches, num_stages, stage_id).steps()
+        forwards = [s.micro_batch for s in steps if isinstance(s, ForwardPass)]
+        backwards = [s.micro_batch for s in steps if isinstance(s, BackwardPass)]
+        assert forwards == list(range(micro_batches))
+        assert backwards == list(range(micro_batches))
+
+        # warmup, then one forward and one backward pass in turns
+        warmup = num_stages - stage_id - 1
+        assert all(isinstance(s, ForwardPass) for s in steps[:warmup])
+        assert steps[warmup:warmup + 4] == [ForwardPass(warmup),
+                                            BackwardPass(0),
+                                            ForwardPass(warmup + 1),
+                                            BackwardPass(1)]
+        # at most num_stages - stage_id activations are held
+        in_flight = 0
+        for s in steps:
+            in_flight += 1 if isinstance(s, ForwardPass) else -1
+            assert in_flight <= num_stages - stage_id
+
+    # fewer micro-batches than stages
+    steps = TrainSchedule(2, 4, 0).steps()
+    assert steps == [ForwardPass(0), ForwardPass(1), BackwardPass(0), BackwardPass(1)]
+
+    assert bubble_fraction(1, 4) == pytest.approx(0.75)
+    assert bubble_fraction(8, 4) == pytest.approx(3 / 11)
+    assert bubble_fraction(8, 1) == 0
+
+
+def test_pipeline_matches_sequential():
+    hidden_dim, micro_batches = 8, 4
+
+    @distributed_test(world_size=2, backend='gloo')
+    def _test_pipeline_matches_sequential():
+        layers = _layers(hidden_dim, 3)
+        reference = copy.deepcopy(torch.nn.Sequential(*layers))
+
+        module = PipelineModule(layers,
+                                num_stages=2,
+                                loss_fn=torch.nn.functional.mse_loss,
+                                partition_method='uniform')
+        assert module.boundaries == [0, 3, 6]
+        executor = PipelineExecutor(module)
+        batches = _batches(hidden_dim, micro_batches)
+        loss = executor.train_batch(iter(batches), micro_batches)
+
+        expected_loss = 0
+        for inputs, labels in batches:
+            micro_loss = torch.nn.functional.mse_loss(reference(inputs),
+                                                      labels) / micro_batches
+            micro_loss.backward()
+            expected_loss += micro_loss.item()
+
+        if dist.get_rank() == 1:
+            assert loss.item() == pytest.approx(expected_loss, rel=1e-5)
+        else:
+            assert loss is None
+        expected = dict(reference.named_parameters())
+        for name, param in module.named_parameters():
+            assert param.model_parallel
+            assert torch.allclose(param.grad, expected[name].grad, atol=1e-6)
+
+    _test_pipeline_matches_sequential()
+
+
+def test_pipeline_integer_inputs():
+    vocab_size, hidden_dim, micro_batches = 10, 8, 3
+
+    @distributed_test(world_size=3, backend='gloo')
+    def _test_pipeline_integer_inputs():
+        torch.manual_seed(0)
+        layers = [
+            NextToken(vocab_size),
+            torch.nn.Embedding(vocab_size,
+                               hidden_dim),
+            torch.nn.Linear(hidden_dim,
+                            hidden_dim)
+        ]
+        reference = copy.deepcopy(torch.nn.Sequential(*layers))
+
+        module = PipelineModule(layers,
+                                num_stages=3,
+                                loss_fn=torch.nn.functional.mse_loss,
+                                partition_method='uniform')
+        executor = PipelineExecutor(module)
+        torch.manual_seed(1)
+        batches = [(torch.randint(vocab_size,
+                                  (3,
+                                   4)),
+                    torch.randn(3,
+                                4,
+                                hidden_dim)) for _ in range(micro_batches)]
+        loss = executor.train_batch(iter(batches), micro_batches)
+
+        for inputs, labels in batches:
+            micro_loss = torch.nn.functional.mse_loss(reference(inputs),
+                                                      labels) / micro_batches
+            micro_loss.backward()
+        if dist.get_rank() == 2:
+            assert torch.isfinite(loss)
+        expected = dict(reference.named_parameters())
+        for name, param in module.named_parameters():
+            assert torch.allclose(param.grad, expected[name].grad, atol=1e-6)
+
+    _test_pipeline_integer_inputs()
+
+
+def test_bubble_fraction():
+    num_stages, micro_batches, seconds = 4, 8, 0.02
+
+    @distributed_test(world_size=num_stages, backend='gloo')
+    def _test_bubble_fraction():
+        layers = [SleepLayer(seconds) for _ in range(num_stages)]
+        module = PipelineModule(layers,
+                                num_stages=num_stages,
+                                loss_fn=torch.nn.functional.mse_loss)
+        executor = PipelineExecutor(module)
+        executor.train_batch(iter(_batches(4, micro_batches)), micro_batches)
+
+        assert executor.executed == TrainSchedule(micro_batches,
+                                                  num_stages,
+                                                  dist.get_rank()).steps()
+        # compute of 3 * seconds per micro-batch, the rest is idle
+        assert executor.busy_seconds >= 3 * seconds * micro_batches
+        expected = bubble_fraction(micro_batches, num_stages)
+        assert abs(executor.bubble - expected) < 0.1
+
+    _test_bubble_fraction()
+
+
+@pytest.mark.skipif(torch.cuda.device_count() < 2, reason='needs 2 GPUs')
+@pytest.mark.parametrize('zero_stage', [0, 1])
+def test_pipeline_engine_checkpoint(tmpdir, zero_stage):
+    hidden_dim, micro_batches = 8, 4
+    config_dict = {
+        "train_batch_size": 2 * micro_batches,
+        "train_micro_batch_size_per_gpu": 2,
+        "steps_per_print": 1,
+        "optimizer": {
+            "type": "Adam",
+            "params": {
+                "lr": 0.001
+            }
+        },
+        "gradient_clipping": 1.0,
+        "fp16": {
+            "enabled": True,
+            "initial_scale_power": 8
+        },
+        "zero_optimization": {
+            "stage": zero_stage
+        }
+    }
+    args = args_from_dict(tmpdir, config_dict)
+
+    @distributed_test(world_size=2)
+    def _test_pipeline_engine_checkpoint(args):
+        def create_engine(seed):
+            torch.manual_seed(seed)
+            layers = [torch.nn.Linear(hidden_dim, hidden_dim) for _ in range(4)]
+            module = PipelineModule(layers,
+                                    num_stages=2,
+                                    loss_fn=torch.nn.functional.mse_loss,
+                                    partition_method='uniform')
+            engine, _, _, _ = deepspeed.initialize(args=args,
+                                                   model=module,
+                                                   model_parameters=module.parameters())
+            assert isinstance(engine, PipelineEngine)
+            return engine
+
+        def batches(seed):
+            torch.manual_seed(seed)
+            return iter([(torch.randn(2,
+                                      hidden_dim).half(),
+                          torch.randn(2,
+                                      hidden_dim).half()) for _ in range(micro_batches)])
+
+        trained = create_engine(0)
+        last_stage = trained.module.grid.is_last_stage()
+        for step in range(3):
+            loss = trained.train_batch(batches(step))
+            if last_stage:
+                assert torch.isfinite(loss)
+            else:
+                assert loss is None
+        assert trained.global_steps == 3
+        trained.save_checkpoint(str(tmpdir), 'pipe')
+
+        # every stage loads its own checkpoint
+        loaded = create_engine(1)
+        loaded.load_checkpoint(str(tmpdir), 'pipe')
+        assert loaded.global_steps == trained.global_steps
+        assert loaded.optimizer.cur_scale == trained.optimizer.cur_scale
+        for p0, p1 in zip(trained.module.parameters(), loaded.module.parameters()):
+            assert torch.equal(p0, p1)
+
+        # and both go on training the same way
+        losses = [engine.train_batch(batches(3)) for engine in [trained, loaded]]
+        if last_stage:
+            assert torch.equal(losses[0], losses[1])
+        for p0, p1 in zip(trained.module.parameters(), loaded.module.parameters()):
+            assert torch.equal(p0, p1)
+
+    _test_pipeline_engine_checkpoint(args=args)
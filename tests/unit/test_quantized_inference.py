@@ -0,0 +1,95 @@
+import pytest
+import torch
+import deepspeed.pt.deepspeed_quantized_inference as quantized_inference
+from deepspeed.pt.deepspeed_cuda import DeepSpeedTransformerConfig
+from deepspeed.pt.deepspeed_quantized_inference import QuantizedLinear, \
+    calibrate_weight_scales, quantize_weight, pack_int8_weight, unpack_int8_weight, \
+    pack_int4_weight, unpack_int4_weight, quantization_report
+from deepspeed.pt.deepspeed_tensor_parallel import \
+    DeepSpeedTensorParallelTransformerLayer
+
+
+def _relative_error(output, expected):
+    return ((output - expected).norm() / expected.norm()).item()
+
+
+def test_pack_weights():
+    torch.manual_seed(0)
+    codes = torch.randint(-127, 128, (21, 37), dtype=torch.int8)
+    packed, compensation = pack_int8_weight(codes)
+    assert packed.shape == (2, 10, 16, 4)
+    assert torch.equal(unpack_int8_weight(packed, 21, 37), codes)
+    assert torch.equal(compensation, 128 * codes.int().sum(dim=1))
+
+    codes = torch.randint(-7, 8, (5, 13), dtype=torch.int8)
+    packed = pack_int4_weight(codes)
+    assert packed.shape == (5, 7) and packed.dtype == torch.uint8
+    assert torch.equal(unpack_int4_weight(packed, 13), codes)
+
+
+@pytest.mark.parametrize('bits', [8, 4])
+def test_calibration(bits):
+    torch.manual_seed(0)
+    # heavy tailed weights
+    weight = torch.randn(8, 64)**3
+    errors = {}
+    for calibration in ['absmax', 'mse']:
+        scales = calibrate_weight_scales(weight, bits, 16, calibration)
+        assert scales.shape == ((8, ) if bits == 8 else (8, 4))
+        codes = quantize_weight(weight, scales, bits, 16)
+        assert codes.abs().max() <= 2**(bits - 1) - 1
+        scale = scales.unsqueeze(1) if bits == 8 else scales.repeat_interleave(16, dim=1)
+        errors[calibration] = ((codes.float() * scale - weight)**2).sum().item()
+    assert errors['mse'] <= errors['absmax']
+
+
+@pytest.mark.parametrize('bits, tolerance', [(8, 0.02), (4, 0.15)])
+def test_quantized_linear(bits, tolerance, monkeypatch):
+    torch.manual_seed(0)
+    weight = torch.randn(48, 70)
+    bias = torch.randn(48)
+    input = torch.randn(2, 5, 70)
+    linear = QuantizedLinear(weight, bits=bits, group_size=32)
+    output = linear(input, bias, gelu=True)
+    assert output.shape == (2, 5, 48)
+    expected = quantized_inference.tanh_gelu(
+        torch.nn.functional.linear(input,
+                                   weight,
+                                   bias))
+    assert _relative_error(output, expected) < tolerance
+    # the codes and about two bits per weight of scales
+    assert linear.weight_bytes() < weight.numel() * 4 * (bits + 2) / 32
+
+    # the native gemm and the torch ops agree
+    monkeypatch.setattr(quantized_inference, 'deepspeed_quantized_gemm_cpu', None)
+    assert torch.allclose(linear(input, bias, gelu=True), output, atol=1e-4)
+
+
+@pytest.mark.parametrize('bits, tolerance', [(8, 0.03), (4, 0.2)])
+def test_quantized_transformer_layer(bits, tolerance):
+    config = DeepSpeedTransformerConfig(batch_size=2,
+                                        max_seq_length=8,
+                                        hidden_size=64,
+                                        heads=4,
+                                        attn_dropout_ratio=0.0,
+                                        hidden_dropout_ratio=0.0,
+                                        num_hidden_layers=2,
+                                        initializer_range=0.2,
+                                        seed=5,
+                                        pre_layer_norm=False)
+    layer = DeepSpeedTensorParallelTransformerLayer(0, config)
+    torch.manual_seed(0)
+    input = torch.randn(2, 8, config.hidden_size)
+    report = quantization_report(layer, input, bits=bits, group_size=32, repeat=2)
+    assert report['relative_error'] < tolerance
+    assert report['quantized_weight_bytes'] < \
+        report['fp32_weight_bytes'] * (bits + 2) / 32
+    assert report['speedup'] > 0
+    quantized_inference.print_quantization_report(report)
+
+    # the report quantizes a copy
+    assert layer.quantized is None
+    layer.quantize(bits, group_size=32)
+    assert 'inter_w' not in dict(layer.named_parameters())
+    with torch.no_grad():
+        assert layer(input, None).shape == input.shape
@@ -0,0 +1,110 @@
+import itertools
+import pytest
+from deepspeed.pt.deepspeed_recompute_planner import BufferProfile, LayerProfile, \
+    RecomputePlan, plan_recomputation, transformer_layer_profile, _options
+from deepspeed.pt.deepspeed_cuda import DeepSpeedTransformerConfig
+
+
+def _layers(num_layers):
+    return [
+        LayerProfile(10,
+                     100 + 10 * i,
+                     5.0 + i,
+                     [
+                         BufferProfile('attn_dropout_checkpoint',
+                                       30,
+                                       1.0),
+                         BufferProfile('normalize_invertible',
+                                       10,
+                                       0.1),
+                         BufferProfile('gelu_checkpoint',
+                                       40,
+                                       0.5 * (i + 1))
+                     ]) for i in range(num_layers)
+    ]
+
+
+def _brute_force(layers, budget):
+    reserve = max(layer.activation_bytes for layer in layers)
+    best = None
+    for options in itertools.product(*[_options(layer) for layer in layers]):
+        memory = sum(o[0] for o in options)
+        if any(o[2] for o in options):
+            memory += reserve
+        if memory <= budget:
+            cost = sum(o[1] for o in options)
+            best = cost if best is None else min(best, cost)
+    return best
+
+
+def test_large_budget_recomputes_nothing():
+    layers = _layers(4)
+    plan = plan_recomputation(layers, 10**6)
+    assert plan.checkpoint_layers == []
+    assert plan.recompute_time == 0
+    assert all(not any(knobs.values()) for knobs in plan.knobs)
+    assert plan.memory == sum(layer.activation_bytes for layer in layers)
+
+
+def test_infeasible_budget_raises():
+    with pytest.raises(ValueError):
+        plan_recomputation(_layers(4), 100)
+
+
+@pytest.mark.parametrize('budget', [150, 200, 250, 300, 330, 360, 400])
+def test_plan_is_optimal(budget):
+    layers = _layers(3)
+    plan = plan_recomputation(layers, budget)
+    assert plan.memory <= budget
+    assert plan.recompute_time == pytest.approx(_brute_force(layers, budget))
+
+
+def test_cheap_knobs_before_checkpointing():
+    layers = _layers(3)
+    # dropping the residual and one gelu input fits without checkpointing
+    plan = plan_recomputation(layers, sum(l.activation_bytes for l in layers) - 50)
+    assert plan.checkpoint_layers == []
+    assert plan.recompute_time == pytest.approx(0.1 + 0.5)
+    assert plan.knobs[0] == {
+        'attn_dropout_checkpoint': False,
+        'normalize_invertible': True,
+        'gelu_checkpoint': True
+    }
+
+
+def test_knob_beaten_by_checkpointing():
+    # checkpointing beats the gelu knob on memory and time, but the budget
+    # leaves no room for the recompute reserve, so the knob must be used
+    layer = LayerProfile(10, 100, 0.5, [BufferProfile('gelu_checkpoint', 40, 1.0)])
+    plan = plan_recomputation([layer], 70)
+    assert plan.checkpoint_layers == []
+    assert plan.knobs == [{'gelu_checkpoint': True}]
+    assert plan.memory == 60
+    assert plan.recompute_time == pytest.approx(1.0)
+
+
+def test_plan_config(tmpdir):
+    config = DeepSpeedTransformerConfig(batch_size=8,
+                                        max_seq_length=128,
+                                        hidden_size=1024,
+                                        heads=16,
+                                        num_hidden_layers=24,
+                                        fp16=True)
+    layers = [transformer_layer_profile(config) for _ in range(24)]
+    full = sum(layer.activation_bytes for layer in layers)
+    plan = plan_recomputation(layers, full // 3)
+    assert plan.memory <= full // 3
+    assert plan.checkpoint_layers
+
+    path = str(tmpdir.join('plan.json'))
+    plan.save(path)
+    loaded = RecomputePlan.load(path)
+    assert loaded.to_dict() == plan.to_dict()
+    section = loaded.activation_checkpointing_config()
+    assert section['number_checkpoints'] == len(plan.checkpoint_layers)
+
+    for layer_id in range(24):
+        layer_config = loaded.transformer_config(config, layer_id)
+        for knob, value in plan.knobs[layer_id].items():
+            assert getattr(layer_config, knob) == value
+    assert not config.gelu_checkpoint
@@ -0,0 +1,50 @@
+import pytest
+import torch
+from deepspeed.pt.deepspeed_fused_lamb import FusedLamb, deepspeed_lamb_cpu
+from deepspeed.pt.deepspeed_stochastic_rounding import stochastic_round
+from deepspeed.pt.deepspeed_stochastic_rounding import stochastic_rounding_seed
+
+
+def test_unbiased():
+    x = torch.full((100000, ), 1.0001)
+    rounded = stochastic_round(x, torch.half, seed=3)
+
+    assert set(rounded.float().unique().tolist()) == {1.0, 1.0 + 2**-10}
+    assert abs(rounded.double().mean().item() - 1.0001) < 1e-5
+
+
+def test_exact_and_special_values():
+    x = torch.tensor([0.5, -2.0, 0.0, float('inf'), 70000.0])
+
+    rounded = stochastic_round(x, torch.half, seed=0)
+
+    assert rounded[:4].float().tolist() == [0.5, -2.0, 0.0, float('inf')]
+    assert rounded[4].float().item() == float('inf')
+
+
+def test_small_updates_accumulate():
+    p = torch.ones(1000).half()
+    for step in range(100):
+        p = stochastic_round(p.float() + 1e-4, torch.half, seed=step)
+
+    # round to nearest would never move away from 1.0
+    assert abs(p.float().mean().item() - 1.01) < 1e-3
+
+
+@pytest.mark.skipif(deepspeed_lamb_cpu is None,
+                    reason='deepspeed_lamb_cpu is not installed')
+@pytest.mark.parametrize('state_bits', [8, 32])
+def test_cpu_kernel_matches_reference(state_bits):
+    torch.manual_seed(0)
+    params = [torch.nn.Parameter(torch.randn(3000)), torch.nn.Parameter(torch.randn(77))]
+    grads = [torch.randn(3000).half(), torch.randn(77).half()]
+    output_params = [torch.empty(3000).half(), torch.empty(77).half()]
+    optimizer = FusedLamb(params, state_bits=state_bits, stochastic_rounding=True)
+
+    for step in range(1, 3):
+        optimizer.step(grads=grads, output_params=output_params)
+        for index, (p, out) in enumerate(zip(params, output_params)):
+            expected = stochastic_round(p.data,
+                                        torch.half,
+                                        stochastic_rounding_seed(step, index))
+            assert torch.equal(out, expected)
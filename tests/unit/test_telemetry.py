@@ -0,0 +1,134 @@
+import json
+import pytest
+import torch
+from deepspeed.pt.deepspeed_telemetry import StepTelemetry, JsonLinesSink, \
+    PrometheusTextfileSink, transformer_flops_per_sample, model_flops_per_sample
+from deepspeed.pt.deepspeed_timer import HostClock
+
+
+class LayerConfig(object):
+    def __init__(self, hidden_size, max_seq_length, heads=4, intermediate_size=-1):
+        self.hidden_size = hidden_size
+        self.max_seq_length = max_seq_length
+        self.heads = heads
+        self.intermediate_size = intermediate_size
+
+
+class Layer(torch.nn.Module):
+    def __init__(self, config):
+        super(Layer, self).__init__()
+        self.config = config
+
+
+class MemorySink(object):
+    def __init__(self):
+        self.records = []
+        self.writes = 0
+
+    def write(self, records):
+        self.records.extend(records)
+        self.writes += 1
+
+
+def _telemetry(sink, **kwargs):
+    return StepTelemetry(sink,
+                         samples_per_step=32,
+                         flops_per_sample=1e12,
+                         data_parallel_size=2,
+                         clock=HostClock(),
+                         **kwargs)
+
+
+def _train(telemetry, steps, buckets=2):
+    for step in range(1, steps + 1):
+        for _ in range(buckets):
+            telemetry.add_allreduce(torch.empty(256, dtype=torch.half))
+        telemetry.optimizer_timer.start()
+        telemetry.optimizer_timer.stop()
+        telemetry.step(step, overflow=step == 3, skipped_steps=int(step >= 3))
+
+
+def test_transformer_flops():
+    # BERT large: 24 * s * h^2 + 4 * s^2 * h forward flops per layer
+    config = LayerConfig(hidden_size=1024, max_seq_length=128)
+    forward = 24 * 128 * 1024 * 1024 + 4 * 128 * 128 * 1024
+    assert transformer_flops_per_sample(config) == 3 * forward
+
+    model = torch.nn.Sequential(Layer(config), Layer(config), torch.nn.Linear(4, 4))
+    assert model_flops_per_sample(model) == 6 * forward
+
+
+def test_records():
+    sink = MemorySink()
+    telemetry = _telemetry(sink, flush_steps=4, max_overhead=1e9)
+    _train(telemetry, 9)
+
+    # the first step has no start time
+    assert sink.writes == 2
+    assert [record['step'] for record in sink.records] == list(range(2, 10))
+    telemetry.flush()
+    assert sink.writes == 2
+
+    record = sink.records[1]
+    assert record['overflow'] == 1 and record['skipped_steps'] == 1
+    assert record['allreduce_bucket_bytes'] == [512, 512]
+    assert record['allreduce_bytes'] == 1024
+    assert record['samples_per_sec'] == pytest.approx(32 / record['step_time'])
+    assert record['tflops'] == pytest.approx(record['samples_per_sec'] / 2)
+    assert record['optimizer_step_time'] >= 0
+    assert record['host_peak_rss_bytes'] >= record['host_rss_bytes'] > 0
+    assert record['telemetry_seconds'] >= 0
+
+
+def test_overhead_is_bounded():
+    sink = MemorySink()
+    telemetry = _telemetry(sink, flush_steps=1, max_overhead=0)
+    _train(telemetry, 16)
+    # every record backs off
+    assert telemetry.interval_steps == 2**len(sink.records)
+    steps = [record['step'] for record in sink.records]
+    assert steps == [2, 4, 8, 16]
+    assert telemetry.total_overhead_seconds > 0
+
+
+@pytest.mark.skipif(not torch.cuda.is_available(), reason='requires a GPU')
+@pytest.mark.parametrize('reset', [False, True])
+def test_device_peak_reset(reset):
+    sink = MemorySink()
+    telemetry = _telemetry(sink,
+                           flush_steps=1,
+                           max_overhead=1e9,
+                           reset_device_peak=reset)
+    block = torch.empty(2**20, device='cuda')
+    peak = torch.cuda.max_memory_allocated()
+    del block
+    _train(telemetry, 2)
+
+    assert sink.records[0]['device_peak_allocated_bytes'] == peak
+    # other readers of the counters only lose the peak when reset is asked for
+    assert (torch.cuda.max_memory_allocated() == peak) != reset
+
+
+def test_jsonl_sink(tmpdir):
+    path = str(tmpdir.join('telemetry.jsonl'))
+    telemetry = _telemetry(JsonLinesSink(path), flush_steps=2, max_overhead=1e9)
+    _train(telemetry, 4)
+    telemetry.flush()
+    with open(path) as fd:
+        records = [json.loads(line) for line in fd]
+    assert [record['step'] for record in records] == [2, 3, 4]
+
+
+def test_prometheus_sink(tmpdir):
+    path = str(tmpdir.join('deepspeed.prom'))
+    sink = PrometheusTextfileSink(path, labels={'rank': 0})
+    telemetry = _telemetry(sink, flush_steps=1, max_overhead=1e9)
+    _train(telemetry, 3)
+    with open(path) as fd:
+        lines = fd.read().splitlines()
+    assert '# TYPE deepspeed_step gauge' in lines
+    assert 'deepspeed_step{rank="0"} 3.0' in lines
+    assert 'deepspeed_allreduce_bucket_bytes{bucket="1",rank="0"} 512.0' in lines
+    assert 'deepspeed_overflow{rank="0"} 1.0' in lines
+    # no value without CUDA or a loss scale
+    assert not any(line.startswith('deepspeed_loss_scale') for line in lines)
@@ -0,0 +1,226 @@
+import math
+import pytest
+import torch
+import torch.distributed as dist
+import torch.nn.functional as F
+from common import distributed_test
+import deepspeed.pt.deepspeed_checkpointing as checkpointing
+from deepspeed.pt.deepspeed_cuda import DeepSpeedTransformerConfig
+from deepspeed.pt.deepspeed_tensor_parallel import \
+    DeepSpeedTensorParallelTransformerLayer, split_transformer_weights
+
+
+def _config(pre_layer_norm):
+    return DeepSpeedTransformerConfig(batch_size=2,
+                                      max_seq_length=6,
+                                      hidden_size=16,
+                                      heads=4,
+                                      attn_dropout_ratio=0.0,
+                                      hidden_dropout_ratio=0.0,
+                                      num_hidden_layers=2,
+                                      initializer_range=0.2,
+                                      seed=7,
+                                      pre_layer_norm=pre_layer_norm)
+
+
+def _weights(hidden_size):
+    torch.manual_seed(0)
+    shapes = {
+        'attn_qkvw': (3 * hidden_size,
+                      hidden_size),
+        'attn_qkvb': (3 * hidden_size, ),
+        'attn_ow': (hidden_size,
+                    hidden_size),
+        'attn_ob': (hidden_size, ),
+        'attn_nw': (hidden_size, ),
+        'attn_nb': (hidden_size, ),
+        'inter_w': (4 * hidden_size,
+                    hidden_size),
+        'inter_b': (4 * hidden_size, ),
+        'output_w': (hidden_size,
+                     4 * hidden_size),
+        'output_b': (hidden_size, ),
+        'norm_w': (hidden_size, ),
+        'norm_b': (hidden_size, )
+    }
+    return {
+        name: torch.nn.Parameter(0.2 * torch.randn(shape))
+        for name,
+        shape in shapes.items()
+    }
+
+
+def _reference(w, input, mask, heads, pre_layer_norm):
+    '''The whole layer with the math of the fused kernels.'''
+    def norm(x, weight, bias):
+        return F.layer_norm(x, x.shape[-1:], weight, bias, eps=1e-12)
+
+    def gelu(x):
+        return 0.5 * x * (1 + torch.tanh(math.sqrt(2 / math.pi) * (x + 0.044715 * x**3)))
+
+    batch_size, seq_length, hidden_size = input.shape
+    head_size = hidden_size // heads
+    x = norm(input, w['norm_w'], w['norm_b']) if pre_layer_norm else input
+    q, k, v = [
+        t.view(batch_size, seq_length, heads, head_size).transpose(1, 2)
+        for t in F.linear(x, w['attn_qkvw'], w['attn_qkvb']).chunk(3, dim=-1)
+    ]
+    probs = F.softmax(torch.matmul(q, k.transpose(-1, -2)) / math.sqrt(head_size) + mask,
+                      dim=-1)
+    context = torch.matmul(probs, v).transpose(1, 2).reshape(input.shape)
+    add_res = input + F.linear(context, w['attn_ow'], w['attn_ob'])
+    ff_input = norm(add_res, w['attn_nw'], w['attn_nb'])
+    ff_output = F.linear(gelu(F.linear(ff_input,
+                                       w['inter_w'],
+                                       w['inter_b'])),
+                         w['output_w'],
+                         w['output_b'])
+    if pre_layer_norm:
+        return add_res + ff_output
+    return norm(ff_input + ff_output, w['norm_w'], w['norm_b'])
+
+
+def test_split_transformer_weights():
+    weights = _weights(8)
+    first = split_transformer_weights(weights, 0, 2)
+    second = split_transformer_weights(weights, 1, 2)
+    qkvw = weights['attn_qkvw'].detach()
+    # the first half of the heads of each of q, k and v
+    assert torch.equal(first['attn_qkvw'],
+                       torch.cat([qkvw[0:4],
+                                  qkvw[8:12],
+                                  qkvw[16:20]]))
+    assert torch.equal(second['attn_qkvb'][4:8], weights['attn_qkvb'].detach()[12:16])
+    assert torch.equal(second['attn_ow'], weights['attn_ow'].detach()[:, 4:])
+    assert torch.equal(second['inter_w'], weights['inter_w'].detach()[16:])
+    assert torch.equal(second['output_w'], weights['output_w'].detach()[:, 16:])
+    assert torch.equal(first['norm_w'], weights['norm_w'].detach())
+
+
+@pytest.mark.parametrize('pre_layer_norm', [True, False])
+def test_tensor_parallel_matches_layer(pre_layer_norm):
+    @distributed_test(world_size=2, backend='gloo')
+    def _test_tensor_parallel_matches_layer():
+        config = _config(pre_layer_norm)
+        weights = _weights(config.hidden_size)
+        layer = DeepSpeedTensorParallelTransformerLayer(
+            0,
+            config,
+            initial_weights={name: w.detach()
+                             for name,
+                             w in weights.items()})
+        assert layer.attn_qkvw.shape == (24, 16)
+        assert layer.inter_w.model_parallel and not hasattr(layer.norm_w,
+                                                            'model_parallel')
+
+        torch.manual_seed(1)
+        input = torch.randn(2, 6, config.hidden_size)
+        mask = torch.zeros(2, 1, 1, 6)
+        mask[1, :, :, 4:] = -10000.0
+        input_tp = input.clone().requires_grad_()
+        output = layer(input_tp, mask)
+        input_ref = input.clone().requires_grad_()
+        expected = _reference(weights, input_ref, mask, config.heads, pre_layer_norm)
+        assert torch.allclose(output, expected, atol=1e-5)
+
+        grad = torch.randn_like(output)
+        output.backward(grad)
+        expected.backward(grad)
+        assert torch.allclose(input_tp.grad, input_ref.grad, atol=1e-5)
+        expected_grads = split_transformer_weights(
+            {name: w.grad
+             for name,
+             w in weights.items()},
+            dist.get_rank(),
+            dist.get_world_size())
+        for name, param in layer.named_parameters():
+            assert torch.allclose(param.grad, expected_grads[name], atol=1e-5), name
+
+    _test_tensor_parallel_matches_layer()
+
+
+def test_tensor_parallel_hidden_dropout():
+    @distributed_test(world_size=2, backend='gloo')
+    def _test_tensor_parallel_hidden_dropout():
+        config = _config(True)
+        config.hidden_dropout_ratio = 0.5
+        layer = DeepSpeedTensorParallelTransformerLayer(0, config)
+        layer.train()
+
+        # the default random states of the ranks differ
+        torch.manual_seed(dist.get_rank())
+        default_state = torch.get_rng_state()
+        input = torch.ones(2, 6, config.hidden_size)
+        output = layer(input, torch.zeros(2, 1, 1, 6))
+        assert torch.equal(torch.get_rng_state(), default_state)
+
+        # both ranks drop the same values of the replicated stream
+        gathered = [torch.zeros_like(output) for _ in range(2)]
+        dist.all_gather(gathered, output.detach())
+        assert torch.equal(gathered[0], gathered[1])
+        # and draw new masks on the next pass
+        assert not torch.equal(layer(input, torch.zeros(2, 1, 1, 6)), output)
+
+        output.sum().backward()
+        layer.norm_b.grad.add_(float(dist.get_rank()))
+        layer.allreduce_replicated_gradients()
+        gathered = [torch.zeros_like(layer.norm_b.grad) for _ in range(2)]
+        dist.all_gather(gathered, layer.norm_b.grad)
+        assert torch.equal(gathered[0], gathered[1])
+
+    _test_tensor_parallel_hidden_dropout()
+
+
+@pytest.mark.skipif(not torch.cuda.is_available(), reason='requires a GPU')
+def test_tensor_parallel_checkpointed_dropout():
+    @distributed_test(world_size=1)
+    def _test_tensor_parallel_checkpointed_dropout():
+        config = _config(True)
+        config.hidden_dropout_ratio = 0.5
+        weights = {name: w.detach() for name, w in _weights(config.hidden_size).items()}
+        layer = DeepSpeedTensorParallelTransformerLayer(0,
+                                                        config,
+                                                        initial_weights=weights).cuda()
+        layer.train()
+        torch.manual_seed(1)
+        input = torch.randn(2, 6, config.hidden_size).cuda()
+        mask = torch.zeros(2, 1, 1, 6).cuda()
+        grad = torch.randn_like(input)
+
+        def run(checkpointed):
+            # both runs start from the same hidden dropout state
+            checkpointing.get_cuda_rng_tracker().reset()
+            layer.zero_grad()
+            x = input.clone().requires_grad_()
+            output = checkpointing.checkpoint(layer, x, mask) if checkpointed \
+                else layer(x, mask)
+            output.backward(grad)
+            grads = [p.grad.clone() for p in layer.parameters()]
+            return [output.detach(), x.grad] + grads
+
+        # the recompute draws the masks of the forward pass
+        for expected, actual in zip(run(False), run(True)):
+            assert torch.allclose(expected, actual, atol=1e-6)
+
+    _test_tensor_parallel_checkpointed_dropout()
+
+
+def test_tensor_parallel_init():
+    @distributed_test(world_size=2, backend='gloo')
+    def _test_tensor_parallel_init():
+        config = _config(True)
+        layer = DeepSpeedTensorParallelTransformerLayer(0, config)
+        again = DeepSpeedTensorParallelTransformerLayer(0, config)
+        other = DeepSpeedTensorParallelTransformerLayer(1, config)
+        assert torch.equal(layer.attn_qkvw, again.attn_qkvw)
+        assert not torch.equal(layer.attn_qkvw, other.attn_qkvw)
+
+        # every rank draws its own slices
+        gathered = [torch.zeros_like(layer.inter_w) for _ in range(2)]
+        dist.all_gather(gathered, layer.inter_w.data)
+        assert not torch.equal(gathered[0], gathered[1])
+        std = config.initializer_range / math.sqrt(2.0 * config.num_hidden_layers)
+        assert layer.output_w.std().item() == pytest.approx(std, rel=0.3)
+        assert torch.all(layer.norm_w == 1.0) and torch.all(layer.output_b == 0.0)
+
+    _test_tensor_parallel_init()
@@ -0,0 +1,76 @@
+import multiprocessing
+import pytest
+import torch
+from deepspeed.pt import deepspeed_thread_pool as thread_pool
+from deepspeed.pt.deepspeed_data_prefetcher import deepspeed_data_cpu
+
+native = pytest.mark.skipif(not thread_pool.is_available() or deepspeed_data_cpu is None,
+                            reason='native thread pool is not built')
+
+
+@native
+def test_set_num_threads():
+    default = thread_pool.get_num_threads()
+    assert default >= 1
+    thread_pool.set_num_threads(3)
+    assert thread_pool.get_num_threads() == 3
+    assert len(thread_pool.get_utilization()) == 2
+    thread_pool.set_num_threads(0)
+    assert thread_pool.get_num_threads() == default
+
+
+@native
+@pytest.mark.parametrize('num_threads', [1, 2, 4])
+def test_kernels_share_pool(num_threads):
+    thread_pool.set_num_threads(num_threads)
+    thread_pool.get_utilization(reset=True)
+
+    # rows large enough for one parallel task each
+    samples = [torch.randn(64, 1024) for _ in range(32)]
+    out = torch.empty(32, 64, 1024)
+    for _ in range(4):
+        deepspeed_data_cpu.collate(samples, out)
+        assert torch.equal(out, torch.stack(samples))
+
+    workers = thread_pool.get_utilization(reset=True)
+    assert len(workers) == num_threads - 1
+    if num_threads > 1:
+        assert sum(worker['tasks'] for worker in workers) > 0
+    for worker in workers:
+        assert 0 <= worker['utilization'] <= 1
+        assert worker['steals'] <= worker['tasks']
+    thread_pool.log_utilization()
+    thread_pool.set_num_threads(0)
+
+
+def _collate_in_child(queue):
+    samples = [torch.randn(64, 1024) for _ in range(32)]
+    out = torch.empty(32, 64, 1024)
+    deepspeed_data_cpu.collate(samples, out)
+    queue.put(torch.equal(out, torch.stack(samples)))
+
+
+@native
+def test_forked_child_restarts_pool():
+    # a DataLoader worker forked after the parent ran tasks on the shared pool
+    thread_pool.set_num_threads(4)
+    samples = [torch.randn(64, 1024) for _ in range(32)]
+    deepspeed_data_cpu.collate(samples, torch.empty(32, 64, 1024))
+
+    context = multiprocessing.get_context('fork')
+    queue = context.Queue()
+    child = context.Process(target=_collate_in_child, args=(queue, ))
+    child.start()
+    child.join(timeout=60)
+    if child.is_alive():
+        child.kill()
+    assert child.exitcode == 0 and queue.get(timeout=1)
+    thread_pool.set_num_threads(0)
+
+
+def test_without_native_pool(monkeypatch):
+    monkeypatch.setattr(thread_pool, 'deepspeed_thread_pool_cpu', None)
+    assert thread_pool.get_num_threads() == 1
+    assert thread_pool.get_utilization() == []
+    thread_pool.set_num_threads(4)
+    thread_pool.log_utilization()
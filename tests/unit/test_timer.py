@@ -0,0 +1,130 @@
+import pytest
+import torch
+from deepspeed.pt.deepspeed_timer import HostClock, CudaEventClock, RollingPercentiles, \
+    SynchronizedWallClockTimer, ThroughputTimer
+
+
+class FakeClock(object):
+    '''Timestamps set by the test, which completes them like a device would.'''
+    def __init__(self):
+        self.now = 0.0
+        self.completed = 0
+        self.marks = []
+
+    def record(self):
+        self.marks.append(self.now)
+        return len(self.marks) - 1
+
+    def ready(self, mark):
+        return mark < self.completed
+
+    def elapsed(self, start, end):
+        self.completed = max(self.completed, end + 1)
+        return self.marks[end] - self.marks[start]
+
+    def complete_all(self):
+        self.completed = len(self.marks)
+
+
+def _phase(timer, clock, seconds):
+    timer.start()
+    clock.now += seconds
+    timer.stop()
+
+
+def test_percentiles():
+    percentiles = RollingPercentiles(window=100)
+    assert percentiles.percentile(50) is None
+    for value in range(1, 201):
+        percentiles.add(float(value))
+    # only the last 100 values
+    assert len(percentiles) == 100
+    assert percentiles.percentile(0) == 101
+    assert percentiles.percentile(50) == pytest.approx(150.5)
+    assert percentiles.percentile(99) == pytest.approx(199.01)
+    assert percentiles.percentile(100) == 200
+
+
+def test_timer_reads_lazily():
+    clock = FakeClock()
+    timers = SynchronizedWallClockTimer(clock=clock)
+    for seconds in [0.1, 0.2, 0.3]:
+        _phase(timers('forward'), clock, seconds)
+
+    # nothing completed on the device yet, the log does not wait for it
+    timer = timers('forward')
+    assert timer.elapsed(reset=True, block=False) == 0
+    assert len(timer.intervals.pending) == 3
+
+    clock.complete_all()
+    timers.log(['forward'])
+    assert len(timer.intervals.pending) == 0
+    assert timer.percentile(50) == pytest.approx(0.2)
+
+    # waits when asked to
+    _phase(timer, clock, 0.4)
+    assert timer.elapsed(block=True) == pytest.approx(0.4)
+    assert timer.elapsed() == 0
+
+
+def test_timer_elapsed_while_running():
+    clock = FakeClock()
+    timer = SynchronizedWallClockTimer(clock=clock)('step')
+    timer.start()
+    clock.now += 1.0
+    assert timer.elapsed(reset=False) == pytest.approx(1.0)
+    assert timer.started_
+    clock.now += 0.5
+    timer.stop()
+    assert timer.elapsed() == pytest.approx(1.5)
+
+
+def test_host_clock():
+    timers = SynchronizedWallClockTimer(clock=HostClock())
+    timers('forward').start()
+    timers('forward').stop()
+    assert timers('forward').elapsed() >= 0
+    timers.log(['forward'])
+
+
+@pytest.mark.skipif(not torch.cuda.is_available(), reason='needs CUDA')
+def test_cuda_event_clock():
+    timers = SynchronizedWallClockTimer(clock=CudaEventClock())
+    x = torch.randn(1024, 1024, device='cuda')
+    for _ in range(3):
+        timers('matmul').start()
+        for _ in range(10):
+            x = x.matmul(x).tanh()
+        timers('matmul').stop()
+    assert timers('matmul').elapsed() > 0
+    assert timers('matmul').percentile(99) >= timers('matmul').percentile(50) > 0
+    # events are reused once read
+    assert len(timers.clock.free_events) == 6
+
+
+def test_throughput_timer():
+    clock = FakeClock()
+    messages = []
+    timer = ThroughputTimer(batch_size=4,
+                            num_workers=2,
+                            start_step=2,
+                            steps_per_output=5,
+                            monitor_memory=False,
+                            logging_fn=messages.append,
+                            clock=clock)
+    for step in range(12):
+        timer.start()
+        clock.now += 0.5 if step % 2 else 0.25
+        # the device completes each step one step later
+        clock.completed = max(clock.completed, len(clock.marks) - 2)
+        timer.stop()
+
+    assert timer.timed_step_count < 10
+    assert timer.avg_samples_per_sec() > 0
+    clock.complete_all()
+    # 8 samples per step, 0.25 and 0.5 seconds per step in turns
+    assert timer.avg_samples_per_sec() == pytest.approx(8 / 0.375)
+    assert timer.timed_step_count == 10
+    assert timer.step_time_percentile(50) == pytest.approx(0.375)
+    assert len(messages) == 2
+    assert 'StepTimeMs p50=' in messages[-1]
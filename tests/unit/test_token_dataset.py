@@ -0,0 +1,99 @@
+import numpy as np
+import pytest
+import torch
+from torch.utils.data import SequentialSampler
+import deepspeed.pt.deepspeed_token_dataset as token_dataset
+from deepspeed.pt.deepspeed_dataloader import DeepSpeedDataLoader
+from deepspeed.pt.deepspeed_token_dataset import MMapTokenDataset, \
+    MMapTokenDatasetBuilder
+
+
+def _build(tmpdir, dtype=np.uint16, num_samples=23, seed=0):
+    rng = np.random.RandomState(seed)
+    high = np.iinfo(dtype).max
+    lengths = rng.randint(0, 20, size=num_samples)
+    samples = [rng.randint(0, high, size=length).astype(np.int64) for length in lengths]
+    prefix = str(tmpdir.join('corpus'))
+    builder = MMapTokenDatasetBuilder(prefix, dtype=dtype)
+    for tokens in samples:
+        builder.add(tokens)
+    builder.finalize()
+    return prefix, samples
+
+
+def _expected(tokens, seq_length, pad_token_id):
+    length = min(len(tokens), seq_length)
+    input_ids = torch.full((seq_length, ), pad_token_id, dtype=torch.int64)
+    input_ids[:length] = torch.from_numpy(tokens[:length])
+    attention_mask = torch.zeros(seq_length, dtype=torch.int64)
+    attention_mask[:length] = 1
+    return input_ids, attention_mask
+
+
+@pytest.mark.parametrize('dtype', [np.uint16, np.int32])
+def test_token_dataset_samples(tmpdir, dtype):
+    prefix, samples = _build(tmpdir, dtype)
+    dataset = MMapTokenDataset(prefix, seq_length=12, pad_token_id=3)
+
+    assert len(dataset) == len(samples)
+    assert list(dataset.sizes) == [len(tokens) for tokens in samples]
+    for index, tokens in enumerate(samples):
+        input_ids, attention_mask = _expected(tokens, 12, 3)
+        sample = dataset[index]
+        assert torch.equal(sample['input_ids'], input_ids)
+        assert torch.equal(sample['attention_mask'], attention_mask)
+
+
+def test_token_dataset_python_fallback(tmpdir, monkeypatch):
+    prefix, samples = _build(tmpdir)
+    dataset = MMapTokenDataset(prefix, seq_length=16)
+    indices = [5, 0, 22, 5, 13]
+    batch = dataset.assemble_batch(indices)
+
+    monkeypatch.setattr(token_dataset, 'deepspeed_data_cpu', None)
+    reference = dataset.assemble_batch(indices)
+    assert torch.equal(batch['input_ids'], reference['input_ids'])
+    assert torch.equal(batch['attention_mask'], reference['attention_mask'])
+
+
+@pytest.mark.parametrize('prefetch_depth', [0, 2])
+def test_token_dataset_loader(tmpdir, prefetch_depth):
+    prefix, samples = _build(tmpdir)
+    dataset = MMapTokenDataset(prefix, seq_length=10)
+    loader = DeepSpeedDataLoader(dataset=dataset,
+                                 batch_size=4,
+                                 pin_memory=False,
+                                 local_rank=0,
+                                 tput_timer=None,
+                                 data_sampler=SequentialSampler(dataset),
+                                 prefetch_depth=prefetch_depth)
+
+    rows = 0
+    for batch in loader:
+        assert batch['input_ids'].size() == (min(4, len(samples) - rows), 10)
+        for row in range(batch['input_ids'].size(0)):
+            input_ids, attention_mask = _expected(samples[rows], 10, 0)
+            assert torch.equal(batch['input_ids'][row], input_ids)
+            assert torch.equal(batch['attention_mask'][row], attention_mask)
+            rows += 1
+    assert rows == len(samples)
+
+
+def test_token_dataset_rejects_large_ids(tmpdir):
+    builder = MMapTokenDatasetBuilder(str(tmpdir.join('corpus')), dtype=np.uint16)
+    with pytest.raises(ValueError):
+        builder.add([1, 2, 70000])
+
+
+def test_token_dataset_pad_to_longest(tmpdir):
+    prefix, samples = _build(tmpdir)
+    dataset = MMapTokenDataset(prefix, seq_length=12, pad_to_multiple_of=8)
+    for indices in ([0, 1, 2], [7], list(range(len(samples)))):
+        longest = max(len(samples[i]) for i in indices)
+        width = min(12, -(-longest // 8) * 8)
+        batch = dataset.assemble_batch(indices)
+        assert batch['input_ids'].size() == (len(indices), width)
+        for row, index in enumerate(indices):
+            input_ids, attention_mask = _expected(samples[index], width, 0)
+            assert torch.equal(batch['input_ids'][row], input_ids)
+            assert torch.equal(batch['attention_mask'][row], attention_mask)
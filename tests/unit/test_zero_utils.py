@@ -0,0 +1,57 @@
+import pytest
+import torch
+from deepspeed.pt.zero_utils import get_aligned_numel, move_to_flat_buffer
+from deepspeed.pt.zero_utils import flatten_dense_tensors_into
+
+
+def test_aligned_numel():
+    assert get_aligned_numel(12, 4) == 12
+    assert get_aligned_numel(13, 4) == 16
+    assert get_aligned_numel(1, 8) == 8
+
+
+def test_move_to_flat_buffer():
+    params = [torch.nn.Parameter(torch.randn(3, 5)), torch.nn.Parameter(torch.randn(7))]
+    expected = [p.data.clone() for p in params]
+
+    flat = move_to_flat_buffer(params, get_aligned_numel(22, 8), torch.device('cpu'))
+
+    assert flat.numel() == 24
+    assert torch.all(flat[22:] == 0)
+    for p, e in zip(params, expected):
+        assert p.shape == e.shape
+        assert torch.equal(p.data, e)
+
+    # params are views of the flat buffer, not copies
+    flat.fill_(1.0)
+    assert torch.all(params[0].data == 1.0)
+    assert torch.all(params[1].data == 1.0)
+
+
+@pytest.mark.skipif(not torch.cuda.is_available(), reason='requires a GPU')
+def test_move_to_flat_buffer_device_peak():
+    params = [torch.nn.Parameter(torch.randn(1024, 1024).cuda()) for _ in range(4)]
+    group_bytes = sum(p.numel() * p.element_size() for p in params)
+    torch.cuda.synchronize()
+    torch.cuda.reset_max_memory_allocated()
+    start = torch.cuda.memory_allocated()
+
+    flat = move_to_flat_buffer(params, 4 * 1024 * 1024, torch.cuda.current_device())
+
+    # the weights leave the device before the buffer is allocated, so the peak
+    # stays at the group instead of the group and the buffer
+    assert torch.cuda.max_memory_allocated() - start < group_bytes
+    assert torch.cuda.memory_allocated() == start
+    assert flat.is_cuda and all(p.data.data_ptr() >= flat.data_ptr() for p in params)
+
+
+def test_flatten_dense_tensors_into():
+    grads = [torch.randn(4, 2).half(), torch.randn(3).half()]
+
+    flat = flatten_dense_tensors_into(grads, 16, torch.float)
+
+    assert flat.dtype == torch.float
+    assert flat.numel() == 16
+    assert torch.equal(flat[:8], grads[0].float().view(-1))
+    assert torch.equal(flat[8:11], grads[1].float())
+    assert torch.all(flat[11:] == 0)